@@ -0,0 +1,207 @@
+/*
+    An arena (bump) allocator.
+
+    The arena is a chain of blocks, newest first. An allocation is carved
+    off the front of the free space in the newest block; when that's too
+    small, a growing arena starts a new block (a bigger one, if the
+    allocation wouldn't fit in one of the usual size), and a fixed one
+    gives up. Nothing is ever freed on its own.
+
+    A fixed arena keeps its header, and its only block, at the start of the
+    caller's buffer.
+*/
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "readlogicalvolume.h"
+#include "debug.h"
+#include "arena.h"
+
+/* every allocation is aligned to suit any type */
+#define kArenaAlignment     (sizeof( max_align_t ))
+
+typedef struct tArenaBlock
+{
+    struct tArenaBlock * next;      /* the block before this one */
+    size_t               size;      /* bytes of data */
+    size_t               used;
+    max_align_t          data[];
+} tArenaBlock;
+
+struct tArena
+{
+    tArenaBlock * blocks;
+    size_t        blockSize;        /* 0 for a fixed arena */
+    size_t        usage;            /* bytes handed out, across every block */
+    int           full;             /* a fixed arena has run out, and said so */
+};
+
+static size_t roundUp( size_t size )
+{
+    return (size + kArenaAlignment - 1) & ~(kArenaAlignment - 1);
+}
+
+static tArenaBlock * newArenaBlock( size_t size )
+{
+    tArenaBlock * block = malloc( sizeof( tArenaBlock ) + size );
+
+    if ( isHeapPtr( block ) )
+    {
+        block->next = NULL;
+        block->size = size;
+        block->used = 0;
+    }
+    return block;
+}
+
+/**
+ * @param blockSize  how much to allocate from the heap at a time, or 0 for kDefaultArenaBlockSize
+ * @return an empty arena that grows as needed, or NULL
+ */
+tArena * newArena( size_t blockSize )
+{
+    tArena * arena = calloc( sizeof( tArena ), 1 );
+
+    if ( isHeapPtr( arena ) )
+    {
+        arena->blockSize = roundUp( blockSize > 0 ? blockSize : kDefaultArenaBlockSize );
+        arena->blocks    = newArenaBlock( arena->blockSize );
+        if ( !isHeapPtr( arena->blocks ) )
+        {
+            free( arena );
+            arena = NULL;
+        }
+    }
+    return arena;
+}
+
+/**
+ * @param buffer  where to keep the arena; it must stay put until the arena is done with
+ * @param size    of the buffer. A little of it goes on the arena's own bookkeeping
+ * @return an empty arena that never grows beyond the buffer, or NULL if the buffer's too small
+ */
+tArena * newFixedArena( void * buffer, size_t size )
+{
+    uintptr_t start = roundUp( (uintptr_t) buffer );
+    size_t    skip  = start - (uintptr_t) buffer + roundUp( sizeof( tArena ) ) + sizeof( tArenaBlock );
+
+    if ( buffer == NULL || size <= skip )
+    {
+        LogError( "a buffer of %lu bytes is too small for an arena", size );
+        return NULL;
+    }
+
+    tArena      * arena = (tArena *) start;
+    tArenaBlock * block = (tArenaBlock *) (start + roundUp( sizeof( tArena ) ));
+
+    arena->blocks    = block;
+    arena->blockSize = 0;
+    arena->usage     = 0;
+    arena->full      = 0;
+    block->next      = NULL;
+    block->size      = (size - skip) & ~(kArenaAlignment - 1);
+    block->used      = 0;
+
+    return arena;
+}
+
+/**
+ * @return size bytes of zeroed memory, aligned for any type, that last until
+ *         the arena is reset or freed; or NULL
+ */
+void * arenaAlloc( tArena * arena, size_t size )
+{
+    tArenaBlock * block = arena->blocks;
+
+    size = roundUp( size > 0 ? size : 1 );
+    if ( block->size - block->used < size )
+    {
+        if ( arena->blockSize == 0 )
+        {
+            if ( !arena->full )
+            {
+                LogError( "fixed arena of %lu bytes is full", block->size );
+                arena->full = 1;
+            }
+            return NULL;
+        }
+
+        block = newArenaBlock( size > arena->blockSize ? size : arena->blockSize );
+        if ( !isHeapPtr( block ) )
+        {
+            return NULL;
+        }
+        block->next   = arena->blocks;
+        arena->blocks = block;
+    }
+
+    void * result = (byte *) block->data + block->used;
+    block->used  += size;
+    arena->usage += size;
+    memset( result, 0, size );
+
+    return result;
+}
+
+/**
+ * @return a zero-terminated copy of length bytes of string, or NULL
+ */
+char * arenaStrndup( tArena * arena, const char * string, size_t length )
+{
+    char * result = arenaAlloc( arena, length + 1 );
+
+    if ( result != NULL )
+    {
+        memcpy( result, string, length );
+    }
+    return result;
+}
+
+/**
+ * @return how many bytes have been allocated from the arena since it was made or last reset
+ */
+size_t getArenaUsage( tArena * arena )
+{
+    return arena->usage;
+}
+
+/**
+ * Release everything allocated from the arena, keeping one block to start again with.
+ */
+void resetArena( tArena * arena )
+{
+    tArenaBlock * block = arena->blocks;
+
+    /* a fixed arena only has the one */
+    while ( block->next != NULL )
+    {
+        tArenaBlock * next = block->next;
+        free( block );
+        block = next;
+    }
+    block->used   = 0;
+    arena->blocks = block;
+    arena->usage  = 0;
+    arena->full   = 0;
+}
+
+/**
+ * Release the arena, and everything allocated from it. A fixed arena's buffer is
+ * left to its owner.
+ */
+void freeArena( tArena * arena )
+{
+    if ( arena != NULL && arena->blockSize > 0 )
+    {
+        resetArena( arena );
+        free( arena->blocks );
+        free( arena );
+    }
+}
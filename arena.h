@@ -0,0 +1,30 @@
+/*
+    An arena (bump) allocator.
+
+    Everything allocated from an arena is released at once, when the arena
+    is reset or freed, so a structure built from thousands of small pieces
+    (the parse tree, a logical volume's segments and names) costs nothing
+    to take apart, and doesn't leave the heap fragmented behind it.
+
+    An arena either grows, a heap block at a time, or is fixed: laid out in
+    a buffer the caller supplies (a static one, say), and never touches the
+    heap at all. A fixed arena that fills up just returns NULL.
+*/
+
+#ifndef READLOGICALVOLUME_ARENA_H
+#define READLOGICALVOLUME_ARENA_H
+
+/* the size of each block a growing arena allocates, unless told otherwise */
+#define kDefaultArenaBlockSize  (256 * 1024)
+
+typedef struct tArena tArena;
+
+tArena * newArena( size_t blockSize );
+tArena * newFixedArena( void * buffer, size_t size );
+void   * arenaAlloc( tArena * arena, size_t size );
+char   * arenaStrndup( tArena * arena, const char * string, size_t length );
+size_t   getArenaUsage( tArena * arena );
+void     resetArena( tArena * arena );
+void     freeArena( tArena * arena );
+
+#endif //READLOGICALVOLUME_ARENA_H
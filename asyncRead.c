@@ -0,0 +1,846 @@
+/*
+    Asynchronous extent reader.
+
+    readLogicalVolume() used to issue one blocking readDrive() per segment,
+    which keeps exactly one request outstanding - fine for a bootloader
+    talking to eMMC, but it leaves an NVMe drive mostly idle. Here, every
+    request is carved into fixed-size chunks, and a configurable number of
+    them are kept in flight.
+
+    The preferred engine is io_uring, driven directly through the system
+    calls so we don't drag in liburing. If the kernel doesn't have it (or
+    it's been blocked, as it often is in containers), we fall back to a
+    pool of threads each doing plain readDriveExtent() calls.
+*/
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "readlogicalvolume.h"
+#include "debug.h"
+#include "readaccess.h"
+#include "asyncRead.h"
+
+/* no point having more reader threads than this, whatever the queue depth */
+#define kMaxReaderThreads   16
+
+typedef struct tReadSlot
+{
+    struct tReadSlot * next;    /* free list, or the thread pool's queues */
+    off64_t       offset;       /* relative to the start of the partition */
+    byte        * dest;
+    size_t        length;
+    size_t        done;         /* bytes transferred so far; short reads are resubmitted */
+    ssize_t       result;
+    tReadCallback callback;
+    void        * cbData;
+    struct iovec  iov;          /* io_uring: describes the part still to be read */
+    const struct iovec * vector;    /* a scatter read, if not NULL; dest is unused */
+    int           vectorCount;
+} tReadSlot;
+
+typedef struct tUring
+{
+    int                   fd;
+    unsigned            * sqHead;
+    unsigned            * sqTail;
+    unsigned            * sqMask;
+    unsigned            * sqArray;
+    struct io_uring_sqe * sqes;
+    unsigned            * cqHead;
+    unsigned            * cqTail;
+    unsigned            * cqMask;
+    struct io_uring_cqe * cqes;
+    unsigned              toSubmit;
+    void                * sqRing;
+    size_t                sqRingSize;
+    void                * cqRing;
+    size_t                cqRingSize;
+    size_t                sqesSize;
+} tUring;
+
+typedef struct tReaderPool
+{
+    pthread_t       * threads;
+    unsigned          threadCount;
+    pthread_mutex_t   lock;
+    pthread_cond_t    work;         /* signalled when something is added to pending */
+    pthread_cond_t    done;         /* signalled when something is added to completed */
+    tReadSlot       * pending;
+    tReadSlot      ** pendingTail;
+    tReadSlot       * completed;
+    int               shutdown;
+} tReaderPool;
+
+struct tAsyncReader
+{
+    tDrive    * drive;
+    tIOEngine   engine;
+    unsigned    depth;
+    size_t      chunkSize;
+    tReadSlot * slots;
+    tReadSlot * freeSlots;
+    unsigned    inFlight;
+    ssize_t     total;
+    int         failed;
+    tUring      uring;
+    tReaderPool pool;
+};
+
+/****************************************************************************/
+/* io_uring engine */
+
+static int uringSetup( unsigned entries, struct io_uring_params * params )
+{
+    return (int) syscall( __NR_io_uring_setup, entries, params );
+}
+
+static int uringEnter( int fd, unsigned toSubmit, unsigned minComplete, unsigned flags )
+{
+    return (int) syscall( __NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0 );
+}
+
+static int openUring( tAsyncReader * reader )
+{
+    tUring * ring = &reader->uring;
+    struct io_uring_params params;
+
+    memset( &params, 0, sizeof( params ) );
+    ring->fd = uringSetup( reader->depth, &params );
+    if ( ring->fd < 0 )
+    {
+        LogInfo( "io_uring is not available (%d: %s)", errno, strerror( errno ) );
+        return -1;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+    ring->cqRingSize = params.cq_off.cqes  + params.cq_entries * sizeof( struct io_uring_cqe );
+    if ( params.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        if ( ring->cqRingSize > ring->sqRingSize )
+        {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+
+    ring->sqRing = mmap( NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING );
+    if ( ring->sqRing == MAP_FAILED )
+    {
+        LogError( "unable to map the io_uring submission ring (%d: %s)", errno, strerror( errno ) );
+        close( ring->fd );
+        return -1;
+    }
+
+    if ( params.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        ring->cqRing = ring->sqRing;
+    }
+    else
+    {
+        ring->cqRing = mmap( NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING );
+        if ( ring->cqRing == MAP_FAILED )
+        {
+            LogError( "unable to map the io_uring completion ring (%d: %s)", errno, strerror( errno ) );
+            munmap( ring->sqRing, ring->sqRingSize );
+            close( ring->fd );
+            return -1;
+        }
+    }
+
+    ring->sqesSize = params.sq_entries * sizeof( struct io_uring_sqe );
+    ring->sqes = mmap( NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES );
+    if ( ring->sqes == MAP_FAILED )
+    {
+        LogError( "unable to map the io_uring submission entries (%d: %s)", errno, strerror( errno ) );
+        if ( ring->cqRing != ring->sqRing )
+        {
+            munmap( ring->cqRing, ring->cqRingSize );
+        }
+        munmap( ring->sqRing, ring->sqRingSize );
+        close( ring->fd );
+        return -1;
+    }
+
+    byte * sq = ring->sqRing;
+    ring->sqHead  = (unsigned *)( sq + params.sq_off.head );
+    ring->sqTail  = (unsigned *)( sq + params.sq_off.tail );
+    ring->sqMask  = (unsigned *)( sq + params.sq_off.ring_mask );
+    ring->sqArray = (unsigned *)( sq + params.sq_off.array );
+
+    byte * cq = ring->cqRing;
+    ring->cqHead  = (unsigned *)( cq + params.cq_off.head );
+    ring->cqTail  = (unsigned *)( cq + params.cq_off.tail );
+    ring->cqMask  = (unsigned *)( cq + params.cq_off.ring_mask );
+    ring->cqes    = (struct io_uring_cqe *)( cq + params.cq_off.cqes );
+
+    ring->toSubmit = 0;
+
+    LogInfo( "io_uring ready, %u submission entries", params.sq_entries );
+    return 0;
+}
+
+static void closeUring( tAsyncReader * reader )
+{
+    tUring * ring = &reader->uring;
+
+    munmap( ring->sqes, ring->sqesSize );
+    if ( ring->cqRing != ring->sqRing )
+    {
+        munmap( ring->cqRing, ring->cqRingSize );
+    }
+    munmap( ring->sqRing, ring->sqRingSize );
+    close( ring->fd );
+}
+
+/* queue the unread part of a slot on the submission ring. not submitted until flushUring() */
+static void prepareUring( tAsyncReader * reader, tReadSlot * slot )
+{
+    tUring  * ring  = &reader->uring;
+    unsigned  tail  = *ring->sqTail;
+    unsigned  index = tail & *ring->sqMask;
+    struct io_uring_sqe * sqe = &ring->sqes[ index ];
+
+    memset( sqe, 0, sizeof( *sqe ) );
+    sqe->opcode    = IORING_OP_READV;
+    sqe->fd        = reader->drive->id;
+    sqe->off       = reader->drive->partition.start + slot->offset + slot->done;
+    if ( slot->vector != NULL )
+    {
+        /* only ever submitted whole; a short scatter read is finished by finishVector() */
+        sqe->addr  = (uint64_t)(uintptr_t) slot->vector;
+        sqe->len   = slot->vectorCount;
+    }
+    else
+    {
+        slot->iov.iov_base = slot->dest + slot->done;
+        slot->iov.iov_len  = slot->length - slot->done;
+        sqe->addr  = (uint64_t)(uintptr_t) &slot->iov;
+        sqe->len   = 1;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t) slot;
+
+    ring->sqArray[ index ] = index;
+    __atomic_store_n( ring->sqTail, tail + 1, __ATOMIC_RELEASE );
+    ++ring->toSubmit;
+}
+
+static int flushUring( tAsyncReader * reader, unsigned minComplete )
+{
+    tUring * ring = &reader->uring;
+
+    while ( ring->toSubmit > 0 || minComplete > 0 )
+    {
+        int submitted = uringEnter( ring->fd, ring->toSubmit, minComplete,
+                                    minComplete > 0 ? IORING_ENTER_GETEVENTS : 0 );
+        if ( submitted < 0 )
+        {
+            if ( errno == EINTR || errno == EAGAIN || errno == EBUSY )
+            {
+                continue;
+            }
+            LogError( "io_uring_enter failed (%d: %s)", errno, strerror( errno ) );
+            return -1;
+        }
+        ring->toSubmit -= submitted;
+        minComplete = 0;
+    }
+    return 0;
+}
+
+static void completeSlot( tAsyncReader * reader, tReadSlot * slot );
+
+/**
+ * Read the rest of a scatter read that came back short, synchronously. Rare
+ * enough not to be worth trimming the vector and going round the ring again.
+ */
+static void finishVector( tAsyncReader * reader, tReadSlot * slot )
+{
+    struct iovec * rest = malloc( slot->vectorCount * sizeof( struct iovec ) );
+    size_t         skip = slot->done;
+    int            count = 0;
+
+    if ( !isHeapPtr( rest ) )
+    {
+        slot->result = -1;
+        return;
+    }
+    for ( int i = 0; i < slot->vectorCount; ++i )
+    {
+        if ( skip >= slot->vector[i].iov_len )
+        {
+            skip -= slot->vector[i].iov_len;
+            continue;
+        }
+        rest[ count ].iov_base = (byte *) slot->vector[i].iov_base + skip;
+        rest[ count ].iov_len  = slot->vector[i].iov_len - skip;
+        skip = 0;
+        ++count;
+    }
+
+    ssize_t rdLen = readDriveVector( reader->drive, slot->offset + slot->done, rest, count );
+    slot->result = (rdLen < 0) ? -1 : (ssize_t)(slot->done + rdLen);
+    free( rest );
+}
+
+/**
+ * harvest whatever is on the completion ring
+ * @return the number of slots that finished (short reads that were resubmitted don't count)
+ */
+static int reapUring( tAsyncReader * reader )
+{
+    tUring * ring  = &reader->uring;
+    int      count = 0;
+    unsigned head  = *ring->cqHead;
+    unsigned tail  = __atomic_load_n( ring->cqTail, __ATOMIC_ACQUIRE );
+
+    while ( head != tail )
+    {
+        struct io_uring_cqe * cqe  = &ring->cqes[ head & *ring->cqMask ];
+        tReadSlot           * slot = (tReadSlot *)(uintptr_t) cqe->user_data;
+        int                   res  = cqe->res;
+        ++head;
+
+        if ( res == -EINTR || res == -EAGAIN )
+        {
+            prepareUring( reader, slot );
+        }
+        else if ( res < 0 )
+        {
+            LogError( "read @ offset %lu for %lu bytes failed (%d: %s)",
+                 slot->offset + slot->done, slot->length - slot->done, -res, strerror( -res ) );
+            slot->result = -1;
+            completeSlot( reader, slot );
+            ++count;
+        }
+        else
+        {
+            slot->done += res;
+            if ( res > 0 && slot->done < slot->length && slot->vector != NULL )
+            {
+                finishVector( reader, slot );
+                completeSlot( reader, slot );
+                ++count;
+            }
+            else if ( res > 0 && slot->done < slot->length )
+            {
+                /* short read - go back for the rest */
+                prepareUring( reader, slot );
+            }
+            else
+            {
+                slot->result = slot->done;
+                completeSlot( reader, slot );
+                ++count;
+            }
+        }
+    }
+    __atomic_store_n( ring->cqHead, head, __ATOMIC_RELEASE );
+
+    return count;
+}
+
+/****************************************************************************/
+/* thread pool engine, for when io_uring isn't available */
+
+static void * readerThread( void * arg )
+{
+    tReaderPool * pool   = arg;
+    tAsyncReader * reader = (tAsyncReader *)((byte *) pool - offsetof( tAsyncReader, pool ));
+
+    pthread_mutex_lock( &pool->lock );
+    for (;;)
+    {
+        while ( pool->pending == NULL && !pool->shutdown )
+        {
+            pthread_cond_wait( &pool->work, &pool->lock );
+        }
+        if ( pool->pending == NULL )
+        {
+            break;
+        }
+
+        tReadSlot * slot = pool->pending;
+        pool->pending = slot->next;
+        if ( pool->pending == NULL )
+        {
+            pool->pendingTail = &pool->pending;
+        }
+        pthread_mutex_unlock( &pool->lock );
+
+        if ( slot->vector != NULL )
+        {
+            slot->result = readDriveVector( reader->drive, slot->offset, slot->vector, slot->vectorCount );
+        }
+        else
+        {
+            slot->result = readDriveExtent( reader->drive, slot->offset, slot->dest, slot->length );
+        }
+
+        pthread_mutex_lock( &pool->lock );
+        slot->next = pool->completed;
+        pool->completed = slot;
+        pthread_cond_signal( &pool->done );
+    }
+    pthread_mutex_unlock( &pool->lock );
+
+    return NULL;
+}
+
+static int openPool( tAsyncReader * reader )
+{
+    tReaderPool * pool = &reader->pool;
+
+    pool->threadCount = reader->depth < kMaxReaderThreads ? reader->depth : kMaxReaderThreads;
+    pool->threads     = calloc( pool->threadCount, sizeof( pthread_t ) );
+    if ( !isHeapPtr( pool->threads ) )
+    {
+        return -1;
+    }
+    pool->pending     = NULL;
+    pool->pendingTail = &pool->pending;
+    pool->completed   = NULL;
+    pool->shutdown    = 0;
+    pthread_mutex_init( &pool->lock, NULL );
+    pthread_cond_init( &pool->work, NULL );
+    pthread_cond_init( &pool->done, NULL );
+
+    for ( unsigned i = 0; i < pool->threadCount; ++i )
+    {
+        int err = pthread_create( &pool->threads[i], NULL, readerThread, pool );
+        if ( err != 0 )
+        {
+            LogError( "unable to start reader thread %u (%d: %s)", i, err, strerror( err ) );
+            pool->threadCount = i;
+            break;
+        }
+    }
+    if ( pool->threadCount == 0 )
+    {
+        free( pool->threads );
+        return -1;
+    }
+
+    LogInfo( "using a pool of %u reader threads", pool->threadCount );
+    return 0;
+}
+
+static void closePool( tAsyncReader * reader )
+{
+    tReaderPool * pool = &reader->pool;
+
+    pthread_mutex_lock( &pool->lock );
+    pool->shutdown = 1;
+    pthread_cond_broadcast( &pool->work );
+    pthread_mutex_unlock( &pool->lock );
+
+    for ( unsigned i = 0; i < pool->threadCount; ++i )
+    {
+        pthread_join( pool->threads[i], NULL );
+    }
+    free( pool->threads );
+    pthread_cond_destroy( &pool->done );
+    pthread_cond_destroy( &pool->work );
+    pthread_mutex_destroy( &pool->lock );
+}
+
+static void submitPool( tAsyncReader * reader, tReadSlot * slot )
+{
+    tReaderPool * pool = &reader->pool;
+
+    pthread_mutex_lock( &pool->lock );
+    slot->next = NULL;
+    *pool->pendingTail = slot;
+    pool->pendingTail  = &slot->next;
+    pthread_cond_signal( &pool->work );
+    pthread_mutex_unlock( &pool->lock );
+}
+
+static int reapPool( tAsyncReader * reader, int wait )
+{
+    tReaderPool * pool  = &reader->pool;
+    int           count = 0;
+
+    pthread_mutex_lock( &pool->lock );
+    while ( wait && pool->completed == NULL )
+    {
+        pthread_cond_wait( &pool->done, &pool->lock );
+    }
+    tReadSlot * slot = pool->completed;
+    pool->completed = NULL;
+    pthread_mutex_unlock( &pool->lock );
+
+    while ( slot != NULL )
+    {
+        tReadSlot * next = slot->next;
+        completeSlot( reader, slot );
+        ++count;
+        slot = next;
+    }
+    return count;
+}
+
+/****************************************************************************/
+
+static void completeSlot( tAsyncReader * reader, tReadSlot * slot )
+{
+    if ( slot->result != (ssize_t) slot->length )
+    {
+        if ( slot->result >= 0 )
+        {
+            LogError( "short read @ offset %lu (%ld of %lu bytes)", slot->offset, slot->result, slot->length );
+        }
+        reader->failed = 1;
+    }
+    else
+    {
+        reader->total += slot->result;
+    }
+
+    if ( slot->callback != NULL )
+    {
+        (*slot->callback)( slot->dest, slot->length, slot->result, slot->cbData );
+    }
+
+    --reader->inFlight;
+    slot->next = reader->freeSlots;
+    reader->freeSlots = slot;
+}
+
+/**
+ * collect completed reads. if wait is set, blocks until at least one finishes.
+ */
+static int reapReads( tAsyncReader * reader, int wait )
+{
+    int count;
+
+    if ( reader->engine == ioEngineUring )
+    {
+        if ( flushUring( reader, 0 ) < 0 )
+        {
+            return -1;
+        }
+        count = reapUring( reader );
+        while ( count == 0 && wait )
+        {
+            if ( flushUring( reader, 1 ) < 0 )
+            {
+                return -1;
+            }
+            count = reapUring( reader );
+        }
+        /* short reads may have been resubmitted while reaping */
+        if ( flushUring( reader, 0 ) < 0 )
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        count = reapPool( reader, wait );
+    }
+    return count;
+}
+
+/**
+ * Start an asynchronous reader for the drive, using the engine, queue depth
+ * and chunk size configured in the tDrive.
+ *
+ * @param drive  the drive to read from
+ * @return a new reader, or NULL if neither engine could be started
+ */
+tAsyncReader * openAsyncReader( tDrive * drive )
+{
+    tAsyncReader * reader = calloc( sizeof( tAsyncReader ), 1 );
+
+    if ( isHeapPtr( reader ) )
+    {
+        reader->drive     = drive;
+        reader->depth     = drive->queueDepth > 0 ? drive->queueDepth : 1;
+        reader->chunkSize = drive->chunkSize > 0 ? drive->chunkSize : kDefaultChunkSize;
+        /* in direct i/o mode, every chunk boundary has to stay sector aligned */
+        reader->chunkSize = (reader->chunkSize + drive->alignment - 1) & ~(drive->alignment - 1);
+        reader->slots     = calloc( reader->depth, sizeof( tReadSlot ) );
+        if ( !isHeapPtr( reader->slots ) )
+        {
+            free( reader );
+            return NULL;
+        }
+        for ( unsigned i = 0; i < reader->depth; ++i )
+        {
+            reader->slots[i].next = reader->freeSlots;
+            reader->freeSlots = &reader->slots[i];
+        }
+
+        /* io_uring needs a file descriptor; mmap and in-memory drives don't have one */
+        int canUseUring = (drive->id >= 0);
+
+        reader->engine = ioEngineNone;
+        if ( drive->engine != ioEngineThreads && canUseUring && openUring( reader ) == 0 )
+        {
+            reader->engine = ioEngineUring;
+        }
+        else if ( (drive->engine != ioEngineUring || !canUseUring) && openPool( reader ) == 0 )
+        {
+            reader->engine = ioEngineThreads;
+        }
+
+        if ( reader->engine == ioEngineNone )
+        {
+            LogError( "unable to start an asynchronous reader" );
+            free( reader->slots );
+            free( reader );
+            reader = NULL;
+        }
+        else
+        {
+            LogInfo( "async reader: queue depth %u, chunk size %lu KB", reader->depth, reader->chunkSize / 1024 );
+        }
+    }
+    return reader;
+}
+
+/**
+ * Queue a read. It's split into chunks, which are handed to the engine as
+ * soon as a slot is free; if all slots are busy, this waits for some of the
+ * outstanding reads to complete.
+ *
+ * @param reader    the reader
+ * @param offset    byte offset from the start of the partition
+ * @param dest      where to put the data
+ * @param length    number of bytes to read
+ * @param callback  optional, invoked as each chunk completes
+ * @param cbData    opaque pointer passed through to callback
+ * @return 0 if the read was queued, -1 if not
+ */
+int queueAsyncRead( tAsyncReader * reader, off64_t offset, void * dest, size_t length,
+                    tReadCallback callback, void * cbData )
+{
+    byte * p = dest;
+
+    if ( offset < 0 || offset + length > reader->drive->partition.length )
+    {
+        LogError( "read requested past the end of partition (%ld + %ld > %ld)",
+             offset, length, reader->drive->partition.length );
+        reader->failed = 1;
+        return -1;
+    }
+
+    while ( length > 0 )
+    {
+        while ( reader->freeSlots == NULL )
+        {
+            if ( reapReads( reader, 1 ) < 0 )
+            {
+                reader->failed = 1;
+                return -1;
+            }
+        }
+
+        tReadSlot * slot = reader->freeSlots;
+        reader->freeSlots = slot->next;
+        ++reader->inFlight;
+
+        slot->offset   = offset;
+        slot->dest     = p;
+        slot->length   = length < reader->chunkSize ? length : reader->chunkSize;
+        slot->done     = 0;
+        slot->result   = 0;
+        slot->callback = callback;
+        slot->cbData   = cbData;
+        slot->vector   = NULL;
+
+        if ( reader->engine == ioEngineUring )
+        {
+            if ( isDriveAligned( reader->drive, slot->offset, slot->dest, slot->length ) )
+            {
+                prepareUring( reader, slot );
+            }
+            else
+            {
+                /* direct i/o, but not aligned: let readDriveExtent() bounce it */
+                slot->result = readDriveExtent( reader->drive, slot->offset, slot->dest, slot->length );
+                completeSlot( reader, slot );
+            }
+        }
+        else
+        {
+            submitPool( reader, slot );
+        }
+
+        offset += slot->length;
+        p      += slot->length;
+        length -= slot->length;
+    }
+
+    if ( reader->engine == ioEngineUring && flushUring( reader, 0 ) < 0 )
+    {
+        reader->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Queue a scatter read: one contiguous range of the drive, spread over several
+ * buffers. Unlike queueAsyncRead(), it isn't split into chunks, so the caller
+ * should keep it to a sensible size. The vector must stay valid until the read
+ * completes.
+ *
+ * @param reader    the reader
+ * @param offset    byte offset from the start of the partition
+ * @param vector    where to put the data
+ * @param count     number of entries in vector
+ * @param callback  optional, invoked when the read completes, with a NULL dest
+ * @param cbData    opaque pointer passed through to callback
+ * @return 0 if the read was queued, -1 if not
+ */
+int queueAsyncReadVector( tAsyncReader * reader, off64_t offset, const struct iovec * vector, int count,
+                          tReadCallback callback, void * cbData )
+{
+    size_t length  = 0;
+    int    aligned = 1;
+
+    for ( int i = 0; i < count; ++i )
+    {
+        aligned = aligned && isDriveAligned( reader->drive, offset + length, vector[i].iov_base, vector[i].iov_len );
+        length += vector[i].iov_len;
+    }
+
+    if ( offset < 0 || offset + length > reader->drive->partition.length )
+    {
+        LogError( "read requested past the end of partition (%ld + %ld > %ld)",
+             offset, length, reader->drive->partition.length );
+        reader->failed = 1;
+        return -1;
+    }
+
+    while ( reader->freeSlots == NULL )
+    {
+        if ( reapReads( reader, 1 ) < 0 )
+        {
+            reader->failed = 1;
+            return -1;
+        }
+    }
+
+    tReadSlot * slot = reader->freeSlots;
+    reader->freeSlots = slot->next;
+    ++reader->inFlight;
+
+    slot->offset      = offset;
+    slot->dest        = NULL;
+    slot->length      = length;
+    slot->done        = 0;
+    slot->result      = 0;
+    slot->callback    = callback;
+    slot->cbData      = cbData;
+    slot->vector      = vector;
+    slot->vectorCount = count;
+
+    if ( reader->engine == ioEngineUring )
+    {
+        if ( aligned )
+        {
+            prepareUring( reader, slot );
+            if ( flushUring( reader, 0 ) < 0 )
+            {
+                reader->failed = 1;
+                return -1;
+            }
+        }
+        else
+        {
+            /* direct i/o, but not aligned: let readDriveVector() bounce it */
+            slot->result = readDriveVector( reader->drive, slot->offset, vector, count );
+            completeSlot( reader, slot );
+        }
+    }
+    else
+    {
+        submitPool( reader, slot );
+    }
+    return 0;
+}
+
+/**
+ * Collect any reads that have completed, invoking their callbacks.
+ *
+ * @param reader  the reader
+ * @param wait    if set, and reads are outstanding, block until at least one completes
+ * @return the number of chunks collected, or -1 if the engine failed
+ */
+int pollAsyncReads( tAsyncReader * reader, int wait )
+{
+    if ( reader->inFlight == 0 )
+    {
+        return 0;
+    }
+
+    int count = reapReads( reader, wait );
+    if ( count < 0 )
+    {
+        reader->failed = 1;
+    }
+    return count;
+}
+
+/**
+ * Wait for every queued read to complete.
+ *
+ * @param reader  the reader
+ * @return the number of bytes read since the last wait, or -1 if any chunk failed
+ */
+ssize_t waitAsyncReads( tAsyncReader * reader )
+{
+    ssize_t result;
+
+    while ( reader->inFlight > 0 )
+    {
+        if ( reapReads( reader, 1 ) < 0 )
+        {
+            /* the ring is unusable, so the outstanding slots will never come back */
+            reader->failed = 1;
+            break;
+        }
+    }
+
+    result = reader->failed ? -1 : reader->total;
+    reader->total  = 0;
+    reader->failed = 0;
+
+    return result;
+}
+
+void closeAsyncReader( tAsyncReader * reader )
+{
+    if ( reader != NULL )
+    {
+        waitAsyncReads( reader );
+        if ( reader->engine == ioEngineUring )
+        {
+            closeUring( reader );
+        }
+        else
+        {
+            closePool( reader );
+        }
+        free( reader->slots );
+        free( reader );
+    }
+}
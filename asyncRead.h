@@ -0,0 +1,33 @@
+/*
+    Asynchronous, chunked reads from a tDrive.
+
+    Each request is split into drive->chunkSize pieces, and up to
+    drive->queueDepth of them are kept in flight at once, using io_uring
+    where the kernel provides it, and a small pool of reader threads where
+    it doesn't.
+*/
+
+#ifndef READLOGICALVOLUME_ASYNCREAD_H
+#define READLOGICALVOLUME_ASYNCREAD_H
+
+/**
+   invoked once for every chunk, as it completes. Always called on the thread that
+   called queueAsyncRead() or waitAsyncReads(), never from a reader thread.
+   result is the number of bytes read, or -1 if the chunk failed.
+ */
+typedef void (*tReadCallback)( void * dest, size_t length, ssize_t result, void * cbData );
+
+struct iovec;
+
+typedef struct tAsyncReader tAsyncReader;
+
+tAsyncReader * openAsyncReader( tDrive * drive );
+int            queueAsyncRead( tAsyncReader * reader, off64_t offset, void * dest, size_t length,
+                               tReadCallback callback, void * cbData );
+int            queueAsyncReadVector( tAsyncReader * reader, off64_t offset, const struct iovec * vector, int count,
+                                     tReadCallback callback, void * cbData );
+int            pollAsyncReads( tAsyncReader * reader, int wait );
+ssize_t        waitAsyncReads( tAsyncReader * reader );
+void           closeAsyncReader( tAsyncReader * reader );
+
+#endif //READLOGICALVOLUME_ASYNCREAD_H
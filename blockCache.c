@@ -0,0 +1,327 @@
+/*
+    LRU block cache.
+
+    The cache is a fixed set of blocks, each blockSize bytes and aligned
+    so it can be filled with direct i/o. Blocks are found through a small
+    chained hash on the block number, and recycled in least-recently-used
+    order.
+
+    Several threads may use one cache. The lock isn't held while a block
+    is being filled; other readers that want the same block wait for it,
+    and readers that want anything else carry on.
+*/
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "readlogicalvolume.h"
+#include "debug.h"
+#include "blockCache.h"
+
+typedef enum {
+    blockEmpty = 0,
+    blockLoading,
+    blockValid
+} tBlockState;
+
+typedef struct tCacheBlock
+{
+    struct tCacheBlock * hashNext;
+    struct tCacheBlock * lruPrev;   /* towards the most recently used */
+    struct tCacheBlock * lruNext;   /* towards the least recently used */
+    off64_t              number;    /* offset / blockSize */
+    tBlockState          state;
+    unsigned             users;     /* readers copying out of it, so it can't be recycled */
+    size_t               length;    /* valid bytes, short at the end of the device */
+    byte               * data;
+} tCacheBlock;
+
+struct tBlockCache
+{
+    pthread_mutex_t   lock;
+    pthread_cond_t    loaded;
+    size_t            blockSize;
+    unsigned          blockCount;
+    unsigned          hashMask;
+    tCacheBlock    ** hash;
+    tCacheBlock     * blocks;
+    tCacheBlock     * mostRecent;
+    tCacheBlock     * leastRecent;
+    byte            * memory;
+    tBlockFill        fill;
+    void            * context;
+    tBlockCacheStats  stats;
+};
+
+static unsigned hashBlock( tBlockCache * cache, off64_t number )
+{
+    return (unsigned)( number ^ (number >> 16) ) & cache->hashMask;
+}
+
+static void unlinkLRU( tBlockCache * cache, tCacheBlock * block )
+{
+    if ( block->lruPrev != NULL ) { block->lruPrev->lruNext = block->lruNext; }
+    else                          { cache->mostRecent = block->lruNext; }
+
+    if ( block->lruNext != NULL ) { block->lruNext->lruPrev = block->lruPrev; }
+    else                          { cache->leastRecent = block->lruPrev; }
+}
+
+static void makeMostRecent( tBlockCache * cache, tCacheBlock * block )
+{
+    unlinkLRU( cache, block );
+    block->lruPrev = NULL;
+    block->lruNext = cache->mostRecent;
+    if ( cache->mostRecent != NULL )
+    {
+        cache->mostRecent->lruPrev = block;
+    }
+    cache->mostRecent = block;
+    if ( cache->leastRecent == NULL )
+    {
+        cache->leastRecent = block;
+    }
+}
+
+static void unlinkHash( tBlockCache * cache, tCacheBlock * block )
+{
+    tCacheBlock ** link = &cache->hash[ hashBlock( cache, block->number ) ];
+
+    while ( *link != NULL )
+    {
+        if ( *link == block )
+        {
+            *link = block->hashNext;
+            break;
+        }
+        link = &(*link)->hashNext;
+    }
+    block->hashNext = NULL;
+}
+
+static tCacheBlock * findBlock( tBlockCache * cache, off64_t number )
+{
+    tCacheBlock * block = cache->hash[ hashBlock( cache, number ) ];
+
+    while ( block != NULL && block->number != number )
+    {
+        block = block->hashNext;
+    }
+    return block;
+}
+
+/**
+ * @param blockSize   size of each block; a power of two
+ * @param blockCount  how many blocks to keep
+ * @param alignment   alignment of the block buffers (for direct i/o), or 0
+ * @param fill        called to read a block on a miss
+ * @param context     passed through to fill
+ * @return the cache, or NULL
+ */
+tBlockCache * newBlockCache( size_t blockSize, unsigned blockCount, size_t alignment,
+                             tBlockFill fill, void * context )
+{
+    tBlockCache * cache = calloc( sizeof( tBlockCache ), 1 );
+
+    if ( isHeapPtr( cache ) )
+    {
+        unsigned hashSize = 1;
+        while ( hashSize < blockCount * 2 )
+        {
+            hashSize <<= 1;
+        }
+
+        if ( alignment < sizeof( void * ) )
+        {
+            alignment = sizeof( void * );
+        }
+
+        cache->blockSize  = blockSize;
+        cache->blockCount = blockCount;
+        cache->hashMask   = hashSize - 1;
+        cache->fill       = fill;
+        cache->context    = context;
+        cache->hash       = calloc( hashSize, sizeof( tCacheBlock * ) );
+        cache->blocks     = calloc( blockCount, sizeof( tCacheBlock ) );
+
+        if ( !isHeapPtr( cache->hash ) || !isHeapPtr( cache->blocks )
+          || posix_memalign( (void **) &cache->memory, alignment, blockSize * blockCount ) != 0 )
+        {
+            LogError( "unable to allocate a %u x %lu byte block cache", blockCount, blockSize );
+            free( cache->hash );
+            free( cache->blocks );
+            free( cache );
+            return NULL;
+        }
+
+        for ( unsigned i = 0; i < blockCount; ++i )
+        {
+            tCacheBlock * block = &cache->blocks[i];
+            block->data    = cache->memory + i * blockSize;
+            block->lruPrev = (i > 0) ? &cache->blocks[ i - 1 ] : NULL;
+            block->lruNext = (i + 1 < blockCount) ? &cache->blocks[ i + 1 ] : NULL;
+        }
+        cache->mostRecent  = &cache->blocks[0];
+        cache->leastRecent = &cache->blocks[ blockCount - 1 ];
+
+        pthread_mutex_init( &cache->lock, NULL );
+        pthread_cond_init( &cache->loaded, NULL );
+    }
+    return cache;
+}
+
+/**
+ * Find a block, reading it in if it isn't cached. Called, and returns, with the
+ * lock held. The block comes back with its user count raised, so it won't be
+ * recycled while the caller copies from it.
+ * @return the block, or NULL if every block is busy or the fill failed
+ */
+static tCacheBlock * getBlock( tBlockCache * cache, off64_t number )
+{
+    tCacheBlock * block;
+
+    for (;;)
+    {
+        block = findBlock( cache, number );
+        if ( block == NULL || block->state != blockLoading )
+        {
+            break;
+        }
+        /* someone else is reading it in - wait for them */
+        pthread_cond_wait( &cache->loaded, &cache->lock );
+    }
+
+    if ( block != NULL )
+    {
+        ++cache->stats.hits;
+        ++block->users;
+        makeMostRecent( cache, block );
+        return block;
+    }
+
+    ++cache->stats.misses;
+
+    /* recycle the least recently used block that nobody is looking at */
+    block = cache->leastRecent;
+    while ( block != NULL && (block->users > 0 || block->state == blockLoading) )
+    {
+        block = block->lruPrev;
+    }
+    if ( block == NULL )
+    {
+        return NULL;
+    }
+
+    if ( block->state != blockEmpty )
+    {
+        unlinkHash( cache, block );
+    }
+    block->number = number;
+    block->state  = blockLoading;
+    block->users  = 1;
+    unsigned h = hashBlock( cache, number );
+    block->hashNext = cache->hash[ h ];
+    cache->hash[ h ] = block;
+    makeMostRecent( cache, block );
+
+    pthread_mutex_unlock( &cache->lock );
+    ssize_t rdLen = (*cache->fill)( cache->context, number * cache->blockSize, block->data, cache->blockSize );
+    pthread_mutex_lock( &cache->lock );
+
+    pthread_cond_broadcast( &cache->loaded );
+    if ( rdLen < 0 )
+    {
+        unlinkHash( cache, block );
+        block->state = blockEmpty;
+        block->users = 0;
+        return NULL;
+    }
+    block->length = rdLen;
+    block->state  = blockValid;
+
+    return block;
+}
+
+/**
+ * Read through the cache. The request may span several blocks.
+ *
+ * @param cache   the cache
+ * @param offset  byte offset, in the same terms as the fill function's
+ * @param dest    where to put the data
+ * @param length  number of bytes to read
+ * @return the number of bytes read (short at the end of the device), or -1
+ */
+ssize_t readBlockCache( tBlockCache * cache, off64_t offset, void * dest, size_t length )
+{
+    byte  * p         = dest;
+    size_t  remaining = length;
+
+    pthread_mutex_lock( &cache->lock );
+    while ( remaining > 0 )
+    {
+        off64_t       number = offset / cache->blockSize;
+        size_t        within = offset % cache->blockSize;
+        tCacheBlock * block  = getBlock( cache, number );
+
+        if ( block == NULL )
+        {
+            pthread_mutex_unlock( &cache->lock );
+            /* every block is busy: go straight to the device rather than wait */
+            ssize_t rdLen = (*cache->fill)( cache->context, offset, p, remaining );
+            if ( rdLen < 0 )
+            {
+                return -1;
+            }
+            return length - remaining + rdLen;
+        }
+
+        size_t available = block->length > within ? block->length - within : 0;
+        size_t count     = remaining < available ? remaining : available;
+
+        /* the block can't be recycled while we hold a use of it, so copy without the lock */
+        pthread_mutex_unlock( &cache->lock );
+        memcpy( p, block->data + within, count );
+        pthread_mutex_lock( &cache->lock );
+        --block->users;
+
+        p         += count;
+        offset    += count;
+        remaining -= count;
+
+        if ( block->length < cache->blockSize && within + count >= block->length )
+        {
+            /* short block: the end of the device */
+            break;
+        }
+    }
+    pthread_mutex_unlock( &cache->lock );
+
+    return length - remaining;
+}
+
+void getBlockCacheStats( tBlockCache * cache, tBlockCacheStats * stats )
+{
+    pthread_mutex_lock( &cache->lock );
+    *stats = cache->stats;
+    pthread_mutex_unlock( &cache->lock );
+}
+
+void freeBlockCache( tBlockCache * cache )
+{
+    if ( cache != NULL )
+    {
+        pthread_cond_destroy( &cache->loaded );
+        pthread_mutex_destroy( &cache->lock );
+        free( cache->memory );
+        free( cache->blocks );
+        free( cache->hash );
+        free( cache );
+    }
+}
@@ -0,0 +1,31 @@
+/*
+    A small LRU cache of fixed-size, aligned blocks.
+
+    Sits beneath readDrive() so the probe phase (GPT, PV label, metadata
+    header and text, all close together near the start of the partition)
+    costs a couple of device reads rather than one per structure.
+*/
+
+#ifndef READLOGICALVOLUME_BLOCKCACHE_H
+#define READLOGICALVOLUME_BLOCKCACHE_H
+
+/**
+   fetches a whole block on a cache miss. offset is a multiple of the block size.
+   returns the number of bytes read (may be short at the end of the device), or -1
+ */
+typedef ssize_t (*tBlockFill)( void * context, off64_t offset, void * dest, size_t length );
+
+typedef struct tBlockCache tBlockCache;
+
+typedef struct tBlockCacheStats {
+    unsigned long hits;
+    unsigned long misses;
+} tBlockCacheStats;
+
+tBlockCache * newBlockCache( size_t blockSize, unsigned blockCount, size_t alignment,
+                             tBlockFill fill, void * context );
+ssize_t       readBlockCache( tBlockCache * cache, off64_t offset, void * dest, size_t length );
+void          getBlockCacheStats( tBlockCache * cache, tBlockCacheStats * stats );
+void          freeBlockCache( tBlockCache * cache );
+
+#endif //READLOGICALVOLUME_BLOCKCACHE_H
@@ -0,0 +1,58 @@
+/*
+    Reading big- and little-endian values out of on-disk structures, and
+    network messages, a byte at a time, whatever the host's byte order.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "readlogicalvolume.h"
+
+/**
+ * @param ptr    starting address of value to be converted
+ * @param count  number of bytes to be converted
+ * @return the value, assuming the value is big-endian in memory
+ */
+uint64_t getBE( const byte * ptr, int count )
+{
+    uint64_t  result = 0;
+    for ( int i      = count; i > 0; --i )
+    {
+        result <<= 8;
+        result |= *ptr++;
+    }
+    return (result);
+}
+
+/**
+ *
+ * @param ptr    starting address of value to be converted
+ * @param count  number of bytes to be converted
+ * @return the value, assuming the value is little-endian in memory
+ */
+uint64_t getLE( const byte * ptr, int count )
+{
+    uint64_t result = 0;
+    ptr += count;
+    for ( int i = count; i > 0; --i )
+    {
+        result <<= 8;
+        result |= *(--ptr);
+    }
+    return (result);
+}
+
+uint64_t get64LE( const byte * ptr )
+{
+    return getLE( ptr, 8 );
+}
+
+uint32_t get32LE( const byte * ptr )
+{
+    return (uint32_t) getLE( ptr, 4 );
+}
+
+uint16_t get16LE( const byte * ptr )
+{
+    return (uint16_t) getLE( ptr, 2 );
+}
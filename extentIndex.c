@@ -0,0 +1,351 @@
+/*
+    Logical-to-physical translation for a logical volume.
+
+    Volumes that have been through a lot of lvextend churn can have tens of
+    thousands of segments. The index keeps the starting extents in one
+    array of their own, so the binary search only touches a few cache
+    lines, and everything else needed to finish the translation in a
+    parallel array of small fixed-size entries.
+
+    A striped segment can't be described by one physical offset: its data
+    is dealt out across the stripes a chunk at a time, so chunk n is on
+    stripe n % stripeCount, in row n / stripeCount. A mirrored segment's
+    data is in each of its legs, which are logical volumes in their own
+    right; reads take turns between the legs, kMirrorStride bytes at a
+    time, so every leg does its share. A raid4/5/6 segment is striped
+    across its legs too, but each row also has a parity chunk or two, on
+    a leg that depends on the layout; see raidParity.c. A thin segment's
+    blocks are wherever its pool put them; see thinPool.c. A snapshot's
+    chunks are in its COW store or its origin; see snapshot.c. The index
+    entries for all of these just mark them as mapped, and the translation
+    goes back to the segment.
+*/
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "readlogicalvolume.h"
+#include "debug.h"
+#include "stringHash.h"
+#include "readaccess.h"
+#include "parseMetadata.h"
+#include "lvm.h"
+#include "extentIndex.h"
+#include "raidParity.h"
+#include "thinPool.h"
+#include "snapshot.h"
+
+struct tExtentIndexEntry
+{
+    off64_t     physicalOffset;     /* bytes from the start of the physical volume's partition */
+    uint32_t    extentCount;
+    uint32_t    pvId;               /* index into tLogicalVolume.pvTable, or kMappedSegment */
+};
+
+/* in place of a pvId: the segment isn't simply linear, so has to be mapped piece by piece */
+#define kMappedSegment      UINT32_MAX
+
+/**
+ * Find where an offset into a mirrored segment lives on one of its legs.
+ * @param leg  which of the usable legs
+ */
+static void mapMirrorOffset( tLogicalVolume * lv, tLogicalVolumeSegment * segment, int leg,
+                             uint64_t within, tExtentRun * run )
+{
+    uint64_t     length   = segment->extentCount * lv->extentSize;
+    uint64_t     toStride = kMirrorStride - within % kMirrorStride;
+    tMirrorLeg * mirror   = &segment->legs[ leg ];
+
+    if ( findExtentRun( mirror->lv, mirror->startExtent * lv->extentSize + within, run ) < 0 )
+    {
+        /* can't happen: the leg was checked to be long enough when it was loaded */
+        run->physicalVolume = NULL;
+        run->offset         = 0;
+        run->length         = length - within;
+    }
+    if ( run->length > toStride )
+    {
+        run->length = toStride;
+    }
+    if ( run->length > length - within )
+    {
+        run->length = length - within;
+    }
+}
+
+/**
+ * Find where an offset into a raid4/5/6 segment lives: on whichever leg the
+ * layout puts that chunk of data, at the same row.
+ */
+static void mapParityOffset( tLogicalVolume * lv, tLogicalVolumeSegment * segment,
+                             uint64_t within, tExtentRun * run )
+{
+    uint64_t length   = segment->extentCount * lv->extentSize;
+    int      dataLegs = segment->legCount - segment->parityCount;
+    uint64_t chunk    = within / segment->stripeSize;
+    uint64_t inChunk  = within % segment->stripeSize;
+    uint64_t row      = chunk / dataLegs;
+    uint64_t toChunk  = segment->stripeSize - inChunk;
+    tRaidRow layout;
+
+    getRaidRow( segment, row, &layout );
+    tMirrorLeg * leg = &segment->legs[ layout.data[ chunk % dataLegs ] ];
+
+    if ( leg->lv == NULL )
+    {
+        run->physicalVolume = NULL;
+        run->offset         = 0;
+        run->length         = toChunk;
+        run->rebuild        = 1;
+    }
+    else if ( findExtentRun( leg->lv, leg->startExtent * lv->extentSize + row * segment->stripeSize + inChunk, run ) < 0 )
+    {
+        /* can't happen: the leg was checked to be long enough when it was loaded */
+        run->physicalVolume = NULL;
+        run->offset         = 0;
+        run->length         = toChunk;
+    }
+    if ( run->length > toChunk )
+    {
+        run->length = toChunk;
+    }
+    if ( run->length > length - within )
+    {
+        run->length = length - within;
+    }
+}
+
+/**
+ * Find where an offset into a segment lives. The run ends at the end of the
+ * stripe chunk, or of the segment, whichever comes first.
+ *
+ * @param lv       the logical volume
+ * @param segment  one of its segments
+ * @param within   byte offset from the start of the segment
+ * @param run      filled in with where it lives, and how much follows contiguously
+ */
+void mapSegmentOffset( tLogicalVolume * lv, tLogicalVolumeSegment * segment, uint64_t within, tExtentRun * run )
+{
+    uint64_t  length = segment->extentCount * lv->extentSize;
+    tStripe * stripe = segment->stripes;
+
+    run->rebuild = 0;
+    if ( segment->type == segmentMirror )
+    {
+        mapMirrorOffset( lv, segment, (within / kMirrorStride) % segment->usableLegs, within, run );
+        return;
+    }
+    if ( segment->type == segmentParity )
+    {
+        mapParityOffset( lv, segment, within, run );
+        return;
+    }
+    if ( segment->type == segmentThin )
+    {
+        mapThinOffset( segment, within, run );
+        return;
+    }
+    if ( segment->type == segmentSnapshot )
+    {
+        mapSnapshotOffset( segment, within, run );
+        return;
+    }
+
+    if ( segment->stripeCount <= 1 )
+    {
+        run->physicalVolume = stripe->physicalVolume;
+        run->offset         = getStripeOffset( lv, stripe ) + within;
+        run->length         = length - within;
+        return;
+    }
+
+    uint64_t chunk   = within / segment->stripeSize;
+    uint64_t inChunk = within % segment->stripeSize;
+    uint64_t row     = chunk / segment->stripeCount;
+
+    stripe = &segment->stripes[ chunk % segment->stripeCount ];
+    run->physicalVolume = stripe->physicalVolume;
+    run->offset         = getStripeOffset( lv, stripe ) + row * segment->stripeSize + inChunk;
+    run->length         = segment->stripeSize - inChunk;
+    if ( run->length > length - within )
+    {
+        run->length = length - within;
+    }
+}
+
+/**
+ * Build the translation index for a logical volume. Its segments must already be
+ * sorted, and their stripes resolved to physical volumes.
+ *
+ * @return 0 on success, -1 if out of memory
+ */
+int buildExtentIndex( tLogicalVolume * lv )
+{
+    int count = lv->segmentCount;
+
+    lv->indexStarts  = malloc( (count + 1) * sizeof( uint64_t ) );
+    lv->indexEntries = malloc( (count + 1) * sizeof( tExtentIndexEntry ) );
+    if ( !isHeapPtr( lv->indexStarts ) || !isHeapPtr( lv->indexEntries ) )
+    {
+        freeExtentIndex( lv );
+        return -1;
+    }
+
+    for ( int i = 0; i < count; ++i )
+    {
+        tLogicalVolumeSegment * segment = &lv->segments[ i ];
+        tStripe               * stripe  = segment->stripes;
+
+        lv->indexStarts[ i ] = segment->startExtent;
+        lv->indexEntries[ i ].extentCount = segment->extentCount;
+        if ( segment->stripeCount != 1 || segment->type != segmentStriped )
+        {
+            lv->indexEntries[ i ].pvId           = kMappedSegment;
+            lv->indexEntries[ i ].physicalOffset = 0;
+        }
+        else
+        {
+            lv->indexEntries[ i ].pvId           = stripe->pvId;
+            lv->indexEntries[ i ].physicalOffset = getStripeOffset( lv, stripe );
+        }
+    }
+    /* a sentinel, so the end of the last segment needs no special case */
+    lv->indexStarts[ count ] = lv->length / lv->extentSize;
+    lv->indexEntries[ count ].extentCount = 0;
+    lv->indexEntries[ count ].pvId = 0;
+    lv->indexEntries[ count ].physicalOffset = 0;
+
+    return 0;
+}
+
+/**
+ * @return the index of the last segment starting at or before an extent
+ */
+static size_t findSegmentIndex( tLogicalVolume * lv, uint64_t extent )
+{
+    const uint64_t * starts = lv->indexStarts;
+    size_t           low    = 0;
+    size_t           size   = lv->segmentCount;
+
+    while ( size > 1 )
+    {
+        size_t half = size / 2;
+        low  = (starts[ low + half ] <= extent) ? low + half : low;
+        size -= half;
+    }
+    return low;
+}
+
+/**
+ * Translate an offset into a logical volume to a physical location.
+ *
+ * @param lv      the logical volume
+ * @param offset  byte offset into the volume
+ * @param run     filled in with where it lives, and how much follows contiguously
+ * @return 0 on success, -1 if the offset is past the end of the volume
+ */
+int findExtentRun( tLogicalVolume * lv, uint64_t offset, tExtentRun * run )
+{
+    const uint64_t * starts = lv->indexStarts;
+
+    run->rebuild = 0;
+    if ( offset >= lv->length || lv->segmentCount == 0 )
+    {
+        return -1;
+    }
+
+    size_t low = findSegmentIndex( lv, offset / lv->extentSize );
+
+    const tExtentIndexEntry * entry = &lv->indexEntries[ low ];
+    uint64_t start = starts[ low ] * lv->extentSize;
+    uint64_t end   = (starts[ low ] + entry->extentCount) * lv->extentSize;
+
+    if ( offset < start )
+    {
+        /* before the first segment */
+        run->physicalVolume = NULL;
+        run->offset         = 0;
+        run->length         = start - offset;
+    }
+    else if ( offset >= end )
+    {
+        /* in a gap, up to the next segment (or the sentinel at the end) */
+        run->physicalVolume = NULL;
+        run->offset         = 0;
+        run->length         = starts[ low + 1 ] * lv->extentSize - offset;
+    }
+    else if ( entry->pvId == kMappedSegment )
+    {
+        mapSegmentOffset( lv, &lv->segments[ low ], offset - start, run );
+    }
+    else
+    {
+        run->physicalVolume = lv->pvTable[ entry->pvId ];
+        run->offset         = entry->physicalOffset + (offset - start);
+        run->length         = end - offset;
+    }
+    return 0;
+}
+
+/**
+ * Find the segment an offset into a volume is in.
+ *
+ * @param within  set to the offset from the start of the segment
+ * @return the segment, or NULL if the offset isn't in one
+ */
+tLogicalVolumeSegment * findVolumeSegment( tLogicalVolume * lv, uint64_t offset, uint64_t * within )
+{
+    if ( offset >= lv->length || lv->segmentCount == 0 )
+    {
+        return NULL;
+    }
+
+    tLogicalVolumeSegment * segment = &lv->segments[ findSegmentIndex( lv, offset / lv->extentSize ) ];
+    uint64_t                start   = segment->startExtent * lv->extentSize;
+
+    if ( offset < start || offset - start >= segment->extentCount * lv->extentSize )
+    {
+        return NULL;
+    }
+    *within = offset - start;
+    return segment;
+}
+
+/**
+ * After a read from a mirrored segment has failed, find where else the same
+ * data can be read from. The run is on a different leg for each attempt.
+ *
+ * @param lv       the logical volume
+ * @param offset   byte offset into the volume
+ * @param attempt  1 for the leg after the one findExtentRun() picks, 2 for the one after that...
+ * @param run      filled in with where to try next
+ * @return 0 if there's another leg to try, -1 if there isn't, or the offset
+ *         isn't in a mirrored segment
+ */
+int findMirrorRun( tLogicalVolume * lv, uint64_t offset, int attempt, tExtentRun * run )
+{
+    uint64_t                within;
+    tLogicalVolumeSegment * segment = findVolumeSegment( lv, offset, &within );
+
+    if ( segment == NULL || segment->type != segmentMirror || attempt >= segment->usableLegs )
+    {
+        return -1;
+    }
+
+    int leg = (within / kMirrorStride + attempt) % segment->usableLegs;
+    mapMirrorOffset( lv, segment, leg, within, run );
+    return 0;
+}
+
+void freeExtentIndex( tLogicalVolume * lv )
+{
+    free( lv->indexStarts );
+    free( lv->indexEntries );
+    lv->indexStarts  = NULL;
+    lv->indexEntries = NULL;
+}
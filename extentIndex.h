@@ -0,0 +1,29 @@
+/*
+    Logical-to-physical translation for a logical volume.
+
+    The segments are flattened into a sorted array at open time, with the
+    physical volumes resolved to small integer ids, so that translating an
+    offset is a binary search over a compact array rather than a walk
+    through the segment list.
+*/
+
+#ifndef READLOGICALVOLUME_EXTENTINDEX_H
+#define READLOGICALVOLUME_EXTENTINDEX_H
+
+/* where a run of a logical volume lives */
+typedef struct tExtentRun {
+    tPhysicalVolume * physicalVolume;   /* NULL in a gap between segments, which reads as zeros */
+    off64_t           offset;           /* byte offset from the start of the physical volume's partition */
+    uint64_t          length;           /* bytes that are contiguous from here */
+    int               rebuild;          /* on a missing raid leg: physicalVolume is NULL, and the data
+                                           has to be rebuilt from parity by recoverVolumeRange() */
+} tExtentRun;
+
+void mapSegmentOffset( tLogicalVolume * lv, tLogicalVolumeSegment * segment, uint64_t within, tExtentRun * run );
+tLogicalVolumeSegment * findVolumeSegment( tLogicalVolume * lv, uint64_t offset, uint64_t * within );
+int  findMirrorRun( tLogicalVolume * lv, uint64_t offset, int attempt, tExtentRun * run );
+int  buildExtentIndex( tLogicalVolume * lv );
+int  findExtentRun( tLogicalVolume * lv, uint64_t offset, tExtentRun * run );
+void freeExtentIndex( tLogicalVolume * lv );
+
+#endif //READLOGICALVOLUME_EXTENTINDEX_H
@@ -0,0 +1,225 @@
+/*
+    Random access to the contents of a logical volume.
+
+    A read is translated through the volume's extent index and split
+    wherever it crosses a segment boundary, and each piece goes to
+    readDrive(), so small reads (the usual case: superblocks,
+    partition tables, file headers) are served through the drive's block
+    cache. Parts of the volume not covered by any segment read as zeros.
+    If a read from one leg of a mirror fails, the other legs are tried;
+    data on a raid leg that's missing, or fails to read, is rebuilt from
+    parity.
+*/
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "readlogicalvolume.h"
+#include "debug.h"
+#include "stringHash.h"
+#include "readaccess.h"
+#include "parseMetadata.h"
+#include "extentIndex.h"
+#include "raidParity.h"
+#include "thinPool.h"
+#include "snapshot.h"
+#include "lvAccess.h"
+
+struct tLVHandle
+{
+    tDrive         * drive;
+    tLogicalVolume * lv;
+};
+
+/**
+ * Open a logical volume for reading.
+ *
+ * @param drive   the drives holding the volume group, as for findLogicalVolume()
+ * @param lvName  name of the logical volume
+ * @param root    the parsed metadata
+ * @return a handle, or NULL if the volume couldn't be found
+ */
+tLVHandle * lvOpen( tDrive * drive, const char * lvName, tNode * root )
+{
+    tLVHandle * handle = NULL;
+    tLogicalVolume * lv = findLogicalVolume( drive, lvName, root );
+
+    if ( lv != NULL )
+    {
+        handle = calloc( sizeof( tLVHandle ), 1 );
+        if ( isHeapPtr( handle ) )
+        {
+            handle->drive = drive;
+            handle->lv    = lv;
+        }
+        else
+        {
+            freeLogicalVolume( lv );
+        }
+    }
+    return handle;
+}
+
+/**
+ * @return the size of the volume, in bytes
+ */
+uint64_t lvSize( tLVHandle * handle )
+{
+    return handle->lv->length;
+}
+
+/**
+ * Read part of a logical volume.
+ *
+ * @param handle  from lvOpen()
+ * @param offset  byte offset into the volume
+ * @param dest    where to put the data
+ * @param length  number of bytes to read
+ * @return the number of bytes read, short only at the end of the volume, or -1 on error
+ */
+ssize_t lvRead( tLVHandle * handle, uint64_t offset, void * dest, size_t length )
+{
+    return readVolumeRange( handle->lv, offset, dest, length );
+}
+
+/**
+ * Read part of a logical volume, as lvRead() does, without a handle.
+ */
+ssize_t readVolumeRange( tLogicalVolume * lv, uint64_t offset, void * dest, size_t length )
+{
+    byte * p = dest;
+
+    if ( offset >= lv->length )
+    {
+        return 0;
+    }
+    if ( length > lv->length - offset )
+    {
+        length = lv->length - offset;
+    }
+
+    size_t remaining = length;
+    while ( remaining > 0 )
+    {
+        tExtentRun run;
+        if ( findExtentRun( lv, offset, &run ) < 0 )
+        {
+            return -1;
+        }
+        size_t count = run.length < remaining ? run.length : remaining;
+
+        if ( run.rebuild )
+        {
+            if ( recoverVolumeRange( lv, offset, p, count ) < 0 )
+            {
+                return -1;
+            }
+        }
+        else if ( run.physicalVolume == NULL )
+        {
+            /* not covered by any segment */
+            memset( p, 0, count );
+        }
+        else if ( readDrive( run.physicalVolume->drive, run.offset, p, count ) != (ssize_t) count
+               && recoverVolumeRange( lv, offset, p, count ) < 0 )
+        {
+            return -1;
+        }
+
+        p         += count;
+        offset    += count;
+        remaining -= count;
+    }
+    return length;
+}
+
+/**
+ * Read part of a volume again, after a read error, from whichever other legs of
+ * a mirror it's on, or by rebuilding it from parity. Data on a missing raid leg
+ * is read this way in the first place.
+ *
+ * @param lv      the logical volume
+ * @param offset  byte offset into the volume
+ * @param dest    where the data should have gone
+ * @param length  number of bytes
+ * @return 0 if every byte was recovered, -1 if not
+ */
+int recoverVolumeRange( tLogicalVolume * lv, uint64_t offset, void * dest, size_t length )
+{
+    byte * p = dest;
+
+    while ( length > 0 )
+    {
+        tExtentRun run;
+        size_t     count = 0;
+        uint64_t   within;
+
+        tLogicalVolumeSegment * segment = findVolumeSegment( lv, offset, &within );
+        if ( segment != NULL && (segment->type == segmentThin || segment->type == segmentSnapshot) )
+        {
+            /* through the volumes below, which recover their own reads */
+            ssize_t count = (segment->type == segmentThin) ? readThinRange( segment, within, p, length )
+                                                           : readSnapshotRange( segment, within, p, length );
+            if ( count < 0 )
+            {
+                LogError( "unable to read \"%s\" at offset %lu", lv->name, offset );
+                return -1;
+            }
+            p      += count;
+            offset += count;
+            length -= count;
+            continue;
+        }
+        if ( segment != NULL && segment->type == segmentParity )
+        {
+            ssize_t rebuilt = rebuildParityRange( segment, within, p, length );
+            if ( rebuilt < 0 )
+            {
+                LogError( "unable to rebuild \"%s\" at offset %lu", lv->name, offset );
+                return -1;
+            }
+            p      += rebuilt;
+            offset += rebuilt;
+            length -= rebuilt;
+            continue;
+        }
+
+        for ( int attempt = 1; count == 0 && findMirrorRun( lv, offset, attempt, &run ) == 0; ++attempt )
+        {
+            count = run.length < length ? run.length : length;
+            if ( run.physicalVolume == NULL )
+            {
+                memset( p, 0, count );
+            }
+            else if ( readDrive( run.physicalVolume->drive, run.offset, p, count ) != (ssize_t) count )
+            {
+                count = 0;
+            }
+        }
+        if ( count == 0 )
+        {
+            LogError( "unable to read \"%s\" at offset %lu", lv->name, offset );
+            return -1;
+        }
+        LogInfo( "read %lu bytes of \"%s\" at offset %lu from another leg", count, lv->name, offset );
+
+        p      += count;
+        offset += count;
+        length -= count;
+    }
+    return 0;
+}
+
+void lvClose( tLVHandle * handle )
+{
+    if ( handle != NULL )
+    {
+        freeLogicalVolume( handle->lv );
+        free( handle );
+    }
+}
@@ -0,0 +1,27 @@
+/*
+    Random access to the contents of a logical volume.
+
+    lvOpen() finds the volume and builds its segment map once; after that,
+    lvRead() translates each request through the map and reads just the
+    bytes asked for, so a caller that wants the first few megabytes of a
+    huge volume never pays for the rest of it.
+
+    Where part of a mirrored volume can't be read, recoverVolumeRange()
+    reads it from the other legs instead, and where part of a raid4/5/6
+    volume can't be, it rebuilds it from parity. The bulk readers use it
+    too.
+*/
+
+#ifndef READLOGICALVOLUME_LVACCESS_H
+#define READLOGICALVOLUME_LVACCESS_H
+
+typedef struct tLVHandle tLVHandle;
+
+tLVHandle * lvOpen( tDrive * drive, const char * lvName, tNode * root );
+uint64_t    lvSize( tLVHandle * handle );
+ssize_t     lvRead( tLVHandle * handle, uint64_t offset, void * dest, size_t length );
+void        lvClose( tLVHandle * handle );
+ssize_t     readVolumeRange( tLogicalVolume * lv, uint64_t offset, void * dest, size_t length );
+int         recoverVolumeRange( tLogicalVolume * lv, uint64_t offset, void * dest, size_t length );
+
+#endif //READLOGICALVOLUME_LVACCESS_H
@@ -8,6 +8,10 @@
 #ifndef READLOGICALVOLUME_LVM_H
 #define READLOGICALVOLUME_LVM_H
 
+/* LVM always counts in 512-byte sectors (extent_size, pe_start, the label
+   search area...), whatever the logical sector size of the underlying drive */
+#define kLVMSectorSize  512
+
 typedef struct tLVMPVLabel
 {                             /* Ofst Size Value           Description */
     byte    signature[8];     /*   0   8   "LABELONE"      Signature */
@@ -0,0 +1,310 @@
+/*
+    Finding the structural characters in the metadata text.
+
+    This is the first stage of the parse, much as in simdjson: each 64-byte
+    block of the text is classified into a 64-bit mask, with a bit set for
+    each structural character in it, and the parser takes the characters
+    from the masks one at a time, lowest bit first, skipping a whole block
+    of plain text with a single test. Quotes and comments are left to the
+    parser, which skips from a '"' straight to the next one, and from a '#'
+    to the end of its line.
+
+    The nine characters come down to six compares, since pairs of them
+    differ in a single bit: '[' and '{' only in 0x20, as are ']' and '}',
+    and '"' and '#' only in 0x01. Setting that bit first matches both.
+
+    The classifier is picked, the first time it's needed, to suit the CPU:
+    AVX2 or SSE2, NEON on ARM, or a table lookup a byte at a time. They
+    all give the same masks; a debug build parses with both the vector
+    kernel and the portable one, and checks the trees come out the same,
+    and testMetadataScan checks every kernel the CPU can run against the
+    portable one.
+*/
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+    #include <immintrin.h>
+    #define optScanX86
+#elif defined( __aarch64__ )
+    #include <arm_neon.h>
+    #define optScanNeon
+#endif
+
+#include "readlogicalvolume.h"
+#include "debug.h"
+#include "metadataScan.h"
+
+static const char    * gKernelName;
+static tScanClassifier gClassify;
+static pthread_once_t gKernelOnce = PTHREAD_ONCE_INIT;
+
+static const byte kStructural[ 256 ] =
+{
+    [ '{' ] = 1, [ '}' ] = 1, [ '[' ] = 1, [ ']' ] = 1, [ '=' ] = 1,
+    [ '"' ] = 1, [ '#' ] = 1, [ ',' ] = 1, [ '\n' ] = 1
+};
+
+static void classifyScalar( const byte * text, size_t blocks, uint64_t * masks )
+{
+    for ( size_t b = 0; b < blocks; ++b, text += 64 )
+    {
+        uint64_t mask = 0;
+        for ( int i = 0; i < 64; ++i )
+        {
+            mask |= (uint64_t) kStructural[ text[ i ] ] << i;
+        }
+        masks[ b ] = mask;
+    }
+}
+
+#ifdef optScanX86
+
+__attribute__(( target( "sse2" ) ))
+static void classifySSE2( const byte * text, size_t blocks, uint64_t * masks )
+{
+    const __m128i bit5     = _mm_set1_epi8( 0x20 );
+    const __m128i bit0     = _mm_set1_epi8( 0x01 );
+    const __m128i open     = _mm_set1_epi8( '{' );
+    const __m128i close    = _mm_set1_epi8( '}' );
+    const __m128i hash     = _mm_set1_epi8( '#' );
+    const __m128i equals   = _mm_set1_epi8( '=' );
+    const __m128i comma    = _mm_set1_epi8( ',' );
+    const __m128i newline  = _mm_set1_epi8( '\n' );
+
+    for ( size_t b = 0; b < blocks; ++b, text += 64 )
+    {
+        uint64_t mask = 0;
+        for ( int i = 0; i < 64; i += 16 )
+        {
+            __m128i v = _mm_loadu_si128( (const __m128i *)( text + i ) );
+            __m128i u = _mm_or_si128( v, bit5 );
+            __m128i m = _mm_or_si128( _mm_cmpeq_epi8( u, open ), _mm_cmpeq_epi8( u, close ) );
+            m = _mm_or_si128( m, _mm_cmpeq_epi8( _mm_or_si128( v, bit0 ), hash ) );
+            m = _mm_or_si128( m, _mm_cmpeq_epi8( v, equals ) );
+            m = _mm_or_si128( m, _mm_or_si128( _mm_cmpeq_epi8( v, comma ), _mm_cmpeq_epi8( v, newline ) ) );
+            mask |= (uint64_t) (uint16_t) _mm_movemask_epi8( m ) << i;
+        }
+        masks[ b ] = mask;
+    }
+}
+
+__attribute__(( target( "avx2" ) ))
+static void classifyAVX2( const byte * text, size_t blocks, uint64_t * masks )
+{
+    const __m256i bit5     = _mm256_set1_epi8( 0x20 );
+    const __m256i bit0     = _mm256_set1_epi8( 0x01 );
+    const __m256i open     = _mm256_set1_epi8( '{' );
+    const __m256i close    = _mm256_set1_epi8( '}' );
+    const __m256i hash     = _mm256_set1_epi8( '#' );
+    const __m256i equals   = _mm256_set1_epi8( '=' );
+    const __m256i comma    = _mm256_set1_epi8( ',' );
+    const __m256i newline  = _mm256_set1_epi8( '\n' );
+
+    for ( size_t b = 0; b < blocks; ++b, text += 64 )
+    {
+        uint64_t mask = 0;
+        for ( int i = 0; i < 64; i += 32 )
+        {
+            __m256i v = _mm256_loadu_si256( (const __m256i *)( text + i ) );
+            __m256i u = _mm256_or_si256( v, bit5 );
+            __m256i m = _mm256_or_si256( _mm256_cmpeq_epi8( u, open ), _mm256_cmpeq_epi8( u, close ) );
+            m = _mm256_or_si256( m, _mm256_cmpeq_epi8( _mm256_or_si256( v, bit0 ), hash ) );
+            m = _mm256_or_si256( m, _mm256_cmpeq_epi8( v, equals ) );
+            m = _mm256_or_si256( m, _mm256_or_si256( _mm256_cmpeq_epi8( v, comma ), _mm256_cmpeq_epi8( v, newline ) ) );
+            mask |= (uint64_t) (uint32_t) _mm256_movemask_epi8( m ) << i;
+        }
+        masks[ b ] = mask;
+    }
+}
+
+#endif /* optScanX86 */
+
+#ifdef optScanNeon
+
+static void classifyNeon( const byte * text, size_t blocks, uint64_t * masks )
+{
+    static const byte kBitWeights[ 16 ] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+
+    const uint8x16_t weights  = vld1q_u8( kBitWeights );
+    const uint8x16_t bit5     = vdupq_n_u8( 0x20 );
+    const uint8x16_t bit0     = vdupq_n_u8( 0x01 );
+    const uint8x16_t open     = vdupq_n_u8( '{' );
+    const uint8x16_t close    = vdupq_n_u8( '}' );
+    const uint8x16_t hash     = vdupq_n_u8( '#' );
+    const uint8x16_t equals   = vdupq_n_u8( '=' );
+    const uint8x16_t comma    = vdupq_n_u8( ',' );
+    const uint8x16_t newline  = vdupq_n_u8( '\n' );
+
+    for ( size_t b = 0; b < blocks; ++b, text += 64 )
+    {
+        uint64_t mask = 0;
+        for ( int i = 0; i < 64; i += 16 )
+        {
+            uint8x16_t v = vld1q_u8( text + i );
+            uint8x16_t u = vorrq_u8( v, bit5 );
+            uint8x16_t m = vorrq_u8( vceqq_u8( u, open ), vceqq_u8( u, close ) );
+            m = vorrq_u8( m, vceqq_u8( vorrq_u8( v, bit0 ), hash ) );
+            m = vorrq_u8( m, vceqq_u8( v, equals ) );
+            m = vorrq_u8( m, vorrq_u8( vceqq_u8( v, comma ), vceqq_u8( v, newline ) ) );
+
+            /* no movemask: weight each lane by its bit, and add up each half */
+            m = vandq_u8( m, weights );
+            uint64_t bits = vaddv_u8( vget_low_u8( m ) ) | ((uint64_t) vaddv_u8( vget_high_u8( m ) ) << 8);
+            mask |= bits << i;
+        }
+        masks[ b ] = mask;
+    }
+}
+
+#endif /* optScanNeon */
+
+/* pthread_once(): pick the best classifier this CPU can run */
+static void initScanKernel( void )
+{
+    gKernelName = "scalar";
+    gClassify   = classifyScalar;
+
+#ifdef optScanX86
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "avx2" ) )
+    {
+        gKernelName = "avx2";
+        gClassify   = classifyAVX2;
+    }
+    else if ( __builtin_cpu_supports( "sse2" ) )
+    {
+        gKernelName = "sse2";
+        gClassify   = classifySSE2;
+    }
+#endif
+#ifdef optScanNeon
+    gKernelName = "neon";
+    gClassify   = classifyNeon;
+#endif
+
+    LogInfo( "using the %s metadata scanner", gKernelName );
+}
+
+/**
+ * @return the name of the instruction set the scan uses
+ */
+const char * getScanKernelName( void )
+{
+    pthread_once( &gKernelOnce, initScanKernel );
+    return gKernelName;
+}
+
+/**
+ * List the classifiers this CPU can run, for testing them against each other.
+ *
+ * @param classifiers  filled in with them, the portable one first; kMaxScanClassifiers long
+ * @param names        filled in with their names
+ * @return how many there are
+ */
+unsigned getScanClassifiers( tScanClassifier * classifiers, const char ** names )
+{
+    unsigned count = 0;
+
+    classifiers[ count ] = classifyScalar;
+    names[ count++ ]     = "scalar";
+
+#ifdef optScanX86
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "sse2" ) )
+    {
+        classifiers[ count ] = classifySSE2;
+        names[ count++ ]     = "sse2";
+    }
+    if ( __builtin_cpu_supports( "avx2" ) )
+    {
+        classifiers[ count ] = classifyAVX2;
+        names[ count++ ]     = "avx2";
+    }
+#endif
+#ifdef optScanNeon
+    classifiers[ count ] = classifyNeon;
+    names[ count++ ]     = "neon";
+#endif
+
+    return count;
+}
+
+/**
+ * Classify the next batch of blocks, starting at offset start.
+ */
+static void loadBatch( tMetadataScan * scan, size_t start )
+{
+    size_t blocks = (scan->length - start) / 64;
+
+    if ( blocks > kScanBatchBlocks )
+    {
+        blocks = kScanBatchBlocks;
+    }
+    (*scan->classify)( scan->text + start, blocks, scan->masks );
+
+    /* a partial block at the end is copied out, and padded with zeros, which aren't structural */
+    size_t tail = start + blocks * 64;
+    if ( blocks < kScanBatchBlocks && tail < scan->length )
+    {
+        byte last[ 64 ] = { 0 };
+        memcpy( last, scan->text + tail, scan->length - tail );
+        (*scan->classify)( last, 1, &scan->masks[ blocks ] );
+        ++blocks;
+    }
+
+    scan->batchStart  = start;
+    scan->batchBlocks = blocks;
+    scan->block       = 0;
+    scan->bits        = (blocks > 0) ? scan->masks[ 0 ] : 0;
+}
+
+/**
+ * @param classify  the classifier to use, from getScanClassifiers(), or NULL
+ *                  for the best one the CPU can run
+ */
+void initMetadataScan( tMetadataScan * scan, const byte * text, size_t length, tScanClassifier classify )
+{
+    pthread_once( &gKernelOnce, initScanKernel );
+
+    scan->text     = text;
+    scan->length   = length;
+    scan->classify = (classify != NULL) ? classify : gClassify;
+    loadBatch( scan, 0 );
+}
+
+/**
+ * @return the offset of the next structural character in the text, or its
+ *         length if there are no more
+ */
+size_t nextStructural( tMetadataScan * scan )
+{
+    while ( scan->bits == 0 )
+    {
+        if ( scan->block + 1 < scan->batchBlocks )
+        {
+            scan->bits = scan->masks[ ++scan->block ];
+        }
+        else
+        {
+            size_t next = scan->batchStart + (size_t) scan->batchBlocks * 64;
+            if ( next >= scan->length )
+            {
+                return scan->length;
+            }
+            loadBatch( scan, next );
+        }
+    }
+
+    size_t offset = scan->batchStart + (size_t) scan->block * 64 + __builtin_ctzll( scan->bits );
+    scan->bits &= scan->bits - 1;
+
+    return offset;
+}
@@ -0,0 +1,40 @@
+/*
+    Finding the structural characters in the metadata text.
+
+    The parser only needs to look at the characters that delimit things:
+    { } [ ] = " # , and newlines. Everything between two of them is a key,
+    a number, whitespace, or the inside of a string or comment, and can be
+    taken or skipped as a whole. The scan finds them 64 bytes at a time,
+    with vector compares, and hands them out in order from a bitmask.
+*/
+
+#ifndef READLOGICALVOLUME_METADATASCAN_H
+#define READLOGICALVOLUME_METADATASCAN_H
+
+/* how many 64-byte blocks are classified at a time */
+#define kScanBatchBlocks    64
+
+/* sets a bit in masks[b] for each structural character in the b'th 64-byte block of text */
+typedef void (* tScanClassifier)( const byte * text, size_t blocks, uint64_t * masks );
+
+/* the portable classifier, and a vector one for each instruction set */
+#define kMaxScanClassifiers 4
+
+typedef struct tMetadataScan
+{
+    const byte * text;
+    size_t       length;
+    tScanClassifier classify;
+    size_t       batchStart;    /* offset of the block masks[0] is for */
+    unsigned     batchBlocks;   /* how many of masks are filled in */
+    unsigned     block;         /* the one being handed out */
+    uint64_t     bits;          /* what's left of it */
+    uint64_t     masks[ kScanBatchBlocks ];
+} tMetadataScan;
+
+void         initMetadataScan( tMetadataScan * scan, const byte * text, size_t length, tScanClassifier classify );
+size_t       nextStructural( tMetadataScan * scan );
+const char * getScanKernelName( void );
+unsigned     getScanClassifiers( tScanClassifier * classifiers, const char ** names );
+
+#endif //READLOGICALVOLUME_METADATASCAN_H
@@ -0,0 +1,968 @@
+/*
+    Serving a logical volume, read-only, over the NBD protocol.
+
+    Only the 'fixed newstyle' handshake is spoken, which is all any
+    current client uses. A connection's own thread reads its requests,
+    and answers the ones that need no i/o (flush, trim, write zeroes,
+    writes) itself; reads are queued for a few worker threads belonging
+    to the connection, so a client that keeps several requests in flight
+    has them worked on at once. Replies go out in whatever order they're
+    finished, which the protocol allows: each carries the client's handle.
+
+    The export is read-only, but still advertises trim and write zeroes,
+    so a client that uses them gets a proper EPERM back rather than having
+    the command refused outright.
+
+    Reads no bigger than a cache block go through a small LRU cache
+    shared by every connection: clients probing a volume (partition
+    tables, filesystem superblocks, directory blocks) tend to read the
+    same few blocks over and over. Larger reads go straight to the volume,
+    where they'd only push the small ones out of the cache.
+*/
+
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE     /* for ppoll() */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "readlogicalvolume.h"
+#include "debug.h"
+#include "stringHash.h"
+#include "readaccess.h"
+#include "parseMetadata.h"
+#include "blockCache.h"
+#include "writeVolume.h"
+#include "lvAccess.h"
+#include "nbdServer.h"
+
+/* handshake */
+#define kNbdMagic               0x4e42444d41474943ULL   /* "NBDMAGIC" */
+#define kNbdOptionMagic         0x49484156454f5054ULL   /* "IHAVEOPT" */
+#define kNbdOptionReplyMagic    0x0003e889045565a9ULL
+
+#define kNbdFlagFixedNewstyle   0x0001
+#define kNbdFlagNoZeroes        0x0002
+
+#define kNbdOptExportName       1
+#define kNbdOptAbort            2
+#define kNbdOptList             3
+#define kNbdOptInfo             6
+#define kNbdOptGo               7
+
+#define kNbdRepAck              1
+#define kNbdRepServer           2
+#define kNbdRepInfo             3
+#define kNbdRepErrUnsupported   0x80000001
+#define kNbdRepErrInvalid       0x80000003
+#define kNbdRepErrUnknown       0x80000006
+
+#define kNbdInfoExport          0
+#define kNbdInfoBlockSize       3
+
+/* the longest option we'll take: enough for any export name */
+#define kNbdMaxOptionLength     4096
+
+/* transmission */
+#define kNbdRequestMagic        0x25609513
+#define kNbdReplyMagic          0x67446698
+
+#define kNbdHasFlags            0x0001
+#define kNbdReadOnly            0x0002
+#define kNbdSendTrim            0x0020
+#define kNbdSendWriteZeroes     0x0040
+#define kNbdCanMultiConn        0x0100
+#define kNbdSendCache           0x0400
+
+#define kNbdCmdRead             0
+#define kNbdCmdWrite            1
+#define kNbdCmdDisconnect       2
+#define kNbdCmdFlush            3
+#define kNbdCmdTrim             4
+#define kNbdCmdCache            5
+#define kNbdCmdWriteZeroes      6
+
+/* errors are Linux errno values, whatever the server's own are */
+#define kNbdEPERM               1
+#define kNbdEIO                 5
+#define kNbdENOMEM              12
+#define kNbdEINVAL              22
+
+/* the largest read we'll serve, advertised to clients that ask */
+#define kNbdMaxRequest          (32 * 1024 * 1024)
+#define kNbdPreferredBlock      4096
+
+/* the read cache: 64 blocks of 64KB */
+#define kNbdCacheBlockSize      (64 * 1024)
+#define kNbdCacheBlocks         64
+
+/* a CACHE request loads no more than this much, so one can't flush everything else out */
+#define kNbdMaxPrefetch         (kNbdCacheBlockSize * kNbdCacheBlocks / 2)
+
+/* requests a connection has read but not yet started on; past this, it stops reading */
+#define kNbdQueueDepth          32
+
+#define kMaxNbdWorkers          64
+
+typedef struct tNbdOptionHeader
+{                               /* Ofst Size Description */
+    byte    magic[8];           /*   0   8   kNbdOptionMagic */
+    byte    option[4];          /*   8   4   kNbdOpt... */
+    byte    length[4];          /*  12   4   bytes of data that follow */
+} tNbdOptionHeader;
+
+typedef struct tNbdOptionReply
+{                               /* Ofst Size Description */
+    byte    magic[8];           /*   0   8   kNbdOptionReplyMagic */
+    byte    option[4];          /*   8   4   the option being replied to */
+    byte    type[4];            /*  12   4   kNbdRep... */
+    byte    length[4];          /*  16   4   bytes of data that follow */
+} tNbdOptionReply;
+
+typedef struct tNbdRequestHeader
+{                               /* Ofst Size Description */
+    byte    magic[4];           /*   0   4   kNbdRequestMagic */
+    byte    flags[2];           /*   4   2   command flags: FUA, no hole, etc. */
+    byte    type[2];            /*   6   2   kNbdCmd... */
+    byte    handle[8];          /*   8   8   opaque, returned in the reply */
+    byte    offset[8];          /*  16   8   */
+    byte    length[4];          /*  24   4   */
+} tNbdRequestHeader;
+
+typedef struct tNbdReplyHeader
+{                               /* Ofst Size Description */
+    byte    magic[4];           /*   0   4   kNbdReplyMagic */
+    byte    error[4];           /*   4   4   0, or kNbdE... */
+    byte    handle[8];          /*   8   8   from the request */
+} tNbdReplyHeader;
+
+typedef struct tNbdRequest
+{
+    unsigned  type;
+    byte      handle[8];
+    uint64_t  offset;
+    uint32_t  length;
+} tNbdRequest;
+
+typedef struct tNbdServer
+{
+    tLVHandle       * lv;
+    const char      * exportName;
+    uint64_t          size;
+    unsigned          workerCount;
+    tBlockCache     * cache;
+
+    pthread_mutex_t   lock;             /* protects the rest */
+    pthread_cond_t    idle;             /* signalled as each connection ends */
+    struct tNbdConnection * connections;
+    unsigned          connectionCount;
+    unsigned long     served;
+} tNbdServer;
+
+typedef struct tNbdConnection
+{
+    struct tNbdConnection * next;
+    tNbdServer      * server;
+    int               fd;
+    pthread_t         thread;
+
+    pthread_mutex_t   sendLock;         /* held while a reply is written, so they don't interleave */
+
+    pthread_mutex_t   queueLock;
+    pthread_cond_t    queueChanged;
+    tNbdRequest       queue[ kNbdQueueDepth ];
+    unsigned          head;
+    unsigned          count;
+    int               closing;          /* no more requests will be queued */
+    unsigned long     served;
+
+    pthread_t         workers[ kMaxNbdWorkers ];
+    unsigned          workerCount;
+} tNbdConnection;
+
+static volatile sig_atomic_t gStopServing;
+
+static void putBE( byte * ptr, uint64_t value, int count )
+{
+    for ( int i = count; i > 0; --i )
+    {
+        ptr[ i - 1 ] = (byte) value;
+        value >>= 8;
+    }
+}
+
+/**
+ * @return 0 once length bytes have been read, or -1 on an error or the end of the stream
+ */
+static int readFully( int fd, void * ptr, size_t length )
+{
+    byte * p = ptr;
+
+    while ( length > 0 )
+    {
+        ssize_t rdLen = read( fd, p, length );
+        if ( rdLen < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if ( rdLen <= 0 )
+        {
+            return -1;
+        }
+        p      += rdLen;
+        length -= rdLen;
+    }
+    return 0;
+}
+
+static ssize_t fillFromVolume( void * context, off64_t offset, void * dest, size_t length )
+{
+    return lvRead( (tLVHandle *) context, offset, dest, length );
+}
+
+static int sendOptionReply( int fd, uint32_t option, uint32_t type, const void * data, uint32_t length )
+{
+    tNbdOptionReply reply;
+
+    putBE( reply.magic,  kNbdOptionReplyMagic, 8 );
+    putBE( reply.option, option, 4 );
+    putBE( reply.type,   type,   4 );
+    putBE( reply.length, length, 4 );
+
+    if ( writeFully( fd, &reply, sizeof( reply ) ) < 0
+      || (length > 0 && writeFully( fd, data, length ) < 0) )
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Send a simple reply to a transmission request. Safe to call from any of the
+ * connection's threads.
+ */
+static int sendReply( tNbdConnection * conn, const byte * handle, uint32_t error,
+                      const void * data, size_t length )
+{
+    tNbdReplyHeader reply;
+    int             result = 0;
+
+    putBE( reply.magic, kNbdReplyMagic, 4 );
+    putBE( reply.error, error, 4 );
+    memcpy( reply.handle, handle, sizeof( reply.handle ) );
+
+    pthread_mutex_lock( &conn->sendLock );
+    if ( writeFully( conn->fd, &reply, sizeof( reply ) ) < 0
+      || (error == 0 && length > 0 && writeFully( conn->fd, data, length ) < 0) )
+    {
+        result = -1;
+    }
+    pthread_mutex_unlock( &conn->sendLock );
+
+    if ( result < 0 )
+    {
+        /* the client's gone: wake the connection's reader, so it stops too */
+        shutdown( conn->fd, SHUT_RDWR );
+    }
+    return result;
+}
+
+static int isOurExport( tNbdServer * server, const byte * name, uint32_t length )
+{
+    /* an empty name asks for the default export, which is the only one */
+    return length == 0
+        || (length == strlen( server->exportName ) && memcmp( name, server->exportName, length ) == 0);
+}
+
+static uint16_t getTransmissionFlags( void )
+{
+    return kNbdHasFlags | kNbdReadOnly | kNbdSendTrim | kNbdSendWriteZeroes
+         | kNbdCanMultiConn | kNbdSendCache;
+}
+
+/**
+ * Answer NBD_OPT_INFO or NBD_OPT_GO.
+ *
+ * @return 1 if the export was found and described, 0 if not, -1 if the connection failed
+ */
+static int sendExportInfo( tNbdConnection * conn, uint32_t option, const byte * data, uint32_t length )
+{
+    tNbdServer * server = conn->server;
+    int          wantBlockSize = 0;
+
+    /* u32 name length, name, u16 count of information requests, then the requests */
+    uint32_t nameLength = (length >= 4) ? (uint32_t) getBE( data, 4 ) : 0;
+    if ( length < 6 || nameLength > length - 6 )
+    {
+        return sendOptionReply( conn->fd, option, kNbdRepErrInvalid, NULL, 0 ) < 0 ? -1 : 0;
+    }
+    const byte * name    = data + 4;
+    unsigned     count   = (unsigned) getBE( name + nameLength, 2 );
+    const byte * request = name + nameLength + 2;
+    if ( length != 4 + nameLength + 2 + 2 * count )
+    {
+        return sendOptionReply( conn->fd, option, kNbdRepErrInvalid, NULL, 0 ) < 0 ? -1 : 0;
+    }
+    if ( !isOurExport( server, name, nameLength ) )
+    {
+        return sendOptionReply( conn->fd, option, kNbdRepErrUnknown, NULL, 0 ) < 0 ? -1 : 0;
+    }
+    for ( unsigned i = 0; i < count; ++i )
+    {
+        if ( getBE( request + 2 * i, 2 ) == kNbdInfoBlockSize )
+        {
+            wantBlockSize = 1;
+        }
+    }
+
+    byte info[ 14 ];
+    putBE( &info[ 0 ], kNbdInfoExport, 2 );
+    putBE( &info[ 2 ], server->size, 8 );
+    putBE( &info[ 10 ], getTransmissionFlags(), 2 );
+    if ( sendOptionReply( conn->fd, option, kNbdRepInfo, info, 12 ) < 0 )
+    {
+        return -1;
+    }
+    if ( wantBlockSize )
+    {
+        putBE( &info[ 0 ],  kNbdInfoBlockSize, 2 );
+        putBE( &info[ 2 ],  1, 4 );
+        putBE( &info[ 6 ],  kNbdPreferredBlock, 4 );
+        putBE( &info[ 10 ], kNbdMaxRequest, 4 );
+        if ( sendOptionReply( conn->fd, option, kNbdRepInfo, info, 14 ) < 0 )
+        {
+            return -1;
+        }
+    }
+    return sendOptionReply( conn->fd, option, kNbdRepAck, NULL, 0 ) < 0 ? -1 : 1;
+}
+
+/**
+ * The handshake, and the option haggling that follows it.
+ *
+ * @return 1 if the client picked the export, and transmission can start, or 0 to hang up
+ */
+static int negotiate( tNbdConnection * conn )
+{
+    tNbdServer * server = conn->server;
+    byte         greeting[ 18 ];
+    byte         clientFlags[ 4 ];
+    byte         data[ kNbdMaxOptionLength ];
+
+    putBE( &greeting[ 0 ],  kNbdMagic, 8 );
+    putBE( &greeting[ 8 ],  kNbdOptionMagic, 8 );
+    putBE( &greeting[ 16 ], kNbdFlagFixedNewstyle | kNbdFlagNoZeroes, 2 );
+    if ( writeFully( conn->fd, greeting, sizeof( greeting ) ) < 0
+      || readFully( conn->fd, clientFlags, sizeof( clientFlags ) ) < 0 )
+    {
+        return 0;
+    }
+    uint32_t flags = (uint32_t) getBE( clientFlags, 4 );
+    if ( (flags & ~(kNbdFlagFixedNewstyle | kNbdFlagNoZeroes)) != 0 )
+    {
+        LogError( "client asked for handshake flags %#x, which aren't supported", flags );
+        return 0;
+    }
+
+    while ( 1 )
+    {
+        tNbdOptionHeader header;
+        if ( readFully( conn->fd, &header, sizeof( header ) ) < 0 )
+        {
+            return 0;
+        }
+        uint32_t option = (uint32_t) getBE( header.option, 4 );
+        uint32_t length = (uint32_t) getBE( header.length, 4 );
+        if ( getBE( header.magic, 8 ) != kNbdOptionMagic || length > kNbdMaxOptionLength )
+        {
+            LogError( "bad option from client (option %u, %u bytes)", option, length );
+            return 0;
+        }
+        if ( readFully( conn->fd, data, length ) < 0 )
+        {
+            return 0;
+        }
+
+        int result = 0;
+        switch ( option )
+        {
+        case kNbdOptExportName:
+            /* the old way: no reply if the name's wrong, we just hang up */
+            if ( !isOurExport( server, data, length ) )
+            {
+                LogError( "client asked for an export that isn't \"%s\"", server->exportName );
+                return 0;
+            }
+            {
+                byte reply[ 10 + 124 ] = { 0 };
+                putBE( &reply[ 0 ], server->size, 8 );
+                putBE( &reply[ 8 ], getTransmissionFlags(), 2 );
+                size_t size = (flags & kNbdFlagNoZeroes) ? 10 : sizeof( reply );
+                return writeFully( conn->fd, reply, size ) == 0;
+            }
+
+        case kNbdOptAbort:
+            sendOptionReply( conn->fd, option, kNbdRepAck, NULL, 0 );
+            return 0;
+
+        case kNbdOptList:
+            if ( length != 0 )
+            {
+                result = sendOptionReply( conn->fd, option, kNbdRepErrInvalid, NULL, 0 );
+            }
+            else
+            {
+                uint32_t nameLength = strlen( server->exportName );
+                byte     reply[ 4 + 256 ];
+                putBE( reply, nameLength, 4 );
+                memcpy( &reply[ 4 ], server->exportName, nameLength );
+                result = sendOptionReply( conn->fd, option, kNbdRepServer, reply, 4 + nameLength );
+                if ( result == 0 )
+                {
+                    result = sendOptionReply( conn->fd, option, kNbdRepAck, NULL, 0 );
+                }
+            }
+            break;
+
+        case kNbdOptInfo:
+        case kNbdOptGo:
+            result = sendExportInfo( conn, option, data, length );
+            if ( result > 0 && option == kNbdOptGo )
+            {
+                return 1;
+            }
+            break;
+
+        default:
+            /* structured replies, metadata contexts, TLS... */
+            result = sendOptionReply( conn->fd, option, kNbdRepErrUnsupported, NULL, 0 );
+            break;
+        }
+        if ( result < 0 )
+        {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Does a request stay within the volume?
+ */
+static int isInVolume( tNbdServer * server, const tNbdRequest * request )
+{
+    return request->offset <= server->size && request->length <= server->size - request->offset;
+}
+
+static void serveRead( tNbdConnection * conn, const tNbdRequest * request )
+{
+    tNbdServer * server = conn->server;
+    byte       * buffer = malloc( request->length > 0 ? request->length : 1 );
+    ssize_t      rdLen;
+
+    if ( !isHeapPtr( buffer ) )
+    {
+        sendReply( conn, request->handle, kNbdENOMEM, NULL, 0 );
+        return;
+    }
+
+    if ( request->length <= kNbdCacheBlockSize )
+    {
+        rdLen = readBlockCache( server->cache, request->offset, buffer, request->length );
+    }
+    else
+    {
+        rdLen = lvRead( server->lv, request->offset, buffer, request->length );
+    }
+
+    if ( rdLen != (ssize_t) request->length )
+    {
+        LogError( "unable to read %u bytes at %lu of \"%s\"", request->length, request->offset, server->exportName );
+        sendReply( conn, request->handle, kNbdEIO, NULL, 0 );
+    }
+    else
+    {
+        sendReply( conn, request->handle, 0, buffer, request->length );
+    }
+    free( buffer );
+}
+
+/**
+ * Load part of the volume into the read cache, in anticipation of it being read.
+ */
+static void serveCache( tNbdConnection * conn, const tNbdRequest * request )
+{
+    tNbdServer * server = conn->server;
+    byte       * buffer = malloc( kNbdCacheBlockSize );
+    uint64_t     offset = request->offset;
+    uint64_t     end    = request->offset + (request->length < kNbdMaxPrefetch ? request->length : kNbdMaxPrefetch);
+
+    while ( isHeapPtr( buffer ) && offset < end )
+    {
+        size_t count = kNbdCacheBlockSize - offset % kNbdCacheBlockSize;
+        if ( count > end - offset )
+        {
+            count = end - offset;
+        }
+        if ( readBlockCache( server->cache, offset, buffer, count ) != (ssize_t) count )
+        {
+            break;
+        }
+        offset += count;
+    }
+    free( buffer );
+
+    /* it's only advice: a read that goes on to fail will say so itself */
+    sendReply( conn, request->handle, 0, NULL, 0 );
+}
+
+static void * connectionWorker( void * context )
+{
+    tNbdConnection * conn = context;
+
+    pthread_mutex_lock( &conn->queueLock );
+    while ( 1 )
+    {
+        while ( conn->count == 0 && !conn->closing )
+        {
+            pthread_cond_wait( &conn->queueChanged, &conn->queueLock );
+        }
+        if ( conn->count == 0 )
+        {
+            break;
+        }
+        tNbdRequest request = conn->queue[ conn->head ];
+        conn->head = (conn->head + 1) % kNbdQueueDepth;
+        --conn->count;
+        ++conn->served;
+        pthread_cond_broadcast( &conn->queueChanged );
+        pthread_mutex_unlock( &conn->queueLock );
+
+        if ( request.type == kNbdCmdRead )
+        {
+            serveRead( conn, &request );
+        }
+        else
+        {
+            serveCache( conn, &request );
+        }
+
+        pthread_mutex_lock( &conn->queueLock );
+    }
+    pthread_mutex_unlock( &conn->queueLock );
+
+    return NULL;
+}
+
+static void queueRequest( tNbdConnection * conn, const tNbdRequest * request )
+{
+    pthread_mutex_lock( &conn->queueLock );
+    while ( conn->count == kNbdQueueDepth )
+    {
+        pthread_cond_wait( &conn->queueChanged, &conn->queueLock );
+    }
+    conn->queue[ (conn->head + conn->count) % kNbdQueueDepth ] = *request;
+    ++conn->count;
+    pthread_cond_broadcast( &conn->queueChanged );
+    pthread_mutex_unlock( &conn->queueLock );
+}
+
+/**
+ * Throw away the data that follows a write, so the next request can be read.
+ */
+static int discardPayload( int fd, uint32_t length )
+{
+    byte buffer[ 4096 ];
+
+    while ( length > 0 )
+    {
+        uint32_t count = length < sizeof( buffer ) ? length : sizeof( buffer );
+        if ( readFully( fd, buffer, count ) < 0 )
+        {
+            return -1;
+        }
+        length -= count;
+    }
+    return 0;
+}
+
+/**
+ * Read the client's requests until it disconnects, answering or queueing each.
+ */
+static void transmit( tNbdConnection * conn )
+{
+    tNbdServer * server = conn->server;
+
+    while ( 1 )
+    {
+        tNbdRequestHeader header;
+        tNbdRequest       request;
+
+        if ( readFully( conn->fd, &header, sizeof( header ) ) < 0 )
+        {
+            break;
+        }
+        if ( getBE( header.magic, 4 ) != kNbdRequestMagic )
+        {
+            LogError( "bad request magic from client: %#lx", getBE( header.magic, 4 ) );
+            break;
+        }
+        request.type   = (unsigned) getBE( header.type, 2 );
+        request.offset = getBE( header.offset, 8 );
+        request.length = (uint32_t) getBE( header.length, 4 );
+        memcpy( request.handle, header.handle, sizeof( request.handle ) );
+
+        if ( request.type == kNbdCmdDisconnect )
+        {
+            break;
+        }
+
+        int result = 0;
+        switch ( request.type )
+        {
+        case kNbdCmdRead:
+            if ( !isInVolume( server, &request ) || request.length > kNbdMaxRequest )
+            {
+                result = sendReply( conn, request.handle, kNbdEINVAL, NULL, 0 );
+            }
+            else
+            {
+                queueRequest( conn, &request );
+            }
+            break;
+
+        case kNbdCmdCache:
+            if ( !isInVolume( server, &request ) )
+            {
+                result = sendReply( conn, request.handle, kNbdEINVAL, NULL, 0 );
+            }
+            else
+            {
+                queueRequest( conn, &request );
+            }
+            break;
+
+        case kNbdCmdWrite:
+            result = discardPayload( conn->fd, request.length );
+            if ( result == 0 )
+            {
+                result = sendReply( conn, request.handle, kNbdEPERM, NULL, 0 );
+            }
+            break;
+
+        case kNbdCmdTrim:
+        case kNbdCmdWriteZeroes:
+            /* advertised so they can be refused properly: nothing on the drive is ever changed */
+            result = sendReply( conn, request.handle,
+                                isInVolume( server, &request ) ? kNbdEPERM : kNbdEINVAL, NULL, 0 );
+            break;
+
+        case kNbdCmdFlush:
+            /* nothing's ever written, so there's nothing to flush */
+            result = sendReply( conn, request.handle, 0, NULL, 0 );
+            break;
+
+        default:
+            result = sendReply( conn, request.handle, kNbdEINVAL, NULL, 0 );
+            break;
+        }
+        if ( result < 0 )
+        {
+            break;
+        }
+    }
+}
+
+static void * serveConnection( void * context )
+{
+    tNbdConnection * conn   = context;
+    tNbdServer     * server = conn->server;
+
+    if ( negotiate( conn ) )
+    {
+        int err = 0;
+
+        for ( unsigned i = 0; i < server->workerCount; ++i )
+        {
+            int started = pthread_create( &conn->workers[ conn->workerCount ], NULL, connectionWorker, conn );
+            if ( started == 0 )
+            {
+                ++conn->workerCount;
+            }
+            else
+            {
+                err = started;
+            }
+        }
+        if ( conn->workerCount == 0 )
+        {
+            LogError( "unable to start any workers for a connection (%d: %s)", err, strerror( err ) );
+        }
+        else
+        {
+            transmit( conn );
+        }
+
+        /* let the workers finish whatever's queued, then stop */
+        pthread_mutex_lock( &conn->queueLock );
+        conn->closing = 1;
+        pthread_cond_broadcast( &conn->queueChanged );
+        pthread_mutex_unlock( &conn->queueLock );
+        for ( unsigned i = 0; i < conn->workerCount; ++i )
+        {
+            pthread_join( conn->workers[ i ], NULL );
+        }
+    }
+    pthread_mutex_lock( &server->lock );
+    tNbdConnection ** link = &server->connections;
+    while ( *link != conn )
+    {
+        link = &(*link)->next;
+    }
+    *link = conn->next;
+    /* closed only once it's off the list, so the server can't shut down a reused descriptor */
+    close( conn->fd );
+    --server->connectionCount;
+    server->served += conn->served;
+    pthread_cond_signal( &server->idle );
+    pthread_mutex_unlock( &server->lock );
+
+    pthread_cond_destroy( &conn->queueChanged );
+    pthread_mutex_destroy( &conn->queueLock );
+    pthread_mutex_destroy( &conn->sendLock );
+    free( conn );
+
+    return NULL;
+}
+
+static void stopServing( int UNUSED( signal ) )
+{
+    gStopServing = 1;
+}
+
+/**
+ * Start a thread for a new connection. The thread cleans up after itself.
+ */
+static int startConnection( tNbdServer * server, int fd )
+{
+    tNbdConnection * conn = calloc( sizeof( tNbdConnection ), 1 );
+    sigset_t         blocked, previous;
+    int              result = -1;
+    int              err    = 0;
+
+    if ( isHeapPtr( conn ) )
+    {
+        conn->server = server;
+        conn->fd     = fd;
+        pthread_mutex_init( &conn->sendLock, NULL );
+        pthread_mutex_init( &conn->queueLock, NULL );
+        pthread_cond_init( &conn->queueChanged, NULL );
+
+        pthread_mutex_lock( &server->lock );
+        conn->next          = server->connections;
+        server->connections = conn;
+        ++server->connectionCount;
+
+        /* only the listening thread should see SIGINT and SIGTERM; the new thread inherits the mask */
+        sigemptyset( &blocked );
+        sigaddset( &blocked, SIGINT );
+        sigaddset( &blocked, SIGTERM );
+        pthread_sigmask( SIG_BLOCK, &blocked, &previous );
+        err = pthread_create( &conn->thread, NULL, serveConnection, conn );
+        if ( err == 0 )
+        {
+            pthread_detach( conn->thread );
+            result = 0;
+        }
+        pthread_sigmask( SIG_SETMASK, &previous, NULL );
+
+        if ( result < 0 )
+        {
+            server->connections = conn->next;
+            --server->connectionCount;
+        }
+        pthread_mutex_unlock( &server->lock );
+
+        if ( result < 0 )
+        {
+            LogError( "unable to start a thread for a connection (%d: %s)", err, strerror( err ) );
+            pthread_cond_destroy( &conn->queueChanged );
+            pthread_mutex_destroy( &conn->queueLock );
+            pthread_mutex_destroy( &conn->sendLock );
+            free( conn );
+        }
+    }
+    return result;
+}
+
+/**
+ * Serve a logical volume, read-only, to NBD clients connecting to a Unix domain
+ * socket, until interrupted with SIGINT or SIGTERM.
+ *
+ * @param handle      from lvOpen()
+ * @param exportName  the name clients ask for; an empty name gets it too
+ * @param socketPath  where to create the socket. A socket already there is replaced
+ * @param workers     how many requests each connection works on at once
+ * @return 0 if the server was stopped by a signal, -1 on error
+ */
+int serveLogicalVolume( tLVHandle * handle, const char * exportName,
+                        const char * socketPath, unsigned workers )
+{
+    tNbdServer         server;
+    struct sockaddr_un address;
+    struct sigaction   action, oldInterrupt, oldTerminate, oldPipe;
+    sigset_t           stopSignals, previous, waiting;
+    struct pollfd      listening;
+    struct stat        existing;
+    int                result = 0;
+
+    if ( strlen( socketPath ) >= sizeof( address.sun_path ) )
+    {
+        LogError( "socket path \"%s\" is too long", socketPath );
+        return -1;
+    }
+    if ( strlen( exportName ) > 256 )
+    {
+        LogError( "export name \"%s\" is too long", exportName );
+        return -1;
+    }
+
+    memset( &server, 0, sizeof( server ) );
+    server.lv          = handle;
+    server.exportName  = exportName;
+    server.size        = lvSize( handle );
+    server.workerCount = (workers == 0) ? 1 : (workers > kMaxNbdWorkers) ? kMaxNbdWorkers : workers;
+    server.cache       = newBlockCache( kNbdCacheBlockSize, kNbdCacheBlocks, 0, fillFromVolume, handle );
+    if ( server.cache == NULL )
+    {
+        return -1;
+    }
+
+    memset( &address, 0, sizeof( address ) );
+    address.sun_family = AF_UNIX;
+    strcpy( address.sun_path, socketPath );
+
+    /* a stale socket from an earlier run would stop bind(); anything else is left alone */
+    if ( lstat( socketPath, &existing ) == 0 && S_ISSOCK( existing.st_mode ) )
+    {
+        unlink( socketPath );
+    }
+
+    /* non-blocking, so a connection that goes away between ppoll() and accept() can't hang the loop */
+    int listener = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+    if ( listener < 0
+      || bind( listener, (struct sockaddr *) &address, sizeof( address ) ) < 0
+      || listen( listener, 16 ) < 0 )
+    {
+        LogError( "unable to listen on \"%s\" (%d: %s)", socketPath, errno, strerror( errno ) );
+        if ( listener >= 0 )
+        {
+            close( listener );
+        }
+        freeBlockCache( server.cache );
+        return -1;
+    }
+
+    pthread_mutex_init( &server.lock, NULL );
+    pthread_cond_init( &server.idle, NULL );
+
+    /*
+     * SIGINT and SIGTERM stay blocked except while waiting in ppoll(), which
+     * unblocks them atomically. Otherwise one arriving after gStopServing was
+     * tested, but before the wait started, would be missed until the next
+     * client connected.
+     */
+    sigemptyset( &stopSignals );
+    sigaddset( &stopSignals, SIGINT );
+    sigaddset( &stopSignals, SIGTERM );
+    pthread_sigmask( SIG_BLOCK, &stopSignals, &previous );
+    waiting = previous;
+    sigdelset( &waiting, SIGINT );
+    sigdelset( &waiting, SIGTERM );
+
+    memset( &action, 0, sizeof( action ) );
+    action.sa_handler = stopServing;
+    sigemptyset( &action.sa_mask );
+    gStopServing = 0;
+    sigaction( SIGINT,  &action, &oldInterrupt );
+    sigaction( SIGTERM, &action, &oldTerminate );
+    /* a client that hangs up mid-reply shows up as a failed write instead */
+    action.sa_handler = SIG_IGN;
+    sigaction( SIGPIPE, &action, &oldPipe );
+
+    fprintf( stderr, "serving \"%s\" (%lu bytes) read-only on \"%s\"\n", exportName, server.size, socketPath );
+
+    listening.fd     = listener;
+    listening.events = POLLIN;
+    while ( !gStopServing )
+    {
+        if ( ppoll( &listening, 1, NULL, &waiting ) < 0 )
+        {
+            if ( errno != EINTR )
+            {
+                LogError( "unable to wait for a connection (%d: %s)", errno, strerror( errno ) );
+                result = -1;
+                break;
+            }
+            continue;
+        }
+
+        int fd = accept( listener, NULL, NULL );
+        if ( fd < 0 )
+        {
+            if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR )
+            {
+                LogError( "unable to accept a connection (%d: %s)", errno, strerror( errno ) );
+                result = -1;
+                break;
+            }
+        }
+        else if ( startConnection( &server, fd ) < 0 )
+        {
+            close( fd );
+        }
+    }
+
+    /* while stopServing() is still the handler, so a signal that came in meanwhile does no harm */
+    pthread_sigmask( SIG_SETMASK, &previous, NULL );
+
+    close( listener );
+    unlink( socketPath );
+
+    /* cut off any clients still connected, and wait for their threads to finish */
+    pthread_mutex_lock( &server.lock );
+    for ( tNbdConnection * conn = server.connections; conn != NULL; conn = conn->next )
+    {
+        shutdown( conn->fd, SHUT_RDWR );
+    }
+    while ( server.connectionCount > 0 )
+    {
+        pthread_cond_wait( &server.idle, &server.lock );
+    }
+    pthread_mutex_unlock( &server.lock );
+
+    tBlockCacheStats stats;
+    getBlockCacheStats( server.cache, &stats );
+    fprintf( stderr, "served %lu reads of \"%s\"; read cache: %lu hits, %lu misses\n",
+             server.served, exportName, stats.hits, stats.misses );
+
+    sigaction( SIGINT,  &oldInterrupt, NULL );
+    sigaction( SIGTERM, &oldTerminate, NULL );
+    sigaction( SIGPIPE, &oldPipe, NULL );
+
+    pthread_cond_destroy( &server.idle );
+    pthread_mutex_destroy( &server.lock );
+    freeBlockCache( server.cache );
+
+    return result;
+}
@@ -0,0 +1,20 @@
+/*
+    Serving a logical volume, read-only, over the NBD protocol.
+
+    The server listens on a Unix domain socket, so a client on the same
+    machine (qemu-img, qemu-nbd, nbd-client, nbdfuse...) can read just the
+    blocks it wants, without extracting the whole volume or needing the
+    LVM stack. Each connection keeps several requests in flight at once,
+    and small reads go through a read cache shared by every connection.
+*/
+
+#ifndef READLOGICALVOLUME_NBDSERVER_H
+#define READLOGICALVOLUME_NBDSERVER_H
+
+/* how many requests each connection works on at once, by default */
+#define kNbdDefaultWorkers      4
+
+int serveLogicalVolume( tLVHandle * handle, const char * exportName,
+                        const char * socketPath, unsigned workers );
+
+#endif //READLOGICALVOLUME_NBDSERVER_H
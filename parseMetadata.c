@@ -7,6 +7,16 @@
     structures handled in readlogicalvolume.c, so it's split out here for
     clarity.
 
+    Nothing is copied out of the text while parsing: keys and strings are
+    left where they are, and the nodes point at them, so the only
+    allocations are of nodes, and those come a block at a time.
+
+    Reading a volume only needs a few parts of the volume group's
+    metadata: extent_size, physical_volumes, and the volume's own entry
+    under logical_volumes. So a section is skipped over, to its matching
+    '}', and only parsed when a search goes into it; the volume group's
+    other volumes never get any further than a node each.
+
      Created by Paul on 2/23/2018.
 */
 
@@ -26,7 +36,15 @@
 #include "debug.h"
 #include "readaccess.h"
 #include "stringHash.h"
+#include "arena.h"
+#include "metadataScan.h"
+#include "lvm.h"
 #include "parseMetadata.h"
+#include "asyncRead.h"
+#include "extentIndex.h"
+#include "readPlan.h"
+#include "thinPool.h"
+#include "snapshot.h"
 
 const char kIndent[] =
 /*              12345678901234567890 */
@@ -57,81 +75,133 @@ tTextBlock * newBuffer( byte * start, size_t length )
 
 /***************************************************************/
 
-tNode * newNode( tNode * node )
+/* a node's direct children, by key, in an open-addressed table; see getKey() */
+typedef struct tNodeIndex
 {
-    if ( isValidPtr( node ) )
-    {
-        node->next = calloc( sizeof( tNode ), 1 );
-        // dumpNode( node, 0 );
-        return isValidPtr( node->next ) ? node->next : node;
-    }
-    else
-    {
-        return calloc( sizeof( tNode ), 1 );
-    }
-}
+    unsigned  mask;             /* one less than the number of slots, a power of two */
+    tNode   * slots[];          /* NULL if empty */
+} tNodeIndex;
 
-/* patterned after fgetc */
-int getNextChar( tTextBlock * buf )
+/* nodes with fewer children than this are just searched in order */
+#define kMinIndexedChildren     8
+
+static unsigned getIndexSlot( tHash hash, unsigned mask )
 {
-    int result = EOF;
+    /* Fibonacci hashing: djb2's low bits are too alike for similar keys */
+    return (unsigned) ((hash * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
 
-    if ( buf->block.length > 0 )
-    {
-        result = *buf->block.ptr++;
-        --buf->block.length;
-    }
-    return result;
+/* the hash only rules keys out: different keys can share one */
+static int isSameKey( const tNode * node, tHash hash, const char * key, size_t length )
+{
+    return node->hash == hash && node->keyLength == length && memcmp( node->key, key, length ) == 0;
 }
 
-int getPreviousChar( tTextBlock * buf )
+/**
+ * Index a node's children by key, once they've all been parsed.
+ * @return the index, or NULL if there are too few of them to be worth it
+ */
+static tNodeIndex * buildNodeIndex( tArena * arena, tNode * children )
 {
-    int result = EOF;
+    unsigned count = 0;
+    unsigned size  = 1;
 
-    if ( buf->block.length > 0 )
+    for ( tNode * child = children; child != NULL; child = child->next )
     {
-        result = *(--buf->block.ptr);
-        ++buf->block.length;
+        ++count;
+    }
+    if ( count < kMinIndexedChildren )
+    {
+        return NULL;
     }
-    return result;
 
-}
+    /* no more than half full, so probe sequences stay short */
+    while ( size < count * 2 )
+    {
+        size <<= 1;
+    }
+    tNodeIndex * index = arenaAlloc( arena, sizeof( tNodeIndex ) + size * sizeof( tNode * ) );
+    if ( index == NULL )
+    {
+        return NULL;
+    }
+    index->mask = size - 1;
 
-void setStringStart( tTextBlock * buf )
-{
-    buf->start = buf->block.ptr;
+    for ( tNode * child = children; child != NULL; child = child->next )
+    {
+        unsigned slot = getIndexSlot( child->hash, index->mask );
+        while ( index->slots[ slot ] != NULL
+             && !isSameKey( index->slots[ slot ], child->hash, child->key, child->keyLength ) )
+        {
+            slot = (slot + 1) & index->mask;
+        }
+        /* where a key appears twice, the first one is the one found */
+        if ( index->slots[ slot ] == NULL )
+        {
+            index->slots[ slot ] = child;
+        }
+    }
+    return index;
 }
 
-void setStringEnd( tTextBlock * buf )
+/* where the text of a section that hasn't been parsed yet is, between its braces */
+typedef struct tUnparsed
 {
-    buf->end = buf->block.ptr - 1;
-}
+    tArena        * arena;          /* where its nodes go, when they're built */
+    tScanClassifier classify;       /* what the rest of the tree was parsed with */
+    const char    * text;
+    size_t          length;
+    const char    * cowStore;       /* the first cow_store in it, noted as it was skipped, or NULL */
+    size_t          cowStoreLength;
+} tUnparsed;
 
-long lenString( tTextBlock * buf )
-{
-    return (buf->end - buf->start);
-}
+static void parseSection( tNode * node );
 
-char * dupString( tTextBlock * buf )
+/**
+ * @param parse  whether to parse a section that's still unparsed; if not, it's
+ *               treated as empty
+ * @return the first of a child or list node's children, or NULL
+ */
+static tNode * getNodeChildren( tNode * node, int parse )
 {
-    char * result = NULL;
-
-    if ( lenString( buf ) > 0 )
+    switch ( node->type )
     {
-        result = calloc( lenString( buf ) + 1, 1 ); /* extra byte to guarantee a trailing null */
-        if ( isHeapPtr( result ) )
+    case childNode:
+        if ( node->unparsed != NULL && parse )
         {
-#if 0
-            LogInfo(  "string:");
-            fprintf(stderr, "\"");
-            fwrite(buf->start, buf->end - buf->start - 1, 1, stderr);
-            fprintf(stderr, "\"\n");
-#endif
-            memcpy( result, buf->start, lenString( buf ) );
+            parseSection( node );
         }
+        return node->child;
+
+    case listNode:
+        return node->list;
+
+    default:
+        return NULL;
     }
+}
 
-    return result;
+/**
+ * @return a zero-terminated copy of a string node's value, from arena, for
+ *         keeping once the metadata's gone, or NULL if it's not a string node
+ */
+static char * dupNodeString( tArena * arena, const tNode * node )
+{
+    if ( node->type != stringNode )
+    {
+        return NULL;
+    }
+    return arenaStrndup( arena, node->string, node->stringLength );
+}
+
+/**
+ * @return non-zero if node is a string node holding exactly value
+ */
+static int isNodeString( const tNode * node, const char * value )
+{
+    return node->type == stringNode
+        && node->stringLength == strlen( value )
+        && memcmp( node->string, value, node->stringLength ) == 0;
 }
 
 /* node traversal functions */
@@ -150,9 +220,10 @@ typedef tNode * (*tNodeCallback)( tNode * node, int depth, int index, void * cbD
  * @param depth     how many levels down we've recursed
  * @param callback  callback that is passed the current node and some context
  * @param cbData    opaque pointer passed through to callback for its use
+ * @param parse     parse the sections that haven't been yet, rather than skip them
  * @return either NULL, or an non-null value returned by the callback function
  */
-tNode * forEachNodeRecurse( tNode * node, int depth, tNodeCallback callback, void * cbData )
+tNode * forEachNodeRecurse( tNode * node, int depth, tNodeCallback callback, void * cbData, int parse )
 {
     tNode * result;
     tNode * child;
@@ -168,25 +239,10 @@ tNode * forEachNodeRecurse( tNode * node, int depth, tNodeCallback callback, voi
             return result;
         }
 
-        switch ( node->type )
-        {
-        case childNode:
-            child = node->child;
-            break;
-
-        case listNode:
-            child = node->list;
-            break;
-
-        default:
-            /* no recursion needed for other types */
-            child = NULL;
-            break;
-        }
-
+        child = getNodeChildren( node, parse );
         if ( child != NULL )
         {
-            result = forEachNodeRecurse( child, depth + 1, callback, cbData );
+            result = forEachNodeRecurse( child, depth + 1, callback, cbData, parse );
             if ( result != NULL )
             {
                 return result;
@@ -200,10 +256,24 @@ tNode * forEachNodeRecurse( tNode * node, int depth, tNodeCallback callback, voi
     return node;
 }
 
+static tNode * walkNodeTree( tNode * root, tNodeCallback callback, void * cbData, int parse )
+{
+    tNode * result;
+
+    /* process the root node first */
+    result = (*callback)( root, 0, 0, cbData );
+    if ( result == NULL && getNodeChildren( root, parse ) != NULL )
+    {
+        result = forEachNodeRecurse( getNodeChildren( root, parse ), 1, callback, cbData, parse );
+    }
+    return result;
+}
+
 
 /**
  * invokes a callback on the root node provided, and each node below it, until
  * the callback returns something other than NULL, which is then returned.
+ * Any section that hasn't been parsed yet is parsed on the way.
  *
  * @param node      the starting point
  * @param depth     how many levels down we've recursed
@@ -214,43 +284,44 @@ tNode * forEachNodeRecurse( tNode * node, int depth, tNodeCallback callback, voi
 
 tNode * forEachNode( tNode * root, tNodeCallback callback, void * cbData )
 {
-    tNode * result;
+    return walkNodeTree( root, callback, cbData, 1 );
+}
 
-    /* process the root node first */
-    result = (*callback)( root, 0, 0, cbData );
-    if (result == NULL)
+/**
+ * Find a direct child of a child or list node by its key.
+ *
+ * @param key     the key; it needn't be zero-terminated
+ * @param length  of the key
+ * @return the first child with that key, or NULL
+ */
+tNode * getKey( const char * key, size_t length, tNode * root )
+{
+    tNode * child = getNodeChildren( root, 1 );
+    tHash   hash  = hashBytes( key, length );
+
+    if ( root->index != NULL )
     {
-        switch (root->type)
+        unsigned slot = getIndexSlot( hash, root->index->mask );
+        while ( (child = root->index->slots[ slot ]) != NULL && !isSameKey( child, hash, key, length ) )
         {
-        case listNode:
-            result = forEachNodeRecurse( root->list, 1, callback, cbData );
-            break;
-
-        case childNode:
-            result = forEachNodeRecurse( root->child, 1, callback, cbData );
-            break;
-
-        default:
-            break;
+            slot = (slot + 1) & root->index->mask;
         }
+        return child;
     }
-    return result;
-}
 
-tNode * hashMatchCallback(tNode * node, int UNUSED(depth), int UNUSED(index), void * cbData)
-{
-    if (node->hash == (tHash)cbData)
+    while ( child != NULL && !isSameKey( child, hash, key, length ) )
     {
-        return node;
+        child = child->next;
     }
-    return NULL;
-}
-
-tNode * getKeyHash( tHash hash, tNode * root )
-{
-    return forEachNode( root, hashMatchCallback, (void *)hash );
+    return child;
 }
 
+/**
+ * Follow a path of keys down from a node, e.g. "logical_volumes/root/segment1",
+ * one level per key.
+ *
+ * @return the node at the end of the path, or NULL if there isn't one
+ */
 tNode * getKeyPath( const char * keyPath, tNode * root )
 {
     tNode * result;
@@ -271,7 +342,7 @@ tNode * getKeyPath( const char * keyPath, tNode * root )
         {
             ++end;
         }
-        result = getKeyHash( hashBytes( start, end - start ), result );
+        result = getKey( start, end - start, result );
         if ( *end == '/' )
         {
             ++end;
@@ -300,6 +371,7 @@ void dumpSegment( tLogicalVolumeSegment * segment )
     LogInfo( "  start extent = %ld", segment->startExtent );
     LogInfo( "  extent count = %ld", segment->extentCount );
     LogInfo( "  stripe count = %ld", segment->stripeCount );
+    LogInfo( "   stripe size = %lu", segment->stripeSize );
     LogInfo( "  stripes @ %p",  segment->stripes );
     for ( int j = 0; j < segment->stripeCount; ++j )
     {
@@ -310,6 +382,23 @@ void dumpSegment( tLogicalVolumeSegment * segment )
              segment->stripes[j].physicalVolume->name );
         LogInfo( "    stripe[%d]   start extent = %ld",    j, segment->stripes[j].startExtent );
     }
+    for ( int j = 0; j < segment->legCount; ++j )
+    {
+        LogInfo( "    leg[%d] \"%s\" from extent %ld%s", j, segment->legs[j].lvName,
+                 segment->legs[j].startExtent, segment->legs[j].lv != NULL ? "" : " (unusable)" );
+    }
+    if ( segment->type == segmentThin )
+    {
+        LogInfo( "    thin device %lu in pool \"%s\"", segment->deviceId, segment->thinPool.lvName );
+    }
+    if ( segment->type == segmentThinPool )
+    {
+        LogInfo( "    thin pool data \"%s\", metadata \"%s\"", segment->poolData.lvName, segment->poolMetadata.lvName );
+    }
+    if ( segment->type == segmentSnapshot )
+    {
+        LogInfo( "    snapshot of \"%s\", COW store \"%s\"", segment->origin.lvName, segment->cowStore.lvName );
+    }
 #endif
 }
 
@@ -329,7 +418,10 @@ void dumpNode( tNode * node, int depth )
         switch ( node->type )
         {
         case childNode:
-            snprintf(scratch, sizeof(scratch), "child @ %p", node->child);
+            if ( node->unparsed != NULL )
+                snprintf(scratch, sizeof(scratch), "unparsed, %lu bytes", node->unparsed->length);
+            else
+                snprintf(scratch, sizeof(scratch), "child @ %p", node->child);
             break;
 
         case listNode:
@@ -337,7 +429,7 @@ void dumpNode( tNode * node, int depth )
             break;
 
         case stringNode:
-            snprintf(scratch, sizeof(scratch), "\"%s\"", node->string);
+            snprintf(scratch, sizeof(scratch), "\"%.*s\"", (int) node->stringLength, node->string);
             break;
 
         case integerNode:
@@ -348,8 +440,8 @@ void dumpNode( tNode * node, int depth )
             snprintf(scratch, sizeof(scratch), "unknown type (%d)", node->type);
             break;
         }
-        LogInfo( "%s | node @ %10p, next @ %10p, (hash %016lx) \"%s\" = %s",
-             &kIndent[ i ], node, node->next, node->hash, node->key, scratch );
+        LogInfo( "%s | node @ %10p, next @ %10p, (hash %016lx) \"%.*s\" = %s",
+             &kIndent[ i ], node, node->next, node->hash, (int) node->keyLength, node->key, scratch );
     }
     else
     {
@@ -374,305 +466,557 @@ tNode * dumpNodeCallback( tNode * node, int depth, int UNUSED(index), void * UNU
 void dumpNodeTree( tNode * node )
 {
 #ifdef optDebugOutput
-    forEachNode( node, dumpNodeCallback, NULL );
+    /* just what's been parsed so far; dumping the tree shouldn't parse the rest of it */
+    walkNodeTree( node, dumpNodeCallback, NULL, 0 );
 #endif
 }
 
 
 /****************************************************************************/
 
+/*
+    The parse works from the structural characters metadataScan.c finds,
+    rather than a character at a time: whatever lies between two of them
+    is taken in one piece, as a key, a number, or whitespace to ignore.
+*/
+
+typedef struct tParser
+{
+    tArena        * arena;
+    tMetadataScan   scan;
+    const char    * text;
+    size_t          length;
+    size_t          from;       /* where the text before the current structural character starts */
+    size_t          at;         /* the current structural character; length at the end */
+    int             held;       /* the current one is to be handed out again */
+    int             lazy;       /* leave sections unparsed, until they're searched */
+    int             outOfMemory; /* a node couldn't be allocated, so the tree is missing it */
+} tParser;
+
 /**
- *
- * @param node
- * @param buf
- * @return
+ * @param portable  find the structure with the portable scanner, whatever the CPU can do
+ * @param lazy      skip over sections, rather than parse them
  */
-tNode * parseList( tNode * node, tTextBlock * buf )
+static void initParser( tParser * parser, tArena * arena, const char * text, size_t length,
+                        tScanClassifier classify, int lazy )
 {
-    tNode   * result;
+    memset( parser, 0, sizeof( tParser ) );
+    parser->arena  = arena;
+    parser->text   = text;
+    parser->length = length;
+    parser->at     = SIZE_MAX;
+    parser->lazy   = lazy;
+    initMetadataScan( &parser->scan, (const byte *) text, length, classify );
+}
 
-    enum
+/**
+ * Move on to the next structural character.
+ * @return the character, or EOF at the end of the text
+ */
+static int nextToken( tParser * parser )
+{
+    if ( parser->held )
     {
-        outside,
-        insideString,
-        insideInteger
-    }       state;
-
-    enum
+        parser->held = 0;
+    }
+    else
     {
-        noElement,
-        integerElement,
-        stringElement
-    }       elementType;
+        /* before the first, 'at' is SIZE_MAX, so this comes out at the start of the text */
+        parser->from = (parser->at < parser->length) ? parser->at + 1 : (parser->at == parser->length) ? parser->length : 0;
+        parser->at   = nextStructural( &parser->scan );
+    }
+    return (parser->at < parser->length) ? (byte) parser->text[ parser->at ] : EOF;
+}
+
+/**
+ * Skip ahead to the next instance of c, e.g. the end of a string or a comment.
+ * @return c, or EOF if there isn't one
+ */
+static int skipTo( tParser * parser, int c )
+{
+    int token;
 
-    int64_t integer;
-    int     c;
+    do { token = nextToken( parser ); } while ( token != c && token != EOF );
+    return token;
+}
 
-    state       = outside;
-    elementType = noElement;
-    result      = NULL;
+/**
+ * Having just passed an opening quote, skip to the closing one. A quote after
+ * an odd number of backslashes is escaped, and part of the string.
+ * @return '"', or EOF if the string doesn't end
+ */
+static int skipString( tParser * parser )
+{
+    int token;
 
-    /* arrays can span lines, so ignore newlines */
-    while ( (c = getNextChar( buf )) != EOF )
+    for ( ;; )
     {
-        switch ( state )
+        token = skipTo( parser, '"' );
+        if ( token != '"' )
         {
-        case outside:
-            switch ( c )
-            {
-            case '"':
-                setStringStart( buf );
-                elementType = stringElement;
-                state       = insideString;
-                break;
-
-            case ',':
-            case ']':
-                if ( elementType != noElement )
-                {
-                    node = newNode( node );
-                    if ( result == NULL ) { result = node; }
-
-                    /* set the node */
-                    switch ( elementType )
-                    {
-                    case integerElement:
-                        node->type    = integerNode;
-                        node->integer = integer;
-                        node->key     = "integer";
-                        break;
-
-                    case stringElement:
-                        node->type   = stringNode;
-                        node->string = dupString( buf );
-                        node->key    = node->string;    /* makes it easier to test for presence of node */
-                        break;
-
-                    default:
-                        /* just to keep the compiler happy */
-                        break;
-                    }
-                    node->hash = hashString( node->key );
-                }
-
-                if ( c == ']' )
-                {
-                    return result;
-                }
-
-                elementType = noElement;
-                break;
-
-            default:
-                if ( isdigit( c ) )
-                {
-                    state       = insideInteger;
-                    elementType = integerElement;
-                    integer     = (c - '0');
-                }
-                break;
-            }
-            break;
-
-        case insideString:
-            if ( c == '"' )
-            {
-                setStringEnd( buf );
-                elementType = stringElement;
-                state       = outside;
-            }
-            break;
+            return token;
+        }
 
-        case insideInteger:
-            if ( isdigit( c ) )
-            {
-                integer = (integer * 10) + (c - '0');
-            }
-            else
-            {
-                getPreviousChar( buf );
-                state = outside;
-            }
-            break;
+        /* the opening quote stops this going back beyond the string */
+        size_t slashes = 0;
+        while ( parser->text[ parser->at - 1 - slashes ] == '\\' )
+        {
+            ++slashes;
+        }
+        if ( (slashes & 1) == 0 )
+        {
+            return token;
         }
     }
-    return result;
 }
 
-tNode * parseString( tNode * node, tTextBlock * buf )
+static int isBlank( char c )
 {
-    int c;
+    return c == ' ' || c == '\t' || c == '\r';
+}
 
-    setStringStart( buf );
-    do
-    {
-        c = getNextChar( buf );
+/**
+ * Trim the whitespace from both ends of the text before the current structural character.
+ * @return its length, with *start set to where it begins
+ */
+static size_t getTokenText( tParser * parser, const char ** start )
+{
+    size_t from = parser->from;
+    size_t to   = parser->at;
 
-    } while ( c != EOF && c != '"' );
-    setStringEnd( buf );
+    while ( from < to && isBlank( parser->text[ from ] ) ) { ++from; }
+    while ( to > from && isBlank( parser->text[ to - 1 ] ) ) { --to; }
 
-    node->type   = stringNode;
-    node->string = dupString( buf );
+    *start = &parser->text[ from ];
+    return to - from;
+}
 
-    return node;
+/**
+ * Take the key from the text before a '=' or '{': all of it, once trimmed. A
+ * volume's name, which is the key for its section, can have '+', '.' and '-'
+ * in it, as well as letters, digits and '_'.
+ * @return its length, with *key set to where it begins
+ */
+static size_t getKeyText( tParser * parser, const char ** key )
+{
+    return getTokenText( parser, key );
 }
 
-tNode * parseInteger( tNode * node, tTextBlock * buf )
+/**
+ * Look for a number in the text before the current structural character.
+ * @return non-zero if there was one, with *value set to it
+ */
+static int getTokenInteger( tParser * parser, int64_t * value )
 {
-    int64_t integer = 0;
-    int     c;
+    const char * p   = &parser->text[ parser->from ];
+    const char * end = &parser->text[ parser->at ];
 
-    while ( (c = getNextChar( buf )) != EOF )
+    while ( p < end && !isdigit( (byte) *p ) ) { ++p; }
+    if ( p == end )
     {
-        if ( isdigit( c ) )
-        {
-            integer = (integer * 10) + (c - '0');
-        }
-        else
-        {
-            // fprintf(stderr, "\ninteger: %lld\n", integer);
-            getPreviousChar( buf );
-            break;
-        }
+        return 0;
+    }
+    *value = 0;
+    while ( p < end && isdigit( (byte) *p ) )
+    {
+        *value = (*value * 10) + (*p++ - '0');
     }
-    node->type    = integerNode;
-    node->integer = integer;
+    return 1;
+}
 
+static tNode * appendNode( tParser * parser, tNode *** tail, const char * key, size_t keyLength )
+{
+    tNode * node = arenaAlloc( parser->arena, sizeof( tNode ) );
+
+    if ( node != NULL )
+    {
+        node->key       = key;
+        node->keyLength = keyLength;
+        node->hash      = hashBytes( key, keyLength );
+        **tail = node;
+        *tail  = &node->next;
+    }
+    else
+    {
+        parser->outOfMemory = 1;
+    }
     return node;
 }
 
-tNode * parseValue( tNode * node, tTextBlock * buf )
+/**
+ * Having just passed an opening quote, find the closing one. Any escapes are
+ * left in the string as they are.
+ * @return the length of the string, with *start set to where it begins
+ */
+static size_t parseString( tParser * parser, const char ** start )
 {
-    int c;
+    *start = &parser->text[ parser->at + 1 ];
+    skipString( parser );
+    return &parser->text[ parser->at ] - *start;
+}
 
-    while ( (c = getNextChar( buf )) != EOF )
+/**
+ * Parse the elements of a list, up to and including its closing ']'. Strings
+ * are their own keys, which makes it easier to test for their presence.
+ *
+ * @return the first element, or NULL if it's empty
+ */
+static tNode * parseList( tParser * parser )
+{
+    tNode  * result = NULL;
+    tNode ** tail   = &result;
+    int      haveString = 0;
+    int      haveInteger = 0;
+    const char * string = NULL;
+    size_t   stringLength = 0;
+    int64_t  integer = 0;
+    int      c;
+
+    /* lists can span lines, so newlines are just separators */
+    while ( (c = nextToken( parser )) != EOF )
     {
+        if ( !haveString && !haveInteger )
+        {
+            haveInteger = getTokenInteger( parser, &integer );
+        }
+
         switch ( c )
         {
-        case ' ':
-        case '\t':
-            /* skip whitespace */
+        case '"':
+            stringLength = parseString( parser, &string );
+            haveString   = 1;
+            haveInteger  = 0;
             break;
 
-        case '\n':
-            getPreviousChar( buf );
-            return node;
-
-        case '[':
-            node->type = listNode;
-            node->list = parseList( node, buf );
-            node->next = NULL;
-            return node;
-
-        case '"':
-            return parseString( node, buf );
+        case '#':
+            skipTo( parser, '\n' );
+            break;
 
-        default:
-            if ( isdigit( c ) )
+        case ',':
+        case ']':
+            if ( haveString )
             {
-                /* back up one character, otherwise we strip the first digit */
-                getPreviousChar( buf );
-
-                return parseInteger( node, buf );
+                tNode * node = appendNode( parser, &tail, string, stringLength );
+                if ( node != NULL )
+                {
+                    node->type         = stringNode;
+                    node->string       = string;
+                    node->stringLength = stringLength;
+                }
+            }
+            else if ( haveInteger )
+            {
+                tNode * node = appendNode( parser, &tail, "integer", 7 );
+                if ( node != NULL )
+                {
+                    node->type    = integerNode;
+                    node->integer = integer;
+                }
+            }
+            if ( c == ']' )
+            {
+                return result;
             }
+            haveString  = 0;
+            haveInteger = 0;
+            break;
+
+        default:
             break;
         }
     }
-    return node;
+    return result;
 }
 
-tNode * parseChild( tNode * node, tTextBlock * buf )
+static tNode * parseChild( tParser * parser );
+
+/**
+ * Having just passed a '{', skip to its matching '}', without building anything.
+ * A cow_store in it is noted on the way past, so a snapshot can be found
+ * without parsing every volume to look for one; see findSnapshotVolume().
+ *
+ * @param unparsed  where to note the cow_store, or NULL
+ */
+static void skipSection( tParser * parser, tUnparsed * unparsed )
 {
-    tNode * result = NULL;
-    int     getKey;
-    int     c;
+    int depth = 1;
+    int c;
 
-    getKey = 1;
-    while ( (c = getNextChar( buf )) != EOF )
+    while ( depth > 0 && (c = nextToken( parser )) != EOF )
     {
-        // dumpMemory( (unsigned long)buf->ptr - 1, buf->ptr - 1, buf->length < 32 ? buf->length : 32);
+        const char * key;
 
         switch ( c )
         {
-        case '#':
-            // dumpMemory( (unsigned long)buf->ptr, buf->ptr, buf->length < 96 ? buf->length : 96 );
-            setStringStart( buf );
-            do { c = getNextChar( buf ); } while ( c != EOF && c != '\n' );
-            setStringEnd( buf );
-            // LogInfo( "comment: \"%s\"", dupString( buf ));
-            break;
-
-        case '\n':
-            do { c = getNextChar( buf ); } while ( c != EOF && (c == '\n' || c == '\t' || c == ' ') );
-            getPreviousChar( buf );
-            getKey = 1;
-            break;
+        case '{': ++depth; break;
+        case '}': --depth; break;
+        case '"': skipString( parser ); break;
+        case '#': skipTo( parser, '\n' ); break;
 
         case '=':
-            /* parseValue() figures out if it's a integer, string or list */
-            node = parseValue( node, buf );
-            break;
-
-        case '{':
-            node->type  = childNode;
-            node->child = parseChild( node, buf );
-            node->next  = NULL;
-            break;
-
-        case '}':
-            return result;
-
-        default:
-            if ( getKey )
+            if ( unparsed != NULL && unparsed->cowStore == NULL
+              && getTokenText( parser, &key ) == 9 && memcmp( key, "cow_store", 9 ) == 0 )
             {
-                getPreviousChar( buf );
-                setStringStart( buf );
-                do {
-                    c = getNextChar( buf );
-
-                } while ( isalnum( c ) || c == '_' );
-                setStringEnd( buf );
-
-                /* ignore zero-length keys, e.g. comment lines */
-                if ( lenString( buf ) > 0)
+                if ( nextToken( parser ) == '"' )
+                {
+                    unparsed->cowStoreLength = parseString( parser, &unparsed->cowStore );
+                }
+                else
                 {
-                    node = newNode( node );
-                    if ( result == NULL )
-                    {
-                        result = node;
-                    }
-
-                    node->key  = dupString( buf );
-                    node->hash = hashString( node->key );
+                    parser->held = 1;
                 }
             }
+            break;
+
+        default:  break;
         }
     }
-    return (result);
 }
 
-
-tNode * parseMetadata( tTextBlock * metadata )
+/**
+ * Parse what follows an '=': a string, a list or a number.
+ * @param node  where to put it, or NULL to just skip it
+ */
+static void parseValue( tParser * parser, tNode * node )
 {
-    tNode * root;
+    tNode        scratch;
+    const char * text;
+    int          c = nextToken( parser );
+
+    if ( node == NULL )
+    {
+        node = &scratch;
+    }
+
+    if ( c == '"' && getTokenText( parser, &text ) == 0 )
+    {
+        node->type         = stringNode;
+        node->stringLength = parseString( parser, &node->string );
+    }
+    else if ( c == '[' && getTokenText( parser, &text ) == 0 )
+    {
+        node->type  = listNode;
+        node->list  = parseList( parser );
+        node->index = buildNodeIndex( parser->arena, node->list );
+    }
+    else
+    {
+        if ( getTokenInteger( parser, &node->integer ) )
+        {
+            node->type = integerNode;
+        }
+        /* whatever ended it may matter, e.g. a '#' or a '}' */
+        parser->held = 1;
+    }
+}
+
+/**
+ * Parse 'key = value' lines and 'key { ... }' sections, up to and including
+ * the '}' that closes the section they're in.
+ *
+ * @return the first of them, or NULL if there are none
+ */
+static tNode * parseChild( tParser * parser )
+{
+    tNode  * result = NULL;
+    tNode ** tail   = &result;
+    int      c;
+
+    while ( (c = nextToken( parser )) != EOF )
+    {
+        const char * key;
+        size_t       keyLength;
+        tNode      * node;
+
+        switch ( c )
+        {
+        case '#':
+            skipTo( parser, '\n' );
+            break;
+
+        case '"':
+            /* a string with no key: skip it, so nothing in it is taken for structure */
+            skipString( parser );
+            break;
+
+        case '=':
+            keyLength = getKeyText( parser, &key );
+            node = (keyLength > 0) ? appendNode( parser, &tail, key, keyLength ) : NULL;
+            parseValue( parser, node );
+            break;
+
+        case '{':
+            keyLength = getKeyText( parser, &key );
+            node = (keyLength > 0) ? appendNode( parser, &tail, key, keyLength ) : NULL;
+            if ( node == NULL )
+            {
+                skipSection( parser, NULL );
+                break;
+            }
+            node->type = childNode;
+            if ( parser->lazy && (node->unparsed = arenaAlloc( parser->arena, sizeof( tUnparsed ) )) != NULL )
+            {
+                /* just note where it is, for parseSection() */
+                node->unparsed->arena    = parser->arena;
+                node->unparsed->classify = parser->scan.classify;
+                node->unparsed->text     = &parser->text[ parser->at + 1 ];
+                skipSection( parser, node->unparsed );
+                node->unparsed->length = &parser->text[ parser->at ] - node->unparsed->text;
+            }
+            else
+            {
+                node->child = parseChild( parser );
+                node->index = buildNodeIndex( parser->arena, node->child );
+            }
+            break;
+
+        case '}':
+            return result;
+
+        default:
+            /* newlines, and stray commas and brackets */
+            break;
+        }
+    }
+    return result;
+}
+
+/**
+ * Parse a section that was skipped over, now a search has gone into it. The
+ * sections inside it are skipped over in turn.
+ */
+static void parseSection( tNode * node )
+{
+    tUnparsed * unparsed = node->unparsed;
+    tParser     parser;
+
+    initParser( &parser, unparsed->arena, unparsed->text, unparsed->length, unparsed->classify, 1 );
+    node->child    = parseChild( &parser );
+    node->index    = buildNodeIndex( unparsed->arena, node->child );
+    node->unparsed = NULL;
+
+    if ( parser.outOfMemory )
+    {
+        LogError( "ran out of memory parsing \"%.*s\": some of it is missing", (int) node->keyLength, node->key );
+    }
+}
+
+/**
+ * Parse the text into a tree, finding its structure with the given classifier.
+ *
+ * @param classify  from getScanClassifiers(), or NULL for the best one the CPU can run
+ * @param lazy      leave the sections to be parsed when they're searched
+ * @return the root of the tree, or NULL, including if the arena ran out before
+ *         the whole tree was built
+ */
+tNode * parseMetadataText( tArena * arena, const byte * text, size_t length, tScanClassifier classify, int lazy )
+{
+    tParser parser;
+    tNode * root = arenaAlloc( arena, sizeof( tNode ) );
 
-    root = newNode( NULL );
     if ( isValidPtr( root ) )
     {
-        root->key   = "root_node";
-        root->hash  = hashString( root->key );
-        root->type  = childNode;
-        root->child = parseChild( root, metadata );
-        root->next  = NULL;
+        initParser( &parser, arena, (const char *) text, length, classify, lazy );
+
+        root->key       = "root_node";
+        root->keyLength = strlen( root->key );
+        root->hash      = hashBytes( root->key, root->keyLength );
+        root->type      = childNode;
+        root->child     = parseChild( &parser );
+        root->index     = buildNodeIndex( arena, root->child );
+
+        if ( parser.outOfMemory )
+        {
+            LogError( "ran out of memory parsing the metadata" );
+            root = NULL;
+        }
+    }
+    return root;
+}
+
+/**
+ * @return non-zero if two trees hold the same keys and values, in the same order,
+ *         once every section in them is parsed
+ */
+int isSameTree( tNode * a, tNode * b )
+{
+    for ( ; a != NULL && b != NULL; a = a->next, b = b->next )
+    {
+        if ( a->type != b->type || a->hash != b->hash || a->keyLength != b->keyLength
+          || memcmp( a->key, b->key, a->keyLength ) != 0 )
+        {
+            return 0;
+        }
+        switch ( a->type )
+        {
+        case childNode:
+        case listNode:
+            if ( !isSameTree( getNodeChildren( a, 1 ), getNodeChildren( b, 1 ) ) ) { return 0; }
+            break;
+
+        case stringNode:
+            if ( a->stringLength != b->stringLength || memcmp( a->string, b->string, a->stringLength ) != 0 )
+            {
+                return 0;
+            }
+            break;
+
+        case integerNode:
+            if ( a->integer != b->integer ) { return 0; }
+            break;
+
+        default:
+            break;
+        }
+    }
+    return a == NULL && b == NULL;
+}
 
+/**
+ * Parse the metadata text into a tree of nodes.
+ *
+ * @param metadata  the text, which the tree refers to, so has to outlive it
+ * @param arena     where to put the tree; freeing or resetting it releases the lot
+ * @return the root of the tree, or NULL
+ */
+tNode * parseMetadata( tTextBlock * metadata, tArena * arena )
+{
+    tNode * root = parseMetadataText( arena, metadata->block.ptr, metadata->block.length, NULL, 1 );
+
+    if ( isValidPtr( root ) )
+    {
+#ifdef optCheckMetadataScan
+        /* parsing a bit at a time, with a vector scanner, has to come out just the same as
+           parsing the lot at once with the portable one. The trees are separate copies,
+           so root is left as unparsed as it would be otherwise */
+        tScanClassifier classifiers[ kMaxScanClassifiers ];
+        const char    * names[ kMaxScanClassifiers ];
+        tArena        * check = newArena( 0 );
+
+        getScanClassifiers( classifiers, names );
+        if ( isHeapPtr( check ) )
+        {
+            tNode * lazy     = parseMetadataText( check, metadata->block.ptr, metadata->block.length, NULL, 1 );
+            tNode * portable = parseMetadataText( check, metadata->block.ptr, metadata->block.length, classifiers[ 0 ], 0 );
+            if ( !isValidPtr( lazy ) || !isValidPtr( portable ) || !isSameTree( lazy, portable ) )
+            {
+                LogError( "the %s metadata scanner's lazy tree differs from the portable one's", getScanKernelName() );
+            }
+            else
+            {
+                LogInfo( "the %s metadata scanner's lazy tree matches the portable one's", getScanKernelName() );
+            }
+            freeArena( check );
+        }
+#endif
         DebugOut( "\n" );
         LogInfo( "######## node dump ########\n" );
         dumpNodeTree( root );
+        LogInfo( "the parse tree takes %lu bytes", getArenaUsage( arena ) );
     }
     return root;
 }
 
-
 #define kHash_id        0x000000000cfb66ec
 #define kHash_device    0x0000eaeb4d97cacf
 #define kHash_dev_size  0x03e752f51209acb8
@@ -689,39 +1033,59 @@ tNode * parseMetadata( tTextBlock * metadata )
  */
 tNode *physVolCallback( tNode * node, int depth, int index, void * cbData )
 {
-    tPhysicalVolume * pv = (tPhysicalVolume *)cbData;
+    static tPhysicalVolume * pv;
+    tLogicalVolume  * lv    = (tLogicalVolume *)cbData;
+    tPhysicalVolume * first = lv->physicalVolumes;
 
     switch (depth)
     {
     case 1:
-        if (index == 0)
+        if ( node->type == childNode )
         {
-            if ( node->type == childNode )
+            if ( index == 0 )
             {
-                pv->name = strdup( node->key );
+                pv = first;
+            }
+            else if ( pv != NULL )
+            {
+                /* another physical volume: append it to the list */
+                tPhysicalVolume * next = arenaAlloc( lv->arena, sizeof(tPhysicalVolume) );
+                if ( isHeapPtr( next ) )
+                {
+                    next->extentSize = first->extentSize;
+                }
+                else
+                {
+                    next = NULL;
+                }
+                pv->next = next;
+                pv = next;
+            }
+            if ( pv != NULL )
+            {
+                pv->name = arenaStrndup( lv->arena, node->key, node->keyLength );
             }
-        }
-        else
-        {
-            /** @todo handle multiple physical volumes */
-            LogError("multiple physical volumes - not currently supported");
         }
         break;
 
     case 2:
+        if ( pv == NULL )
+        {
+            break;
+        }
         switch (node->hash )
         {
         case kHash_id:
             if (node->type == stringNode)
             {
-                pv->id = strdup( node->string );
+                pv->id = dupNodeString( lv->arena, node );
             }
             break;
 
         case kHash_device:
             if (node->type == stringNode)
             {
-                pv->dev = strdup( node->string );
+                pv->dev = dupNodeString( lv->arena, node );
             }
             break;
 
@@ -761,9 +1125,93 @@ tNode *physVolCallback( tNode * node, int depth, int index, void * cbData )
 #define kHash_extent_count  0x7dadb102604275ff
 #define kHash_type          0x0000003739774241
 #define kHash_stripe_count  0x87697ace17d5787e
+#define kHash_stripe_size   0xfc588799a3aa4bf0
 #define kHash_stripes       0x001e4859a5efeb29
+#define kHash_raids         0x0000071e682e12d2
+#define kHash_mirrors       0x001e4857be6eac8d
+#define kHash_thin_pool     0x80d1c62898addd8b
+#define kHash_device_id     0x80d1b197696eae7b
+#define kHash_external_origin 0x9bb2280428d453e9
+#define kHash_metadata      0x03e7534e5bcbabe0
+#define kHash_pool          0x000000373974e619
+#define kHash_chunk_size    0x9b07be1c97984772
+#define kHash_origin        0x0000eaeb68249fa7
+#define kHash_cow_store     0x80d1b0b366553bb4
 /* depth = 3 */
 /* stripe pairs themselves: (physical volume name, starting extent) */
+/* raids pairs: (metadata sub-volume name, image sub-volume name) */
+/* mirrors pairs: (image sub-volume name, starting extent) */
+
+/* the segment types we can read, by their 'type' string in the metadata */
+static const struct
+{
+    const char * name;
+    tSegmentType type;
+    int          parityCount;
+    tRaidLayout  layout;
+} kSegmentTypes[] =
+{
+    { "striped",    segmentStriped, 0, 0 },
+    { "linear",     segmentStriped, 0, 0 },
+    { "mirror",     segmentMirror,  0, 0 },
+    { "raid1",      segmentMirror,  0, 0 },
+    { "raid4",      segmentParity,  1, raidParityFirst },
+    { "raid5",      segmentParity,  1, raidLeftSymmetric },
+    { "raid5_n",    segmentParity,  1, raidParityLast },
+    { "raid5_la",   segmentParity,  1, raidLeftAsymmetric },
+    { "raid5_ra",   segmentParity,  1, raidRightAsymmetric },
+    { "raid5_ls",   segmentParity,  1, raidLeftSymmetric },
+    { "raid5_rs",   segmentParity,  1, raidRightSymmetric },
+    { "raid6",      segmentParity,  2, raidZeroRestart },
+    { "raid6_zr",   segmentParity,  2, raidZeroRestart },
+    { "raid6_nr",   segmentParity,  2, raidNRestart },
+    { "raid6_nc",   segmentParity,  2, raidNContinue },
+    { "raid6_n_6",  segmentParity,  2, raidParityLast },
+    { "raid6_la_6", segmentParity,  2, raidLeftAsymmetric },
+    { "raid6_ra_6", segmentParity,  2, raidRightAsymmetric },
+    { "raid6_ls_6", segmentParity,  2, raidLeftSymmetric },
+    { "raid6_rs_6", segmentParity,  2, raidRightSymmetric },
+    { "thin",       segmentThin,    0, 0 },
+    { "thin-pool",  segmentThinPool, 0, 0 },
+    { "snapshot",   segmentSnapshot, 0, 0 }
+};
+
+/**
+ * Set a segment's type, and for raid, its layout, from a 'type' string in the metadata.
+ */
+static void setSegmentType( tLogicalVolumeSegment * segment, const tNode * type )
+{
+    for ( size_t i = 0; i < sizeof( kSegmentTypes ) / sizeof( kSegmentTypes[0] ); ++i )
+    {
+        if ( isNodeString( type, kSegmentTypes[i].name ) )
+        {
+            segment->type        = kSegmentTypes[i].type;
+            segment->parityCount = kSegmentTypes[i].parityCount;
+            segment->layout      = kSegmentTypes[i].layout;
+            return;
+        }
+    }
+    LogError( "segments of type \"%.*s\" are not supported", (int) type->stringLength, type->string );
+    segment->type = segmentUnsupported;
+}
+
+/**
+ * Make room for the legs of a mirrored or raid segment: one per pair in its list.
+ */
+static void allocMirrorLegs( tArena * arena, tLogicalVolumeSegment * segment, tNode * list )
+{
+    int count = 0;
+    for ( tNode * entry = list; entry != NULL; entry = entry->next )
+    {
+        ++count;
+    }
+    segment->legCount = 0;
+    segment->legs     = arenaAlloc( arena, sizeof(tMirrorLeg) * (count / 2 > 0 ? count / 2 : 1) );
+    if ( isHeapPtr( segment->legs ) )
+    {
+        segment->legCount = count / 2;
+    }
+}
 
 /**
  *
@@ -776,26 +1224,53 @@ tNode *physVolCallback( tNode * node, int depth, int index, void * cbData )
 
 tNode * logVolCallback( tNode * node, int depth, int index, void * cbData )
 {
-    static int seg;
-    static int stripeCount;
-    tLogicalVolumeSegment * segment = (tLogicalVolumeSegment *)cbData;
+    static int   seg;
+    static int   stripeCount;
+    static tHash list;          /* which list the depth 3 nodes belong to */
+    tLogicalVolume        * lv      = (tLogicalVolume *)cbData;
+    tLogicalVolumeSegment * segment = lv->segments;
 
     switch (depth)
     {
     case 1: /* is it a segment? which one? */
-        if (memcmp(node->key, "segment", 7) == 0
+        seg = -1;
+        if (node->keyLength > 7 && strncmp(node->key, "segment", 7) == 0
             && node->type == childNode)
         {
-            seg = atoi(&node->key[7]) - 1;
+            seg = 0;
+            for (size_t i = 7; i < node->keyLength && isdigit(node->key[i]); ++i)
+            {
+                seg = (seg * 10) + (node->key[i] - '0');
+            }
+            --seg;
+            if (seg >= lv->segmentCount)
+            {
+                seg = -1;
+            }
         }
-        else seg = 0;
         break;
 
     case 2: /* attributes of this segment */
         if (seg >= 0)
         {
+            list = node->hash;
             switch ( node->hash )
             {
+            case kHash_type:
+                if ( node->type == stringNode )
+                {
+                    setSegmentType( &segment[ seg ], node );
+                }
+                break;
+
+            case kHash_raids:
+            case kHash_mirrors:
+                if ( node->type == listNode )
+                {
+                    allocMirrorLegs( lv->arena, &segment[ seg ], node->list );
+                }
+                break;
+
             case kHash_start_extent:
                 if ( node->type == integerNode )
                 {
@@ -815,19 +1290,98 @@ tNode * logVolCallback( tNode * node, int depth, int index, void * cbData )
                 {
                     stripeCount = node->integer;
                     segment[ seg ].stripeCount = stripeCount;
-                    segment[ seg ].stripes = calloc( sizeof(tStripe), stripeCount );
+                    segment[ seg ].stripes = arenaAlloc( lv->arena, sizeof(tStripe) * stripeCount );
+                }
+                break;
+
+            case kHash_stripe_size:
+            case kHash_chunk_size:
+                if ( node->type == integerNode )
+                {
+                    segment[ seg ].stripeSize = node->integer * kLVMSectorSize;
+                }
+                break;
+
+            case kHash_thin_pool:
+                if ( node->type == stringNode )
+                {
+                    segment[ seg ].thinPool.lvName = dupNodeString( lv->arena, node );
+                }
+                break;
+
+            case kHash_device_id:
+                if ( node->type == integerNode )
+                {
+                    segment[ seg ].deviceId = node->integer;
+                }
+                break;
+
+            case kHash_external_origin:
+                /* unmapped blocks would come from another volume, rather than being zeros */
+                LogError( "thin volumes with an external origin are not supported" );
+                segment[ seg ].type = segmentUnsupported;
+                break;
+
+            case kHash_metadata:
+                if ( node->type == stringNode )
+                {
+                    segment[ seg ].poolMetadata.lvName = dupNodeString( lv->arena, node );
+                }
+                break;
+
+            case kHash_pool:
+                if ( node->type == stringNode )
+                {
+                    segment[ seg ].poolData.lvName = dupNodeString( lv->arena, node );
+                }
+                break;
+
+            case kHash_origin:
+                if ( node->type == stringNode )
+                {
+                    segment[ seg ].origin.lvName = dupNodeString( lv->arena, node );
+                }
+                break;
+
+            case kHash_cow_store:
+                if ( node->type == stringNode )
+                {
+                    segment[ seg ].cowStore.lvName = dupNodeString( lv->arena, node );
                 }
                 break;
             }
         }
         break;
 
-    case 3: /* array of stripes (usually 1 stripe) */
+    case 3: /* array of stripes (usually 1 stripe), or of mirror legs */
+        if ( seg >= 0 && (list == kHash_raids || list == kHash_mirrors) )
+        {
+            if ( index / 2 >= segment[ seg ].legCount )
+            {
+                break;
+            }
+            tMirrorLeg * leg = &segment[ seg ].legs[ index / 2 ];
+            /* raids: the second of each pair is the image; mirrors: the first is, then where it starts */
+            int isName = (list == kHash_raids) ? (index & 1) == 1 : (index & 1) == 0;
+            if ( isName && node->type == stringNode )
+            {
+                leg->lvName = dupNodeString( lv->arena, node );
+            }
+            else if ( list == kHash_mirrors && !isName && node->type == integerNode )
+            {
+                leg->startExtent = node->integer;
+            }
+            break;
+        }
+        if ( seg < 0 || list != kHash_stripes || segment[ seg ].stripes == NULL || index / 2 >= stripeCount )
+        {
+            break;
+        }
         if ( (index & 1) == 0 )
         {
             if ( node->type == stringNode )
             {
-                segment[ seg ].stripes[ index / 2 ].pvName = strdup( node->string );
+                segment[ seg ].stripes[ index / 2 ].pvName = dupNodeString( lv->arena, node );
             }
         }
         else
@@ -835,10 +1389,7 @@ tNode * logVolCallback( tNode * node, int depth, int index, void * cbData )
             /* starting extent */
             if ( node->type == integerNode )
             {
-                if ( index / 2 < stripeCount )
-                {
-                    segment[ seg ].stripes[ index / 2 ].startExtent = node->integer;
-                }
+                segment[ seg ].stripes[ index / 2 ].startExtent = node->integer;
             }
         }
         break;
@@ -846,40 +1397,443 @@ tNode * logVolCallback( tNode * node, int depth, int index, void * cbData )
     return NULL;
 }
 
-tMemoryBlock * readLogicalVolume( tDrive * drive, const char * lvName, tNode * root )
+/* qsort comparator: segments in logical order */
+static int compareSegments( const void * a, const void * b )
+{
+    const tLogicalVolumeSegment * segA = a;
+    const tLogicalVolumeSegment * segB = b;
+
+    return (segA->startExtent > segB->startExtent) - (segA->startExtent < segB->startExtent);
+}
+
+/**
+ * Compare a PV id from the metadata, which has dashes in it, with one from a
+ * PV label, which doesn't.
+ * @return non-zero if they're the same id
+ */
+static int isSamePVId( const char * metadataId, const char * labelId )
+{
+    int count = 0;
+
+    while ( *metadataId != '\0' )
+    {
+        if ( *metadataId != '-' )
+        {
+            if ( count >= kPVIdLength || *metadataId != labelId[ count ] )
+            {
+                return 0;
+            }
+            ++count;
+        }
+        ++metadataId;
+    }
+    return count == kPVIdLength;
+}
+
+/**
+ * Resolve a segment's stripes to physical volumes, and check that its layout
+ * is one we can read, so nothing past here needs to.
+ *
+ * @param number  the segment's position in the metadata, for messages
+ * @return 0 if the segment can be read, -1 if not
+ */
+static int checkSegment( tLogicalVolume * lv, tLogicalVolumeSegment * segment, int number )
+{
+    int result = 0;
+
+    if ( segment->type == segmentUnsupported )
+    {
+        LogError( "segment %d of \"%s\" is of a type that can't be read", number, lv->name );
+        return -1;
+    }
+    if ( segment->type == segmentMirror )
+    {
+        if ( segment->usableLegs == 0 )
+        {
+            LogError( "none of the %d legs of segment %d of \"%s\" can be read", segment->legCount, number, lv->name );
+            return -1;
+        }
+        return 0;
+    }
+    if ( segment->type == segmentThinPool )
+    {
+        if ( segment->poolData.lv == NULL || segment->poolMetadata.lv == NULL )
+        {
+            LogError( "the data or metadata of thin pool \"%s\" can't be read", lv->name );
+            return -1;
+        }
+        return 0;
+    }
+    if ( segment->type == segmentThin )
+    {
+        if ( segment->thin == NULL )
+        {
+            LogError( "segment %d of \"%s\" is thin, and its pool can't be read", number, lv->name );
+            return -1;
+        }
+        return 0;
+    }
+    if ( segment->type == segmentSnapshot )
+    {
+        if ( segment->snapshot == NULL )
+        {
+            LogError( "segment %d of \"%s\" is a snapshot that can't be read", number, lv->name );
+            return -1;
+        }
+        return 0;
+    }
+    if ( segment->type == segmentParity )
+    {
+        /* each leg holds an equal share of the data in whole chunks, or parity for it */
+        long dataLegs = segment->legCount - segment->parityCount;
+        if ( dataLegs < 1 || segment->legCount > kMaxRaidLegs || segment->stripeSize == 0
+          || segment->extentCount % dataLegs != 0
+          || ((segment->extentCount / dataLegs) * lv->extentSize) % segment->stripeSize != 0 )
+        {
+            LogError( "segment %d of \"%s\" can't be split across %d legs in %lu byte chunks",
+                      number, lv->name, segment->legCount, segment->stripeSize );
+            return -1;
+        }
+        int missing = segment->legCount - segment->usableLegs;
+        if ( missing > segment->parityCount )
+        {
+            LogError( "%d of the %d legs of segment %d of \"%s\" can't be read; there's only enough parity to rebuild %d",
+                      missing, segment->legCount, number, lv->name, segment->parityCount );
+            return -1;
+        }
+        if ( missing > 0 )
+        {
+            LogError( "segment %d of \"%s\" is degraded; rebuilding the missing data from parity", number, lv->name );
+        }
+        return 0;
+    }
+
+    if ( segment->stripeCount < 1 || segment->stripes == NULL )
+    {
+        LogError( "segment %d of \"%s\" has no stripes", number, lv->name );
+        return -1;
+    }
+    if ( segment->stripeCount > 1 )
+    {
+        /* each stripe holds an equal share of the extents, in whole chunks */
+        uint64_t stripeLength = (segment->extentCount / segment->stripeCount) * lv->extentSize;
+        if ( segment->stripeSize == 0
+          || segment->extentCount % segment->stripeCount != 0
+          || stripeLength % segment->stripeSize != 0 )
+        {
+            LogError( "segment %d of \"%s\" can't be split into %ld stripes of %lu byte chunks",
+                      number, lv->name, segment->stripeCount, segment->stripeSize );
+            return -1;
+        }
+    }
+
+    for ( int j = 0; j < segment->stripeCount; ++j )
+    {
+        tStripe * stripe = &segment->stripes[j];
+        tHash     hash   = (stripe->pvName != NULL) ? hashString( stripe->pvName ) : 0;
+
+        for ( unsigned k = 0; k < lv->pvCount && stripe->pvName != NULL; ++k )
+        {
+            tPhysicalVolume * pv = lv->pvTable[ k ];
+            if ( pv->nameHash == hash && pv->name != NULL && strcmp( stripe->pvName, pv->name ) == 0 )
+            {
+                stripe->physicalVolume = pv;
+                stripe->pvId = pv->index;
+                break;
+            }
+        }
+
+        /* keep going, so every missing stripe gets reported */
+        if ( stripe->physicalVolume == NULL )
+        {
+            LogError( "stripe %d of segment %d of \"%s\" is on physical volume \"%s\", which isn't in the metadata",
+                      j + 1, number, lv->name, stripe->pvName );
+            result = -1;
+        }
+        else if ( stripe->physicalVolume->drive == NULL )
+        {
+            LogError( "stripe %d of segment %d of \"%s\" is on physical volume \"%s\" (%s), which is missing",
+                      j + 1, number, lv->name, stripe->pvName, stripe->physicalVolume->id );
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/* legs are logical volumes themselves; this is as deep as that's allowed to go */
+#define kMaxVolumeNesting   4
+
+/* a volume's description is small: a few KB, unless it has a great many segments */
+#define kVolumeArenaBlockSize   (16 * 1024)
+
+static tLogicalVolume * loadLogicalVolume( tDrive * drive, const char * lvName, tNode * vg, int depth );
+
+/**
+ * Load each leg of a mirrored or raid segment. A leg that can't be read (e.g.
+ * its physical volume is missing) just leaves the others to do the work: a
+ * mirror's usable legs are sorted to the front, while a raid segment's stay
+ * where they are, since the position of each one is part of the layout.
+ */
+static void loadSegmentLegs( tDrive * drive, tNode * vg, tLogicalVolume * lv,
+                             tLogicalVolumeSegment * segment, int number, int depth )
+{
+    long legExtents = segment->extentCount;
+
+    if ( segment->type == segmentParity && segment->legCount > segment->parityCount )
+    {
+        legExtents /= segment->legCount - segment->parityCount;
+    }
+
+    segment->usableLegs = 0;
+    for ( int j = 0; j < segment->legCount; ++j )
+    {
+        tMirrorLeg * leg = &segment->legs[j];
+        uint64_t     end = (leg->startExtent + legExtents) * lv->extentSize;
+
+        if ( leg->lvName != NULL && depth < kMaxVolumeNesting )
+        {
+            leg->lv = loadLogicalVolume( drive, leg->lvName, vg, depth + 1 );
+        }
+        if ( leg->lv != NULL && leg->lv->length < end )
+        {
+            LogError( "leg \"%s\" is too short for segment %d of \"%s\"", leg->lvName, number, lv->name );
+            freeLogicalVolume( leg->lv );
+            leg->lv = NULL;
+        }
+        if ( leg->lv == NULL )
+        {
+            LogError( "leg %d (\"%s\") of segment %d of \"%s\" can't be read; using the other legs",
+                      j + 1, leg->lvName, number, lv->name );
+            continue;
+        }
+
+        if ( segment->type == segmentMirror )
+        {
+            tMirrorLeg usable = *leg;
+            *leg = segment->legs[ segment->usableLegs ];
+            segment->legs[ segment->usableLegs ] = usable;
+        }
+        ++segment->usableLegs;
+    }
+}
+
+/**
+ * Load the other volumes a thin, thin pool or snapshot segment is read through:
+ * the pool a thin segment is in, a pool's data and metadata, or a snapshot's
+ * origin and COW store. Then find a thin segment's mappings in the pool's
+ * metadata, or a snapshot's exceptions in its COW store.
+ */
+static void loadSegmentVolumes( tDrive * drive, tNode * vg, tLogicalVolume * lv,
+                                tLogicalVolumeSegment * segment, int number, int depth )
+{
+    tMirrorLeg * volumes[] = { &segment->thinPool, &segment->poolData, &segment->poolMetadata,
+                               &segment->origin, &segment->cowStore };
+
+    for ( size_t j = 0; j < sizeof( volumes ) / sizeof( volumes[0] ); ++j )
+    {
+        if ( volumes[j]->lvName != NULL && depth < kMaxVolumeNesting )
+        {
+            volumes[j]->lv = loadLogicalVolume( drive, volumes[j]->lvName, vg, depth + 1 );
+            if ( volumes[j]->lv == NULL )
+            {
+                LogError( "\"%s\", which segment %d of \"%s\" needs, can't be read",
+                          volumes[j]->lvName, number, lv->name );
+            }
+        }
+    }
+    if ( segment->type == segmentThin && segment->thinPool.lv != NULL )
+    {
+        segment->thin = openThinDevice( lv, segment, number );
+    }
+    if ( segment->type == segmentSnapshot && segment->origin.lv != NULL && segment->cowStore.lv != NULL )
+    {
+        segment->snapshot = openSnapshot( lv, segment, number );
+    }
+}
+
+/**
+ * The volume LVM shows as an old-style snapshot is just its COW store; it's a
+ * hidden volume, with a 'snapshot' segment, that ties that to the origin.
+ * @return a copy of the name of the hidden volume if lvName is a COW store, or NULL
+ */
+static char * findSnapshotVolume( const char * lvName, tNode * vg )
+{
+    tNode * logicalVolumes = getKeyPath( "logical_volumes", vg );
+
+    if ( !isValidPtr( logicalVolumes ) || logicalVolumes->type != childNode )
+    {
+        return NULL;
+    }
+    for ( tNode * volume = getNodeChildren( logicalVolumes, 1 ); volume != NULL; volume = volume->next )
+    {
+        /* one that hasn't been parsed had its cow_store, if it has one, noted when it was skipped */
+        if ( volume->unparsed != NULL )
+        {
+            if ( volume->unparsed->cowStore != NULL && volume->unparsed->cowStoreLength == strlen( lvName )
+              && memcmp( volume->unparsed->cowStore, lvName, volume->unparsed->cowStoreLength ) == 0 )
+            {
+                return strndup( volume->key, volume->keyLength );
+            }
+            continue;
+        }
+        /* the cow_store is in the volume's segment */
+        for ( tNode * segment = getNodeChildren( volume, 1 ); segment != NULL; segment = segment->next )
+        {
+            tNode * cowStore = getKeyPath( "cow_store", segment );
+            if ( isValidPtr( cowStore ) && isNodeString( cowStore, lvName ) )
+            {
+                return strndup( volume->key, volume->keyLength );
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @return the volume group's node: the first node under the root that has children
+ */
+static tNode * getVolumeGroupNode( tNode * root )
+{
+    tNode * node = getNodeChildren( root, 1 );
+
+    while ( node != NULL && node->type != childNode )
+    {
+        node = node->next;
+    }
+    return node;
+}
+
+/**
+ * Find a logical volume in the metadata, and work out where its segments are.
+ *
+ * @param drive   the drives we have, linked by their next fields; each physical
+ *                volume is found on the one whose PV label has its id
+ * @param lvName  name of the logical volume
+ * @param root    the parsed metadata
+ * @return the logical volume, with its segments in logical order, or NULL if it
+ *         couldn't be found, or refers to a physical volume we don't have
+ */
+tLogicalVolume * findLogicalVolume( tDrive * drive, const char * lvName, tNode * root )
+{
+    tNode          * vg = getVolumeGroupNode( root );
+    char           * snapshotName;
+    tLogicalVolume * lv;
+
+    if ( vg == NULL )
+    {
+        LogError( "there's no volume group in the metadata" );
+        return NULL;
+    }
+
+    /* everything from the extent index down divides by it, the volume's legs included */
+    tNode * extentSize = getKeyPath( "extent_size", vg );
+    if ( !isValidPtr( extentSize ) || extentSize->type != integerNode || extentSize->integer <= 0 )
+    {
+        LogError( "the volume group has no valid extent_size" );
+        return NULL;
+    }
+
+    snapshotName = findSnapshotVolume( lvName, vg );
+    if ( snapshotName != NULL )
+    {
+        LogInfo( "\"%s\" is a snapshot; reading it through \"%s\"", lvName, snapshotName );
+        lvName = snapshotName;
+    }
+    lv = loadLogicalVolume( drive, lvName, vg, 0 );
+    free( snapshotName );
+
+    return lv;
+}
+
+/**
+ * findLogicalVolume(), for a volume that may be a leg of another.
+ * @param vg     the volume group's node in the metadata
+ * @param depth  how many volumes this one is nested inside
+ */
+static tLogicalVolume * loadLogicalVolume( tDrive * drive, const char * lvName, tNode * vg, int depth )
 {
     tPhysicalVolume * physicalVolume;
-    tLogicalVolumeSegment * segments;
+    tLogicalVolume  * lv;
 
-    physicalVolume = calloc( sizeof(tPhysicalVolume),1 );
-    physicalVolume->drive = drive;
+    /* everything that describes the volume comes from its own arena, and goes with it */
+    tArena * arena = newArena( kVolumeArenaBlockSize );
+    if ( !isHeapPtr( arena ) )
+    {
+        return NULL;
+    }
+    lv = arenaAlloc( arena, sizeof( tLogicalVolume ) );
+    physicalVolume = arenaAlloc( arena, sizeof(tPhysicalVolume) );
+    if ( lv == NULL || physicalVolume == NULL )
+    {
+        freeArena( arena );
+        return NULL;
+    }
+    lv->arena           = arena;
+    lv->name            = arenaStrndup( arena, lvName, strlen( lvName ) );
+    lv->physicalVolumes = physicalVolume;
 
-    tNode * extentSizeNode = getKeyPath( "extent_size", root );
+    tNode * extentSizeNode = getKeyPath( "extent_size", vg );
     if ( isValidPtr(extentSizeNode) && extentSizeNode->type == integerNode )
     {
-        physicalVolume->extentSize = extentSizeNode->integer * drive->sectorSize;
+        physicalVolume->extentSize = extentSizeNode->integer * kLVMSectorSize;
         DebugOut( "\n" );
         LogInfo( "extents are %ld KB long", physicalVolume->extentSize / 1024 );
     }
+    lv->extentSize = physicalVolume->extentSize;
 
-    tNode * physicalVolumes = getKeyPath( "physical_volumes", root );
-
-    DebugOut( "\n" );
-    LogInfo( "######## physical volumes ########\n" );
-    dumpNodeTree( physicalVolumes );
+    tNode * physicalVolumes = getKeyPath( "physical_volumes", vg );
 
     if ( isValidPtr(physicalVolumes) && physicalVolumes->type == childNode )
     {
-        forEachNode( physicalVolumes, physVolCallback, (void *)physicalVolume );
-        dumpPhysicalVolume(physicalVolume);
+        forEachNode( physicalVolumes, physVolCallback, (void *)lv );
+
+        /* now it's been parsed */
+        DebugOut( "\n" );
+        LogInfo( "######## physical volumes ########\n" );
+        dumpNodeTree( physicalVolumes );
+        for ( tPhysicalVolume * pv = physicalVolume; pv != NULL; pv = pv->next )
+        {
+            dumpPhysicalVolume( pv );
+        }
     }
 
-    tNode * logicalVolume = getKeyPath( "logical_volumes", root );
-    logicalVolume = getKeyPath( lvName, logicalVolume );
+    /* give each physical volume a small integer id, so nothing past here needs its name,
+       and find the drive it's on */
+    for ( tPhysicalVolume * pv = physicalVolume; pv != NULL; pv = pv->next )
+    {
+        for ( tDrive * d = drive; d != NULL && pv->drive == NULL && pv->id != NULL; d = d->next )
+        {
+            if ( isSamePVId( pv->id, d->pvId ) )
+            {
+                pv->drive = d;
+                LogInfo( "physical volume \"%s\" is on \"%s\"", pv->name, d->path );
+            }
+        }
+        pv->index    = lv->pvCount++;
+        pv->nameHash = (pv->name != NULL) ? hashString( pv->name ) : 0;
+    }
+    lv->pvTable = arenaAlloc( lv->arena, lv->pvCount * sizeof( tPhysicalVolume * ) );
+    if ( lv->pvTable == NULL )
+    {
+        freeLogicalVolume( lv );
+        return NULL;
+    }
+    for ( tPhysicalVolume * pv = physicalVolume; pv != NULL; pv = pv->next )
+    {
+        lv->pvTable[ pv->index ] = pv;
+    }
 
-    DebugOut( "\n" );
-    LogInfo( "######## logical volume ########\n" );
-    dumpNodeTree( logicalVolume );
+    tNode * logicalVolume = getKeyPath( "logical_volumes", vg );
+    if ( isValidPtr( logicalVolume ) )
+    {
+        logicalVolume = getKeyPath( lvName, logicalVolume );
+    }
+    if ( !isValidPtr( logicalVolume ) )
+    {
+        LogError( "logical volume \"%s\" was not found", lvName );
+        freeLogicalVolume( lv );
+        return NULL;
+    }
 
     tNode * segmentCountNode = getKeyPath( "segment_count", logicalVolume );
     int segmentCount = 0;
@@ -894,25 +1848,52 @@ tMemoryBlock * readLogicalVolume( tDrive * drive, const char * lvName, tNode * r
         else
             LogInfo( "there are %d segments", segmentCount);
 
-        segments = calloc( sizeof(tLogicalVolumeSegment), segmentCount );
-        forEachNode( logicalVolume, logVolCallback, segments );
+        tLogicalVolumeSegment * segments = arenaAlloc( lv->arena, sizeof(tLogicalVolumeSegment) * segmentCount );
+        if ( segments == NULL )
+        {
+            freeLogicalVolume( lv );
+            return NULL;
+        }
+        lv->segments     = segments;
+        lv->segmentCount = segmentCount;
+        forEachNode( logicalVolume, logVolCallback, lv );
+
+        DebugOut( "\n" );
+        LogInfo( "######## logical volume ########\n" );
+        dumpNodeTree( logicalVolume );
+
         for (int i = 0; i < segmentCount; ++i)
         {
-            for (int j = 0; j < segments[i].stripeCount; ++j)
+            if ( segments[i].type == segmentMirror || segments[i].type == segmentParity )
             {
-                tPhysicalVolume * pv = physicalVolume;
-                while ( isValidPtr(pv) )
-                {
-                    if ( strcmp( segments[i].stripes[j].pvName, pv->name ) == 0 )
-                    {
-                        segments[i].stripes[j].physicalVolume = pv;
-                        break;
-                    }
-                    pv = pv->next;
-                }
+                loadSegmentLegs( drive, vg, lv, &segments[i], i + 1, depth );
+            }
+            if ( segments[i].type == segmentThinPool && depth == 0 )
+            {
+                LogError( "\"%s\" is a thin pool; read the thin volumes in it instead", lvName );
+                freeLogicalVolume( lv );
+                return NULL;
+            }
+            if ( segments[i].type == segmentThin || segments[i].type == segmentThinPool
+              || segments[i].type == segmentSnapshot )
+            {
+                loadSegmentVolumes( drive, vg, lv, &segments[i], i + 1, depth );
+            }
+            if ( checkSegment( lv, &segments[i], i + 1 ) < 0 )
+            {
+                freeLogicalVolume( lv );
+                return NULL;
+            }
+            uint64_t end = (segments[ i ].startExtent + segments[ i ].extentCount) * lv->extentSize;
+            if ( end > lv->length )
+            {
+                lv->length = end;
             }
         }
 
+        /* the metadata lists them in order, but nothing guarantees it */
+        qsort( segments, segmentCount, sizeof( tLogicalVolumeSegment ), compareSegments );
+
 #ifdef optDebugOutput
         for ( int i = 0; i < segmentCount; ++i )
         {
@@ -922,41 +1903,93 @@ tMemoryBlock * readLogicalVolume( tDrive * drive, const char * lvName, tNode * r
 #endif
     }
 
+    if ( buildExtentIndex( lv ) < 0 )
+    {
+        freeLogicalVolume( lv );
+        return NULL;
+    }
+    return lv;
+}
+
+/**
+ * Release a logical volume found by findLogicalVolume(), and the physical volumes
+ * it refers to.
+ */
+void freeLogicalVolume( tLogicalVolume * lv )
+{
+    if ( lv != NULL )
+    {
+        for ( int i = 0; i < lv->segmentCount; ++i )
+        {
+            for ( int j = 0; j < lv->segments[i].legCount; ++j )
+            {
+                freeLogicalVolume( lv->segments[i].legs[j].lv );
+            }
+
+            /* these refer to the volumes below, so go first */
+            closeThinDevice( lv->segments[i].thin );
+            closeSnapshot( lv->segments[i].snapshot );
+            tMirrorLeg * volumes[] = { &lv->segments[i].thinPool, &lv->segments[i].poolData, &lv->segments[i].poolMetadata,
+                                       &lv->segments[i].origin, &lv->segments[i].cowStore };
+            for ( size_t j = 0; j < sizeof( volumes ) / sizeof( volumes[0] ); ++j )
+            {
+                freeLogicalVolume( volumes[j]->lv );
+            }
+        }
+        freeExtentIndex( lv );
+
+        /* the volume itself, its segments, physical volumes and names are all in here */
+        freeArena( lv->arena );
+    }
+}
+
+/**
+ * @return where a stripe's data starts, as a byte offset into its physical volume's partition
+ */
+off64_t getStripeOffset( tLogicalVolume * lv, tStripe * stripe )
+{
+    return (stripe->physicalVolume->peStart * kLVMSectorSize)
+         + (stripe->startExtent * lv->extentSize);
+}
+
+tMemoryBlock * readLogicalVolume( tDrive * drive, const char * lvName, tNode * root )
+{
+    tLogicalVolume * lv = findLogicalVolume( drive, lvName, root );
+    if ( lv == NULL )
+    {
+        return NULL;
+    }
+
     /* now we have enough information to actually read the segments into memory */
 
     tMemoryBlock * buffer = malloc( sizeof( tMemoryBlock ) );
 
-    /** @todo this code assumes one stripe per segment */
     if ( isHeapPtr( buffer ) )
     {
-        buffer->length = 0;
-        for ( int i = 0; i < segmentCount; ++i )
-        {
-            buffer->length += segments[ i ].extentCount * segments[ i ].stripes->physicalVolume->extentSize;
-        }
-        buffer->ptr  = malloc( buffer->length );
+        buffer->length = lv->length;
+        buffer->ptr    = allocDriveBuffer( drive, buffer->length );
         if ( isValidPtr( buffer->ptr ) )
         {
-            for ( int i = 0; i < segmentCount; ++i )
-            {
-                tStripe * stripe = segments[ i ].stripes;
-                physicalVolume = stripe->physicalVolume;
+            /* read the segments in the order they sit on the disk, not in logical order */
+            tReadPlan * plan = newReadPlan();
 
-                off64_t   extentSize = physicalVolume->extentSize;
-                off64_t   offset     = (physicalVolume->peStart * physicalVolume->drive->sectorSize)
-                                     + (stripe->startExtent * extentSize);
-
-                tMemoryBlock destBlock;
-                destBlock.ptr    = &buffer->ptr[ segments[i].startExtent * extentSize ];
-                destBlock.length = segments[i].extentCount * extentSize;
-
-                LogInfo( "extentSize = %ld (%1.2f MB)", extentSize, extentSize/1048576.0 );
-                LogInfo( "    offset = %ld (%ld extents)", offset , offset / extentSize);
-
-                readDrive( stripe->physicalVolume->drive, offset, destBlock.ptr, destBlock.length );
+            if ( !isHeapPtr( plan )
+              || addVolumeToPlan( plan, lv, buffer->ptr ) < 0
+              || executeReadPlan( plan ) < 0 )
+            {
+                LogError( "failed to read all of logical volume \"%s\"", lvName );
+                free( buffer->ptr );
+                buffer->ptr = NULL;
             }
+            freeReadPlan( plan );
+        }
+        if ( !isValidPtr( buffer->ptr ) )
+        {
+            free( buffer );
+            buffer = NULL;
         }
     }
+    freeLogicalVolume( lv );
 
     return (buffer);
-}
\ No newline at end of file
+}
@@ -5,6 +5,8 @@
 #ifndef READLOGICALVOLUME_PARSEMETADATA_H
 #define READLOGICALVOLUME_PARSEMETADATA_H
 
+#include "metadataScan.h"
+
 typedef enum
 {
     childNode = 1,
@@ -13,17 +15,39 @@ typedef enum
     integerNode
 } tNodeType;
 
+/*
+    Keys and strings aren't copied out of the metadata text: they're views
+    into it, and aren't zero-terminated, so always go by their lengths. A
+    string's escapes (\" and \\) are left in it. The text has to outlive
+    the tree parsed from it.
+
+    Sections ('key { ... }') are parsed lazily: all the parse keeps of one
+    at first is where its text is, and its nodes are only built when a
+    search goes into it. So a tree changes as it's searched: getKey(),
+    getKeyPath(), forEachNode(), findLogicalVolume(), readLogicalVolume()
+    and lvOpen() all write to it, without any locking, so none of them may
+    be called on the same tree from more than one thread at once. Once a
+    volume's been found, reading it doesn't go back to the tree, so the
+    threads that do that are free to run alongside each other.
+*/
 typedef struct tNode
 {
     struct tNode * next;
     tHash          hash;
-    tStringZ     * key;
+    const char   * key;
+    size_t         keyLength;
     tNodeType      type;
+    struct tNodeIndex * index;      /* child and list nodes with many children: those, by hash */
+    struct tUnparsed  * unparsed;   /* a child node whose children haven't been parsed yet */
     union
     {
         struct tNode * child;
         struct tNode * list;
-        tStringZ     * string;
+        struct
+        {
+            const char * string;
+            size_t       stringLength;
+        };
         int64_t        integer;
     };
 } tNode;
@@ -34,28 +58,109 @@ typedef struct tPhysicalVolume {
     struct tPhysicalVolume * next;
     tDrive                 * drive;
     char                   * name;
+    tHash                    nameHash;
+    unsigned                 index;     /* into tLogicalVolume.pvTable */
     char                   * id;
     char                   * dev;
     size_t   extentSize;    /* in bytes */
     uint64_t devSize;
-    tExtent  peStart;   /* start of the region containing extents, in sectors from the beginning of the partition */
+    tExtent  peStart;   /* start of the region containing extents, in 512-byte sectors from the beginning of the partition */
     long     peCount;
 } tPhysicalVolume;
 
 typedef struct tStripe {
     tStringZ        * pvName;
     tPhysicalVolume * physicalVolume;
+    unsigned          pvId;             /* physicalVolume->index */
     tExtent           startExtent;
 } tStripe;
 
+typedef enum {
+    segmentStriped = 0,     /* 'striped' or 'linear': the data is on the stripes */
+    segmentMirror,          /* 'mirror' or 'raid1': every leg holds a full copy */
+    segmentParity,          /* 'raid4', 'raid5...' or 'raid6...': striped across the legs, plus parity */
+    segmentThin,            /* 'thin': blocks handed out by a thin pool as they're written */
+    segmentThinPool,        /* 'thin-pool': only read through the thin volumes in it */
+    segmentSnapshot,        /* 'snapshot': an origin volume, as it was, from its COW store */
+    segmentUnsupported
+} tSegmentType;
+
+/* where the parity goes, row by row, in a segmentParity segment (as md names them) */
+typedef enum {
+    raidParityFirst = 0,    /* raid4 */
+    raidParityLast,         /* raid5_n, raid6_n_6 */
+    raidLeftAsymmetric,     /* raid5_la, raid6_la_6 */
+    raidRightAsymmetric,    /* raid5_ra, raid6_ra_6 */
+    raidLeftSymmetric,      /* raid5_ls (raid5), raid6_ls_6 */
+    raidRightSymmetric,     /* raid5_rs, raid6_rs_6 */
+    raidZeroRestart,        /* raid6_zr (raid6) */
+    raidNRestart,           /* raid6_nr */
+    raidNContinue           /* raid6_nc */
+} tRaidLayout;
+
+/* md won't assemble an array with more legs than this */
+#define kMaxRaidLegs    64
+
+/* one leg of a mirrored or raid segment: another logical volume, e.g. an _rimage or _mimage */
+typedef struct tMirrorLeg {
+    tStringZ              * lvName;
+    struct tLogicalVolume * lv;         /* NULL if it can't be read */
+    tExtent                 startExtent;
+} tMirrorLeg;
+
+/* mirrored reads take turns between the legs in strides of this many bytes */
+#define kMirrorStride   (4 * 1024 * 1024)
+
+typedef struct tArena tArena;
+typedef struct tThinDevice tThinDevice;
+typedef struct tSnapshot tSnapshot;
+
 typedef struct tLogicalVolumeSegment {
-    tExtent   startExtent;
-    long      extentCount;
-    long      stripeCount;
-    tStripe * stripes;
+    tExtent      startExtent;
+    long         extentCount;
+    tSegmentType type;
+    long         stripeCount;
+    uint64_t     stripeSize;    /* in bytes; the data is spread across the stripes in chunks this big,
+                                   or for a thin pool or snapshot, handed out in blocks this big */
+    tStripe    * stripes;
+    int          legCount;
+    int          usableLegs;    /* mirrors: the legs that can be read are sorted to the front */
+    tMirrorLeg * legs;          /* parity: in order, with a NULL lv for each that's missing */
+    int          parityCount;   /* parity: 1 for raid4/5, 2 for raid6 */
+    tRaidLayout  layout;
+    tMirrorLeg   thinPool;      /* thin: the pool it's in */
+    uint64_t     deviceId;      /* thin: which of the pool's volumes it is */
+    tThinDevice * thin;         /* thin: its block mappings; see thinPool.c */
+    tMirrorLeg   poolData;      /* thin-pool: the sub-volume holding the blocks (_tdata) */
+    tMirrorLeg   poolMetadata;  /* thin-pool: the one holding the mappings (_tmeta) */
+    tMirrorLeg   origin;        /* snapshot: the volume it's a snapshot of */
+    tMirrorLeg   cowStore;      /* snapshot: the volume holding the chunks changed since */
+    tSnapshot  * snapshot;      /* snapshot: which those are; see snapshot.c */
 } tLogicalVolumeSegment;
 
-tNode         * parseMetadata( tTextBlock * metadata );
-tMemoryBlock * readLogicalVolume( tDrive * drive, const char * lvName, tNode * root );
+typedef struct tExtentIndexEntry tExtentIndexEntry;
+
+typedef struct tLogicalVolume {
+    const char            * name;
+    size_t                  extentSize;         /* in bytes */
+    uint64_t                length;             /* in bytes */
+    int                     segmentCount;
+    tLogicalVolumeSegment * segments;           /* sorted by startExtent */
+    tPhysicalVolume       * physicalVolumes;
+    unsigned                pvCount;
+    tPhysicalVolume      ** pvTable;            /* physical volumes by index */
+    uint64_t              * indexStarts;        /* see extentIndex.c */
+    tExtentIndexEntry     * indexEntries;
+    tArena                * arena;              /* holds this, and everything above but the index */
+} tLogicalVolume;
+
+tNode          * parseMetadata( tTextBlock * metadata, tArena * arena );
+tNode          * parseMetadataText( tArena * arena, const byte * text, size_t length, tScanClassifier classify, int lazy );
+int              isSameTree( tNode * a, tNode * b );
+tNode          * getKeyPath( const char * keyPath, tNode * root );
+tLogicalVolume * findLogicalVolume( tDrive * drive, const char * lvName, tNode * root );
+void             freeLogicalVolume( tLogicalVolume * lv );
+off64_t          getStripeOffset( tLogicalVolume * lv, tStripe * stripe );
+tMemoryBlock   * readLogicalVolume( tDrive * drive, const char * lvName, tNode * root );
 
 #endif //READLOGICALVOLUME_PARSEMETADATA_H
@@ -0,0 +1,779 @@
+/*
+    Reading raid4, raid5 and raid6 segments.
+
+    The layouts follow md's raid5_compute_sector(). For raid4/5, and the
+    raid6 '_6' layouts, P rotates (or not) across the legs as raid5 would
+    have it, and a raid6 array just adds Q on the last leg. The raid6
+    'zr', 'nr' and 'nc' layouts rotate P and Q together, and come from
+    DDF, which also numbers the data for Q by leg rather than by position
+    in the row.
+
+    A missing chunk of data is rebuilt from the same range of every other
+    leg in its row: from P alone if it's there, else from Q, and if two
+    chunks of data are missing, from both:
+
+        Dx = P' ^ ...                           (P' = P ^ the data we have)
+        Dx = Q' / g^x                           (Q' = Q ^ g^n.Dn for the data we have)
+        Dx = (g^y.P' ^ Q') / (g^x ^ g^y)        (Dy is missing too)
+
+    All of which is done with two kernels, working a block at a time: one
+    that xors a block into another, and one that multiplies a block by a
+    constant in GF(2^8) and xors it into another. The multiply splits each
+    byte into nibbles, and looks up the product of each with a 16 entry
+    table in a vector register (pshufb, or tbl on ARM), so a whole vector
+    is multiplied at once. Which kernels are used is decided at run time,
+    by what the CPU supports.
+*/
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+    #include <immintrin.h>
+    #define optParityX86
+#elif defined( __aarch64__ )
+    #include <arm_neon.h>
+    #define optParityNeon
+#endif
+
+#include "readlogicalvolume.h"
+#include "debug.h"
+#include "stringHash.h"
+#include "readaccess.h"
+#include "parseMetadata.h"
+#include "lvAccess.h"
+#include "extentIndex.h"
+#include "raidParity.h"
+
+/* the GF(2^8) that raid6 uses: x^8 + x^4 + x^3 + x^2 + 1, with generator 2 */
+#define kGFPolynomial   0x11d
+
+typedef struct
+{
+    const char * name;
+    void (* xorBlock)( byte * dest, const byte * src, size_t length );
+    void (* mulXorBlock)( byte * dest, const byte * src, byte factor, size_t length );
+} tParityKernels;
+
+static byte gfExp[ 512 ];   /* doubled, so a sum of two logs needs no reduction */
+static byte gfLog[ 256 ];
+
+static tParityKernels gKernels;
+static pthread_once_t gKernelsOnce = PTHREAD_ONCE_INIT;
+
+static byte gfMul( byte a, byte b )
+{
+    return (a == 0 || b == 0) ? 0 : gfExp[ gfLog[ a ] + gfLog[ b ] ];
+}
+
+static byte gfInverse( byte a )
+{
+    return gfExp[ 255 - gfLog[ a ] ];
+}
+
+/* the products of factor with every value of the low nibble, and of the high nibble */
+static void gfNibbleTables( byte factor, byte low[16], byte high[16] )
+{
+    for ( int i = 0; i < 16; ++i )
+    {
+        low[ i ]  = gfMul( factor, i );
+        high[ i ] = gfMul( factor, i << 4 );
+    }
+}
+
+/* ---- portable kernels, which the vector ones also use for their tails ---- */
+
+static void xorBlockScalar( byte * dest, const byte * src, size_t length )
+{
+    size_t i = 0;
+
+    for ( ; i + sizeof( uint64_t ) <= length; i += sizeof( uint64_t ) )
+    {
+        uint64_t d, s;
+        memcpy( &d, dest + i, sizeof( d ) );
+        memcpy( &s, src + i, sizeof( s ) );
+        d ^= s;
+        memcpy( dest + i, &d, sizeof( d ) );
+    }
+    for ( ; i < length; ++i )
+    {
+        dest[ i ] ^= src[ i ];
+    }
+}
+
+static void mulXorBlockScalar( byte * dest, const byte * src, byte factor, size_t length )
+{
+    byte low[16], high[16];
+
+    gfNibbleTables( factor, low, high );
+    for ( size_t i = 0; i < length; ++i )
+    {
+        dest[ i ] ^= low[ src[ i ] & 0x0f ] ^ high[ src[ i ] >> 4 ];
+    }
+}
+
+#ifdef optParityX86
+
+__attribute__(( target( "sse2" ) ))
+static void xorBlockSSE2( byte * dest, const byte * src, size_t length )
+{
+    size_t i = 0;
+
+    for ( ; i + 16 <= length; i += 16 )
+    {
+        __m128i d = _mm_loadu_si128( (const __m128i *)( dest + i ) );
+        __m128i s = _mm_loadu_si128( (const __m128i *)( src + i ) );
+        _mm_storeu_si128( (__m128i *)( dest + i ), _mm_xor_si128( d, s ) );
+    }
+    xorBlockScalar( dest + i, src + i, length - i );
+}
+
+__attribute__(( target( "ssse3" ) ))
+static void mulXorBlockSSSE3( byte * dest, const byte * src, byte factor, size_t length )
+{
+    byte   low[16], high[16];
+    size_t i = 0;
+
+    gfNibbleTables( factor, low, high );
+
+    __m128i lowTable  = _mm_loadu_si128( (const __m128i *) low );
+    __m128i highTable = _mm_loadu_si128( (const __m128i *) high );
+    __m128i mask      = _mm_set1_epi8( 0x0f );
+
+    for ( ; i + 16 <= length; i += 16 )
+    {
+        __m128i s  = _mm_loadu_si128( (const __m128i *)( src + i ) );
+        __m128i lo = _mm_and_si128( s, mask );
+        __m128i hi = _mm_and_si128( _mm_srli_epi64( s, 4 ), mask );
+        __m128i p  = _mm_xor_si128( _mm_shuffle_epi8( lowTable, lo ), _mm_shuffle_epi8( highTable, hi ) );
+        __m128i d  = _mm_loadu_si128( (const __m128i *)( dest + i ) );
+        _mm_storeu_si128( (__m128i *)( dest + i ), _mm_xor_si128( d, p ) );
+    }
+    mulXorBlockScalar( dest + i, src + i, factor, length - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+static void xorBlockAVX2( byte * dest, const byte * src, size_t length )
+{
+    size_t i = 0;
+
+    for ( ; i + 32 <= length; i += 32 )
+    {
+        __m256i d = _mm256_loadu_si256( (const __m256i *)( dest + i ) );
+        __m256i s = _mm256_loadu_si256( (const __m256i *)( src + i ) );
+        _mm256_storeu_si256( (__m256i *)( dest + i ), _mm256_xor_si256( d, s ) );
+    }
+    xorBlockScalar( dest + i, src + i, length - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+static void mulXorBlockAVX2( byte * dest, const byte * src, byte factor, size_t length )
+{
+    byte   low[16], high[16];
+    size_t i = 0;
+
+    gfNibbleTables( factor, low, high );
+
+    /* vpshufb looks up within each 128 bit lane, so both lanes get the table */
+    __m256i lowTable  = _mm256_broadcastsi128_si256( _mm_loadu_si128( (const __m128i *) low ) );
+    __m256i highTable = _mm256_broadcastsi128_si256( _mm_loadu_si128( (const __m128i *) high ) );
+    __m256i mask      = _mm256_set1_epi8( 0x0f );
+
+    for ( ; i + 32 <= length; i += 32 )
+    {
+        __m256i s  = _mm256_loadu_si256( (const __m256i *)( src + i ) );
+        __m256i lo = _mm256_and_si256( s, mask );
+        __m256i hi = _mm256_and_si256( _mm256_srli_epi64( s, 4 ), mask );
+        __m256i p  = _mm256_xor_si256( _mm256_shuffle_epi8( lowTable, lo ), _mm256_shuffle_epi8( highTable, hi ) );
+        __m256i d  = _mm256_loadu_si256( (const __m256i *)( dest + i ) );
+        _mm256_storeu_si256( (__m256i *)( dest + i ), _mm256_xor_si256( d, p ) );
+    }
+    mulXorBlockScalar( dest + i, src + i, factor, length - i );
+}
+
+#endif /* optParityX86 */
+
+#ifdef optParityNeon
+
+static void xorBlockNeon( byte * dest, const byte * src, size_t length )
+{
+    size_t i = 0;
+
+    for ( ; i + 16 <= length; i += 16 )
+    {
+        vst1q_u8( dest + i, veorq_u8( vld1q_u8( dest + i ), vld1q_u8( src + i ) ) );
+    }
+    xorBlockScalar( dest + i, src + i, length - i );
+}
+
+static void mulXorBlockNeon( byte * dest, const byte * src, byte factor, size_t length )
+{
+    byte   low[16], high[16];
+    size_t i = 0;
+
+    gfNibbleTables( factor, low, high );
+
+    uint8x16_t lowTable  = vld1q_u8( low );
+    uint8x16_t highTable = vld1q_u8( high );
+    uint8x16_t mask      = vdupq_n_u8( 0x0f );
+
+    for ( ; i + 16 <= length; i += 16 )
+    {
+        uint8x16_t s = vld1q_u8( src + i );
+        uint8x16_t p = veorq_u8( vqtbl1q_u8( lowTable, vandq_u8( s, mask ) ),
+                                 vqtbl1q_u8( highTable, vshrq_n_u8( s, 4 ) ) );
+        vst1q_u8( dest + i, veorq_u8( vld1q_u8( dest + i ), p ) );
+    }
+    mulXorBlockScalar( dest + i, src + i, factor, length - i );
+}
+
+#endif /* optParityNeon */
+
+/*
+    rebuildParityRange() can be called from any thread, and a buffer for what's
+    read from each leg, and another for the syndrome, are kept for each thread
+    that does, growing as needed, rather than allocated for every range.
+*/
+typedef struct tRebuildBuffers
+{
+    size_t  size;
+    byte  * scratch;
+    byte  * syndrome;
+} tRebuildBuffers;
+
+static pthread_key_t gBuffersKey;
+
+/* pthread key destructor: a thread that rebuilt data has finished */
+static void freeRebuildBuffers( void * arg )
+{
+    tRebuildBuffers * buffers = arg;
+
+    free( buffers->scratch );
+    free( buffers->syndrome );
+    free( buffers );
+}
+
+/* pthread_once(): build the field's tables, and pick the best kernels this CPU can run */
+static void initParity( void )
+{
+    unsigned value = 1;
+
+    for ( int i = 0; i < 255; ++i )
+    {
+        gfExp[ i ] = gfExp[ i + 255 ] = value;
+        gfLog[ value ] = i;
+        value <<= 1;
+        if ( value & 0x100 )
+        {
+            value ^= kGFPolynomial;
+        }
+    }
+    gfExp[ 510 ] = gfExp[ 511 ] = gfExp[ 0 ];
+
+    pthread_key_create( &gBuffersKey, freeRebuildBuffers );
+
+    gKernels = (tParityKernels) { "scalar", xorBlockScalar, mulXorBlockScalar };
+
+#ifdef optParityX86
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports( "avx2" ) )
+    {
+        gKernels = (tParityKernels) { "avx2", xorBlockAVX2, mulXorBlockAVX2 };
+    }
+    else if ( __builtin_cpu_supports( "ssse3" ) )
+    {
+        gKernels = (tParityKernels) { "ssse3", xorBlockSSE2, mulXorBlockSSSE3 };
+    }
+    else if ( __builtin_cpu_supports( "sse2" ) )
+    {
+        gKernels = (tParityKernels) { "sse2", xorBlockSSE2, mulXorBlockScalar };
+    }
+#endif
+#ifdef optParityNeon
+    gKernels = (tParityKernels) { "neon", xorBlockNeon, mulXorBlockNeon };
+#endif
+
+    LogInfo( "using the %s parity kernels", gKernels.name );
+}
+
+/**
+ * @return the name of the instruction set the parity kernels use
+ */
+const char * getParityKernelName( void )
+{
+    pthread_once( &gKernelsOnce, initParity );
+    return gKernels.name;
+}
+
+/**
+ * Where P and each chunk of data go in a row of a raid5 layout (or of a raid6
+ * '_6' layout, leaving out the last leg, which is Q's).
+ *
+ * @param legs  how many legs P and the data rotate across
+ */
+static void getRaid5Row( tRaidLayout layoutType, int legs, uint64_t row, tRaidRow * layout )
+{
+    int dataLegs = legs - 1;
+    int parity;
+
+    switch ( layoutType )
+    {
+    case raidParityFirst:       parity = 0;                          break;
+    case raidLeftAsymmetric:
+    case raidLeftSymmetric:     parity = dataLegs - (int)(row % legs); break;
+    case raidRightAsymmetric:
+    case raidRightSymmetric:    parity = (int)(row % legs);           break;
+    case raidParityLast:
+    default:                    parity = dataLegs;                   break;
+    }
+
+    layout->parity = parity;
+    for ( int i = 0; i < dataLegs; ++i )
+    {
+        switch ( layoutType )
+        {
+        case raidLeftSymmetric:
+        case raidRightSymmetric:
+            /* the data carries on from just after P, wrapping round */
+            layout->data[ i ] = (parity + 1 + i) % legs;
+            break;
+        default:
+            /* the data is in leg order, stepping over P */
+            layout->data[ i ] = (i >= parity) ? i + 1 : i;
+            break;
+        }
+    }
+}
+
+/**
+ * Where P, Q and each chunk of data go in a row of a raid6 'zr', 'nr' or 'nc' layout.
+ */
+static void getRotatingRow( tRaidLayout layoutType, int legs, uint64_t row, tRaidRow * layout )
+{
+    int dataLegs = legs - 2;
+    int parity, syndrome;
+
+    if ( layoutType == raidNContinue )
+    {
+        /* left symmetric, with Q just before P */
+        parity   = legs - 1 - (int)(row % legs);
+        syndrome = (parity + legs - 1) % legs;
+        for ( int i = 0; i < dataLegs; ++i )
+        {
+            layout->data[ i ] = (parity + 1 + i) % legs;
+        }
+    }
+    else
+    {
+        /* zr starts with P on the first leg and moves right; nr starts with it on the
+           second to last, and moves left. Q follows P, wrapping round to the first leg */
+        if ( layoutType == raidZeroRestart )
+        {
+            parity = (int)(row % legs);
+        }
+        else
+        {
+            parity = legs - 1 - (int)((row + 1) % legs);
+        }
+        syndrome = (parity == legs - 1) ? 0 : parity + 1;
+        for ( int i = 0; i < dataLegs; ++i )
+        {
+            if ( parity == legs - 1 )
+            {
+                layout->data[ i ] = i + 1;
+            }
+            else
+            {
+                layout->data[ i ] = (i >= parity) ? i + 2 : i;
+            }
+        }
+    }
+    layout->parity   = parity;
+    layout->syndrome = syndrome;
+}
+
+/**
+ * Work out which leg holds what in one row of a raid4/5/6 segment.
+ *
+ * @param segment  the segment
+ * @param row      which row: the chunk number / the number of data legs
+ * @param layout   filled in
+ */
+void getRaidRow( const tLogicalVolumeSegment * segment, uint64_t row, tRaidRow * layout )
+{
+    int legs = segment->legCount;
+    int ddf  = 0;
+
+    if ( segment->parityCount == 2
+      && (segment->layout == raidZeroRestart || segment->layout == raidNRestart
+       || segment->layout == raidNContinue) )
+    {
+        getRotatingRow( segment->layout, legs, row, layout );
+        ddf = 1;
+    }
+    else
+    {
+        getRaid5Row( segment->layout, legs - (segment->parityCount - 1), row, layout );
+        layout->syndrome = (segment->parityCount == 2) ? legs - 1 : -1;
+    }
+
+    /* Q's coefficients. DDF numbers the data by leg; md by position, counting
+       from the leg after Q, so the first chunk of data in the row isn't always 0 */
+    for ( int i = 0; i < legs; ++i )
+    {
+        layout->slot[ i ] = ddf ? i : 0;
+    }
+    if ( !ddf && layout->syndrome >= 0 )
+    {
+        int leg  = (layout->syndrome == legs - 1) ? 0 : layout->syndrome + 1;
+        int slot = 0;
+        for ( int i = 0; i < legs; ++i, leg = (leg + 1) % legs )
+        {
+            if ( leg != layout->parity && leg != layout->syndrome )
+            {
+                layout->slot[ leg ] = slot++;
+            }
+        }
+    }
+}
+
+/**
+ * @return this thread's buffers, at least length bytes each, or NULL
+ */
+static tRebuildBuffers * getRebuildBuffers( size_t length )
+{
+    tRebuildBuffers * buffers = pthread_getspecific( gBuffersKey );
+
+    if ( buffers == NULL )
+    {
+        buffers = calloc( sizeof( tRebuildBuffers ), 1 );
+        if ( !isHeapPtr( buffers ) || pthread_setspecific( gBuffersKey, buffers ) != 0 )
+        {
+            free( buffers );
+            return NULL;
+        }
+    }
+    if ( buffers->size < length )
+    {
+        free( buffers->scratch );
+        free( buffers->syndrome );
+        buffers->scratch  = malloc( length );
+        buffers->syndrome = malloc( length );
+        buffers->size     = (isHeapPtr( buffers->scratch ) && isHeapPtr( buffers->syndrome )) ? length : 0;
+        if ( buffers->size == 0 )
+        {
+            return NULL;
+        }
+    }
+    return buffers;
+}
+
+/*
+    Read a range of a leg, at the same offset into it as the chunk we're
+    rebuilding. It goes straight to the drive: the block cache is for the
+    metadata, and a leg's data is only wanted the once.
+*/
+static int readLeg( tLogicalVolumeSegment * segment, int leg, uint64_t legOffset, byte * dest, size_t length )
+{
+    tLogicalVolume * legLV  = segment->legs[ leg ].lv;
+    uint64_t         offset = segment->legs[ leg ].startExtent * legLV->extentSize + legOffset;
+
+    while ( length > 0 )
+    {
+        tExtentRun run;
+        if ( findExtentRun( legLV, offset, &run ) < 0 || run.rebuild )
+        {
+            return -1;
+        }
+        size_t count = run.length < length ? run.length : length;
+
+        if ( run.physicalVolume == NULL )
+        {
+            memset( dest, 0, count );
+        }
+        else if ( readDriveExtent( run.physicalVolume->drive, run.offset, dest, count ) != (ssize_t) count )
+        {
+            return -1;
+        }
+        offset += count;
+        dest   += count;
+        length -= count;
+    }
+    return 0;
+}
+
+/**
+ * Work out how to rebuild a chunk of data from the rest of its row: which legs
+ * are summed into what, and how the sums are combined at the end.
+ *
+ * @param missing  bit n is set for each leg that can't be used; includes the target
+ * @return 0, or -1 if too much of the row is missing
+ */
+static int planRowRebuild( const tLogicalVolumeSegment * segment, const tRaidRow * layout, int target,
+                           uint64_t missing, tParityRebuild * rebuild )
+{
+    int dataLegs     = segment->legCount - segment->parityCount;
+    int missingData  = 0;
+    int otherMissing = -1;
+
+    for ( int i = 0; i < dataLegs; ++i )
+    {
+        int leg = layout->data[ i ];
+        if ( missing & (1ULL << leg) )
+        {
+            ++missingData;
+            if ( leg != target )
+            {
+                otherMissing = leg;
+            }
+        }
+    }
+
+    int haveP = !(missing & (1ULL << layout->parity));
+    int haveQ = layout->syndrome >= 0 && !(missing & (1ULL << layout->syndrome));
+    int useP  = haveP;
+    int useQ  = haveQ && (missingData == 2 || !haveP);
+
+    if ( missingData > 2 || (missingData == 2 && !(haveP && haveQ)) || (!useP && !useQ) )
+    {
+        return -1;
+    }
+
+    /* the result collects P', and Q' goes in the syndrome - or in the result, if there's no P */
+    byte * qFactor = useP ? rebuild->syndromeFactor : rebuild->destFactor;
+
+    memset( rebuild->destFactor, 0, sizeof( rebuild->destFactor ) );
+    memset( rebuild->syndromeFactor, 0, sizeof( rebuild->syndromeFactor ) );
+    if ( useP )
+    {
+        rebuild->destFactor[ layout->parity ] = 1;
+    }
+    if ( useQ )
+    {
+        qFactor[ layout->syndrome ] = 1;
+    }
+    for ( int i = 0; i < dataLegs; ++i )
+    {
+        int leg = layout->data[ i ];
+        if ( missing & (1ULL << leg) )
+        {
+            continue;
+        }
+        if ( useP )
+        {
+            rebuild->destFactor[ leg ] = 1;
+        }
+        if ( useQ )
+        {
+            qFactor[ leg ] = gfExp[ layout->slot[ leg ] ];
+        }
+    }
+
+    byte gx = gfExp[ layout->slot[ target ] ];
+    rebuild->needsSyndrome = useP && useQ;
+    rebuild->syndromeScale = 0;
+    if ( !useQ )
+    {
+        /* the result is P', which is the missing data */
+        rebuild->destScale = 1;
+    }
+    else if ( !useP )
+    {
+        rebuild->destScale = gfInverse( gx );
+    }
+    else
+    {
+        byte gy     = gfExp[ layout->slot[ otherMissing ] ];
+        byte factor = gfInverse( gx ^ gy );
+        rebuild->destScale     = gfMul( gy, factor );
+        rebuild->syndromeScale = factor;
+    }
+    return 0;
+}
+
+/**
+ * Work out how to rebuild data in a raid4/5/6 segment that's on a missing leg,
+ * from the same range of the rest of its row. The caller reads those, adds each
+ * to the sum with addToParityRebuild(), and finishes with finishParityRebuild().
+ *
+ * @param within  byte offset from the start of the segment
+ * @param length  number of bytes wanted; rebuild->length stops at the end of the chunk
+ * @return 0, or -1 if too much of the row is missing
+ */
+int getParityRebuild( tLogicalVolumeSegment * segment, uint64_t within, size_t length, tParityRebuild * rebuild )
+{
+    int      dataLegs = segment->legCount - segment->parityCount;
+    uint64_t chunk    = within / segment->stripeSize;
+    uint64_t inChunk  = within % segment->stripeSize;
+    uint64_t row      = chunk / dataLegs;
+    uint64_t missing;
+    tRaidRow layout;
+
+    pthread_once( &gKernelsOnce, initParity );
+
+    rebuild->legOffset = row * segment->stripeSize + inChunk;
+    rebuild->length    = (length < segment->stripeSize - inChunk) ? length : segment->stripeSize - inChunk;
+
+    getRaidRow( segment, row, &layout );
+    int target = layout.data[ chunk % dataLegs ];
+
+    missing = 1ULL << target;
+    for ( int i = 0; i < segment->legCount; ++i )
+    {
+        if ( segment->legs[ i ].lv == NULL )
+        {
+            missing |= 1ULL << i;
+        }
+    }
+    return planRowRebuild( segment, &layout, target, missing, rebuild );
+}
+
+/**
+ * Add a leg's share of a row to one of a rebuild's sums: the sum, or the syndrome.
+ * @param factor  from tParityRebuild.destFactor or .syndromeFactor, for the leg
+ */
+void addToParityRebuild( byte * sum, const byte * src, byte factor, size_t length )
+{
+    if ( factor == 1 )
+    {
+        gKernels.xorBlock( sum, src, length );
+    }
+    else
+    {
+        gKernels.mulXorBlock( sum, src, factor, length );
+    }
+}
+
+/**
+ * Turn the sums into the missing data, once the whole row is in them. The
+ * arithmetic is byte by byte, so a range can be finished in pieces.
+ *
+ * @param sum       has the data put in it
+ * @param syndrome  if rebuild->needsSyndrome
+ */
+void finishParityRebuild( const tParityRebuild * rebuild, byte * sum, const byte * syndrome, size_t length )
+{
+    /* multiplying in place by c is xoring in the block times c ^ 1 */
+    if ( rebuild->destScale != 1 )
+    {
+        gKernels.mulXorBlock( sum, sum, rebuild->destScale ^ 1, length );
+    }
+    if ( rebuild->needsSyndrome )
+    {
+        gKernels.mulXorBlock( sum, syndrome, rebuild->syndromeScale, length );
+    }
+}
+
+/**
+ * Rebuild part of a chunk of data from the rest of its row.
+ *
+ * @param missing    bit n is set for each leg that can't be used; includes the target
+ * @param failedLeg  set to the leg that couldn't be read, if that's why it failed
+ * @return 0 if it was rebuilt, -1 if not
+ */
+static int rebuildChunk( tLogicalVolumeSegment * segment, const tRaidRow * layout, int target,
+                         uint64_t missing, uint64_t legOffset, byte * dest, size_t length,
+                         tRebuildBuffers * buffers, int * failedLeg )
+{
+    tParityRebuild rebuild;
+
+    *failedLeg = -1;
+    if ( planRowRebuild( segment, layout, target, missing, &rebuild ) < 0 )
+    {
+        return -1;
+    }
+
+    memset( dest, 0, length );
+    memset( buffers->syndrome, 0, length );
+    for ( int leg = 0; leg < segment->legCount; ++leg )
+    {
+        if ( rebuild.destFactor[ leg ] == 0 && rebuild.syndromeFactor[ leg ] == 0 )
+        {
+            continue;
+        }
+        if ( readLeg( segment, leg, legOffset, buffers->scratch, length ) < 0 )
+        {
+            *failedLeg = leg;
+            return -1;
+        }
+        if ( rebuild.destFactor[ leg ] != 0 )
+        {
+            addToParityRebuild( dest, buffers->scratch, rebuild.destFactor[ leg ], length );
+        }
+        if ( rebuild.syndromeFactor[ leg ] != 0 )
+        {
+            addToParityRebuild( buffers->syndrome, buffers->scratch, rebuild.syndromeFactor[ leg ], length );
+        }
+    }
+    finishParityRebuild( &rebuild, dest, buffers->syndrome, length );
+    return 0;
+}
+
+/**
+ * Rebuild data in a raid4/5/6 segment from the rest of its row, because the leg
+ * it's on is missing, or couldn't be read. Anything else in the row that can't
+ * be read is worked round too, as far as the parity allows.
+ *
+ * @param segment  the segment
+ * @param within   byte offset from the start of the segment
+ * @param dest     where to put the data
+ * @param length   number of bytes wanted
+ * @return the number of bytes rebuilt, which stops at the end of the chunk, or -1
+ */
+ssize_t rebuildParityRange( tLogicalVolumeSegment * segment, uint64_t within, void * dest, size_t length )
+{
+    int      dataLegs  = segment->legCount - segment->parityCount;
+    uint64_t chunk     = within / segment->stripeSize;
+    uint64_t inChunk   = within % segment->stripeSize;
+    uint64_t row       = chunk / dataLegs;
+    uint64_t legOffset = row * segment->stripeSize + inChunk;
+    uint64_t missing   = 0;
+    tRaidRow layout;
+
+    pthread_once( &gKernelsOnce, initParity );
+
+    if ( length > segment->stripeSize - inChunk )
+    {
+        length = segment->stripeSize - inChunk;
+    }
+
+    getRaidRow( segment, row, &layout );
+    int target = layout.data[ chunk % dataLegs ];
+
+    missing = 1ULL << target;
+    for ( int i = 0; i < segment->legCount; ++i )
+    {
+        if ( segment->legs[ i ].lv == NULL )
+        {
+            missing |= 1ULL << i;
+        }
+    }
+
+    tRebuildBuffers * buffers = getRebuildBuffers( length );
+    if ( buffers == NULL )
+    {
+        return -1;
+    }
+
+    /* a leg that fails to read joins the missing ones, and we try again without it */
+    for ( int attempt = 0; attempt <= segment->parityCount; ++attempt )
+    {
+        int failedLeg;
+        if ( rebuildChunk( segment, &layout, target, missing, legOffset, dest, length, buffers, &failedLeg ) == 0 )
+        {
+            return length;
+        }
+        if ( failedLeg < 0 )
+        {
+            break;
+        }
+        missing |= 1ULL << failedLeg;
+    }
+    return -1;
+}
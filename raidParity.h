@@ -0,0 +1,51 @@
+/*
+    Reading raid4, raid5 and raid6 segments.
+
+    The data is dealt out across the legs a chunk at a time, as for a
+    striped segment, but each row also has a P chunk (the xor of the row's
+    data) and, for raid6, a Q chunk (a Reed-Solomon syndrome over GF(2^8)).
+    Which leg holds what in each row depends on the layout, which is md's.
+
+    Data on a leg that's missing, or that can't be read, is rebuilt from
+    the rest of its row: on its own, by rebuildParityRange(), or by a read
+    plan, as it comes across the rest of the row in its sweep over the
+    drives. The xor and GF(2^8) kernels are vectorized, and picked to suit
+    the CPU the first time they're needed.
+*/
+
+#ifndef READLOGICALVOLUME_RAIDPARITY_H
+#define READLOGICALVOLUME_RAIDPARITY_H
+
+/* which leg holds which chunk, in one row of a segment */
+typedef struct tRaidRow {
+    int parity;                     /* the leg holding P */
+    int syndrome;                   /* the leg holding Q, or -1 for raid4/5 */
+    int data[ kMaxRaidLegs ];       /* the leg holding each chunk of data, in logical order */
+    int slot[ kMaxRaidLegs ];       /* by leg: the power of the generator its data is multiplied by in Q */
+} tRaidRow;
+
+/*
+    How to rebuild a range of a chunk of data on a missing leg, from the same
+    range of the rest of its row: each leg that's needed is multiplied by a
+    factor and xored into the sum, or into a second sum, the syndrome (a
+    factor of 0 means it isn't); then the sum is multiplied by destScale,
+    and the syndrome times syndromeScale is xored into it.
+*/
+typedef struct tParityRebuild {
+    uint64_t legOffset;                         /* where the range is, on every leg */
+    size_t   length;                            /* stops at the end of the chunk */
+    byte     destFactor[ kMaxRaidLegs ];        /* by leg */
+    byte     syndromeFactor[ kMaxRaidLegs ];
+    int      needsSyndrome;
+    byte     destScale;
+    byte     syndromeScale;
+} tParityRebuild;
+
+void         getRaidRow( const tLogicalVolumeSegment * segment, uint64_t row, tRaidRow * layout );
+int          getParityRebuild( tLogicalVolumeSegment * segment, uint64_t within, size_t length, tParityRebuild * rebuild );
+void         addToParityRebuild( byte * sum, const byte * src, byte factor, size_t length );
+void         finishParityRebuild( const tParityRebuild * rebuild, byte * sum, const byte * syndrome, size_t length );
+ssize_t      rebuildParityRange( tLogicalVolumeSegment * segment, uint64_t within, void * dest, size_t length );
+const char * getParityKernelName( void );
+
+#endif //READLOGICALVOLUME_RAIDPARITY_H
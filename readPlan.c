@@ -0,0 +1,1152 @@
+/*
+    Physical-order read scheduling.
+
+    Each segment contributes a piece: a drive, a physical range, and where
+    that data belongs - in memory, or at an offset in an output file. When
+    the plan is executed, the pieces are sorted by drive and device offset,
+    and the physical ranges they cover are cut into requests of at most
+    drive->chunkSize bytes. Each part of the disk is read exactly once,
+    even when several pieces (from several volumes) want it, and the
+    requests are queued on the asynchronous reader in ascending order, so
+    the device sees one sequential sweep, with drive->queueDepth requests
+    in flight.
+
+    Each drive's requests are read on a thread of their own, so a volume
+    striped or spread across several drives is read from all of them at
+    once, while each drive still sees a single sequential sweep.
+
+    A request whose pieces are all in memory, and tile it exactly, is a
+    single scatter read straight into place. Anything else is read into a
+    staging buffer, then copied or pwrite()n out to each piece that wants
+    part of it.
+
+    If a request can't be read, and the pieces that wanted it are in a
+    mirrored segment, their share of it is read from the other legs.
+
+    Data on a missing raid leg is rebuilt as the sweep goes. The same range
+    of each of the other legs it needs is added to the plan as a piece of
+    its own, which is summed into the rebuild as it's read; the rebuild is
+    finished, and delivered, when the last of them arrives. If one of them
+    can't be read, that rebuild is done again on its own, working round the
+    leg that failed, once everything else has been read.
+
+    If drive->threads is set, the requests are run on a work-stealing pool
+    of that many threads instead, each doing plain synchronous reads into
+    its own staging buffer, and writing the results out with pwrite().
+*/
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "readlogicalvolume.h"
+#include "debug.h"
+#include "stringHash.h"
+#include "readaccess.h"
+#include "asyncRead.h"
+#include "parseMetadata.h"
+#include "writeVolume.h"
+#include "workPool.h"
+#include "extentIndex.h"
+#include "lvAccess.h"
+#include "raidParity.h"
+#include "readPlan.h"
+
+/* preadv() and io_uring won't take more than this many buffers in one read */
+#define kMaxPlanVector  1024
+
+/* rebuilds share this many locks between them */
+#define kRebuildLocks   64
+
+typedef struct tPlanOutput
+{
+    int         fd;
+    uint64_t    length;         /* of the volume going to it */
+    unsigned    flags;          /* kWriteSparse */
+} tPlanOutput;
+
+typedef struct tPlanPiece
+{
+    tDrive    * drive;
+    off64_t     offset;         /* byte offset from the start of the partition */
+    size_t      length;
+    byte      * dest;           /* in memory, or NULL if it's going to an output, or a rebuild */
+    int         output;         /* index into tReadPlan.outputs */
+    off64_t     outputOffset;
+    tLogicalVolume * lv;        /* where it came from, to recover it if the read fails */
+    uint64_t    logical;        /* byte offset into lv */
+    int         rebuild;        /* index into tReadPlan.rebuilds if it's part of a row, or -1 */
+    size_t      rebuildOffset;  /* where it goes in the rebuild */
+    byte        factor;         /* what it's multiplied by on the way... */
+    int         intoSyndrome;   /* ...into the sum, or the syndrome */
+} tPlanPiece;
+
+/* data on a missing raid leg, being rebuilt from pieces of the rest of its row */
+typedef struct tPlanRebuild
+{
+    tParityRebuild parity;
+    byte      * dest;           /* in memory, or NULL if it's going to an output */
+    int         output;
+    off64_t     outputOffset;
+    tLogicalVolume * lv;
+    uint64_t    logical;
+    byte      * buffer;         /* from the plan's pool, for the sums that don't go straight to dest */
+    byte      * sum;            /* NULL until the first piece arrives */
+    byte      * syndrome;
+    size_t      remaining;      /* bytes still to come, across all its pieces */
+    int         done;
+    int         failed;         /* one of its pieces couldn't be read */
+} tPlanRebuild;
+
+/* part of a request, destined for part of a piece */
+typedef struct tPlanDelivery
+{
+    int         piece;
+    size_t      requestOffset;
+    size_t      pieceOffset;
+    size_t      length;
+} tPlanDelivery;
+
+typedef struct tPlanRequest
+{
+    struct tPlanGroup * group;
+    tDrive    * drive;
+    off64_t     offset;
+    size_t      length;
+    int         firstDelivery;  /* index into tReadPlan.deliveries */
+    int         deliveryCount;
+    int         firstVector;    /* index into tReadPlan.vectors, or -1 if it needs staging */
+    byte      * staging;
+} tPlanRequest;
+
+struct tReadPlan
+{
+    tPlanPiece    * pieces;
+    int             pieceCount;
+    int             pieceSpace;
+    tPlanRebuild  * rebuilds;
+    int             rebuildCount;
+    int             rebuildSpace;
+    size_t          rebuildSize;    /* the longest rebuild */
+    byte         ** freeBuffers;    /* a stack of rebuild buffers not in use, each two rebuildSize long */
+    int             freeBufferCount;
+    int             freeBufferSpace;
+    pthread_mutex_t bufferLock;
+    pthread_mutex_t rebuildLocks[ kRebuildLocks ];
+    tPlanOutput   * outputs;
+    int             outputCount;
+    int             outputSpace;
+    tPlanRequest  * requests;
+    int             requestCount;
+    int             requestSpace;
+    tPlanDelivery * deliveries;
+    int             deliveryCount;
+    int             deliverySpace;
+    struct iovec  * vectors;
+    int             vectorCount;
+    int             vectorSpace;
+    int             failed;
+    unsigned        workerCount;    /* the most worker threads used for any drive */
+    tWorkerStats    workerStats[ kMaxWorkers ];
+};
+
+/* the requests for one drive, which are read independently of any other drive's */
+typedef struct tPlanGroup
+{
+    tReadPlan     * plan;
+    tDrive        * drive;
+    tPlanRequest  * requests;
+    int             requestCount;
+    byte         ** freeStaging;    /* a stack of staging buffers not in use */
+    unsigned        freeStagingCount;
+    int             queued;         /* reads queued on the asynchronous reader... */
+    int             completed;      /* ...and how many of them have come back */
+    int             failed;
+    unsigned        workerCount;
+    tWorkerStats    workerStats[ kMaxWorkers ];
+    pthread_t       thread;
+    int             threadStarted;
+} tPlanGroup;
+
+/* for running a drive's requests on the work pool */
+typedef struct tPlanWork
+{
+    tPlanGroup    * group;
+    byte         ** staging;        /* one per worker */
+} tPlanWork;
+
+tReadPlan * newReadPlan( void )
+{
+    tReadPlan * plan = calloc( sizeof( tReadPlan ), 1 );
+
+    if ( isHeapPtr( plan ) )
+    {
+        pthread_mutex_init( &plan->bufferLock, NULL );
+        for ( int i = 0; i < kRebuildLocks; ++i )
+        {
+            pthread_mutex_init( &plan->rebuildLocks[ i ], NULL );
+        }
+    }
+    return plan;
+}
+
+/* grow one of the plan's arrays, if it's full. @return 0 on success, -1 if out of memory */
+static int makeRoom( void ** array, int * space, int count, size_t size )
+{
+    if ( count >= *space )
+    {
+        int    newSpace = (*space > 0) ? *space * 2 : 64;
+        void * grown    = realloc( *array, newSpace * size );
+        if ( !isHeapPtr( grown ) )
+        {
+            return -1;
+        }
+        *array = grown;
+        *space = newSpace;
+    }
+    return 0;
+}
+
+/**
+ * Add a range of data on a missing raid leg to the plan, to be rebuilt from a
+ * piece of each of the other legs it needs.
+ *
+ * @param within  byte offset from the start of the segment
+ * @return the number of bytes added, which stops at the end of the chunk, or -1
+ */
+static ssize_t addRebuild( tReadPlan * plan, tLogicalVolume * lv, tLogicalVolumeSegment * segment,
+                           uint64_t within, size_t length, byte * dest, int output, uint64_t logical )
+{
+    tParityRebuild parity;
+
+    if ( getParityRebuild( segment, within, length, &parity ) < 0 )
+    {
+        LogError( "unable to rebuild \"%s\" at offset %lu: too much of it is missing", lv->name, logical );
+        return -1;
+    }
+    if ( makeRoom( (void **) &plan->rebuilds, &plan->rebuildSpace, plan->rebuildCount, sizeof( tPlanRebuild ) ) < 0 )
+    {
+        return -1;
+    }
+    int            index   = plan->rebuildCount++;
+    tPlanRebuild * rebuild = &plan->rebuilds[ index ];
+
+    memset( rebuild, 0, sizeof( tPlanRebuild ) );
+    rebuild->parity       = parity;
+    rebuild->dest         = dest;
+    rebuild->output       = output;
+    rebuild->outputOffset = logical;
+    rebuild->lv           = lv;
+    rebuild->logical      = logical;
+    if ( parity.length > plan->rebuildSize )
+    {
+        plan->rebuildSize = parity.length;
+    }
+
+    for ( int leg = 0; leg < segment->legCount; ++leg )
+    {
+        if ( parity.destFactor[ leg ] == 0 && parity.syndromeFactor[ leg ] == 0 )
+        {
+            continue;
+        }
+        tLogicalVolume * legLV = segment->legs[ leg ].lv;
+        uint64_t         start = segment->legs[ leg ].startExtent * lv->extentSize + parity.legOffset;
+
+        for ( size_t done = 0; done < parity.length; )
+        {
+            tExtentRun run;
+            if ( findExtentRun( legLV, start + done, &run ) < 0 || run.rebuild )
+            {
+                LogError( "unable to rebuild \"%s\" at offset %lu", lv->name, logical );
+                return -1;
+            }
+            size_t count = run.length < parity.length - done ? run.length : parity.length - done;
+
+            /* a part of the leg that isn't backed by anything is zeros, which add nothing */
+            for ( int syndrome = 0; run.physicalVolume != NULL && syndrome < 2; ++syndrome )
+            {
+                byte factor = syndrome ? parity.syndromeFactor[ leg ] : parity.destFactor[ leg ];
+                if ( factor == 0 )
+                {
+                    continue;
+                }
+                if ( makeRoom( (void **) &plan->pieces, &plan->pieceSpace, plan->pieceCount, sizeof( tPlanPiece ) ) < 0 )
+                {
+                    return -1;
+                }
+                tPlanPiece * piece = &plan->pieces[ plan->pieceCount++ ];
+                piece->drive         = run.physicalVolume->drive;
+                piece->offset        = run.offset;
+                piece->length        = count;
+                piece->dest          = NULL;
+                piece->output        = -1;
+                piece->outputOffset  = 0;
+                piece->lv            = legLV;
+                piece->logical       = start + done;
+                piece->rebuild       = index;
+                piece->rebuildOffset = done;
+                piece->factor        = factor;
+                piece->intoSyndrome  = syndrome;
+                rebuild->remaining  += count;
+            }
+            done += count;
+        }
+    }
+
+    /* nothing to sum: it's all zeros */
+    if ( rebuild->remaining == 0 )
+    {
+        if ( dest != NULL )
+        {
+            memset( dest, 0, parity.length );
+        }
+        rebuild->done = 1;
+    }
+    return parity.length;
+}
+
+/**
+ * Add every segment of a logical volume to the plan. A linear segment is a
+ * single piece; a striped one is a piece per chunk, which the scheduler
+ * stitches back together into long runs down each stripe.
+ */
+static int addSegments( tReadPlan * plan, tLogicalVolume * lv, byte * dest, int output )
+{
+    for ( int i = 0; i < lv->segmentCount; ++i )
+    {
+        tLogicalVolumeSegment * segment = &lv->segments[ i ];
+        uint64_t start  = segment->startExtent * lv->extentSize;
+        uint64_t length = segment->extentCount * lv->extentSize;
+
+        for ( uint64_t within = 0; within < length; )
+        {
+            tExtentRun run;
+            mapSegmentOffset( lv, segment, within, &run );
+
+            if ( run.rebuild )
+            {
+                ssize_t added = addRebuild( plan, lv, segment, within, run.length,
+                                            (dest != NULL) ? &dest[ start + within ] : NULL, output, start + within );
+                if ( added < 0 )
+                {
+                    return -1;
+                }
+                within += added;
+                continue;
+            }
+            if ( run.physicalVolume == NULL )
+            {
+                /* not backed by anything: reads as zeros */
+                if ( dest != NULL )
+                {
+                    memset( &dest[ start + within ], 0, run.length );
+                }
+                within += run.length;
+                continue;
+            }
+
+            if ( makeRoom( (void **) &plan->pieces, &plan->pieceSpace, plan->pieceCount, sizeof( tPlanPiece ) ) < 0 )
+            {
+                return -1;
+            }
+            tPlanPiece * piece = &plan->pieces[ plan->pieceCount++ ];
+            piece->drive        = run.physicalVolume->drive;
+            piece->offset       = run.offset;
+            piece->length       = run.length;
+            piece->dest         = (dest != NULL) ? &dest[ start + within ] : NULL;
+            piece->output       = output;
+            piece->outputOffset = start + within;
+            piece->lv           = lv;
+            piece->logical      = start + within;
+            piece->rebuild      = -1;
+
+            within += run.length;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Add everything needed to assemble a logical volume in memory to the plan.
+ *
+ * @param plan  the plan
+ * @param lv    the logical volume
+ * @param dest  memory for the whole volume; lv->length bytes
+ * @return 0 on success, -1 if out of memory
+ */
+int addVolumeToPlan( tReadPlan * plan, tLogicalVolume * lv, byte * dest )
+{
+    return addSegments( plan, lv, dest, -1 );
+}
+
+/**
+ * Add everything needed to write a logical volume out to a file to the plan.
+ * The data is written with pwrite(), so the output must be seekable.
+ *
+ * @param plan   the plan
+ * @param lv     the logical volume
+ * @param fd     the output file
+ * @param flags  kWriteSparse to leave holes where the volume is zeros
+ * @return 0 on success, -1 if out of memory
+ */
+int addVolumeOutputToPlan( tReadPlan * plan, tLogicalVolume * lv, int fd, unsigned flags )
+{
+    if ( makeRoom( (void **) &plan->outputs, &plan->outputSpace, plan->outputCount, sizeof( tPlanOutput ) ) < 0 )
+    {
+        return -1;
+    }
+    tPlanOutput * output = &plan->outputs[ plan->outputCount ];
+    output->fd     = fd;
+    output->length = lv->length;
+    output->flags  = flags;
+
+    return addSegments( plan, lv, NULL, plan->outputCount++ );
+}
+
+/* qsort comparator: pieces by drive, then by device offset */
+static int comparePieces( const void * a, const void * b )
+{
+    const tPlanPiece * pieceA = a;
+    const tPlanPiece * pieceB = b;
+
+    if ( pieceA->drive != pieceB->drive )
+    {
+        return (pieceA->drive > pieceB->drive) - (pieceA->drive < pieceB->drive);
+    }
+    return (pieceA->offset > pieceB->offset) - (pieceA->offset < pieceB->offset);
+}
+
+static off64_t pieceEnd( const tPlanPiece * piece )
+{
+    return piece->offset + (off64_t) piece->length;
+}
+
+/**
+ * Work out which pieces want which parts of a request. If they're all in memory,
+ * and between them cover every byte exactly once, it can be read in place.
+ * @return 0 on success, -1 if out of memory
+ */
+static int addDeliveries( tReadPlan * plan, tPlanRequest * request, int first, int last )
+{
+    off64_t requestEnd = request->offset + (off64_t) request->length;
+    off64_t covered    = request->offset;     /* for the in-place check: how far the pieces tile it */
+    int     inPlace    = 1;
+
+    request->firstDelivery = plan->deliveryCount;
+    request->deliveryCount = 0;
+
+    for ( int i = first; i < last && plan->pieces[ i ].offset < requestEnd; ++i )
+    {
+        tPlanPiece * piece = &plan->pieces[ i ];
+        if ( pieceEnd( piece ) <= request->offset )
+        {
+            continue;
+        }
+
+        off64_t start = piece->offset > request->offset ? piece->offset : request->offset;
+        off64_t end   = pieceEnd( piece ) < requestEnd ? pieceEnd( piece ) : requestEnd;
+
+        if ( makeRoom( (void **) &plan->deliveries, &plan->deliverySpace,
+                       plan->deliveryCount, sizeof( tPlanDelivery ) ) < 0 )
+        {
+            return -1;
+        }
+        tPlanDelivery * delivery = &plan->deliveries[ plan->deliveryCount++ ];
+        delivery->piece         = i;
+        delivery->requestOffset = start - request->offset;
+        delivery->pieceOffset   = start - piece->offset;
+        delivery->length        = end - start;
+        ++request->deliveryCount;
+
+        if ( piece->dest == NULL || start != covered )
+        {
+            inPlace = 0;
+        }
+        covered = end;
+    }
+
+    request->firstVector = -1;
+    if ( inPlace && covered == requestEnd && request->deliveryCount <= kMaxPlanVector )
+    {
+        request->firstVector = plan->vectorCount;
+        for ( int i = 0; i < request->deliveryCount; ++i )
+        {
+            tPlanDelivery * delivery = &plan->deliveries[ request->firstDelivery + i ];
+            if ( makeRoom( (void **) &plan->vectors, &plan->vectorSpace,
+                           plan->vectorCount, sizeof( struct iovec ) ) < 0 )
+            {
+                return -1;
+            }
+            struct iovec * vector = &plan->vectors[ plan->vectorCount++ ];
+            vector->iov_base = plan->pieces[ delivery->piece ].dest + delivery->pieceOffset;
+            vector->iov_len  = delivery->length;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Sort the pieces, and cut the ranges they cover into requests.
+ * @return 0 on success, -1 if out of memory
+ */
+static int scheduleReads( tReadPlan * plan )
+{
+    int duplicated = 0;
+
+    qsort( plan->pieces, plan->pieceCount, sizeof( tPlanPiece ), comparePieces );
+
+    /* pieces that overlap or touch form a run, which is read once from end to end */
+    for ( int first = 0; first < plan->pieceCount; )
+    {
+        tDrive * drive = plan->pieces[ first ].drive;
+        off64_t  start = plan->pieces[ first ].offset;
+        off64_t  end   = pieceEnd( &plan->pieces[ first ] );
+        int      last  = first + 1;
+
+        while ( last < plan->pieceCount
+             && plan->pieces[ last ].drive == drive
+             && plan->pieces[ last ].offset <= end )
+        {
+            if ( plan->pieces[ last ].offset < end )
+            {
+                ++duplicated;
+            }
+            if ( pieceEnd( &plan->pieces[ last ] ) > end )
+            {
+                end = pieceEnd( &plan->pieces[ last ] );
+            }
+            ++last;
+        }
+
+        size_t maxLength = drive->chunkSize > 0 ? drive->chunkSize : kDefaultChunkSize;
+        int    skip      = first;   /* pieces before this end before the current request */
+
+        for ( off64_t offset = start; offset < end; offset += maxLength )
+        {
+            if ( makeRoom( (void **) &plan->requests, &plan->requestSpace,
+                           plan->requestCount, sizeof( tPlanRequest ) ) < 0 )
+            {
+                return -1;
+            }
+            tPlanRequest * request = &plan->requests[ plan->requestCount++ ];
+            request->group   = NULL;
+            request->drive   = drive;
+            request->offset  = offset;
+            request->length  = (end - offset) < (off64_t) maxLength ? (size_t)(end - offset) : maxLength;
+            request->staging = NULL;
+
+            while ( skip < last && pieceEnd( &plan->pieces[ skip ] ) <= offset )
+            {
+                ++skip;
+            }
+            if ( addDeliveries( plan, request, skip, last ) < 0 )
+            {
+                return -1;
+            }
+        }
+        first = last;
+    }
+
+    LogInfo( "read plan: %d pieces (%d sharing data, %d to rebuild) in %d requests",
+             plan->pieceCount, duplicated, plan->rebuildCount, plan->requestCount );
+    return 0;
+}
+
+/* pwrite() the lot, coping with short writes and interrupted system calls */
+static int pwriteFully( int fd, const byte * ptr, size_t length, off64_t offset )
+{
+    while ( length > 0 )
+    {
+        ssize_t wrLen = pwrite64( fd, ptr, length, offset );
+        if ( wrLen < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            return -1;
+        }
+        ptr    += wrLen;
+        offset += wrLen;
+        length -= wrLen;
+    }
+    return 0;
+}
+
+/* @return a buffer for a rebuild's sums, from the pool if there's one free, or NULL */
+static byte * takeRebuildBuffer( tReadPlan * plan )
+{
+    byte * buffer = NULL;
+
+    pthread_mutex_lock( &plan->bufferLock );
+    if ( plan->freeBufferCount > 0 )
+    {
+        buffer = plan->freeBuffers[ --plan->freeBufferCount ];
+    }
+    pthread_mutex_unlock( &plan->bufferLock );
+
+    if ( buffer == NULL )
+    {
+        buffer = malloc( 2 * plan->rebuildSize );
+        if ( !isHeapPtr( buffer ) )
+        {
+            buffer = NULL;
+        }
+    }
+    return buffer;
+}
+
+/* put a rebuild buffer back in the pool */
+static void giveRebuildBuffer( tReadPlan * plan, byte * buffer )
+{
+    pthread_mutex_lock( &plan->bufferLock );
+    if ( makeRoom( (void **) &plan->freeBuffers, &plan->freeBufferSpace,
+                   plan->freeBufferCount, sizeof( byte * ) ) == 0 )
+    {
+        plan->freeBuffers[ plan->freeBufferCount++ ] = buffer;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock( &plan->bufferLock );
+    free( buffer );
+}
+
+/* write a rebuilt range out, if it's going to an output. @return 0 on success, -1 on error */
+static int writeRebuild( tReadPlan * plan, tPlanRebuild * rebuild, const byte * data )
+{
+    if ( rebuild->dest != NULL )
+    {
+        return 0;
+    }
+
+    tPlanOutput * output = &plan->outputs[ rebuild->output ];
+    if ( (output->flags & kWriteSparse) && isAllZero( data, rebuild->parity.length ) )
+    {
+        return 0;
+    }
+    if ( pwriteFully( output->fd, data, rebuild->parity.length, rebuild->outputOffset ) < 0 )
+    {
+        LogError( "unable to write output (%d: %s)", errno, strerror( errno ) );
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Sum part of a piece of a row into its rebuild, and if that was the last of
+ * the row, finish the rebuild and deliver it.
+ * @return 0 on success, -1 on error
+ */
+static int addToRebuild( tReadPlan * plan, const tPlanPiece * piece, const byte * src, size_t pieceOffset, size_t length )
+{
+    tPlanRebuild    * rebuild = &plan->rebuilds[ piece->rebuild ];
+    pthread_mutex_t * lock    = &plan->rebuildLocks[ piece->rebuild % kRebuildLocks ];
+    size_t            at      = piece->rebuildOffset + pieceOffset;
+    int               finished;
+
+    pthread_mutex_lock( lock );
+    if ( rebuild->sum == NULL && !rebuild->failed )
+    {
+        /* the first piece to arrive: start the sums off at zero */
+        if ( rebuild->dest == NULL || rebuild->parity.needsSyndrome )
+        {
+            rebuild->buffer = takeRebuildBuffer( plan );
+            rebuild->failed = rebuild->buffer == NULL;
+        }
+        if ( !rebuild->failed )
+        {
+            rebuild->sum      = (rebuild->dest != NULL) ? rebuild->dest : rebuild->buffer;
+            rebuild->syndrome = rebuild->buffer + plan->rebuildSize;
+            memset( rebuild->sum, 0, rebuild->parity.length );
+            if ( rebuild->parity.needsSyndrome )
+            {
+                memset( rebuild->syndrome, 0, rebuild->parity.length );
+            }
+        }
+    }
+    if ( !rebuild->failed )
+    {
+        addToParityRebuild( (piece->intoSyndrome ? rebuild->syndrome : rebuild->sum) + at, src, piece->factor, length );
+        rebuild->remaining -= length;
+    }
+    finished = !rebuild->failed && rebuild->remaining == 0;
+    pthread_mutex_unlock( lock );
+
+    if ( !finished )
+    {
+        return 0;
+    }
+
+    /* nothing else touches it now */
+    finishParityRebuild( &rebuild->parity, rebuild->sum, rebuild->syndrome, rebuild->parity.length );
+    int result = writeRebuild( plan, rebuild, rebuild->sum );
+    if ( rebuild->buffer != NULL )
+    {
+        giveRebuildBuffer( plan, rebuild->buffer );
+        rebuild->buffer = NULL;
+    }
+    rebuild->done = 1;
+    return result;
+}
+
+/* a piece of a row couldn't be read: its rebuild will have to be done again afterwards */
+static void failRebuild( tReadPlan * plan, const tPlanPiece * piece )
+{
+    tPlanRebuild    * rebuild = &plan->rebuilds[ piece->rebuild ];
+    pthread_mutex_t * lock    = &plan->rebuildLocks[ piece->rebuild % kRebuildLocks ];
+    byte            * buffer;
+
+    pthread_mutex_lock( lock );
+    rebuild->failed = 1;
+    buffer          = rebuild->buffer;
+    rebuild->buffer = NULL;
+    pthread_mutex_unlock( lock );
+
+    if ( buffer != NULL )
+    {
+        giveRebuildBuffer( plan, buffer );
+    }
+}
+
+/**
+ * Rebuild the ranges whose pieces didn't all arrive, on their own. Each leg that
+ * can't be read is worked round, as far as the parity allows.
+ * @return 0 on success, -1 on error
+ */
+static int finishFailedRebuilds( tReadPlan * plan )
+{
+    byte * buffer = NULL;
+    int    result = 0;
+
+    for ( int i = 0; i < plan->rebuildCount && result == 0; ++i )
+    {
+        tPlanRebuild * rebuild = &plan->rebuilds[ i ];
+        if ( rebuild->done )
+        {
+            continue;
+        }
+        if ( rebuild->dest == NULL && buffer == NULL )
+        {
+            buffer = takeRebuildBuffer( plan );
+            if ( buffer == NULL )
+            {
+                return -1;
+            }
+        }
+
+        byte * target = (rebuild->dest != NULL) ? rebuild->dest : buffer;
+        result = recoverVolumeRange( rebuild->lv, rebuild->logical, target, rebuild->parity.length );
+        if ( result == 0 )
+        {
+            result = writeRebuild( plan, rebuild, target );
+        }
+    }
+    if ( buffer != NULL )
+    {
+        giveRebuildBuffer( plan, buffer );
+    }
+    return result;
+}
+
+/* hand a staged request's data out to the pieces that want it */
+static int deliverRequest( tReadPlan * plan, tPlanRequest * request )
+{
+    for ( int i = 0; i < request->deliveryCount; ++i )
+    {
+        tPlanDelivery * delivery = &plan->deliveries[ request->firstDelivery + i ];
+        tPlanPiece    * piece    = &plan->pieces[ delivery->piece ];
+        const byte    * src      = request->staging + delivery->requestOffset;
+
+        if ( piece->rebuild >= 0 )
+        {
+            if ( addToRebuild( plan, piece, src, delivery->pieceOffset, delivery->length ) < 0 )
+            {
+                return -1;
+            }
+            continue;
+        }
+        if ( piece->dest != NULL )
+        {
+            memcpy( piece->dest + delivery->pieceOffset, src, delivery->length );
+            continue;
+        }
+
+        tPlanOutput * output = &plan->outputs[ piece->output ];
+        if ( (output->flags & kWriteSparse) && isAllZero( src, delivery->length ) )
+        {
+            continue;
+        }
+        if ( pwriteFully( output->fd, src, delivery->length, piece->outputOffset + delivery->pieceOffset ) < 0 )
+        {
+            LogError( "unable to write output (%d: %s)", errno, strerror( errno ) );
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * A request couldn't be read: read each piece's share of it again from another
+ * mirror leg, into wherever the request would have put it. A piece of a row
+ * being rebuilt leaves that rebuild to be done again, without it, at the end.
+ * @return 0 if it was all recovered, -1 if not
+ */
+static int recoverRequest( tReadPlan * plan, tPlanRequest * request )
+{
+    for ( int i = 0; i < request->deliveryCount; ++i )
+    {
+        tPlanDelivery * delivery = &plan->deliveries[ request->firstDelivery + i ];
+        tPlanPiece    * piece    = &plan->pieces[ delivery->piece ];
+
+        if ( piece->rebuild >= 0 )
+        {
+            failRebuild( plan, piece );
+            continue;
+        }
+
+        byte * target = (request->staging != NULL) ? request->staging + delivery->requestOffset
+                                                   : piece->dest + delivery->pieceOffset;
+        if ( recoverVolumeRange( piece->lv, piece->logical + delivery->pieceOffset, target, delivery->length ) < 0 )
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* tReadCallback: a request has been read */
+static void requestRead( void * dest, size_t length, ssize_t result, void * cbData )
+{
+    tPlanRequest * request = cbData;
+    tPlanGroup   * group   = request->group;
+    (void) dest;
+
+    ++group->completed;
+    if ( result != (ssize_t) length && recoverRequest( group->plan, request ) < 0 )
+    {
+        group->failed = 1;
+    }
+    if ( request->staging != NULL )
+    {
+        if ( !group->failed && deliverRequest( group->plan, request ) < 0 )
+        {
+            group->failed = 1;
+        }
+        group->freeStaging[ group->freeStagingCount++ ] = request->staging;
+        request->staging = NULL;
+    }
+}
+
+/* tWorkFunction: read one request, and deliver it */
+static ssize_t runRequest( int task, unsigned worker, void * context )
+{
+    tPlanWork    * work    = context;
+    tReadPlan    * plan    = work->group->plan;
+    tPlanRequest * request = &work->group->requests[ task ];
+    ssize_t        rdLen;
+
+    if ( request->firstVector >= 0 )
+    {
+        rdLen = readDriveVector( request->drive, request->offset,
+                                 &plan->vectors[ request->firstVector ], request->deliveryCount );
+        if ( rdLen != (ssize_t) request->length )
+        {
+            rdLen = (recoverRequest( plan, request ) == 0) ? (ssize_t) request->length : -1;
+        }
+        return rdLen;
+    }
+
+    request->staging = work->staging[ worker ];
+    rdLen = readDriveExtent( request->drive, request->offset, request->staging, request->length );
+    if ( rdLen != (ssize_t) request->length )
+    {
+        rdLen = (recoverRequest( plan, request ) == 0) ? (ssize_t) request->length : -1;
+    }
+    if ( rdLen >= 0 && deliverRequest( plan, request ) < 0 )
+    {
+        rdLen = -1;
+    }
+    request->staging = NULL;
+    return rdLen;
+}
+
+/**
+ * Run one drive's requests on the work pool.
+ * @return 0 on success, -1 on error
+ */
+static int runRequestsOnPool( tPlanGroup * group )
+{
+    tDrive     * drive       = group->drive;
+    unsigned     threads     = drive->threads < kMaxWorkers ? drive->threads : kMaxWorkers;
+    size_t       stagingSize = drive->chunkSize > 0 ? drive->chunkSize : kDefaultChunkSize;
+    byte       * staging[ kMaxWorkers ];
+    tPlanWork    work = { group, staging };
+    int          result = 0;
+
+    for ( unsigned i = 0; i < threads; ++i )
+    {
+        staging[ i ] = allocDriveBuffer( drive, stagingSize );
+        if ( !isValidPtr( staging[ i ] ) )
+        {
+            result = -1;
+        }
+    }
+
+    if ( result == 0 )
+    {
+        LogInfo( "running %d requests on %u threads", group->requestCount, threads );
+        result = runWorkPool( threads, group->requestCount, runRequest, &work, group->workerStats );
+        group->workerCount = threads;
+    }
+
+    for ( unsigned i = 0; i < threads; ++i )
+    {
+        free( staging[ i ] );
+    }
+    return result;
+}
+
+/**
+ * Print what each worker thread did, if the plan ran on worker threads.
+ */
+void reportReadPlan( tReadPlan * plan, FILE * output )
+{
+    if ( plan->workerCount > 0 )
+    {
+        reportWorkerStats( output, plan->workerCount, plan->workerStats );
+    }
+}
+
+/**
+ * Read one drive's requests, in physical order, with drive->queueDepth in flight.
+ * @return NULL; group->failed is set on error
+ */
+static void * readGroup( void * arg )
+{
+    tPlanGroup * group = arg;
+    tReadPlan  * plan  = group->plan;
+    tDrive     * drive = group->drive;
+
+    if ( drive->threads > 0 )
+    {
+        group->failed = runRequestsOnPool( group ) < 0;
+        return NULL;
+    }
+
+    tAsyncReader * reader       = openAsyncReader( drive );
+    unsigned       stagingCount = (reader != NULL && drive->queueDepth > 0) ? drive->queueDepth : 1;
+    size_t         stagingSize  = drive->chunkSize > 0 ? drive->chunkSize : kDefaultChunkSize;
+    byte        ** staging      = calloc( stagingCount, sizeof( byte * ) );
+
+    group->freeStaging      = calloc( stagingCount, sizeof( byte * ) );
+    group->freeStagingCount = 0;
+    for ( unsigned i = 0; isHeapPtr( staging ) && isHeapPtr( group->freeStaging ) && i < stagingCount; ++i )
+    {
+        staging[ i ] = allocDriveBuffer( drive, stagingSize );
+        if ( isValidPtr( staging[ i ] ) )
+        {
+            group->freeStaging[ group->freeStagingCount++ ] = staging[ i ];
+        }
+    }
+    if ( group->freeStagingCount == 0 )
+    {
+        group->failed = 1;
+    }
+
+    for ( int i = 0; i < group->requestCount && !group->failed; ++i )
+    {
+        tPlanRequest * request = &group->requests[ i ];
+
+        if ( request->firstVector >= 0 )
+        {
+            struct iovec * vectors = &plan->vectors[ request->firstVector ];
+            if ( reader != NULL )
+            {
+                group->failed |= queueAsyncReadVector( reader, request->offset, vectors, request->deliveryCount,
+                                                       requestRead, request ) < 0;
+                group->queued += !group->failed;
+            }
+            else
+            {
+                requestRead( NULL, request->length,
+                             readDriveVector( drive, request->offset, vectors, request->deliveryCount ), request );
+            }
+            continue;
+        }
+
+        /* wait for a staging buffer to come free */
+        while ( group->freeStagingCount == 0 && !group->failed )
+        {
+            group->failed |= pollAsyncReads( reader, 1 ) < 0;
+        }
+        if ( group->failed )
+        {
+            break;
+        }
+        request->staging = group->freeStaging[ --group->freeStagingCount ];
+        if ( reader != NULL )
+        {
+            group->failed |= queueAsyncRead( reader, request->offset, request->staging, request->length,
+                                             requestRead, request ) < 0;
+            group->queued += !group->failed;
+        }
+        else
+        {
+            requestRead( request->staging, request->length,
+                         readDriveExtent( drive, request->offset, request->staging, request->length ), request );
+        }
+    }
+
+    if ( reader != NULL )
+    {
+        /* requestRead() has recovered any read that failed, or failed the group;
+           all that's left is to check that every read came back */
+        waitAsyncReads( reader );
+        group->failed |= group->completed < group->queued;
+        closeAsyncReader( reader );
+    }
+    for ( unsigned i = 0; isHeapPtr( staging ) && i < stagingCount; ++i )
+    {
+        free( staging[ i ] );
+    }
+    free( staging );
+    free( group->freeStaging );
+    group->freeStaging = NULL;
+
+    return NULL;
+}
+
+/**
+ * Read everything in the plan, in physical order, reading every drive at once.
+ *
+ * @return 0 on success, -1 on error
+ */
+int executeReadPlan( tReadPlan * plan )
+{
+    if ( scheduleReads( plan ) < 0 )
+    {
+        return -1;
+    }
+    plan->failed = 0;
+
+    /* requests are grouped by drive */
+    int groupCount = 0;
+    for ( int i = 0; i < plan->requestCount; ++i )
+    {
+        if ( i == 0 || plan->requests[ i ].drive != plan->requests[ i - 1 ].drive )
+        {
+            ++groupCount;
+        }
+    }
+
+    tPlanGroup * groups = calloc( groupCount > 0 ? groupCount : 1, sizeof( tPlanGroup ) );
+    if ( !isHeapPtr( groups ) )
+    {
+        return -1;
+    }
+
+    for ( int first = 0, g = 0; first < plan->requestCount; ++g )
+    {
+        tPlanGroup * group = &groups[ g ];
+        int          last  = first;
+
+        group->plan     = plan;
+        group->drive    = plan->requests[ first ].drive;
+        group->requests = &plan->requests[ first ];
+        while ( last < plan->requestCount && plan->requests[ last ].drive == group->drive )
+        {
+            plan->requests[ last++ ].group = group;
+        }
+        group->requestCount = last - first;
+        first = last;
+    }
+
+    /* one thread per drive beyond the first, which is read on this one */
+    for ( int g = 1; g < groupCount; ++g )
+    {
+        groups[ g ].threadStarted = pthread_create( &groups[ g ].thread, NULL, readGroup, &groups[ g ] ) == 0;
+    }
+    for ( int g = 0; g < groupCount; ++g )
+    {
+        if ( groups[ g ].threadStarted )
+        {
+            pthread_join( groups[ g ].thread, NULL );
+        }
+        else
+        {
+            readGroup( &groups[ g ] );
+        }
+    }
+
+    for ( int g = 0; g < groupCount; ++g )
+    {
+        tPlanGroup * group = &groups[ g ];
+
+        plan->failed |= group->failed;
+        for ( unsigned i = 0; i < group->workerCount; ++i )
+        {
+            plan->workerStats[ i ].tasks   += group->workerStats[ i ].tasks;
+            plan->workerStats[ i ].stolen  += group->workerStats[ i ].stolen;
+            plan->workerStats[ i ].bytes   += group->workerStats[ i ].bytes;
+            plan->workerStats[ i ].seconds += group->workerStats[ i ].seconds;
+        }
+        if ( group->workerCount > plan->workerCount )
+        {
+            plan->workerCount = group->workerCount;
+        }
+    }
+    free( groups );
+
+    if ( !plan->failed && finishFailedRebuilds( plan ) < 0 )
+    {
+        plan->failed = 1;
+    }
+
+    /* gaps, and holes at the end, still have to be part of each file */
+    for ( int i = 0; i < plan->outputCount && !plan->failed; ++i )
+    {
+        struct stat outputStat;
+        tPlanOutput * output = &plan->outputs[ i ];
+        if ( fstat( output->fd, &outputStat ) == 0 && S_ISREG( outputStat.st_mode )
+          && (uint64_t) outputStat.st_size < output->length
+          && ftruncate64( output->fd, output->length ) < 0 )
+        {
+            LogError( "unable to extend output (%d: %s)", errno, strerror( errno ) );
+            plan->failed = 1;
+        }
+    }
+
+    return plan->failed ? -1 : 0;
+}
+
+void freeReadPlan( tReadPlan * plan )
+{
+    if ( plan != NULL )
+    {
+        free( plan->pieces );
+        free( plan->outputs );
+        free( plan->requests );
+        free( plan->deliveries );
+        free( plan->vectors );
+        free( plan->rebuilds );
+        for ( int i = 0; i < plan->freeBufferCount; ++i )
+        {
+            free( plan->freeBuffers[ i ] );
+        }
+        free( plan->freeBuffers );
+        pthread_mutex_destroy( &plan->bufferLock );
+        for ( int i = 0; i < kRebuildLocks; ++i )
+        {
+            pthread_mutex_destroy( &plan->rebuildLocks[ i ] );
+        }
+        free( plan );
+    }
+}
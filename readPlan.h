@@ -0,0 +1,24 @@
+/*
+    Physical-order read scheduling.
+
+    A read plan gathers the physical ranges behind one or more logical
+    volumes, each bound for memory or for an output file, and reads them
+    in a single sweep across each drive, in ascending device order. A
+    fragmented volume is read without seeking back and forth, a range
+    that several volumes share is read only once, and adjacent ranges
+    are merged into scatter reads that land each piece in place.
+*/
+
+#ifndef READLOGICALVOLUME_READPLAN_H
+#define READLOGICALVOLUME_READPLAN_H
+
+typedef struct tReadPlan tReadPlan;
+
+tReadPlan * newReadPlan( void );
+int         addVolumeToPlan( tReadPlan * plan, tLogicalVolume * lv, byte * dest );
+int         addVolumeOutputToPlan( tReadPlan * plan, tLogicalVolume * lv, int fd, unsigned flags );
+int         executeReadPlan( tReadPlan * plan );
+void        reportReadPlan( tReadPlan * plan, FILE * output );
+void        freeReadPlan( tReadPlan * plan );
+
+#endif //READLOGICALVOLUME_READPLAN_H
@@ -3,35 +3,601 @@
 //
 
 #define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE     /* for O_DIRECT */
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <sys/file.h>
 #include <string.h>
 #include <endian.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
 #include <errno.h>
 
+#include "readlogicalvolume.h"
 #include "debug.h"
+#include "blockCache.h"
+
+/* the kernel's UIO_MAXIOV. IOV_MAX isn't visible without _XOPEN_SOURCE */
+#define kMaxIOVecCount  1024
+
+/* size of the bounce buffer used for unaligned transfers in direct i/o mode */
+#define kBounceBufferSize   (256 * 1024)
+
+/* the block cache under readDrive(), for the fd backend. Reads of kCacheBypassLength
+   or more are assumed to be extent data, which is read once, so they go around it */
+#define kCacheBlockSize     (64 * 1024)
+#define kCacheBlockCount    32
+#define kCacheBypassLength  (256 * 1024)
 
 /*********************************************************************************************
   drive access routines
 
-  In a bootloader, these three routines are likely to access eMMC or use a FTL directly.
-  For testing under Linux, we use standard i/o.
+  In a bootloader, these routines are likely to access eMMC or use a FTL directly.
+  For testing under Linux, every tDrive has a backend (tDriveOps): positional i/o
+  on a file descriptor (pread64/preadv64), a read-only mmap of the whole drive,
+  or an image held in memory. None of them has a 'current position', so a tDrive
+  may be shared by several reader threads. Nothing in a tDrive changes after
+  setPartition(), which is called during the probe phase, before any readers
+  are started.
+
+*****/
+
+/**
+ * find out the logical and physical sector sizes, and the size of the device.
+ * block devices can tell us directly. for image files, assume 512-byte logical
+ * sectors (readGPT() will notice if it's really a 4Kn image) and use the
+ * filesystem's preferred i/o size as the physical sector size.
+ */
+static int getDriveGeometry( tDrive * drive )
+{
+    struct stat st;
+
+    if ( fstat( drive->id, &st ) < 0 )
+    {
+        LogError( "unable to get the size of the drive (%d: %s)", errno, strerror(errno) );
+        return -1;
+    }
+
+    if ( S_ISBLK( st.st_mode ) )
+    {
+        int          logical;
+        unsigned int physical;
+        uint64_t     size;
+
+        if ( ioctl( drive->id, BLKSSZGET, &logical ) < 0
+          || ioctl( drive->id, BLKPBSZGET, &physical ) < 0
+          || ioctl( drive->id, BLKGETSIZE64, &size ) < 0 )
+        {
+            LogError( "unable to get the geometry of the drive (%d: %s)", errno, strerror(errno) );
+            return -1;
+        }
+        drive->sectorSize         = logical;
+        drive->physicalSectorSize = physical;
+        drive->partition.length   = size;
+        /* the kernel only insists on logical sector alignment for block devices */
+        drive->alignment          = logical;
+    }
+    else
+    {
+        drive->sectorSize         = 512;
+        drive->physicalSectorSize = st.st_blksize > 512 ? st.st_blksize : 512;
+        drive->partition.length   = st.st_size;
+        /* the filesystem may want more than 512 bytes; its block size is always enough */
+        drive->alignment          = drive->physicalSectorSize;
+    }
+    drive->partition.start = 0;
+
+    LogInfo( "sector size %ld logical, %ld physical", drive->sectorSize, drive->physicalSectorSize );
+    return 0;
+}
+
+/**
+ * How many threads are worth throwing at the drive. A spinning disk only has
+ * one set of heads, so more than one just makes it seek; anything else gets a
+ * thread per CPU.
+ *
+ * @return the suggested number of threads; at least 1
+ */
+unsigned getDriveParallelism( tDrive * drive )
+{
+    struct stat st;
+    long        cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    unsigned    result = cpus > 0 ? cpus : 1;
+
+    if ( drive->id >= 0 && fstat( drive->id, &st ) == 0 )
+    {
+        /* an image file lives on whatever device holds its filesystem */
+        dev_t dev = S_ISBLK( st.st_mode ) ? st.st_rdev : st.st_dev;
+        char  path[128];
+        FILE * file;
+
+        /* partitions don't have a queue directory of their own; their disk does */
+        snprintf( path, sizeof( path ), "/sys/dev/block/%u:%u/queue/rotational", major( dev ), minor( dev ) );
+        file = fopen( path, "r" );
+        if ( file == NULL )
+        {
+            snprintf( path, sizeof( path ), "/sys/dev/block/%u:%u/../queue/rotational", major( dev ), minor( dev ) );
+            file = fopen( path, "r" );
+        }
+        if ( file != NULL )
+        {
+            int rotational = 0;
+            if ( fscanf( file, "%d", &rotational ) == 1 && rotational )
+            {
+                result = 1;
+            }
+            fclose( file );
+        }
+    }
+    LogInfo( "drive parallelism: %u", result );
+    return result;
+}
+
+/**
+ * In direct i/o mode, the offset, length and buffer address of every read
+ * must be a multiple of drive->alignment. Otherwise, anything goes.
+ */
+int isDriveAligned( tDrive * drive, off64_t offset, const void * ptr, size_t length )
+{
+    size_t mask = drive->alignment - 1;
+
+    return ( ((drive->partition.start + offset) & mask) == 0
+          && ((uintptr_t) ptr & mask) == 0
+          && (length & mask) == 0 );
+}
+
+/**
+ * allocate a buffer aligned for direct i/o on any drive needing no more than alignment
+ * @return the buffer (release with free()), or NULL
+ */
+void * allocAlignedBuffer( size_t alignment, size_t length )
+{
+    void * result = NULL;
+
+    if ( alignment < sizeof( void * ) )
+    {
+        alignment = sizeof( void * );
+    }
+    int err = posix_memalign( &result, alignment, length );
+    if ( err != 0 )
+    {
+        LogError( "unable to allocate a %lu byte buffer (%d: %s)", length, err, strerror( err ) );
+        result = NULL;
+    }
+    return result;
+}
+
+/**
+ * allocate a buffer suitable for reading directly from the drive, without bouncing
+ * @return the buffer (release with free()), or NULL
+ */
+void * allocDriveBuffer( tDrive * drive, size_t length )
+{
+    return allocAlignedBuffer( drive->alignment, length );
+}
+
+void setPartition( tDrive * drive, off64_t offset, size_t length )
+{
+    drive->partition.start  = offset;
+    drive->partition.length = length;
+    LogInfo( "partition start %ld (%#lx), size %ld (%.2f MB)",
+         drive->partition.start,  drive->partition.start,
+         drive->partition.length, drive->partition.length / 1048576.0 );
+}
+
+/**
+ * check a request against the bounds of the partition
+ * @return true if the whole request lies inside the partition
+ */
+static int isInPartition( tDrive * drive, off64_t offset, size_t length )
+{
+    if ( offset < 0 || (offset + length) > drive->partition.length )
+    {
+        LogError( "read requested past the end of partition (%ld + %ld > %ld)",
+             offset, length, drive->partition.start + drive->partition.length );
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * the pread64() loop: retries short reads and EINTR, stops at the end of the device.
+ * position is an absolute device offset.
+ */
+static ssize_t readFully( tDrive * drive, off64_t position, void * dest, size_t length )
+{
+    byte  * p         = dest;
+    size_t  remaining = length;
+
+    while ( remaining > 0 )
+    {
+        ssize_t rdLen = pread64( drive->id, p, remaining, position );
+        if ( rdLen < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            LogError( "read @ offset %lu for %lu bytes failed (%d: %s)",
+                 position, remaining, errno, strerror( errno ) );
+            return -1;
+        }
+        if ( rdLen == 0 )
+        {
+            /* end of device */
+            break;
+        }
+        p         += rdLen;
+        position  += rdLen;
+        remaining -= rdLen;
+    }
+    return length - remaining;
+}
+
+/**
+ * Direct i/o version of readFully(). An unaligned head or tail is read into a
+ * sector-aligned bounce buffer and the wanted part copied out; the aligned middle
+ * goes straight into dest if dest is suitably aligned, and through the bounce
+ * buffer in kBounceBufferSize pieces if it isn't.
+ */
+static ssize_t readDirect( tDrive * drive, off64_t position, void * dest, size_t length )
+{
+    off64_t  mask      = drive->alignment - 1;
+    byte   * p         = dest;
+    size_t   remaining = length;
+    byte   * bounce    = allocDriveBuffer( drive, kBounceBufferSize );
+
+    if ( bounce == NULL )
+    {
+        return -1;
+    }
+
+    while ( remaining > 0 )
+    {
+        off64_t head   = position & mask;
+        size_t  rdSize;
+        ssize_t rdLen;
+
+        if ( head == 0 && remaining > (size_t) mask && ((uintptr_t) p & mask) == 0 )
+        {
+            /* aligned middle section, straight into the destination */
+            rdSize = remaining & ~mask;
+            rdLen  = readFully( drive, position, p, rdSize );
+            if ( rdLen < 0 )
+            {
+                free( bounce );
+                return -1;
+            }
+        }
+        else
+        {
+            /* go via the bounce buffer */
+            rdSize = ( head + remaining + mask ) & ~mask;
+            if ( rdSize > kBounceBufferSize )
+            {
+                rdSize = kBounceBufferSize;
+            }
+            rdLen = readFully( drive, position - head, bounce, rdSize );
+            if ( rdLen < 0 )
+            {
+                free( bounce );
+                return -1;
+            }
+            rdLen -= head;
+            if ( rdLen < 0 )
+            {
+                rdLen = 0;
+            }
+            if ( (size_t) rdLen > remaining )
+            {
+                rdLen = remaining;
+            }
+            memcpy( p, bounce + head, rdLen );
+            rdSize = rdSize - head < remaining ? rdSize - head : remaining;
+        }
+
+        p         += rdLen;
+        position  += rdLen;
+        remaining -= rdLen;
+
+        if ( (size_t) rdLen < rdSize )
+        {
+            /* end of device */
+            break;
+        }
+    }
+    free( bounce );
+
+    return length - remaining;
+}
+
+/* fd backend: plain or direct i/o through pread64() */
+static ssize_t fdRead( tDrive * drive, off64_t position, void * dest, size_t length )
+{
+    if ( drive->directIO && !isDriveAligned( drive, position - drive->partition.start, dest, length ) )
+    {
+        return readDirect( drive, position, dest, length );
+    }
+    return readFully( drive, position, dest, length );
+}
+
+/* direct i/o with unaligned buffers: each one goes through readDirect() in turn */
+static ssize_t readVectorUnaligned( tDrive * drive, off64_t offset, const struct iovec * iov, int count )
+{
+    ssize_t result = 0;
+    off64_t position = drive->partition.start + offset;
+
+    for ( int i = 0; i < count; ++i )
+    {
+        ssize_t rdLen = readDirect( drive, position, iov[i].iov_base, iov[i].iov_len );
+        if ( rdLen < 0 )
+        {
+            return -1;
+        }
+        result   += rdLen;
+        position += rdLen;
+        if ( (size_t) rdLen < iov[i].iov_len )
+        {
+            break;
+        }
+    }
+    return result;
+}
+
+/* fd backend: scatter through preadv64(), resuming partial transfers */
+static ssize_t fdReadVector( tDrive * drive, off64_t position, const struct iovec * iov, int count, size_t UNUSED(length) )
+{
+    ssize_t result = 0;
+
+    if ( drive->directIO )
+    {
+        off64_t offset = position - drive->partition.start;
+        for ( int i = 0; i < count; ++i )
+        {
+            if ( !isDriveAligned( drive, offset, iov[i].iov_base, iov[i].iov_len ) )
+            {
+                return readVectorUnaligned( drive, position - drive->partition.start, iov, count );
+            }
+            offset += iov[i].iov_len;
+        }
+    }
+
+    /* work on a copy, so partial transfers can be resumed without touching the caller's array */
+    struct iovec * vec = malloc( count * sizeof( struct iovec ) );
+    if ( !isHeapPtr( vec ) )
+    {
+        LogError( "unable to allocate an iovec[%d] (%d: %s)", count, errno, strerror( errno ) );
+        return -1;
+    }
+    memcpy( vec, iov, count * sizeof( struct iovec ) );
+
+    struct iovec * v         = vec;
+    int            remaining = count;
+
+    while ( remaining > 0 )
+    {
+        ssize_t rdLen = preadv64( drive->id, v, remaining < kMaxIOVecCount ? remaining : kMaxIOVecCount, position );
+        if ( rdLen < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            LogError( "vectored read @ offset %lu failed (%d: %s)",
+                 position, errno, strerror( errno ) );
+            result = -1;
+            break;
+        }
+        if ( rdLen == 0 )
+        {
+            /* end of device */
+            break;
+        }
+        result   += rdLen;
+        position += rdLen;
+
+        /* skip the buffers that were filled, and trim a partially-filled one */
+        while ( remaining > 0 && (size_t) rdLen >= v->iov_len )
+        {
+            rdLen -= v->iov_len;
+            ++v;
+            --remaining;
+        }
+        if ( remaining > 0 )
+        {
+            v->iov_base = (byte *) v->iov_base + rdLen;
+            v->iov_len -= rdLen;
+        }
+    }
+    free( vec );
+
+    return (result);
+}
+
+static void fdClose( tDrive * drive )
+{
+    if (drive->id >= 0)
+    {
+        close(drive->id);
+        drive->id = -1;
+    }
+}
+
+/* block cache miss: offset is absolute, and block aligned */
+static ssize_t fdCacheFill( void * context, off64_t offset, void * dest, size_t length )
+{
+    tDrive * drive = context;
+
+    LogInfo( "block cache miss, reading %#lx bytes @ %#lx", length, offset );
+    return fdRead( drive, offset, dest, length );
+}
+
+static const tDriveOps gFileDriveOps =
+{
+    "fd",
+    fdRead,
+    fdReadVector,
+    NULL,           /* no mapping - every read is a copy */
+    fdClose
+};
+
+/*********************************************************************************************
+  mmap and in-memory backends
+
+  Both keep the whole drive in our address space, so a read is just a memcpy,
+  and mapDrive() can hand out pointers straight into the image. The only
+  difference is where the image came from, and so how it's released.
 
 *****/
 
-tDrive * openDrive( const char *drivePath )
+static ssize_t imageRead( tDrive * drive, off64_t position, void * dest, size_t length )
+{
+    if ( (size_t) position >= drive->imageSize )
+    {
+        return 0;
+    }
+    if ( length > drive->imageSize - position )
+    {
+        length = drive->imageSize - position;
+    }
+    memcpy( dest, drive->image + position, length );
+    return length;
+}
+
+static ssize_t imageReadVector( tDrive * drive, off64_t position, const struct iovec * iov, int count, size_t UNUSED(length) )
+{
+    ssize_t result = 0;
+
+    for ( int i = 0; i < count; ++i )
+    {
+        ssize_t rdLen = imageRead( drive, position, iov[i].iov_base, iov[i].iov_len );
+        result   += rdLen;
+        position += rdLen;
+        if ( (size_t) rdLen < iov[i].iov_len )
+        {
+            break;
+        }
+    }
+    return result;
+}
+
+static const void * imageMap( tDrive * drive, off64_t position, size_t length )
+{
+    if ( (size_t) position > drive->imageSize || length > drive->imageSize - position )
+    {
+        return NULL;
+    }
+    return drive->image + position;
+}
+
+static void mappedClose( tDrive * drive )
+{
+    if ( drive->image != NULL )
+    {
+        munmap( drive->image, drive->imageSize );
+        drive->image = NULL;
+    }
+}
+
+static void memoryClose( tDrive * drive )
+{
+    if ( drive->ownsImage )
+    {
+        free( drive->image );
+    }
+    drive->image = NULL;
+}
+
+static const tDriveOps gMappedDriveOps =
+{
+    "mmap",
+    imageRead,
+    imageReadVector,
+    imageMap,
+    mappedClose
+};
+
+static const tDriveOps gMemoryDriveOps =
+{
+    "memory",
+    imageRead,
+    imageReadVector,
+    imageMap,
+    memoryClose
+};
+
+/* swap the descriptor for a read-only mapping of the whole drive */
+static int mapImage( tDrive * drive )
+{
+    drive->imageSize = drive->partition.length;
+    drive->image = mmap( NULL, drive->imageSize, PROT_READ, MAP_SHARED, drive->id, 0 );
+    if ( drive->image == MAP_FAILED )
+    {
+        LogError( "unable to map \'%s\' (%d: %s)", drive->path, errno, strerror( errno ) );
+        drive->image = NULL;
+        return -1;
+    }
+    madvise( drive->image, drive->imageSize, MADV_SEQUENTIAL );
+
+    close( drive->id );
+    drive->id  = -1;
+    drive->ops = &gMappedDriveOps;
+    return 0;
+}
+
+/* swap the descriptor for a copy of the whole drive in memory */
+static int loadImage( tDrive * drive )
+{
+    drive->imageSize = drive->partition.length;
+    drive->image = malloc( drive->imageSize );
+    if ( !isHeapPtr( drive->image ) )
+    {
+        LogError( "unable to allocate %lu bytes for an image of \'%s\'", drive->imageSize, drive->path );
+        return -1;
+    }
+    if ( readFully( drive, 0, drive->image, drive->imageSize ) != (ssize_t) drive->imageSize )
+    {
+        LogError( "unable to load \'%s\' into memory", drive->path );
+        free( drive->image );
+        drive->image = NULL;
+        return -1;
+    }
+
+    close( drive->id );
+    drive->id        = -1;
+    drive->ownsImage = 1;
+    drive->ops       = &gMemoryDriveOps;
+    return 0;
+}
+
+/**
+ * @param drivePath  path to a block device or an image file
+ * @param flags      kDriveDirectIO to bypass the page cache, kDriveMapped to mmap the
+ *                   drive, or kDriveInMemory to load the whole thing into memory
+ * @return the open drive, or NULL on failure
+ */
+tDrive * openDrive( const char *drivePath, unsigned flags )
 {
     tDrive * drive = calloc( sizeof(tDrive), 1 );
     if (drive != NULL)
     {
         drive->sectorSize = 512;
+        drive->alignment  = 1;
+        drive->engine     = ioEngineAuto;
+        drive->queueDepth = kDefaultQueueDepth;
+        drive->chunkSize  = kDefaultChunkSize;
+        drive->directIO   = (flags & (kDriveDirectIO | kDriveMapped | kDriveInMemory)) == kDriveDirectIO;
+        drive->ops        = &gFileDriveOps;
 
-        drive->id = open(drivePath, O_RDONLY);
+        drive->id = open(drivePath, O_RDONLY | (drive->directIO ? O_DIRECT : 0));
         if (drive->id < 0)
         {
             LogError( "unable to open \'%s\' (%d: %s)",
@@ -41,84 +607,234 @@ tDrive * openDrive( const char *drivePath )
         }
         else
         {
-            struct stat st;
-            if ( fstat( drive->id, &st) < 0 )
+            if ( getDriveGeometry( drive ) == 0 )
             {
-                LogError( "unable to get the size of the drive (%d: %s)", errno, strerror(errno) );
-            }
-            else
-            {
-                drive->partition.start  = 0;
-                drive->partition.length = 4096;
-                LogInfo( "drive size %ld (%.2f MB)",
+                LogInfo( "drive size %ld (%.2f MB)%s",
                      drive->partition.length,
-                     drive->partition.length / 1048576.0 );
+                     drive->partition.length / 1048576.0,
+                     drive->directIO ? ", direct i/o" : "" );
 
-                    drive->path = strdup(drivePath);
+                if ( !drive->directIO )
+                {
+                    drive->alignment = 1;
+                }
+
+                drive->path = strdup(drivePath);
                 if (drive->path == NULL)
                 {
                     LogError( "### unable to store the path \'%s\' (%d: %s)\n",
                         drivePath, errno, strerror(errno) );
+                    close(drive->id);
                     free(drive);
                     drive = NULL;
                 }
+                else if ( ((flags & kDriveMapped)   && mapImage( drive )  < 0)
+                       || ((flags & kDriveInMemory) && loadImage( drive ) < 0) )
+                {
+                    closeDrive( drive );
+                    free( (void *) drive->path );
+                    free( drive );
+                    drive = NULL;
+                }
+                else if ( drive->ops == &gFileDriveOps )
+                {
+                    /* the mmap and memory backends have no use for a cache. For the fd backend,
+                       it's an optimisation, so carry on without one if it can't be created */
+                    drive->cache = newBlockCache( kCacheBlockSize, kCacheBlockCount,
+                                                  drive->directIO ? drive->alignment : 0,
+                                                  fdCacheFill, drive );
+                }
             }
         }
     }
     return (drive);
 }
 
-void setPartition( tDrive * drive, off64_t offset, size_t length )
+/**
+ * Wrap an image that's already in memory as a drive. The caller keeps ownership
+ * of the image, which must outlive the drive. Handy for benchmarking the parser
+ * and extraction paths without any i/o at all.
+ *
+ * @param name    used in log messages
+ * @param image   the drive contents
+ * @param length  size of the image, in bytes
+ * @return the drive, or NULL on failure
+ */
+tDrive * openMemoryDrive( const char * name, void * image, size_t length )
 {
-    drive->partition.start  = offset;
-    drive->partition.length = length;
-    LogInfo( "partition start %ld (%#lx), size %ld (%.2f MB)",
-         drive->partition.start,  drive->partition.start,
-         drive->partition.length, drive->partition.length / 1048576.0 );
+    tDrive * drive = calloc( sizeof(tDrive), 1 );
+    if ( drive != NULL )
+    {
+        drive->id                 = -1;
+        drive->path               = strdup( name );
+        drive->sectorSize         = 512;
+        drive->physicalSectorSize = 512;
+        drive->alignment          = 1;
+        drive->engine             = ioEngineThreads;
+        drive->queueDepth         = kDefaultQueueDepth;
+        drive->chunkSize          = kDefaultChunkSize;
+        drive->partition.start    = 0;
+        drive->partition.length   = length;
+        drive->image              = image;
+        drive->imageSize          = length;
+        drive->ops                = &gMemoryDriveOps;
+    }
+    return drive;
 }
 
+/*********************************************************************************************
+  the public interface, which dispatches to whichever backend the drive uses
+
+*****/
+
+/**
+ * Positional read, relative to the start of the partition. On the fd backend this
+ * uses pread64(), so the file offset of drive->id is never touched, and any number
+ * of threads may read through the same tDrive at once. Short reads are retried
+ * until the full length has been transferred, or we hit the end of the device.
+ *
+ * In direct i/o mode, unaligned requests are handled transparently, though it's
+ * cheaper to use allocDriveBuffer() and sector-aligned offsets.
+ *
+ * Small reads go through the drive's block cache, if it has one.
+ *
+ * @param drive   the drive to read from
+ * @param offset  byte offset from the start of the partition
+ * @param dest    where to put the data
+ * @param length  number of bytes to read
+ * @return the number of bytes read, or -1 on failure
+ */
 ssize_t readDrive( tDrive * drive, off64_t offset, void * dest, size_t length )
 {
     ssize_t result = 0;
 
     LogInfo( "readDrive( offset %#lx, %ld (%#lx) bytes)", offset, length, length );
-    if ( drive != NULL )
+    if ( drive != NULL && isInPartition( drive, offset, length ) )
     {
-        if ( (offset + length) > drive->partition.length )
+        if ( drive->cache != NULL && length < kCacheBypassLength )
         {
-            LogError( "read requested past the end of partition (%ld + %ld > %ld)",
-                 offset, length, drive->partition.start + drive->partition.length );
+            result = readBlockCache( drive->cache, drive->partition.start + offset, dest, length );
         }
         else
         {
-            if ( lseek64( drive->id, drive->partition.start + offset, SEEK_SET ) < 0 )
-            {
-                LogError( "seek to offset %lu failed (%d: %s)",
-                     drive->partition.start + offset, errno, strerror( errno ) );
-            }
-            else
+            result = drive->ops->read( drive, drive->partition.start + offset, dest, length );
+        }
+    }
+    return (result);
+}
+
+/**
+ * Same as readDrive(), but never goes through the block cache. For bulk extent
+ * data, which is only read once, and would just push the metadata out.
+ */
+ssize_t readDriveExtent( tDrive * drive, off64_t offset, void * dest, size_t length )
+{
+    ssize_t result = 0;
+
+    LogInfo( "readDriveExtent( offset %#lx, %ld (%#lx) bytes)", offset, length, length );
+    if ( drive != NULL && isInPartition( drive, offset, length ) )
+    {
+        result = drive->ops->read( drive, drive->partition.start + offset, dest, length );
+    }
+    return (result);
+}
+
+/**
+ * Vectored positional read: one contiguous range of the partition is scattered
+ * across several destination buffers, in a single preadv64() where possible.
+ * Like readDrive(), it's safe to call concurrently on a shared tDrive.
+ *
+ * @param drive   the drive to read from
+ * @param offset  byte offset from the start of the partition
+ * @param iov     destination buffers, filled in order
+ * @param count   number of entries in iov
+ * @return the number of bytes read, or -1 on failure
+ */
+ssize_t readDriveVector( tDrive * drive, off64_t offset, const struct iovec * iov, int count )
+{
+    ssize_t result = 0;
+    size_t  length = 0;
+
+    for ( int i = 0; i < count; ++i )
+    {
+        length += iov[i].iov_len;
+    }
+
+    LogInfo( "readDriveVector( offset %#lx, %ld (%#lx) bytes in %d buffers)", offset, length, length, count );
+    if ( drive != NULL && count > 0 && isInPartition( drive, offset, length ) )
+    {
+        result = drive->ops->readVector( drive, drive->partition.start + offset, iov, count, length );
+    }
+    return (result);
+}
+
+/**
+ * Get at part of the drive without copying it, if the backend allows it.
+ *
+ * @param drive   the drive
+ * @param offset  byte offset from the start of the partition
+ * @param length  number of bytes wanted
+ * @return a read-only pointer into the drive image, or NULL if the backend can't map
+ */
+const void * mapDrive( tDrive * drive, off64_t offset, size_t length )
+{
+    if ( drive != NULL && drive->ops->map != NULL && isInPartition( drive, offset, length ) )
+    {
+        return drive->ops->map( drive, drive->partition.start + offset, length );
+    }
+    return NULL;
+}
+
+/**
+ * For the small structures read while probing (GPT, PV label, metadata). Returns
+ * a pointer into the drive image if the backend can map, and otherwise reads into
+ * a freshly allocated buffer. Either way, the result is read-only, and should be
+ * handed back with releaseDriveBlock().
+ *
+ * @return the data, or NULL if it couldn't all be read
+ */
+const void * readDriveBlock( tDrive * drive, off64_t offset, size_t length )
+{
+    const void * result = mapDrive( drive, offset, length );
+
+    if ( result == NULL && drive != NULL && drive->ops->map == NULL )
+    {
+        void * block = calloc( length, 1 );
+        if ( isHeapPtr( block ) )
+        {
+            if ( readDrive( drive, offset, block, length ) != (ssize_t) length )
             {
-                result = read( drive->id, dest, length );
-                if ( result < 0 )
-                {
-                    LogError( "read @ offset %lu for %lu bytes failed (%d: %s)\n",
-                         offset, length, errno, strerror( errno ) );
-                }
+                free( block );
+                block = NULL;
             }
         }
+        result = block;
+    }
+    return result;
+}
+
+void releaseDriveBlock( tDrive * drive, const void * block )
+{
+    if ( drive != NULL && drive->ops->map == NULL )
+    {
+        free( (void *) block );
     }
-    return (result);
 }
 
 void closeDrive( tDrive * drive )
 {
     if (drive != NULL)
     {
-        if (drive->id >= 0)
+        LogInfo( "closing \'%s\' (%s backend)", drive->path, drive->ops->name );
+        if ( drive->cache != NULL )
         {
-            close(drive->id);
-            drive->id = -1;
+            tBlockCacheStats stats;
+            getBlockCacheStats( drive->cache, &stats );
+            LogInfo( "block cache: %lu hits, %lu misses", stats.hits, stats.misses );
+            freeBlockCache( drive->cache );
+            drive->cache = NULL;
         }
+        drive->ops->close( drive );
     }
 }
 
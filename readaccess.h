@@ -5,6 +5,8 @@
 #ifndef READLOGICALVOLUME_READACCESS_H
 #define READLOGICALVOLUME_READACCESS_H
 
+struct iovec;
+
 typedef off64_t     tExtent;
 
 typedef struct tPartition {
@@ -12,11 +14,57 @@ typedef struct tPartition {
     size_t      length;
 } tPartition;
 
-typedef struct {
+/* how asynchronous reads are carried out, see asyncRead.c */
+typedef enum {
+    ioEngineAuto = 0,   /* io_uring if the kernel allows it, otherwise threads */
+    ioEngineUring,
+    ioEngineThreads,
+    ioEngineNone        /* neither could be started */
+} tIOEngine;
+
+#define kDefaultQueueDepth  16
+#define kDefaultChunkSize   (1024 * 1024)
+
+/* flags for openDrive() */
+#define kDriveDirectIO      0x0001      /* O_DIRECT: bypass the page cache */
+#define kDriveMapped        0x0002      /* mmap the whole drive, read by copying from the mapping */
+#define kDriveInMemory      0x0004      /* load the whole drive into memory up front */
+
+/* a PV UUID, as it appears in the PV label: 32 characters, no dashes */
+#define kPVIdLength         32
+
+struct tDrive;
+struct tBlockCache;
+
+/* a drive backend. positions passed in are absolute, i.e. already include the partition start */
+typedef struct tDriveOps {
+    const char * name;
+    ssize_t      (* read)( struct tDrive * drive, off64_t position, void * dest, size_t length );
+    ssize_t      (* readVector)( struct tDrive * drive, off64_t position,
+                                 const struct iovec * iov, int count, size_t length );
+    const void * (* map)( struct tDrive * drive, off64_t position, size_t length );   /* may be NULL */
+    void         (* close)( struct tDrive * drive );
+} tDriveOps;
+
+typedef struct tDrive {
+    struct tDrive * next;       /* the next drive holding part of the volume group */
     int          id;
     const char * path;
-    size_t       sectorSize;
+    size_t       sectorSize;            /* logical sector size, i.e. the size of an LBA */
+    size_t       physicalSectorSize;
+    size_t       alignment;             /* required alignment of offsets, lengths and buffers */
+    int          directIO;
     tPartition   partition;
+    tIOEngine    engine;
+    unsigned     queueDepth;    /* how many chunks the async reader keeps in flight */
+    size_t       chunkSize;     /* large reads are split into pieces of this size */
+    unsigned     threads;       /* if non-zero, read plans run on this many worker threads instead */
+    const tDriveOps * ops;
+    unsigned char * image;      /* mmap and memory backends: the whole drive */
+    size_t       imageSize;
+    int          ownsImage;
+    struct tBlockCache * cache; /* small reads, e.g. while probing. may be NULL */
+    char         pvId[ kPVIdLength + 1 ];   /* from the PV label; empty until it's been read */
 } tDrive;
 
 
@@ -25,9 +73,19 @@ typedef struct tDiskBlock {
     size_t      length;
 } tDiskBlock;
 
-tDrive *  openDrive( const char *drivePath );
+tDrive *  openDrive( const char *drivePath, unsigned flags );
+tDrive *  openMemoryDrive( const char * name, void * image, size_t length );
+int  isDriveAligned( tDrive * drive, off64_t offset, const void * ptr, size_t length );
+void * allocAlignedBuffer( size_t alignment, size_t length );
+void * allocDriveBuffer( tDrive * drive, size_t length );
+unsigned getDriveParallelism( tDrive * drive );
 void   setPartition( tDrive * drive, off64_t offset, size_t length );
 ssize_t   readDrive( tDrive * drive, off64_t offset, void * dest, size_t length );
+ssize_t   readDriveExtent( tDrive * drive, off64_t offset, void * dest, size_t length );
+ssize_t   readDriveVector( tDrive * drive, off64_t offset, const struct iovec * iov, int count );
+const void * mapDrive( tDrive * drive, off64_t offset, size_t length );
+const void * readDriveBlock( tDrive * drive, off64_t offset, size_t length );
+void   releaseDriveBlock( tDrive * drive, const void * block );
 void     closeDrive( tDrive * drive );
 
 #endif //READLOGICALVOLUME_READACCESS_H
@@ -8,9 +8,11 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <syslog.h>
 //#include <sys/file.h>
 #include <string.h>
+#include <stddef.h>
 //#include <ctype.h>
 #include <inttypes.h>
 #include <endian.h>
@@ -20,7 +22,13 @@
 #include "readaccess.h"
 #include "debug.h"
 #include "stringHash.h"
+#include "arena.h"
 #include "parseMetadata.h"
+#include "writeVolume.h"
+#include "lvAccess.h"
+#include "readPlan.h"
+#include "nbdServer.h"
+#include "workPool.h"
 #include "gpt.h"
 #include "lvm.h"
 
@@ -28,63 +36,14 @@
 
 
 /************************************/
-/**
- * @param ptr    starting address of value to be converted
- * @param count  number of bytes to be converted
- * @return the value, assuming the value is big-endian in memory
- */
-uint64_t getBE( byte * ptr, int count )
-{
-    uint64_t  result = 0;
-    for ( int i      = count; i > 0; --i )
-    {
-        result <<= 8;
-        result |= *ptr++;
-    }
-    return (result);
-}
-
-/**
- *
- * @param ptr    starting address of value to be converted
- * @param count  number of bytes to be converted
- * @return the value, assuming the value is little-endian in memory
- */
-uint64_t getLE( byte * ptr, int count )
-{
-    uint64_t result = 0;
-    ptr += count;
-    for ( int i = count; i > 0; --i )
-    {
-        result <<= 8;
-        result |= *(--ptr);
-    }
-    return (result);
-}
-
-uint64_t get64LE( byte * ptr )
-{
-    return getLE( ptr, 8 );
-}
-
-uint32_t get32LE( byte * ptr )
-{
-    return (uint32_t) getLE( ptr, 4 );
-}
-
-uint16_t get16LE( byte * ptr )
-{
-    return (uint16_t) getLE( ptr, 2 );
-}
-
 /**
  *
  * @param data
  * @return
  */
-int SixteenBytesAreZero( byte * data )
+int SixteenBytesAreZero( const byte * data )
 {
-    byte * p = data;
+    const byte * p = data;
     unsigned int result = 0;
 
     for ( int i = 16; i > 0; --i )
@@ -95,7 +54,7 @@ int SixteenBytesAreZero( byte * data )
     return (result == 0);
 }
 
-int UUIDisLVM( byte * uuid )
+int UUIDisLVM( const byte * uuid )
 {
     const byte lvmUUID[] = { 0x79, 0xD3, 0xD6, 0xE6, 0x07, 0xF5, 0xC2, 0x44,
                              0xA2, 0x3C, 0x23, 0x8F, 0x2A, 0x3D, 0xF9, 0x28 };
@@ -114,12 +73,12 @@ int UUIDisLVM( byte * uuid )
  */
 
 #ifdef optDebugOutput
-void dumpGPTEntry( tGPTEntry * entry )
+void dumpGPTEntry( const tGPTEntry * entry )
 {
     char name[37];
     char * p;
     char uuid[40];
-    char * q;
+    const char * q;
     /* type[16];       0 (0x00)  16 bytes  Partition type GUID */
     /* thank Microsoft for the 'mixed-endian' representation */
     snprintf( uuid, sizeof( uuid ),
@@ -174,18 +133,18 @@ void dumpGPTEntry( tGPTEntry * entry )
 #define dumpGPTEntry( arg )
 #endif
 
+/* we look at no more than this many raw location descriptors in the metadata area header */
+#define kMaxRawLocations    32
+
 tTextBlock * readMetadata( tDrive * drive, tDiskBlock * metadataList )
 {
     tTextBlock * result = NULL;
-    ssize_t      rdLen;
     tDiskBlock   metadata;
 
-    size_t mdHeaderLength = sizeof(tLVMMetadataHeader) + 32 * sizeof(tLVMRawLocation);
-    tLVMMetadataHeader * mdHeader = calloc( mdHeaderLength + sizeof(tLVMRawLocation), 1 );
+    size_t mdHeaderLength = sizeof(tLVMMetadataHeader) + kMaxRawLocations * sizeof(tLVMRawLocation);
+    const tLVMMetadataHeader * mdHeader = readDriveBlock( drive, metadataList->offset, mdHeaderLength );
 
-    rdLen = readDrive( drive, metadataList->offset, mdHeader, mdHeaderLength );
-
-    if ( rdLen != (ssize_t) mdHeaderLength )
+    if ( mdHeader == NULL )
     {
         LogError( "unable to read metadata header (%d: %s)", errno, strerror( errno ) );
     }
@@ -201,8 +160,8 @@ tTextBlock * readMetadata( tDrive * drive, tDiskBlock * metadataList )
             LogInfo( "  metadata offset %8lx", metadata.offset );
             LogInfo( "    metadata size %8lx", metadata.length );
 
-            tLVMRawLocation * rawLoc = mdHeader->list;
-            while ( !SixteenBytesAreZero( (byte *) rawLoc ) )
+            const tLVMRawLocation * rawLoc = mdHeader->list;
+            for ( int i = kMaxRawLocations; i > 0 && !SixteenBytesAreZero( (const byte *) rawLoc ); --i )
             {
                 off64_t offset = get64LE( rawLoc->offset );
                 size_t  length = get64LE( rawLoc->size );
@@ -220,27 +179,25 @@ tTextBlock * readMetadata( tDrive * drive, tDiskBlock * metadataList )
 
                     if ( isValidPtr( result ) )
                     {
+                        /* the parser never writes to the text, so it can stay in the drive's mapping, if it has one */
                         result->block.length = length;
-                        result->block.ptr    = calloc( length, sizeof( byte ) );
-                        if ( isValidPtr( result->block.ptr ) )
+                        result->block.ptr    = (byte *) readDriveBlock( drive, metadata.offset + offset, length );
+                        if ( !isValidPtr( result->block.ptr ) )
+                        {
+                            LogError( "unable to read metadata text" );
+                        }
+                        else
                         {
-                            rdLen = readDrive( drive, metadata.offset + offset, result->block.ptr, length );
-                            if ( rdLen != (ssize_t)length )
-                            {
-                                LogError( "unable to read metadata text" );
-                            }
-                            else
-                            {
-                                DebugOut( "\n_______________________________\n\n" );
-                                fwrite( result->block.ptr, result->block.length, 1, stderr );
-                                DebugOut( "\n_______________________________\n\n" );
-                            }
+                            DebugOut( "\n_______________________________\n\n" );
+                            fwrite( result->block.ptr, result->block.length, 1, stderr );
+                            DebugOut( "\n_______________________________\n\n" );
                         }
                     }
                 }
                 ++rawLoc;
             }
         }
+        releaseDriveBlock( drive, mdHeader );
     }
     if ( result == NULL )
     {
@@ -263,77 +220,145 @@ tTextBlock * readMetadata( tDrive * drive, tDiskBlock * metadataList )
 
 tDiskBlock * readPhysicalVolumeLabel( tDrive * drive )
 {
-    /* the PV label is in one of the first four sectors of the partition, usually the second one */
-    size_t pvLabelRdLen = 4 * drive->sectorSize;
+    /* the PV label is in one of the first four sectors of the partition, usually the second one.
+       These are always 512-byte 'LVM sectors', even on a drive with 4K logical sectors */
+    size_t pvLabelRdLen = 4 * kLVMSectorSize;
 
-    tLVMPVLabel * label = calloc( sizeof( byte ), pvLabelRdLen );
+    const byte * labelArea = readDriveBlock( drive, 0, pvLabelRdLen );
 
-    if ( isValidPtr( label ) )
+    if ( labelArea == NULL )
     {
-        ssize_t rdlen = readDrive( drive, 0, label, pvLabelRdLen );
-        if ( rdlen != (ssize_t) pvLabelRdLen )
-        {
-            LogError( "unable to read pvLabel area (%d: %s)", errno, strerror( errno ) );
-        }
-        else
+        LogError( "unable to read pvLabel area (%d: %s)", errno, strerror( errno ) );
+    }
+    else
+    {
+        const tLVMPVLabel * label = (const tLVMPVLabel *) labelArea;
+
+        for ( int i = 0; i < 4; ++i )
         {
-            for ( int i = 0; i < 4; ++i )
+            if ( (memcmp( label->signature, "LABELONE", 8 ) == 0)
+                && (memcmp( label->typeID,  "LVM2 001", 8 ) == 0)
+                && checkLVMCRC32( get32LE( label->crc32 ), (const byte *) label + 20, kLVMSectorSize - 20 ) )
             {
-                if ( (memcmp( label->signature, "LABELONE", 8 ) == 0)
-                    && (memcmp( label->typeID,  "LVM2 001", 8 ) == 0)
-                    && checkCRC32( get32LE( label->crc32 ), (byte *) label + 20, drive->sectorSize - 20 ) )
-                {
 #ifdef optDebugOutput
-                    const char * ordinal[] = {"first", "second", "third", "fourth"};
-                    LogInfo( "found pvLabel in the %s sector", ordinal[ i ] );
+                const char * ordinal[] = {"first", "second", "third", "fourth"};
+                LogInfo( "found pvLabel in the %s sector", ordinal[ i ] );
 #endif
-                    tLVMPVHeader * pvHeader = (tLVMPVHeader *) ((byte *) label + get32LE( label->offset ));
-                    LogInfo( "PV UUID is %32s", pvHeader->uuid );
-                    size_t pvSize = get64LE( pvHeader->size );
-                    LogInfo( "PV size is %ld", pvSize );
-
-                    tLVMDataArea * dataArea = pvHeader->list;
-                    /* skip over the data list. we want the metadata list that follows it. */
-                    while ( !SixteenBytesAreZero( (byte *) dataArea ) )
-                    {
-                        ++dataArea;
-                    }
-                    /* skip over the data list terminator. metadata list follows immediately after */
+                const tLVMPVHeader * pvHeader = (const tLVMPVHeader *) ((const byte *) label + get32LE( label->offset ));
+                /* it's how the physical volume in the metadata is matched to this drive */
+                memcpy( drive->pvId, pvHeader->uuid, kPVIdLength );
+                drive->pvId[ kPVIdLength ] = '\0';
+                LogInfo( "PV UUID is %s", drive->pvId );
+                size_t pvSize = get64LE( pvHeader->size );
+                LogInfo( "PV size is %ld", pvSize );
+
+                const tLVMDataArea * dataArea = pvHeader->list;
+                /* skip over the data list. we want the metadata list that follows it. */
+                while ( !SixteenBytesAreZero( (const byte *) dataArea ) )
+                {
                     ++dataArea;
+                }
+                /* skip over the data list terminator. metadata list follows immediately after */
+                ++dataArea;
 
-                    int count = 0;
-                    tLVMDataArea * mdaList = dataArea;
-                    while ( !SixteenBytesAreZero( (byte *) dataArea ) )
-                    {
-                        ++count;
-                        ++dataArea;
-                    }
-
-                    /* Now we know how large a list to create, add one entry for a trailing null */
-                    tDiskBlock * blockList = calloc( sizeof( tDiskBlock ), count + 1 );
+                int count = 0;
+                const tLVMDataArea * mdaList = dataArea;
+                while ( !SixteenBytesAreZero( (const byte *) dataArea ) )
+                {
+                    ++count;
+                    ++dataArea;
+                }
 
-                    tDiskBlock * list = blockList;
-                    dataArea = mdaList;
-                    while ( !SixteenBytesAreZero( (byte *) dataArea ) )
-                    {
-                        list->offset = get64LE( dataArea->offset );
-                        list->length = get64LE( dataArea->size );
-                        LogInfo( "    data area: offset %lx, %ld bytes", list->offset, list->length );
-                        ++list;
-                        ++dataArea;
-                    }
+                /* Now we know how large a list to create, add one entry for a trailing null */
+                tDiskBlock * blockList = calloc( sizeof( tDiskBlock ), count + 1 );
 
-                    return blockList;
+                tDiskBlock * list = blockList;
+                dataArea = mdaList;
+                while ( !SixteenBytesAreZero( (const byte *) dataArea ) )
+                {
+                    list->offset = get64LE( dataArea->offset );
+                    list->length = get64LE( dataArea->size );
+                    LogInfo( "    data area: offset %lx, %ld bytes", list->offset, list->length );
+                    ++list;
+                    ++dataArea;
                 }
-                label = (tLVMPVLabel *) ((byte *) label + drive->sectorSize);
+
+                releaseDriveBlock( drive, labelArea );
+                return blockList;
             }
-            LogError("no Physical Volume Label was found");
+            label = (const tLVMPVLabel *) ((const byte *) label + kLVMSectorSize);
         }
+        LogError("no Physical Volume Label was found");
+        releaseDriveBlock( drive, labelArea );
     }
     return NULL;
 }
 
 
+/**
+ * The GPT header lives in LBA 1, so where it is depends on the logical sector size.
+ * A block device tells us its sector size, but an image file doesn't, so if the
+ * header isn't where we expect it, try the other common sector size. If it turns
+ * up there, that's the drive's sector size from now on (e.g. an image of a 4Kn drive).
+ * @return the header (release with releaseDriveBlock()), or NULL if it couldn't be read
+ */
+const tGPTHeader * readGPTHeader( tDrive * drive )
+{
+    const tGPTHeader * gptHeader = readDriveBlock( drive, drive->sectorSize, sizeof( tGPTHeader ) );
+
+    if ( gptHeader != NULL && memcmp( gptHeader->signature, "EFI PART", 8 ) != 0 )
+    {
+        size_t             otherSize   = (drive->sectorSize == 512) ? 4096 : 512;
+        const tGPTHeader * otherHeader = readDriveBlock( drive, otherSize, sizeof( tGPTHeader ) );
+
+        if ( otherHeader != NULL && memcmp( otherHeader->signature, "EFI PART", 8 ) == 0 )
+        {
+            LogInfo( "found the GPT header with %ld byte sectors, not %ld", otherSize, drive->sectorSize );
+            drive->sectorSize = otherSize;
+            releaseDriveBlock( drive, gptHeader );
+            gptHeader = otherHeader;
+        }
+        else
+        {
+            /* keep what was in the expected place, so the caller reports it */
+            releaseDriveBlock( drive, otherHeader );
+        }
+    }
+    return gptHeader;
+}
+
+/**
+ * The CRC covers as much of the header as its size field says: usually 92 bytes,
+ * but a later revision may add fields, as long as it all fits in the sector.
+ * It's calculated with the CRC field zeroed, and the header may be in a read-only
+ * mapping, so the check is done on a copy.
+ * @return non-zero if the header's CRC is correct
+ */
+static int checkGPTHeaderCRC( tDrive * drive, const tGPTHeader * gptHeader )
+{
+    uint32_t headerSize = get32LE( gptHeader->size );
+    int      result     = 0;
+
+    if ( headerSize < sizeof( tGPTHeader ) || headerSize > drive->sectorSize )
+    {
+        LogError( "GPT header size of %u bytes is out of range", headerSize );
+        return 0;
+    }
+
+    const byte * header     = readDriveBlock( drive, drive->sectorSize, headerSize );
+    byte       * headerCopy = malloc( headerSize );
+    if ( header != NULL && isHeapPtr( headerCopy ) )
+    {
+        memcpy( headerCopy, header, headerSize );
+        memset( headerCopy + offsetof( tGPTHeader, crc32 ), 0, sizeof( gptHeader->crc32 ) );
+        result = checkCRC32( get32LE( gptHeader->crc32 ), headerCopy, headerSize );
+    }
+    free( headerCopy );
+    releaseDriveBlock( drive, header );
+
+    return result;
+}
+
 /**
  * start off by walking the GPT, looking for partitions marked as LVM
  * If found, pass them to readPhysicalVolumeLabel()
@@ -345,73 +370,64 @@ tDrive * readGPT( tDrive * drive )
 {
     if ( isValidPtr( drive ) )
     {
-        tGPTHeader * gptHeader = malloc( sizeof( tGPTHeader ) );
-        if ( isHeapPtr( gptHeader ) )
+        const tGPTHeader * gptHeader = readGPTHeader( drive );
+        if ( gptHeader == NULL )
+        {
+            LogError( "Unable to read GPT header (%d: %s)", errno, strerror( errno ) );
+        }
+        else
         {
-            ssize_t rdLen = readDrive( drive, drive->sectorSize, gptHeader, sizeof( tGPTHeader ) );
-            if ( rdLen != sizeof( tGPTHeader ) )
+            if ( memcmp( gptHeader->signature, "EFI PART", 8 ) != 0
+                || get32LE( gptHeader->revision ) != 0x00010000
+                || !checkGPTHeaderCRC( drive, gptHeader ) )
             {
-                LogError( "Unable to read GPT header (%d: %s)", errno, strerror( errno ) );
+                LogInfo( "signature, revision or CRC is incorrect" );
             }
             else
             {
-                uint32_t crc32 = get32LE( gptHeader->crc32 );
-                memset( gptHeader->crc32, 0, sizeof( gptHeader->crc32 ) );
-
-                if ( memcmp( gptHeader->signature, "EFI PART", 8 ) != 0
-                    || get32LE( gptHeader->revision ) != 0x00010000
-                    || !checkCRC32( crc32, (byte *) gptHeader, get32LE(gptHeader->size) ) )
+                LogInfo( "signature, revision & CRC are correct" );
+                LogInfo( "  Partition first LBA = %ld", get64LE( gptHeader->partitionTable.firstLBA ) );
+                LogInfo( "      Partition Count = %d",  get32LE( gptHeader->partitionTable.count ) );
+                LogInfo( " Partition Entry Size = %d",  get32LE( gptHeader->partitionTable.size ) );
+
+                size_t tableLength = get32LE( gptHeader->partitionTable.count )
+                                   * get32LE( gptHeader->partitionTable.size );
+                off64_t gptTableOffset = get64LE( gptHeader->partitionTable.firstLBA ) * drive->sectorSize;
+                setPartition( drive, 0, gptTableOffset + tableLength );
+
+                const tGPTEntry * gptTable = readDriveBlock( drive, gptTableOffset, tableLength );
+                if ( gptTable == NULL )
                 {
-                    LogInfo( "signature, revision or CRC is incorrect" );
+                    LogError( "Unable to read partition table (%d: %s)", errno, strerror( errno ) );
                 }
                 else
                 {
-                    LogInfo( "signature, revision & CRC are correct" );
-                    LogInfo( "  Partition first LBA = %ld", get64LE( gptHeader->partitionTable.firstLBA ) );
-                    LogInfo( "      Partition Count = %d",  get32LE( gptHeader->partitionTable.count ) );
-                    LogInfo( " Partition Entry Size = %d",  get32LE( gptHeader->partitionTable.size ) );
-
-                    size_t tableLength = get32LE( gptHeader->partitionTable.count )
-                                       * get32LE( gptHeader->partitionTable.size );
-                    tGPTEntry * gptTable = calloc( tableLength, 1 );
-
-                    if ( isHeapPtr( gptTable ) )
+                    LogInfo( "read of partition table successful" );
+                    const tGPTEntry * entry = gptTable;
+                    size_t  entrySize = get32LE( gptHeader->partitionTable.size );
+                    for ( int count   = get32LE( gptHeader->partitionTable.count ); count > 0; --count )
                     {
-                        off64_t gptTableOffset = get64LE( gptHeader->partitionTable.firstLBA ) * drive->sectorSize;
-                        setPartition( drive, 0, gptTableOffset + tableLength );
-                        rdLen = readDrive( drive, gptTableOffset, gptTable, tableLength );
-                        if ( rdLen != (ssize_t) tableLength )
+                        if ( SixteenBytesAreZero( entry->type ) )
                         {
-                            LogError( "Unable to read partition table (%d: %s)", errno, strerror( errno ) );
+                            break;
                         }
-                        else
+                        if ( UUIDisLVM( entry->type ) )
                         {
-                            LogInfo( "read of partition table successful" );
-                            tGPTEntry * entry = gptTable;
-                            size_t  entrySize = get32LE( gptHeader->partitionTable.size );
-                            for ( int count   = get32LE( gptHeader->partitionTable.count ); count > 0; --count )
-                            {
-                                if ( SixteenBytesAreZero( entry->type ) )
-                                {
-                                    break;
-                                }
-                                if ( UUIDisLVM( entry->type ) )
-                                {
-                                    LogInfo( "found LVM PV partition" );
-
-                                    setPartition( drive,
-                                                  get64LE( entry->firstLBA ) * drive->sectorSize,
-                                                  (get64LE( entry->lastLBA ) - get64LE( entry->firstLBA ))
-                                                      * drive->sectorSize );
-
-                                    dumpGPTEntry( entry );
-                                }
-                                entry = (tGPTEntry *) ((byte *) entry + entrySize);
-                            }
+                            LogInfo( "found LVM PV partition" );
+
+                            setPartition( drive,
+                                          get64LE( entry->firstLBA ) * drive->sectorSize,
+                                          (get64LE( entry->lastLBA ) - get64LE( entry->firstLBA ) + 1)
+                                              * drive->sectorSize );
+
+                            dumpGPTEntry( entry );
                         }
+                        entry = (const tGPTEntry *) ((const byte *) entry + entrySize);
                     }
+                    releaseDriveBlock( drive, gptTable );
                 }
             }
+            releaseDriveBlock( drive, gptHeader );
         }
     }
     return drive;
@@ -428,26 +444,229 @@ tDrive * readGPT( tDrive * drive )
  */
 void usage( FILE * output )
 {
-    fprintf( output, "### usage: %s <drive path> <logical volume label>\n", gExecName );
+    fprintf( output, "### usage: %s [options] <drive path> <logical volume label> [<label> ...]\n", gExecName );
+    fprintf( output, "    -q <depth>      number of reads to keep in flight (default %d)\n", kDefaultQueueDepth );
+    fprintf( output, "    -c <KB>         size of each read, in kilobytes (default %d)\n", kDefaultChunkSize / 1024 );
+    fprintf( output, "    -e <engine>     'uring', 'threads' or 'auto' (default)\n" );
+    fprintf( output, "    -d              use direct i/o, bypassing the page cache\n" );
+    fprintf( output, "    -b <backend>    'fd' (default), 'mmap', or 'memory' to load the whole drive first\n" );
+    fprintf( output, "    -o <path>       where to write the volume, '-' for stdout (default '<label>.bin')\n" );
+    fprintf( output, "                    several volumes are read in a single pass, each to '<label>.bin'\n" );
+    fprintf( output, "    -M              read the whole volume into memory before writing it out\n" );
+    fprintf( output, "    -z              write runs of zeros out in full, rather than leaving holes\n" );
+    fprintf( output, "    -r <off>,<len>  copy just this byte range of the volume\n" );
+    fprintf( output, "    -p <path>       another drive or image holding physical volumes of the same group\n" );
+    fprintf( output, "                    (may be repeated)\n" );
+    fprintf( output, "    -t <threads>    read on this many threads, writing with pwrite(); 0 picks a count\n" );
+    fprintf( output, "                    to suit the drive (one for a spinning disk)\n" );
+    fprintf( output, "    -n <socket>     serve the volume read-only over NBD on this Unix socket, until\n" );
+    fprintf( output, "                    interrupted, rather than copying it; -t sets how many requests\n" );
+    fprintf( output, "                    each connection works on at once (default %d)\n", kNbdDefaultWorkers );
 }
 
-void writeMemoryBuffer( tMemoryBlock * buffer, const char * lvName )
+/**
+ * @param path  the output path, or "-" for stdout
+ * @return a file descriptor, or -1
+ */
+int openOutput( const char * path )
 {
-    char filename[256];
-    snprintf( filename, sizeof( filename ), "%s.bin", lvName );
-    int fd = creat( filename, S_IRUSR | S_IRGRP );
+    if ( strcmp( path, "-" ) == 0 )
+    {
+        return STDOUT_FILENO;
+    }
+
+    int fd = creat( path, S_IRUSR | S_IRGRP );
     if ( fd == -1 )
     {
-        LogError( "unable to open file \"%s\" (%d: %s)", filename, errno, strerror( errno ) );
+        LogError( "unable to open file \"%s\" (%d: %s)", path, errno, strerror( errno ) );
     }
-    else
+    return fd;
+}
+
+/**
+ * Copy a byte range of a logical volume to a file descriptor, reading only that range.
+ * @return 0 on success, -1 on error
+ */
+int writeVolumeRange( tDrive * drive, const char * lvName, tNode * root,
+                      uint64_t offset, uint64_t length, int fd )
+{
+    int result = -1;
+    tLVHandle * handle = lvOpen( drive, lvName, root );
+
+    if ( handle != NULL )
     {
-        LogInfo( " writing memory block @ %p to \'%s\'", buffer, filename );
-        write( fd, buffer->ptr, buffer->length );
-        close( fd );
+        size_t chunkSize = drive->chunkSize > 0 ? drive->chunkSize : kDefaultChunkSize;
+        byte * buffer    = malloc( chunkSize );
+
+        if ( isValidPtr( buffer ) )
+        {
+            result = 0;
+            while ( length > 0 )
+            {
+                ssize_t count = lvRead( handle, offset, buffer, length < chunkSize ? length : chunkSize );
+                if ( count <= 0 )
+                {
+                    result = (count < 0) ? -1 : 0;
+                    break;
+                }
+                if ( writeFully( fd, buffer, count ) < 0 )
+                {
+                    LogError( "unable to write output (%d: %s)", errno, strerror( errno ) );
+                    result = -1;
+                    break;
+                }
+                offset += count;
+                length -= count;
+            }
+            free( buffer );
+        }
+        lvClose( handle );
     }
+    return result;
 }
 
+/**
+ * Extract several logical volumes in one pass over the drive: every physical
+ * range any of them needs goes into one plan, and is read once, in physical
+ * order, and written to each output that wants it.
+ *
+ * @param outputPath  where to write a single volume, or NULL for '<label>.bin'
+ * @return 0 on success, -1 on error
+ */
+int extractVolumes( tDrive * drive, tNode * root, int count, char * lvNames[],
+                    const char * outputPath, unsigned writeFlags )
+{
+    int               result = 0;
+    tLogicalVolume ** lvs    = calloc( count, sizeof( tLogicalVolume * ) );
+    int             * fds    = calloc( count, sizeof( int ) );
+    tReadPlan       * plan   = newReadPlan();
+
+    if ( !isHeapPtr( lvs ) || !isHeapPtr( fds ) || !isHeapPtr( plan ) )
+    {
+        result = -1;
+    }
+
+    for ( int i = 0; isHeapPtr( fds ) && i < count; ++i )
+    {
+        fds[ i ] = -1;
+    }
+
+    for ( int i = 0; i < count && result == 0; ++i )
+    {
+        char path[256];
+        if ( outputPath != NULL )
+        {
+            snprintf( path, sizeof( path ), "%s", outputPath );
+        }
+        else
+        {
+            snprintf( path, sizeof( path ), "%s.bin", lvNames[ i ] );
+        }
+
+        lvs[ i ] = findLogicalVolume( drive, lvNames[ i ], root );
+        if ( lvs[ i ] == NULL
+          || (fds[ i ] = openOutput( path )) == -1
+          || addVolumeOutputToPlan( plan, lvs[ i ], fds[ i ], writeFlags ) < 0 )
+        {
+            result = -1;
+        }
+    }
+
+    if ( result == 0 )
+    {
+        result = executeReadPlan( plan );
+        reportReadPlan( plan, stderr );
+    }
+
+    for ( int i = 0; isHeapPtr( lvs ) && isHeapPtr( fds ) && i < count; ++i )
+    {
+        if ( fds[ i ] >= 0 )
+        {
+            close( fds[ i ] );
+        }
+        if ( result == 0 )
+        {
+            if ( outputPath != NULL )
+            {
+                fprintf( stderr, "copied %lu bytes of \"%s\" to \"%s\"\n",
+                         lvs[ i ]->length, lvNames[ i ], outputPath );
+            }
+            else
+            {
+                fprintf( stderr, "copied %lu bytes of \"%s\" to \"%s.bin\"\n",
+                         lvs[ i ]->length, lvNames[ i ], lvNames[ i ] );
+            }
+        }
+        freeLogicalVolume( lvs[ i ] );
+    }
+    freeReadPlan( plan );
+    free( fds );
+    free( lvs );
+
+    return result;
+}
+
+/**
+ * @param buffer  the volume, in memory
+ * @param fd      where to write it
+ * @param flags   kWriteSparse to seek over blocks of zeros, if fd is a regular file
+ * @return 0 on success, -1 on error
+ */
+int writeMemoryBuffer( tMemoryBlock * buffer, int fd, unsigned flags )
+{
+    const size_t kSparseBlockSize = 64 * 1024;
+    struct stat  outputStat;
+
+    LogInfo( " writing memory block @ %p", buffer );
+
+    if ( (flags & kWriteSparse) && fstat( fd, &outputStat ) == 0 && S_ISREG( outputStat.st_mode ) )
+    {
+        size_t offset = 0;
+        off64_t hole  = 0;
+        while ( offset < buffer->length )
+        {
+            size_t count = buffer->length - offset < kSparseBlockSize ? buffer->length - offset : kSparseBlockSize;
+            if ( isAllZero( &buffer->ptr[ offset ], count ) )
+            {
+                hole += count;
+            }
+            else if ( (hole > 0 && lseek64( fd, hole, SEEK_CUR ) < 0)
+                   || writeFully( fd, &buffer->ptr[ offset ], count ) < 0 )
+            {
+                break;
+            }
+            else
+            {
+                hole = 0;
+            }
+            offset += count;
+        }
+        /* a hole at the end has to be made part of the file */
+        if ( offset == buffer->length && hole > 0 )
+        {
+            off64_t end = lseek64( fd, hole, SEEK_CUR );
+            if ( end < 0 || ftruncate64( fd, end ) < 0 )
+            {
+                offset = 0;
+            }
+        }
+        if ( offset == buffer->length )
+        {
+            return 0;
+        }
+    }
+    else if ( writeFully( fd, buffer->ptr, buffer->length ) == 0 )
+    {
+        return 0;
+    }
+
+    LogError( "unable to write output (%d: %s)", errno, strerror( errno ) );
+    return -1;
+}
+
+/* how many drives can be given with -p */
+#define kMaxExtraDrives     64
+
 /**
  *
  * @param argc
@@ -456,45 +675,292 @@ void writeMemoryBuffer( tMemoryBlock * buffer, const char * lvName )
  */
 int main( int argc, char * argv[] )
 {
+    tIOEngine engine     = ioEngineAuto;
+    unsigned  queueDepth = kDefaultQueueDepth;
+    size_t    chunkSize  = kDefaultChunkSize;
+    unsigned  flags      = 0;
+    int       inMemory   = 0;
+    unsigned  writeFlags = kWriteSparse;
+    int       rangeOnly  = 0;
+    uint64_t  rangeOffset = 0;
+    uint64_t  rangeLength = 0;
+    const char * outputPath = NULL;
+    const char * socketPath = NULL;
+    int       threads    = -1;
+    const char * extraPaths[ kMaxExtraDrives ];
+    int       extraCount = 0;
+    int       status     = -1;
+    int       opt;
+
     debugInit( argc, argv );
 
-    if ( argc < 3 )
+    while ( (opt = getopt( argc, argv, "q:c:e:db:o:Mzr:t:p:n:" )) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'q':
+            queueDepth = strtoul( optarg, NULL, 0 );
+            break;
+
+        case 'c':
+            chunkSize = strtoul( optarg, NULL, 0 ) * 1024;
+            break;
+
+        case 'e':
+            if ( strcmp( optarg, "uring" ) == 0 )        { engine = ioEngineUring; }
+            else if ( strcmp( optarg, "threads" ) == 0 ) { engine = ioEngineThreads; }
+            else if ( strcmp( optarg, "auto" ) == 0 )    { engine = ioEngineAuto; }
+            else
+            {
+                usage( stderr );
+                exit( -1 );
+            }
+            break;
+
+        case 'd':
+            flags |= kDriveDirectIO;
+            break;
+
+        case 'b':
+            flags &= ~(kDriveMapped | kDriveInMemory);
+            if ( strcmp( optarg, "mmap" ) == 0 )         { flags |= kDriveMapped; }
+            else if ( strcmp( optarg, "memory" ) == 0 )  { flags |= kDriveInMemory; }
+            else if ( strcmp( optarg, "fd" ) != 0 )
+            {
+                usage( stderr );
+                exit( -1 );
+            }
+            break;
+
+        case 'o':
+            outputPath = optarg;
+            break;
+
+        case 'n':
+            socketPath = optarg;
+            break;
+
+        case 'M':
+            inMemory = 1;
+            break;
+
+        case 'z':
+            writeFlags &= ~kWriteSparse;
+            break;
+
+        case 'r':
+            {
+                char * end;
+                rangeOnly   = 1;
+                rangeOffset = strtoull( optarg, &end, 0 );
+                if ( *end != ',' )
+                {
+                    usage( stderr );
+                    exit( -1 );
+                }
+                rangeLength = strtoull( end + 1, NULL, 0 );
+            }
+            break;
+
+        case 'p':
+            if ( extraCount >= kMaxExtraDrives )
+            {
+                usage( stderr );
+                exit( -1 );
+            }
+            extraPaths[ extraCount++ ] = optarg;
+            break;
+
+        case 't':
+            {
+                char * end;
+                long   count = strtol( optarg, &end, 0 );
+                if ( end == optarg || *end != '\0' || count < 0 || count > kMaxWorkers )
+                {
+                    fprintf( stderr, "### -t takes a thread count from 0 to %d\n", kMaxWorkers );
+                    usage( stderr );
+                    exit( -1 );
+                }
+                threads = (int) count;
+            }
+            break;
+
+        default:
+            usage( stderr );
+            exit( -1 );
+        }
+    }
+
+    if ( argc - optind < 2 || queueDepth == 0 || chunkSize == 0 )
     {
         usage( stderr );
         exit( -1 );
     }
 
-    tDrive * drive = openDrive( argv[1] );
-    if ( isValidPtr( drive ) )
+    const char * drivePath = argv[ optind ];
+    const char * lvName    = argv[ optind + 1 ];
+    int          lvCount   = argc - optind - 1;
+
+    if ( lvCount > 1 && (outputPath != NULL || rangeOnly || inMemory) )
+    {
+        /* those only make sense for one volume */
+        usage( stderr );
+        exit( -1 );
+    }
+
+    if ( socketPath != NULL && (lvCount > 1 || outputPath != NULL || rangeOnly || inMemory) )
+    {
+        /* serving replaces copying the volume anywhere */
+        usage( stderr );
+        exit( -1 );
+    }
+
+    if ( socketPath == NULL && threads >= 0 && (rangeOnly || inMemory || (outputPath != NULL && strcmp( outputPath, "-" ) == 0)) )
+    {
+        /* the worker threads write with pwrite(), which needs a file they can seek in */
+        usage( stderr );
+        exit( -1 );
+    }
+
+    char defaultPath[256];
+    if ( outputPath == NULL )
+    {
+        snprintf( defaultPath, sizeof( defaultPath ), "%s.bin", lvName );
+        outputPath = defaultPath;
+    }
+
+    /* open every drive first, so a bad path is reported before any real work is done */
+    tDrive *  drives = NULL;
+    tDrive ** tail   = &drives;
+    int       opened = 1;
+    for ( int i = -1; i < extraCount && opened; ++i )
     {
-        tDrive * result = readGPT( drive );
-        if (isValidPtr(result))
+        tDrive * d = openDrive( (i < 0) ? drivePath : extraPaths[ i ], flags );
+        opened = isValidPtr( d );
+        if ( opened )
         {
-            tDiskBlock * metadataArea = readPhysicalVolumeLabel( drive );
-            if ( isValidPtr(metadataArea) )
+            *tail = d;
+            tail  = &d->next;
+        }
+    }
+
+    /* every drive needs its partition found, and its PV label read to learn which physical
+       volume it holds. Each PV has a copy of the metadata; we use the first drive's */
+    tDiskBlock * metadataArea = NULL;
+    for ( tDrive * d = drives; opened && d != NULL; d = d->next )
+    {
+        d->engine     = engine;
+        d->queueDepth = queueDepth;
+        d->chunkSize  = chunkSize;
+        if ( threads >= 0 && socketPath == NULL )
+        {
+            d->threads = (threads > 0) ? (unsigned) threads : getDriveParallelism( d );
+        }
+
+        tDiskBlock * area = NULL;
+        if ( isValidPtr( readGPT( d ) ) )
+        {
+            area = readPhysicalVolumeLabel( d );
+        }
+        if ( !isValidPtr( area ) )
+        {
+            opened = 0;
+        }
+        else if ( d == drives )
+        {
+            metadataArea = area;
+        }
+        else
+        {
+            free( area );
+        }
+    }
+
+    tDrive * drive = drives;
+    tArena * parseArena = opened ? newArena( 0 ) : NULL;
+    if ( isHeapPtr( parseArena ) )
+    {
+        tTextBlock * metadata = readMetadata( drive, metadataArea );
+        if ( isValidPtr(metadata) )
+        {
+            tNode * metadataTree = parseMetadata( metadata, parseArena );
+            if ( isValidPtr(metadataTree) && socketPath != NULL )
             {
-                tTextBlock * metadata = readMetadata( drive, metadataArea );
-                if ( isValidPtr(metadata) )
+                tLVHandle * handle = lvOpen( drive, lvName, metadataTree );
+                if ( isValidPtr( handle ) )
                 {
-                    tNode * metadataTree = parseMetadata( metadata );
-                    if ( isValidPtr(metadataTree) )
+                    unsigned workers = (threads > 0) ? (unsigned) threads : kNbdDefaultWorkers;
+                    status = serveLogicalVolume( handle, lvName, socketPath, workers );
+                    lvClose( handle );
+                }
+            }
+            else if ( isValidPtr(metadataTree) && lvCount > 1 )
+            {
+                status = extractVolumes( drive, metadataTree, lvCount, &argv[ optind + 1 ], NULL, writeFlags );
+            }
+            else if ( isValidPtr(metadataTree) && drive->threads > 0 )
+            {
+                status = extractVolumes( drive, metadataTree, 1, &argv[ optind + 1 ], outputPath, writeFlags );
+            }
+            else if ( isValidPtr(metadataTree) && rangeOnly )
+            {
+                int fd = openOutput( outputPath );
+                if ( fd != -1 )
+                {
+                    status = writeVolumeRange( drive, lvName, metadataTree, rangeOffset, rangeLength, fd );
+                    close( fd );
+                }
+            }
+            else if ( isValidPtr(metadataTree) && inMemory )
+            {
+                tMemoryBlock * buffer = readLogicalVolume( drive, lvName, metadataTree );
+                if ( isValidPtr( buffer ) )
+                {
+                    LogInfo( "memory block @ %p", (void *) buffer );
+                    LogInfo( "     pointer = %p", (void *) buffer->ptr );
+                    LogInfo( "      length = %ld (0x%lx)", buffer->length, buffer->length );
+
+                    int fd = openOutput( outputPath );
+                    if ( fd != -1 )
                     {
-                        tMemoryBlock * buffer = readLogicalVolume( drive, argv[2], metadataTree );
-                        if ( isValidPtr( buffer ) )
+                        status = writeMemoryBuffer( buffer, fd, writeFlags );
+                        close( fd );
+                    }
+                }
+            }
+            else if ( isValidPtr(metadataTree) )
+            {
+                tLogicalVolume * lv = findLogicalVolume( drive, lvName, metadataTree );
+                if ( isValidPtr( lv ) )
+                {
+                    int fd = openOutput( outputPath );
+                    if ( fd != -1 )
+                    {
+                        tWriteStats stats;
+                        status = writeLogicalVolume( drive, lv, fd, writeFlags, &stats );
+                        close( fd );
+                        if ( status == 0 )
                         {
-                            LogInfo( "memory block @ %p", (void *) buffer );
-                            LogInfo( "     pointer = %p", (void *) buffer->ptr );
-                            LogInfo( "      length = %ld (0x%lx)", buffer->length, buffer->length );
-
-                            writeMemoryBuffer( buffer, argv[2] );
+                            fprintf( stderr, "copied %lu bytes of \"%s\" to \"%s\" (%s): "
+                                             "%lu read, %lu written, %lu left as holes\n",
+                                     lv->length, lvName, outputPath, getTransferPathName( stats.path ),
+                                     stats.read, stats.written, stats.skipped );
                         }
                     }
+                    freeLogicalVolume( lv );
                 }
             }
         }
     }
+    freeArena( parseArena );
+    free( metadataArea );
 
-    closeDrive( drive );
+    while ( drives != NULL )
+    {
+        tDrive * next = drives->next;
+        closeDrive( drives );
+        drives = next;
+    }
 
-    exit( 0 );
+    exit( status );
 }
@@ -21,5 +21,12 @@ typedef struct
     byte  * end;
 } tTextBlock;
 
+/* see byteOrder.c */
+uint64_t getBE( const byte * ptr, int count );
+uint64_t getLE( const byte * ptr, int count );
+uint64_t get64LE( const byte * ptr );
+uint32_t get32LE( const byte * ptr );
+uint16_t get16LE( const byte * ptr );
+
 
 #endif //READLOGICALVOLUME_H
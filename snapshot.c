@@ -0,0 +1,426 @@
+/*
+    Reading old-style (non-thin) snapshots.
+
+    The COW store is made of chunks of the snapshot's chunk size. Chunk 0
+    is a header. After it, metadata chunks and data chunks alternate: each
+    metadata chunk is an array of exceptions, (origin chunk, COW chunk)
+    pairs, and is followed by as many data chunks as it has room for. The
+    first exception with a COW chunk of 0 marks the end of the table.
+
+    The whole table is read once, when the snapshot is opened, into an
+    open-addressed hash from origin chunk to COW chunk. The origin chunks
+    are also kept in a sorted array, so a run that isn't remapped can be
+    followed straight to the next chunk that is.
+
+    A run that isn't remapped is translated through the origin, so it
+    comes out at the same physical location as the origin's own data.
+    When the origin and its snapshots are exported together, the read
+    plan sees the overlap, and reads each shared chunk only once.
+*/
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "readlogicalvolume.h"
+#include "debug.h"
+#include "stringHash.h"
+#include "readaccess.h"
+#include "parseMetadata.h"
+#include "lvm.h"
+#include "extentIndex.h"
+#include "lvAccess.h"
+#include "snapshot.h"
+
+#define kSnapshotMagic      0x70416e53      /* 'SnAp' */
+#define kSnapshotVersion    1
+
+typedef struct tSnapshotHeader
+{                           /* Ofst Size Description */
+    byte    magic[4];       /*   0   4   kSnapshotMagic */
+    byte    valid[4];       /*   4   4   0 once the snapshot has overflowed, or been invalidated */
+    byte    version[4];     /*   8   4   kSnapshotVersion */
+    byte    chunkSize[4];   /*  12   4   in 512-byte sectors */
+} tSnapshotHeader;
+
+typedef struct tSnapshotException
+{                           /* Ofst Size Description */
+    byte    oldChunk[8];    /*   0   8   the chunk of the origin */
+    byte    newChunk[8];    /*   8   8   where its old contents are in the COW store; 0 ends the table */
+} tSnapshotException;
+
+/* an entry in the hash; a cowChunk of 0 (the header) marks an empty slot */
+typedef struct tExceptionSlot
+{
+    uint64_t    chunk;
+    uint64_t    cowChunk;
+} tExceptionSlot;
+
+struct tSnapshot
+{
+    tLogicalVolume * origin;
+    tLogicalVolume * cow;
+    uint64_t         chunkSize;         /* in bytes */
+    uint64_t         start;             /* where the segment starts in the origin, in bytes */
+    uint64_t         length;            /* and how long it is */
+    tExceptionSlot * slots;
+    uint64_t         slotMask;
+    uint64_t       * remapped;          /* the origin chunks with an exception, in order */
+    size_t           exceptionCount;
+    size_t           exceptionSpace;
+};
+
+static uint64_t hashChunk( tSnapshot * snapshot, uint64_t chunk )
+{
+    /* Fibonacci hashing: consecutive chunks land far apart */
+    return ((chunk * 0x9E3779B97F4A7C15ULL) >> 32) & snapshot->slotMask;
+}
+
+/**
+ * @return where a chunk of the origin is in the COW store, or 0 if it hasn't been remapped
+ */
+static uint64_t findException( tSnapshot * snapshot, uint64_t chunk )
+{
+    for ( uint64_t i = hashChunk( snapshot, chunk ); snapshot->slots[ i ].cowChunk != 0; i = (i + 1) & snapshot->slotMask )
+    {
+        if ( snapshot->slots[ i ].chunk == chunk )
+        {
+            return snapshot->slots[ i ].cowChunk;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Add an exception to the hash, keeping the table at most half full.
+ * @return 0 on success, -1 if out of memory
+ */
+static int addException( tSnapshot * snapshot, uint64_t chunk, uint64_t cowChunk )
+{
+    if ( (snapshot->exceptionCount + 1) * 2 > snapshot->slotMask + 1 )
+    {
+        uint64_t         oldSize  = snapshot->slotMask + 1;
+        tExceptionSlot * oldSlots = snapshot->slots;
+        tExceptionSlot * slots    = calloc( oldSize * 2, sizeof( tExceptionSlot ) );
+
+        if ( !isHeapPtr( slots ) )
+        {
+            return -1;
+        }
+        snapshot->slots    = slots;
+        snapshot->slotMask = oldSize * 2 - 1;
+        for ( uint64_t i = 0; i < oldSize; ++i )
+        {
+            if ( oldSlots[ i ].cowChunk != 0 )
+            {
+                uint64_t j = hashChunk( snapshot, oldSlots[ i ].chunk );
+                while ( slots[ j ].cowChunk != 0 )
+                {
+                    j = (j + 1) & snapshot->slotMask;
+                }
+                slots[ j ] = oldSlots[ i ];
+            }
+        }
+        free( oldSlots );
+    }
+
+    uint64_t i = hashChunk( snapshot, chunk );
+    while ( snapshot->slots[ i ].cowChunk != 0 && snapshot->slots[ i ].chunk != chunk )
+    {
+        i = (i + 1) & snapshot->slotMask;
+    }
+    if ( snapshot->slots[ i ].cowChunk != 0 )
+    {
+        /* the same chunk again: the later copy is the one that counts */
+        snapshot->slots[ i ].cowChunk = cowChunk;
+        return 0;
+    }
+    snapshot->slots[ i ].chunk    = chunk;
+    snapshot->slots[ i ].cowChunk = cowChunk;
+
+    if ( snapshot->exceptionCount == snapshot->exceptionSpace )
+    {
+        size_t     space    = snapshot->exceptionSpace > 0 ? snapshot->exceptionSpace * 2 : 256;
+        uint64_t * remapped = realloc( snapshot->remapped, space * sizeof( uint64_t ) );
+        if ( !isHeapPtr( remapped ) )
+        {
+            return -1;
+        }
+        snapshot->remapped       = remapped;
+        snapshot->exceptionSpace = space;
+    }
+    snapshot->remapped[ snapshot->exceptionCount++ ] = chunk;
+    return 0;
+}
+
+/* qsort comparator: chunk numbers in order */
+static int compareChunks( const void * a, const void * b )
+{
+    uint64_t chunkA = *(const uint64_t *) a;
+    uint64_t chunkB = *(const uint64_t *) b;
+
+    return (chunkA > chunkB) - (chunkA < chunkB);
+}
+
+/**
+ * @return the first chunk after the one given that has an exception, or UINT64_MAX if none does
+ */
+static uint64_t findNextException( tSnapshot * snapshot, uint64_t chunk )
+{
+    size_t low  = 0;
+    size_t high = snapshot->exceptionCount;
+
+    while ( low < high )
+    {
+        size_t middle = low + (high - low) / 2;
+        if ( snapshot->remapped[ middle ] <= chunk )
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return (low < snapshot->exceptionCount) ? snapshot->remapped[ low ] : UINT64_MAX;
+}
+
+/**
+ * Read the exception table from the COW store into the hash.
+ * @return 0 on success, -1 if it can't be read, or doesn't make sense
+ */
+static int loadExceptions( tSnapshot * snapshot, const char * name )
+{
+    uint64_t             perArea   = snapshot->chunkSize / sizeof( tSnapshotException );
+    uint64_t             cowChunks = snapshot->cow->length / snapshot->chunkSize;
+    uint64_t             chunks    = (snapshot->start + snapshot->length + snapshot->chunkSize - 1) / snapshot->chunkSize;
+    tSnapshotException * area      = malloc( snapshot->chunkSize );
+
+    if ( !isHeapPtr( area ) )
+    {
+        return -1;
+    }
+
+    /* each metadata chunk is followed by the data chunks it describes */
+    for ( uint64_t metadataChunk = 1; metadataChunk < cowChunks; metadataChunk += perArea + 1 )
+    {
+        if ( readVolumeRange( snapshot->cow, metadataChunk * snapshot->chunkSize, area, snapshot->chunkSize )
+             != (ssize_t) snapshot->chunkSize )
+        {
+            LogError( "unable to read the exceptions of snapshot \"%s\" at chunk %lu", name, metadataChunk );
+            free( area );
+            return -1;
+        }
+        for ( uint64_t i = 0; i < perArea; ++i )
+        {
+            uint64_t chunk    = get64LE( area[ i ].oldChunk );
+            uint64_t cowChunk = get64LE( area[ i ].newChunk );
+
+            if ( cowChunk == 0 )
+            {
+                free( area );
+                return 0;
+            }
+            if ( chunk >= chunks || cowChunk >= cowChunks )
+            {
+                LogError( "snapshot \"%s\" maps chunk %lu to chunk %lu of its COW store, which doesn't fit",
+                          name, chunk, cowChunk );
+                free( area );
+                return -1;
+            }
+            if ( addException( snapshot, chunk, cowChunk ) < 0 )
+            {
+                free( area );
+                return -1;
+            }
+        }
+    }
+    /* the COW store is full, so the table has no end marker */
+    free( area );
+    return 0;
+}
+
+/**
+ * Check a snapshot's COW store, and load its exceptions. The origin and COW
+ * store must already be loaded.
+ *
+ * @param lv       the snapshot volume
+ * @param segment  its snapshot segment
+ * @param number   the segment's position in the metadata, for messages
+ * @return the snapshot, or NULL if it can't be read
+ */
+tSnapshot * openSnapshot( tLogicalVolume * lv, tLogicalVolumeSegment * segment, int number )
+{
+    tSnapshotHeader header;
+    tSnapshot     * snapshot = calloc( sizeof( tSnapshot ), 1 );
+
+    if ( !isHeapPtr( snapshot ) )
+    {
+        return NULL;
+    }
+    snapshot->origin    = segment->origin.lv;
+    snapshot->cow       = segment->cowStore.lv;
+    snapshot->chunkSize = segment->stripeSize;
+    snapshot->start     = segment->startExtent * lv->extentSize;
+    snapshot->length    = segment->extentCount * lv->extentSize;
+    snapshot->slotMask  = 255;
+    snapshot->slots     = calloc( snapshot->slotMask + 1, sizeof( tExceptionSlot ) );
+
+    if ( !isHeapPtr( snapshot->slots ) )
+    {
+        closeSnapshot( snapshot );
+        return NULL;
+    }
+    if ( snapshot->chunkSize < sizeof( tSnapshotException ) || (snapshot->chunkSize & (snapshot->chunkSize - 1)) != 0 )
+    {
+        LogError( "segment %d of \"%s\" has %lu byte chunks, which isn't a power of two",
+                  number, lv->name, snapshot->chunkSize );
+        closeSnapshot( snapshot );
+        return NULL;
+    }
+    if ( readVolumeRange( snapshot->cow, 0, &header, sizeof( header ) ) != sizeof( header ) )
+    {
+        LogError( "unable to read the COW store of \"%s\"", lv->name );
+        closeSnapshot( snapshot );
+        return NULL;
+    }
+    if ( get32LE( header.magic ) != kSnapshotMagic || get32LE( header.version ) != kSnapshotVersion
+      || (uint64_t) get32LE( header.chunkSize ) * kLVMSectorSize != snapshot->chunkSize )
+    {
+        LogError( "\"%s\" isn't a version %d COW store with %lu byte chunks",
+                  segment->cowStore.lvName, kSnapshotVersion, snapshot->chunkSize );
+        closeSnapshot( snapshot );
+        return NULL;
+    }
+    if ( get32LE( header.valid ) == 0 )
+    {
+        LogError( "snapshot \"%s\" has been invalidated (probably its COW store filled up)", segment->cowStore.lvName );
+        closeSnapshot( snapshot );
+        return NULL;
+    }
+    if ( loadExceptions( snapshot, segment->cowStore.lvName ) < 0 )
+    {
+        closeSnapshot( snapshot );
+        return NULL;
+    }
+    qsort( snapshot->remapped, snapshot->exceptionCount, sizeof( uint64_t ), compareChunks );
+
+    LogInfo( "snapshot \"%s\" of \"%s\": %lu of its %lu KB chunks have changed",
+             segment->cowStore.lvName, segment->origin.lvName, snapshot->exceptionCount, snapshot->chunkSize / 1024 );
+    return snapshot;
+}
+
+/**
+ * Find where a run of a snapshot is: in the COW store if it's been remapped,
+ * or in the origin if not.
+ *
+ * @param within  byte offset into the segment
+ * @param limit   the most bytes wanted
+ * @param source  set to the volume it's in
+ * @param offset  set to the byte offset into that volume
+ * @return how many bytes follow contiguously in that volume
+ */
+static uint64_t findSnapshotRun( tSnapshot * snapshot, uint64_t within, uint64_t limit,
+                                 tLogicalVolume ** source, uint64_t * offset )
+{
+    uint64_t position = snapshot->start + within;
+    uint64_t chunk    = position / snapshot->chunkSize;
+    uint64_t inChunk  = position % snapshot->chunkSize;
+    uint64_t wanted   = (inChunk + limit + snapshot->chunkSize - 1) / snapshot->chunkSize;
+    uint64_t cowChunk = findException( snapshot, chunk );
+    uint64_t count    = 1;
+
+    if ( cowChunk != 0 )
+    {
+        /* chunks copied one after another usually land one after another */
+        while ( count < wanted && findException( snapshot, chunk + count ) == cowChunk + count )
+        {
+            ++count;
+        }
+        *source = snapshot->cow;
+        *offset = cowChunk * snapshot->chunkSize + inChunk;
+    }
+    else
+    {
+        uint64_t next = findNextException( snapshot, chunk );
+        count   = (next - chunk < wanted) ? next - chunk : wanted;
+        *source = snapshot->origin;
+        *offset = position;
+    }
+
+    uint64_t length = count * snapshot->chunkSize - inChunk;
+    return (length < limit) ? length : limit;
+}
+
+/**
+ * Find where an offset into a snapshot segment lives.
+ */
+void mapSnapshotOffset( tLogicalVolumeSegment * segment, uint64_t within, tExtentRun * run )
+{
+    tSnapshot      * snapshot = segment->snapshot;
+    tLogicalVolume * source;
+    uint64_t         offset;
+    uint64_t         length   = findSnapshotRun( snapshot, within, snapshot->length - within, &source, &offset );
+
+    if ( findExtentRun( source, offset, run ) < 0 )
+    {
+        /* past the end of the origin, which can't have shrunk while it had snapshots */
+        run->physicalVolume = NULL;
+        run->offset         = 0;
+        run->length         = length;
+        run->rebuild        = 0;
+    }
+    else if ( run->length > length )
+    {
+        run->length = length;
+    }
+}
+
+/**
+ * Read part of a snapshot segment through its origin and COW store, rather
+ * than going straight to the physical volumes, so either of them can recover
+ * its own reads.
+ *
+ * @return the number of bytes read, which stops at the end of the segment, or -1
+ */
+ssize_t readSnapshotRange( tLogicalVolumeSegment * segment, uint64_t within, void * dest, size_t length )
+{
+    tSnapshot * snapshot = segment->snapshot;
+    byte      * p        = dest;
+
+    if ( length > snapshot->length - within )
+    {
+        length = snapshot->length - within;
+    }
+
+    size_t remaining = length;
+    while ( remaining > 0 )
+    {
+        tLogicalVolume * source;
+        uint64_t         offset;
+        uint64_t         count = findSnapshotRun( snapshot, within, remaining, &source, &offset );
+
+        if ( readVolumeRange( source, offset, p, count ) != (ssize_t) count )
+        {
+            return -1;
+        }
+        p         += count;
+        within    += count;
+        remaining -= count;
+    }
+    return length;
+}
+
+void closeSnapshot( tSnapshot * snapshot )
+{
+    if ( snapshot != NULL )
+    {
+        free( snapshot->slots );
+        free( snapshot->remapped );
+        free( snapshot );
+    }
+}
@@ -0,0 +1,19 @@
+/*
+    Reading old-style (non-thin) snapshots.
+
+    A snapshot is its origin volume as it was when the snapshot was taken.
+    Before a chunk of the origin is first written to, the kernel copies it
+    to the snapshot's COW store, and records the copy in an exception
+    table there. Chunks with an exception are read from the COW store;
+    the rest are still the same as the origin's, and are read from there.
+*/
+
+#ifndef READLOGICALVOLUME_SNAPSHOT_H
+#define READLOGICALVOLUME_SNAPSHOT_H
+
+tSnapshot * openSnapshot( tLogicalVolume * lv, tLogicalVolumeSegment * segment, int number );
+void        mapSnapshotOffset( tLogicalVolumeSegment * segment, uint64_t within, tExtentRun * run );
+ssize_t     readSnapshotRange( tLogicalVolumeSegment * segment, uint64_t within, void * dest, size_t length );
+void        closeSnapshot( tSnapshot * snapshot );
+
+#endif //READLOGICALVOLUME_SNAPSHOT_H
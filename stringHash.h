@@ -8,8 +8,10 @@
 #include "readlogicalvolume.h"
 typedef unsigned long tHash;
 
-int checkCRC32( uint32_t crc, byte * ptr, size_t length );
+int checkCRC32( uint32_t crc, const byte * ptr, size_t length );
+int checkLVMCRC32( uint32_t crc, const byte * ptr, size_t length );
 void crc32( const void * data, size_t n_bytes, uint32_t * crc );
+uint32_t crc32c( uint32_t crc, const void * data, size_t length );
 tHash hashString( const tStringZ * ptr );
 tHash hashBytes( const char * ptr, size_t len );
 
@@ -0,0 +1,330 @@
+/*
+    Tests the metadata scan: every vector classifier the CPU can run, against
+    the portable one, on the metadata in testdata/metadata.txt.
+
+    The text is tried at each offset from a 64-byte boundary, so every
+    quote, escape and structural character in it lands at every position
+    in a block, and runs of them straddle the boundary between two. At each
+    offset, each classifier has to give the same masks as the portable one,
+    and the same structural characters from a scan; and the trees parsed
+    with each, all at once and lazily, have to be the same as the portable
+    one's, and hold what the text says.
+
+    The text is also parsed into a fixed arena, in a static buffer: one big
+    enough has to give the same tree, and one too small has to give none.
+*/
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "readlogicalvolume.h"
+#include "debug.h"
+#include "readaccess.h"
+#include "stringHash.h"
+#include "arena.h"
+#include "metadataScan.h"
+#include "lvm.h"
+#include "parseMetadata.h"
+
+/* the text is moved along by each of this many bytes */
+#define kShifts     64
+
+/* room for the tree of testdata/metadata.txt a few times over */
+#define kFixedArenaSize (64 * 1024)
+
+static tScanClassifier gClassifiers[ kMaxScanClassifiers ];
+static const char    * gNames[ kMaxScanClassifiers ];
+static unsigned        gCount;
+
+static byte gFixedBuffer[ kFixedArenaSize ];
+
+/**
+ * @return the contents of the file, with *length set to its size, or NULL
+ */
+static byte * loadFile( const char * path, size_t * length )
+{
+    FILE * file   = fopen( path, "rb" );
+    byte * result = NULL;
+
+    if ( file == NULL )
+    {
+        LogError( "unable to open \"%s\"", path );
+        return NULL;
+    }
+    if ( fseek( file, 0, SEEK_END ) == 0 )
+    {
+        long size = ftell( file );
+        result = (size > 0) ? malloc( size ) : NULL;
+        if ( isHeapPtr( result ) )
+        {
+            rewind( file );
+            *length = fread( result, 1, size, file );
+            if ( *length != (size_t) size )
+            {
+                free( result );
+                result = NULL;
+            }
+        }
+    }
+    fclose( file );
+    return result;
+}
+
+/**
+ * Every classifier has to set the same bits as the portable one, in every block.
+ * @return 0 if they all do, -1 if not
+ */
+static int checkMasks( const byte * text, size_t length, unsigned shift )
+{
+    size_t     blocks = (length + 63) / 64;
+    byte     * padded = calloc( blocks, 64 );
+    uint64_t * expect = calloc( blocks, sizeof( uint64_t ) );
+    uint64_t * masks  = calloc( blocks, sizeof( uint64_t ) );
+    int        result = 0;
+
+    if ( !isHeapPtr( padded ) || !isHeapPtr( expect ) || !isHeapPtr( masks ) )
+    {
+        result = -1;
+    }
+    else
+    {
+        memcpy( padded, text, length );
+        (*gClassifiers[ 0 ])( padded, blocks, expect );
+
+        for ( unsigned i = 1; i < gCount; ++i )
+        {
+            (*gClassifiers[ i ])( padded, blocks, masks );
+            for ( size_t b = 0; b < blocks; ++b )
+            {
+                if ( masks[ b ] != expect[ b ] )
+                {
+                    LogError( "shifted %u: %s gives %016lx for block %lu, not %016lx",
+                              shift, gNames[ i ], masks[ b ], b, expect[ b ] );
+                    result = -1;
+                    break;
+                }
+            }
+        }
+    }
+    free( padded );
+    free( expect );
+    free( masks );
+    return result;
+}
+
+/**
+ * Scanning with each classifier, partial block at the end and all, has to find
+ * the same structural characters as scanning with the portable one.
+ * @return 0 if it does, -1 if not
+ */
+static int checkScan( const byte * text, size_t length, unsigned shift )
+{
+    for ( unsigned i = 1; i < gCount; ++i )
+    {
+        tMetadataScan expect;
+        tMetadataScan scan;
+        size_t        offset;
+
+        initMetadataScan( &expect, text, length, gClassifiers[ 0 ] );
+        initMetadataScan( &scan, text, length, gClassifiers[ i ] );
+        do
+        {
+            offset = nextStructural( &expect );
+            size_t found = nextStructural( &scan );
+            if ( found != offset )
+            {
+                LogError( "shifted %u: %s scan finds offset %lu, not %lu", shift, gNames[ i ], found, offset );
+                return -1;
+            }
+        } while ( offset < length );
+    }
+    return 0;
+}
+
+/* @return non-zero if the node is a string that reads exactly so */
+static int isString( tNode * node, const char * string )
+{
+    return node != NULL && node->type == stringNode
+        && node->stringLength == strlen( string ) && memcmp( node->string, string, node->stringLength ) == 0;
+}
+
+/* @return non-zero if the node is a child or list node with that many children */
+static int hasChildren( tNode * node, int count )
+{
+    if ( node == NULL || (node->type != childNode && node->type != listNode) )
+    {
+        return 0;
+    }
+    for ( tNode * child = node->child; child != NULL; child = child->next )
+    {
+        --count;
+    }
+    return count == 0;
+}
+
+/**
+ * Check a tree parsed all at once holds what's in testdata/metadata.txt: in
+ * particular, that no quote, escape or structural character inside a string
+ * or comment was taken for anything else.
+ * @return 0 if it does, -1 if not
+ */
+static int checkValues( tNode * root, const char * name, unsigned shift )
+{
+    tNode * extentCount = getKeyPath( "vg0/logical_volumes/home/segment1/extent_count", root );
+    tNode * dataCount   = getKeyPath( "vg0/logical_volumes/data-2018.03+old/segment1/extent_count", root );
+    tNode * version     = getKeyPath( "version", root );
+
+    if ( !hasChildren( getKeyPath( "vg0/logical_volumes", root ), 4 )
+      || !hasChildren( getKeyPath( "vg0/tags", root ), 7 )
+      || !hasChildren( getKeyPath( "vg0/logical_volumes/root/tags", root ), 4 )
+      || !isString( getKeyPath( "vg0/logical_volumes/root/creation_host", root ), "host \\\"a\\\" { b } [ c ] = d , e # f" )
+      || !isString( getKeyPath( "vg0/logical_volumes/swap/creation_host", root ), "\\\\" )
+      || !isString( getKeyPath( "vg0/logical_volumes/home/creation_host", root ), "x\\\"}\\\"" )
+      || extentCount == NULL || extentCount->type != integerNode || extentCount->integer != 25600
+      || dataCount == NULL || dataCount->type != integerNode || dataCount->integer != 512
+      || version == NULL || version->type != integerNode || version->integer != 1
+      || !isString( getKeyPath( "contents", root ), "Text Format Volume Group" ) )
+    {
+        LogError( "shifted %u: the tree parsed with %s doesn't hold what the text does", shift, name );
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * The trees parsed with each classifier, all at once and lazily, have to be the
+ * same as the one parsed all at once with the portable one.
+ * @return 0 if they are, -1 if not
+ */
+static int checkTrees( const byte * text, size_t length, unsigned shift )
+{
+    tArena * arena  = newArena( 0 );
+    int      result = 0;
+
+    if ( !isHeapPtr( arena ) )
+    {
+        return -1;
+    }
+
+    tNode * expect = parseMetadataText( arena, text, length, gClassifiers[ 0 ], 0 );
+    if ( expect == NULL || checkValues( expect, gNames[ 0 ], shift ) < 0 )
+    {
+        result = -1;
+    }
+    for ( unsigned i = 0; i < gCount && result == 0; ++i )
+    {
+        for ( int lazy = (i == 0); lazy <= 1 && result == 0; ++lazy )
+        {
+            tNode * tree = parseMetadataText( arena, text, length, gClassifiers[ i ], lazy );
+            if ( tree == NULL || !isSameTree( tree, expect ) )
+            {
+                LogError( "shifted %u: the %s tree parsed with %s differs from the portable one",
+                          shift, lazy ? "lazy" : "whole", gNames[ i ] );
+                result = -1;
+            }
+        }
+    }
+    freeArena( arena );
+    return result;
+}
+
+/**
+ * A fixed arena has to hold the same tree as a growing one, and hold it again
+ * once it's reset. One too small for the tree has to make the parse fail,
+ * rather than leave something out.
+ * @return 0 if it does, -1 if not
+ */
+static int checkFixedArena( const byte * text, size_t length )
+{
+    tArena * arena  = newArena( 0 );
+    tArena * fixed  = newFixedArena( gFixedBuffer, sizeof( gFixedBuffer ) );
+    int      result = 0;
+
+    if ( !isHeapPtr( arena ) || fixed == NULL )
+    {
+        freeArena( arena );
+        return -1;
+    }
+
+    tNode * expect = parseMetadataText( arena, text, length, gClassifiers[ 0 ], 0 );
+    size_t  needed = getArenaUsage( arena );
+
+    for ( int pass = 0; pass < 2 && result == 0; ++pass )
+    {
+        tNode * tree = parseMetadataText( fixed, text, length, gClassifiers[ 0 ], 0 );
+        if ( tree == NULL || !isSameTree( tree, expect ) || checkValues( tree, "a fixed arena", 0 ) < 0
+          || getArenaUsage( fixed ) != needed )
+        {
+            LogError( "the tree parsed into a fixed arena differs from the one in a growing arena" );
+            result = -1;
+        }
+        resetArena( fixed );
+    }
+    freeArena( fixed );
+
+    /* half the room the tree takes */
+    fixed = newFixedArena( gFixedBuffer, needed / 2 );
+    if ( fixed == NULL || parseMetadataText( fixed, text, length, gClassifiers[ 0 ], 0 ) != NULL )
+    {
+        LogError( "parsing into a fixed arena of %lu bytes didn't fail, with %lu needed", needed / 2, needed );
+        result = -1;
+    }
+    freeArena( fixed );
+    freeArena( arena );
+    return result;
+}
+
+int main( int argc, char * argv[] )
+{
+    size_t length;
+    byte * text;
+    byte * shifted;
+    int    result = EXIT_SUCCESS;
+
+    if ( argc != 2 )
+    {
+        fprintf( stderr, "usage: %s <testdata/metadata.txt>\n", argv[ 0 ] );
+        return EXIT_FAILURE;
+    }
+    text = loadFile( argv[ 1 ], &length );
+    shifted = isHeapPtr( text ) ? malloc( kShifts + length ) : NULL;
+    if ( !isHeapPtr( shifted ) )
+    {
+        free( text );
+        return EXIT_FAILURE;
+    }
+    gCount = getScanClassifiers( gClassifiers, gNames );
+
+    /* blanks in front of the first key are skipped, so only where everything falls moves */
+    for ( unsigned shift = 0; shift < kShifts; ++shift )
+    {
+        memset( shifted, ' ', shift );
+        memcpy( shifted + shift, text, length );
+
+        if ( checkMasks( shifted, shift + length, shift ) < 0
+          || checkScan( shifted, shift + length, shift ) < 0
+          || checkTrees( shifted, shift + length, shift ) < 0 )
+        {
+            result = EXIT_FAILURE;
+        }
+    }
+    if ( checkFixedArena( text, length ) < 0 )
+    {
+        result = EXIT_FAILURE;
+    }
+
+    for ( unsigned i = 0; i < gCount; ++i )
+    {
+        printf( "%s%s", (i > 0) ? ", " : "", gNames[ i ] );
+    }
+    printf( ": %s, at %d offsets: %s\n", argv[ 1 ], kShifts, (result == EXIT_SUCCESS) ? "ok" : "FAILED" );
+
+    free( shifted );
+    free( text );
+    return result;
+}
@@ -0,0 +1,698 @@
+/*
+    Reading thin volumes.
+
+    The metadata volume is made of 4KB blocks. Block 0 is the superblock,
+    which holds the roots of two b-trees: one from each thin volume's
+    device id to a few details about it, and a two-level one from a device
+    id, then a block of that device, to the block of the data volume that
+    holds it. It also holds the roots of the two space maps, which count
+    the references to each block of the data and metadata volumes; only
+    their totals are used here, to check that the pool adds up before
+    anything is read from it.
+
+    Every metadata block has a checksum, which is checked as it's read
+    in. The checked blocks are kept in a small LRU cache, and the leaf the
+    last lookup landed in is kept to one side, along with the range of
+    blocks it covers, so a sequential read only goes back to the tree when
+    it steps off the end of a leaf. Blocks that follow each other in the
+    data volume too are returned as a single run, so a volume that was
+    written in order reads back in long requests.
+*/
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "readlogicalvolume.h"
+#include "debug.h"
+#include "stringHash.h"
+#include "readaccess.h"
+#include "parseMetadata.h"
+#include "lvm.h"
+#include "extentIndex.h"
+#include "blockCache.h"
+#include "lvAccess.h"
+#include "thinPool.h"
+
+/* the metadata volume is read and written in blocks of this size */
+#define kThinBlockSize          4096
+
+#define kThinSuperblockMagic    27022010
+#define kThinSuperblockXor      160774
+#define kThinNodeXor            121107
+
+/* set while the kernel thinks the metadata needs a thin_check */
+#define kThinNeedsCheck         0x00000001
+
+/* how many metadata blocks to keep in the cache */
+#define kThinNodeCacheBlocks    256
+
+/* deeper than any real tree could be: there's a loop in it */
+#define kMaxThinTreeDepth       16
+
+typedef struct tThinSpaceMapRoot
+{                               /* Ofst Size Description */
+    byte    blockCount[8];      /*   0   8   blocks in the volume */
+    byte    allocated[8];       /*   8   8   of them, how many are in use */
+    byte    bitmapRoot[8];      /*  16   8   index of the reference count bitmaps */
+    byte    refCountRoot[8];    /*  24   8   b-tree of the counts too big for the bitmaps */
+} tThinSpaceMapRoot;
+
+typedef struct tThinSuperblock
+{                                   /* Ofst Size Description */
+    byte    csum[4];                /*   0   4   crc32c from offset 4 to the end of the block, xor kThinSuperblockXor */
+    byte    flags[4];               /*   4   4   kThinNeedsCheck */
+    byte    blockNumber[8];         /*   8   8   always 0 */
+    byte    uuid[16];               /*  16  16   */
+    byte    magic[8];               /*  32   8   kThinSuperblockMagic */
+    byte    version[4];             /*  40   4   1 or 2 */
+    byte    time[4];                /*  44   4   bumped for each snapshot */
+    byte    transactionId[8];       /*  48   8   */
+    byte    heldRoot[8];            /*  56   8   a metadata snapshot, if one's been taken */
+    byte    dataSpaceMap[128];      /*  64 128   tThinSpaceMapRoot for the data volume */
+    byte    metadataSpaceMap[128];  /* 192 128   tThinSpaceMapRoot for the metadata volume */
+    byte    mappingRoot[8];         /* 320   8   device id -> (block -> data block) */
+    byte    detailsRoot[8];         /* 328   8   device id -> tThinDeviceDetails */
+    byte    dataBlockSize[4];       /* 336   4   in 512-byte sectors */
+    byte    metadataBlockSize[4];   /* 340   4   in 512-byte sectors; always 8 */
+    byte    metadataBlockCount[8];  /* 344   8   */
+} tThinSuperblock;
+
+typedef struct tThinNodeHeader
+{                               /* Ofst Size Description */
+    byte    csum[4];            /*   0   4   crc32c from offset 4 to the end of the block, xor kThinNodeXor */
+    byte    flags[4];           /*   4   4   kThinInternalNode or kThinLeafNode */
+    byte    blockNumber[8];     /*   8   8   where the node is, as a check */
+    byte    entryCount[4];      /*  16   4   */
+    byte    maxEntries[4];      /*  20   4   room for this many 8-byte keys, which follow; then their values */
+    byte    valueSize[4];       /*  24   4   */
+    byte    padding[4];         /*  28   4   */
+} tThinNodeHeader;
+
+#define kThinInternalNode   0x00000001
+#define kThinLeafNode       0x00000002
+
+typedef struct tThinDeviceDetails
+{                               /* Ofst Size Description */
+    byte    mappedBlocks[8];    /*   0   8   */
+    byte    transactionId[8];   /*   8   8   */
+    byte    creationTime[4];    /*  16   4   */
+    byte    snapshotTime[4];    /*  20   4   */
+} tThinDeviceDetails;
+
+struct tThinDevice
+{
+    tLogicalVolume * metadata;          /* the pool's _tmeta */
+    tLogicalVolume * data;              /* and its _tdata */
+    uint64_t         metadataBlocks;
+    uint64_t         blockSize;         /* of the data blocks, in bytes */
+    uint64_t         blockCount;        /* data blocks in the pool */
+    uint64_t         root;              /* of the device's own mapping tree */
+    uint64_t         start;             /* where the segment starts in the device, in bytes */
+    uint64_t         length;            /* and how long it is */
+    tBlockCache    * nodes;             /* metadata blocks, already checked */
+
+    pthread_mutex_t  lock;              /* over the rest */
+    int              hintValid;
+    uint64_t         hintLow;           /* the leaf the last lookup landed in, and the range */
+    uint64_t         hintHigh;          /* of blocks [low, high) it has all the mappings for */
+    byte             hint[ kThinBlockSize ];
+    unsigned long    lookups;
+    unsigned long    hintHits;
+};
+
+static uint32_t getEntryCount( const byte * node )
+{
+    return get32LE( ((const tThinNodeHeader *) node)->entryCount );
+}
+
+static uint64_t getNodeKey( const byte * node, uint32_t index )
+{
+    return get64LE( node + sizeof( tThinNodeHeader ) + index * sizeof( uint64_t ) );
+}
+
+static const byte * getNodeValue( const byte * node, uint32_t index )
+{
+    const tThinNodeHeader * header = (const tThinNodeHeader *) node;
+
+    return node + sizeof( tThinNodeHeader ) + get32LE( header->maxEntries ) * sizeof( uint64_t )
+                + index * get32LE( header->valueSize );
+}
+
+/**
+ * @return the index of the first key in a node at or after the one given,
+ *         or the entry count if there isn't one
+ */
+static uint32_t findFirstKey( const byte * node, uint64_t key )
+{
+    uint32_t low  = 0;
+    uint32_t high = getEntryCount( node );
+
+    while ( low < high )
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if ( getNodeKey( node, middle ) < key )
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * Check a metadata block's checksum, and that it's where it thinks it is. The
+ * superblock and the b-tree nodes start the same way, but use different xors.
+ * @return 0 if it's good, -1 if not
+ */
+static int checkThinBlock( const byte * block, uint64_t number, uint32_t xor )
+{
+    const tThinNodeHeader * header = (const tThinNodeHeader *) block;
+    uint32_t                csum   = crc32c( ~0, block + sizeof( header->csum ), kThinBlockSize - sizeof( header->csum ) ) ^ xor;
+
+    if ( csum != get32LE( header->csum ) )
+    {
+        LogError( "thin pool metadata block %lu is corrupt (its checksum is %08x, but should be %08x)",
+                  number, get32LE( header->csum ), csum );
+        return -1;
+    }
+    if ( get64LE( header->blockNumber ) != number )
+    {
+        LogError( "thin pool metadata block %lu thinks it's block %lu", number, get64LE( header->blockNumber ) );
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Fills the node cache: reads a metadata block, and checks it's a sound
+ * b-tree node, so nothing that comes out of the cache needs checking again.
+ */
+static ssize_t fillThinNode( void * context, off64_t offset, void * dest, size_t length )
+{
+    tThinDevice     * thin   = context;
+    tThinNodeHeader * header = dest;
+    uint64_t          number = offset / kThinBlockSize;
+
+    if ( length != kThinBlockSize || readVolumeRange( thin->metadata, offset, dest, length ) != (ssize_t) length )
+    {
+        LogError( "unable to read thin pool metadata block %lu", number );
+        return -1;
+    }
+    if ( checkThinBlock( dest, number, kThinNodeXor ) < 0 )
+    {
+        return -1;
+    }
+
+    uint32_t flags      = get32LE( header->flags );
+    uint32_t maxEntries = get32LE( header->maxEntries );
+    uint32_t valueSize  = get32LE( header->valueSize );
+
+    if ( (flags != kThinInternalNode && flags != kThinLeafNode)
+      || getEntryCount( dest ) > maxEntries
+      || valueSize == 0
+      || sizeof( tThinNodeHeader ) + maxEntries * (sizeof( uint64_t ) + valueSize) > kThinBlockSize )
+    {
+        LogError( "thin pool metadata block %lu isn't a b-tree node", number );
+        return -1;
+    }
+    return length;
+}
+
+/**
+ * Get a b-tree node, from the cache if it's there.
+ *
+ * @param number     the metadata block it's in
+ * @param node       kThinBlockSize bytes to copy it to
+ * @param valueSize  the size of the values if it's a leaf; internal nodes' values are block numbers
+ * @return 0 on success, -1 if it can't be read, or isn't the node expected
+ */
+static int getThinNode( tThinDevice * thin, uint64_t number, byte * node, uint32_t valueSize )
+{
+    const tThinNodeHeader * header = (const tThinNodeHeader *) node;
+
+    if ( number >= thin->metadataBlocks )
+    {
+        LogError( "thin pool metadata refers to block %lu, past the end of the metadata", number );
+        return -1;
+    }
+    if ( readBlockCache( thin->nodes, number * kThinBlockSize, node, kThinBlockSize ) != kThinBlockSize )
+    {
+        return -1;
+    }
+
+    uint32_t expected = (get32LE( header->flags ) == kThinLeafNode) ? valueSize : sizeof( uint64_t );
+    if ( get32LE( header->valueSize ) != expected )
+    {
+        LogError( "thin pool metadata block %lu has %u byte values, not %u", number, get32LE( header->valueSize ), expected );
+        return -1;
+    }
+    if ( get32LE( header->flags ) == kThinInternalNode && getEntryCount( node ) == 0 )
+    {
+        LogError( "thin pool metadata block %lu is an empty internal node", number );
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Walk down a b-tree to the leaf that would hold a key. Every key in the tree
+ * from low up to (not including) high is in that leaf, if it's anywhere.
+ *
+ * @param root       the tree's root block
+ * @param key        the key
+ * @param valueSize  the size of the values in its leaves
+ * @param leaf       kThinBlockSize bytes to put the leaf in
+ * @param low, high  set to the range of keys the leaf covers
+ * @return 0 on success, -1 on error
+ */
+static int findThinLeaf( tThinDevice * thin, uint64_t root, uint64_t key, uint32_t valueSize,
+                         byte * leaf, uint64_t * low, uint64_t * high )
+{
+    uint64_t number = root;
+
+    *low  = 0;
+    *high = UINT64_MAX;
+    for ( int depth = 0; depth < kMaxThinTreeDepth; ++depth )
+    {
+        if ( getThinNode( thin, number, leaf, valueSize ) < 0 )
+        {
+            return -1;
+        }
+        if ( get32LE( ((const tThinNodeHeader *) leaf)->flags ) == kThinLeafNode )
+        {
+            return 0;
+        }
+
+        /* the last child whose first key is at or before this one; the first
+           child if there isn't one, as the next key after it will be there */
+        uint32_t count = getEntryCount( leaf );
+        uint32_t index = findFirstKey( leaf, key );
+        if ( index == count || getNodeKey( leaf, index ) > key )
+        {
+            index = (index > 0) ? index - 1 : 0;
+        }
+        if ( getNodeKey( leaf, index ) <= key && getNodeKey( leaf, index ) > *low )
+        {
+            *low = getNodeKey( leaf, index );
+        }
+        if ( index + 1 < count && getNodeKey( leaf, index + 1 ) < *high )
+        {
+            *high = getNodeKey( leaf, index + 1 );
+        }
+        number = get64LE( getNodeValue( leaf, index ) );
+    }
+    LogError( "thin pool metadata b-tree at block %lu is more than %d levels deep", root, kMaxThinTreeDepth );
+    return -1;
+}
+
+/**
+ * Look up a key in a b-tree.
+ * @param node  kThinBlockSize bytes to read the nodes into
+ * @return where its value is in node, or NULL if it's not in the tree (or on error)
+ */
+static const byte * lookupThinValue( tThinDevice * thin, uint64_t root, uint64_t key, uint32_t valueSize, byte * node )
+{
+    uint64_t low, high;
+
+    if ( findThinLeaf( thin, root, key, valueSize, node, &low, &high ) < 0 )
+    {
+        return NULL;
+    }
+    uint32_t index = findFirstKey( node, key );
+    if ( index == getEntryCount( node ) || getNodeKey( node, index ) != key )
+    {
+        return NULL;
+    }
+    return getNodeValue( node, index );
+}
+
+/**
+ * Map a block of the device from the leaf of its mapping tree that covers it.
+ *
+ * @param high       the first block past the ones the leaf covers
+ * @param dataBlock  set to where the block is in the data volume, if it's mapped
+ * @param count      set to how many blocks, starting with this one, are mapped to consecutive
+ *                   data blocks; or if it isn't mapped, how many unmapped blocks there are
+ * @return 1 if the block is mapped, 0 if it isn't
+ */
+static int mapFromLeaf( const byte * leaf, uint64_t high, uint64_t block, uint64_t * dataBlock, uint64_t * count )
+{
+    uint32_t entries = getEntryCount( leaf );
+    uint32_t index   = findFirstKey( leaf, block );
+
+    if ( index < entries && getNodeKey( leaf, index ) == block )
+    {
+        /* the data block, with the time it was mapped in the bottom 24 bits */
+        *dataBlock = get64LE( getNodeValue( leaf, index ) ) >> 24;
+        *count     = 1;
+        while ( index + *count < entries
+             && getNodeKey( leaf, index + *count ) == block + *count
+             && get64LE( getNodeValue( leaf, index + *count ) ) >> 24 == *dataBlock + *count )
+        {
+            ++*count;
+        }
+        return 1;
+    }
+    *count = ((index < entries) ? getNodeKey( leaf, index ) : high) - block;
+    return 0;
+}
+
+/**
+ * Map a block of the device, through the last leaf looked up if it covers the
+ * block, or by walking the tree if not.
+ * @return 1 if the block is mapped, 0 if it isn't, -1 if the metadata can't be read
+ */
+static int findThinBlocks( tThinDevice * thin, uint64_t block, uint64_t * dataBlock, uint64_t * count )
+{
+    byte     leaf[ kThinBlockSize ];
+    uint64_t low, high;
+    int      mapped;
+
+    pthread_mutex_lock( &thin->lock );
+    ++thin->lookups;
+    if ( thin->hintValid && block >= thin->hintLow && block < thin->hintHigh )
+    {
+        ++thin->hintHits;
+        mapped = mapFromLeaf( thin->hint, thin->hintHigh, block, dataBlock, count );
+        pthread_mutex_unlock( &thin->lock );
+    }
+    else
+    {
+        pthread_mutex_unlock( &thin->lock );
+        if ( findThinLeaf( thin, thin->root, block, sizeof( uint64_t ), leaf, &low, &high ) < 0 )
+        {
+            return -1;
+        }
+        mapped = mapFromLeaf( leaf, high, block, dataBlock, count );
+
+        pthread_mutex_lock( &thin->lock );
+        memcpy( thin->hint, leaf, kThinBlockSize );
+        thin->hintLow   = low;
+        thin->hintHigh  = high;
+        thin->hintValid = 1;
+        pthread_mutex_unlock( &thin->lock );
+    }
+
+    if ( mapped && (*dataBlock >= thin->blockCount || *count > thin->blockCount - *dataBlock) )
+    {
+        LogError( "block %lu of a thin volume is mapped to block %lu, but there are only %lu in the pool",
+                  block, *dataBlock, thin->blockCount );
+        return -1;
+    }
+    return mapped;
+}
+
+/**
+ * Find where a run of a thin volume is in the pool's data volume.
+ *
+ * @param within      byte offset into the segment
+ * @param limit       the most bytes wanted
+ * @param dataOffset  set to the byte offset into the data volume, if the run is mapped
+ * @param length      set to how many bytes follow contiguously, mapped or not
+ * @return 1 if the run is mapped, 0 if it isn't (so reads as zeros), -1 if the metadata can't be read
+ */
+static int findThinRun( tThinDevice * thin, uint64_t within, uint64_t limit, uint64_t * dataOffset, uint64_t * length )
+{
+    uint64_t offset  = thin->start + within;
+    uint64_t block   = offset / thin->blockSize;
+    uint64_t inBlock = offset % thin->blockSize;
+    uint64_t dataBlock, count;
+
+    int mapped = findThinBlocks( thin, block, &dataBlock, &count );
+    if ( mapped < 0 )
+    {
+        return -1;
+    }
+
+    /* the last hole in a volume runs to the end of the keys, not of the volume */
+    uint64_t wanted = (inBlock + limit + thin->blockSize - 1) / thin->blockSize;
+    if ( count > wanted )
+    {
+        count = wanted;
+    }
+    *length = count * thin->blockSize - inBlock;
+    if ( *length > limit )
+    {
+        *length = limit;
+    }
+    *dataOffset = mapped ? dataBlock * thin->blockSize + inBlock : 0;
+    return mapped;
+}
+
+/**
+ * Find where an offset into a thin segment lives. An unmapped run has no
+ * physical volume, so reads as zeros without any i/o; if the metadata can't
+ * be read, the run is flagged for rebuild, so recoverVolumeRange() has
+ * another go at it, and reports it if that fails too.
+ */
+void mapThinOffset( tLogicalVolumeSegment * segment, uint64_t within, tExtentRun * run )
+{
+    tThinDevice * thin = segment->thin;
+    uint64_t      dataOffset, length;
+
+    int mapped = findThinRun( thin, within, thin->length - within, &dataOffset, &length );
+
+    run->rebuild = 0;
+    if ( mapped > 0 && findExtentRun( thin->data, dataOffset, run ) == 0 )
+    {
+        if ( run->length > length )
+        {
+            run->length = length;
+        }
+        return;
+    }
+
+    run->physicalVolume = NULL;
+    run->offset         = 0;
+    if ( mapped == 0 )
+    {
+        run->length = length;
+    }
+    else
+    {
+        run->length  = thin->blockSize - (thin->start + within) % thin->blockSize;
+        run->rebuild = 1;
+        if ( run->length > thin->length - within )
+        {
+            run->length = thin->length - within;
+        }
+    }
+}
+
+/**
+ * Read part of a thin segment through its data volume, rather than going
+ * straight to the physical volumes: whatever's needed to read that (another
+ * mirror leg, or parity) is taken care of by readVolumeRange().
+ *
+ * @param segment  the thin segment
+ * @param within   byte offset into it
+ * @param dest     where to put the data
+ * @param length   number of bytes wanted
+ * @return the number of bytes read, which stops at the end of the segment, or -1
+ */
+ssize_t readThinRange( tLogicalVolumeSegment * segment, uint64_t within, void * dest, size_t length )
+{
+    tThinDevice * thin = segment->thin;
+    byte        * p    = dest;
+
+    if ( length > thin->length - within )
+    {
+        length = thin->length - within;
+    }
+
+    size_t remaining = length;
+    while ( remaining > 0 )
+    {
+        uint64_t dataOffset, count;
+
+        int mapped = findThinRun( thin, within, remaining, &dataOffset, &count );
+        if ( mapped < 0 )
+        {
+            return -1;
+        }
+        if ( mapped == 0 )
+        {
+            memset( p, 0, count );
+        }
+        else if ( readVolumeRange( thin->data, dataOffset, p, count ) != (ssize_t) count )
+        {
+            return -1;
+        }
+        p         += count;
+        within    += count;
+        remaining -= count;
+    }
+    return length;
+}
+
+/**
+ * @return the pool's data volume, where a thin segment's blocks are read from
+ */
+tLogicalVolume * getThinDataVolume( tLogicalVolumeSegment * segment )
+{
+    return segment->thin->data;
+}
+
+/**
+ * Check the superblock of a pool's metadata volume, and pick up what's needed
+ * from it to map the blocks of one of its devices.
+ * @return 0 on success, -1 if the pool can't be read
+ */
+static int readThinSuperblock( tThinDevice * thin, tLogicalVolumeSegment * poolSegment, const char * poolName,
+                               uint64_t * mappingRoot, uint64_t * detailsRoot )
+{
+    byte            * block = malloc( kThinBlockSize );
+    tThinSuperblock * super = (tThinSuperblock *) block;
+    int               result = -1;
+
+    if ( !isHeapPtr( block ) )
+    {
+        return -1;
+    }
+    if ( readVolumeRange( thin->metadata, 0, block, kThinBlockSize ) != kThinBlockSize )
+    {
+        LogError( "unable to read the superblock of thin pool \"%s\"", poolName );
+    }
+    else if ( get64LE( super->magic ) != kThinSuperblockMagic || checkThinBlock( block, 0, kThinSuperblockXor ) < 0 )
+    {
+        LogError( "the metadata of thin pool \"%s\" doesn't have a valid superblock", poolName );
+    }
+    else if ( get32LE( super->version ) < 1 || get32LE( super->version ) > 2
+           || get32LE( super->metadataBlockSize ) * kLVMSectorSize != kThinBlockSize )
+    {
+        LogError( "the metadata of thin pool \"%s\" is version %u, with %u byte blocks, which isn't supported",
+                  poolName, get32LE( super->version ), get32LE( super->metadataBlockSize ) * kLVMSectorSize );
+    }
+    else
+    {
+        tThinSpaceMapRoot * dataMap     = (tThinSpaceMapRoot *) super->dataSpaceMap;
+        tThinSpaceMapRoot * metadataMap = (tThinSpaceMapRoot *) super->metadataSpaceMap;
+
+        thin->blockSize      = (uint64_t) get32LE( super->dataBlockSize ) * kLVMSectorSize;
+        thin->blockCount     = get64LE( dataMap->blockCount );
+        thin->metadataBlocks = get64LE( super->metadataBlockCount );
+        *mappingRoot         = get64LE( super->mappingRoot );
+        *detailsRoot         = get64LE( super->detailsRoot );
+
+        LogInfo( "thin pool \"%s\": transaction %lu, %lu of %lu %lu KB data blocks and %lu of %lu metadata blocks in use",
+                 poolName, get64LE( super->transactionId ),
+                 get64LE( dataMap->allocated ), thin->blockCount, thin->blockSize / 1024,
+                 get64LE( metadataMap->allocated ), get64LE( metadataMap->blockCount ) );
+
+        if ( get32LE( super->flags ) & kThinNeedsCheck )
+        {
+            LogError( "thin pool \"%s\" is flagged as needing a check; reading it anyway", poolName );
+        }
+
+        if ( thin->blockSize == 0 || (poolSegment->stripeSize != 0 && thin->blockSize != poolSegment->stripeSize) )
+        {
+            LogError( "thin pool \"%s\" has %lu byte blocks, but its metadata says %lu",
+                      poolName, poolSegment->stripeSize, thin->blockSize );
+        }
+        else if ( thin->blockCount > thin->data->length / thin->blockSize
+               || thin->metadataBlocks > thin->metadata->length / kThinBlockSize
+               || get64LE( dataMap->allocated ) > thin->blockCount
+               || get64LE( metadataMap->allocated ) > get64LE( metadataMap->blockCount ) )
+        {
+            LogError( "the space maps of thin pool \"%s\" don't fit its data and metadata volumes", poolName );
+        }
+        else
+        {
+            result = 0;
+        }
+    }
+    free( block );
+    return result;
+}
+
+/**
+ * Find a thin volume's mappings in the metadata of its pool. The pool, and its
+ * data and metadata sub-volumes, must already be loaded.
+ *
+ * @param lv       the thin volume
+ * @param segment  its thin segment
+ * @param number   the segment's position in the metadata, for messages
+ * @return its mappings, or NULL if they can't be read
+ */
+tThinDevice * openThinDevice( tLogicalVolume * lv, tLogicalVolumeSegment * segment, int number )
+{
+    tLogicalVolume * pool = segment->thinPool.lv;
+
+    if ( pool->segmentCount != 1 || pool->segments[0].type != segmentThinPool )
+    {
+        LogError( "\"%s\", the pool for segment %d of \"%s\", isn't a thin pool", pool->name, number, lv->name );
+        return NULL;
+    }
+
+    tLogicalVolumeSegment * poolSegment = &pool->segments[0];
+    tThinDevice           * thin        = calloc( sizeof( tThinDevice ), 1 );
+    byte                  * node        = malloc( kThinBlockSize );
+
+    if ( !isHeapPtr( thin ) || !isHeapPtr( node ) )
+    {
+        free( thin );
+        free( node );
+        return NULL;
+    }
+    thin->metadata = poolSegment->poolMetadata.lv;
+    thin->data     = poolSegment->poolData.lv;
+    thin->start    = segment->startExtent * lv->extentSize;
+    thin->length   = segment->extentCount * lv->extentSize;
+    pthread_mutex_init( &thin->lock, NULL );
+
+    uint64_t mappingRoot, detailsRoot;
+    if ( readThinSuperblock( thin, poolSegment, pool->name, &mappingRoot, &detailsRoot ) < 0
+      || (thin->nodes = newBlockCache( kThinBlockSize, kThinNodeCacheBlocks, 0, fillThinNode, thin )) == NULL )
+    {
+        free( node );
+        closeThinDevice( thin );
+        return NULL;
+    }
+
+    const byte * value = lookupThinValue( thin, detailsRoot, segment->deviceId, sizeof( tThinDeviceDetails ), node );
+    if ( value != NULL )
+    {
+        const tThinDeviceDetails * details = (const tThinDeviceDetails *) value;
+        LogInfo( "\"%s\" is thin device %lu of \"%s\", with %lu blocks mapped",
+                 lv->name, segment->deviceId, pool->name, get64LE( details->mappedBlocks ) );
+        value = lookupThinValue( thin, mappingRoot, segment->deviceId, sizeof( uint64_t ), node );
+    }
+    if ( value == NULL )
+    {
+        LogError( "thin device %lu (\"%s\") isn't in the metadata of thin pool \"%s\"",
+                  segment->deviceId, lv->name, pool->name );
+        free( node );
+        closeThinDevice( thin );
+        return NULL;
+    }
+    thin->root = get64LE( value );
+
+    free( node );
+    return thin;
+}
+
+void closeThinDevice( tThinDevice * thin )
+{
+    if ( thin != NULL )
+    {
+        if ( thin->nodes != NULL )
+        {
+            tBlockCacheStats stats;
+            getBlockCacheStats( thin->nodes, &stats );
+            LogInfo( "thin mappings: %lu lookups, %lu from the last leaf; metadata cache %lu hits, %lu misses",
+                     thin->lookups, thin->hintHits, stats.hits, stats.misses );
+            freeBlockCache( thin->nodes );
+        }
+        pthread_mutex_destroy( &thin->lock );
+        free( thin );
+    }
+}
@@ -0,0 +1,19 @@
+/*
+    Reading thin volumes.
+
+    A thin pool is a pair of sub-volumes: _tdata, which holds the blocks,
+    and _tmeta, which records which of them belong where in each thin
+    volume, in the kernel's dm-thin format. A block of a thin volume that
+    has never been written isn't mapped to anything, and reads as zeros.
+*/
+
+#ifndef READLOGICALVOLUME_THINPOOL_H
+#define READLOGICALVOLUME_THINPOOL_H
+
+tThinDevice    * openThinDevice( tLogicalVolume * lv, tLogicalVolumeSegment * segment, int number );
+void             mapThinOffset( tLogicalVolumeSegment * segment, uint64_t within, tExtentRun * run );
+ssize_t          readThinRange( tLogicalVolumeSegment * segment, uint64_t within, void * dest, size_t length );
+tLogicalVolume * getThinDataVolume( tLogicalVolumeSegment * segment );
+void             closeThinDevice( tThinDevice * thin );
+
+#endif //READLOGICALVOLUME_THINPOOL_H
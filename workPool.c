@@ -0,0 +1,242 @@
+/*
+    A work-stealing thread pool, for running a fixed set of numbered tasks.
+
+    Since the tasks are known up front, each worker's deque is just a range
+    of task numbers, [next, end). The owner takes from the front; a thief
+    takes from the back. A lock per worker is plenty: a task is a whole
+    chunk of i/o, so the deques are touched a few thousand times a second
+    at most.
+*/
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "readlogicalvolume.h"
+#include "debug.h"
+#include "workPool.h"
+
+typedef struct tWorker
+{
+    pthread_mutex_t   lock;
+    int               next;     /* the next task the owner will take */
+    int               end;      /* one past the last task; thieves take from here */
+    pthread_t         thread;
+    struct tWorkPool * pool;
+    unsigned          index;
+    tWorkerStats      stats;
+} tWorker;
+
+typedef struct tWorkPool
+{
+    tWorker         * workers;
+    unsigned          workerCount;
+    tWorkFunction     work;
+    void            * context;
+    struct timespec   start;
+    int               failed;       /* accessed atomically */
+} tWorkPool;
+
+static double secondsSince( const struct timespec * start )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* @return a task from the front of our own share, or -1 if it's empty */
+static int takeTask( tWorker * worker )
+{
+    int task = -1;
+
+    pthread_mutex_lock( &worker->lock );
+    if ( worker->next < worker->end )
+    {
+        task = worker->next++;
+    }
+    pthread_mutex_unlock( &worker->lock );
+    return task;
+}
+
+/* @return a task from the back of the fullest share we can find, or -1 if there's no work left */
+static int stealTask( tWorker * thief )
+{
+    tWorkPool * pool = thief->pool;
+
+    for (;;)
+    {
+        tWorker * victim = NULL;
+        int       most   = 0;
+
+        for ( unsigned i = 1; i < pool->workerCount; ++i )
+        {
+            tWorker * worker = &pool->workers[ (thief->index + i) % pool->workerCount ];
+            pthread_mutex_lock( &worker->lock );
+            int       left   = worker->end - worker->next;
+            pthread_mutex_unlock( &worker->lock );
+            if ( left > most )
+            {
+                most   = left;
+                victim = worker;
+            }
+        }
+        if ( victim == NULL )
+        {
+            return -1;
+        }
+
+        int task = -1;
+        pthread_mutex_lock( &victim->lock );
+        if ( victim->next < victim->end )
+        {
+            task = --victim->end;
+        }
+        pthread_mutex_unlock( &victim->lock );
+
+        if ( task >= 0 )
+        {
+            return task;
+        }
+        /* someone got there first - look again */
+    }
+}
+
+static void * workerThread( void * arg )
+{
+    tWorker   * worker = arg;
+    tWorkPool * pool   = worker->pool;
+
+    while ( !__atomic_load_n( &pool->failed, __ATOMIC_RELAXED ) )
+    {
+        int stolen = 0;
+        int task   = takeTask( worker );
+        if ( task < 0 )
+        {
+            task   = stealTask( worker );
+            stolen = 1;
+        }
+        if ( task < 0 )
+        {
+            break;
+        }
+
+        ssize_t bytes = (*pool->work)( task, worker->index, pool->context );
+        if ( bytes < 0 )
+        {
+            __atomic_store_n( &pool->failed, 1, __ATOMIC_RELAXED );
+            break;
+        }
+        ++worker->stats.tasks;
+        worker->stats.stolen += stolen;
+        worker->stats.bytes  += bytes;
+    }
+    worker->stats.seconds = secondsSince( &pool->start );
+
+    return NULL;
+}
+
+/**
+ * Run tasks 0 to taskCount - 1, spread over a pool of threads, and wait for them all.
+ *
+ * @param threadCount  number of threads to use; at most kMaxWorkers
+ * @param taskCount    number of tasks
+ * @param work         called for each task
+ * @param context      passed through to work
+ * @param stats        optional, threadCount entries, filled in with what each thread did
+ * @return 0 if every task succeeded, -1 if not
+ */
+int runWorkPool( unsigned threadCount, int taskCount, tWorkFunction work, void * context, tWorkerStats * stats )
+{
+    tWorkPool pool;
+
+    if ( threadCount < 1 )
+    {
+        threadCount = 1;
+    }
+    if ( threadCount > kMaxWorkers )
+    {
+        threadCount = kMaxWorkers;
+    }
+
+    memset( &pool, 0, sizeof( pool ) );
+    pool.workers = calloc( threadCount, sizeof( tWorker ) );
+    if ( !isHeapPtr( pool.workers ) )
+    {
+        return -1;
+    }
+    pool.workerCount = threadCount;
+    pool.work        = work;
+    pool.context     = context;
+    clock_gettime( CLOCK_MONOTONIC, &pool.start );
+
+    /* each worker starts with a contiguous share, so it reads sequentially until it has to steal */
+    for ( unsigned i = 0; i < threadCount; ++i )
+    {
+        tWorker * worker = &pool.workers[ i ];
+        pthread_mutex_init( &worker->lock, NULL );
+        worker->pool  = &pool;
+        worker->index = i;
+        worker->next  = (int)( (int64_t) taskCount * i / threadCount );
+        worker->end   = (int)( (int64_t) taskCount * (i + 1) / threadCount );
+    }
+
+    /* the calling thread is worker 0 */
+    unsigned started = 1;
+    for ( unsigned i = 1; i < threadCount; ++i )
+    {
+        int err = pthread_create( &pool.workers[ i ].thread, NULL, workerThread, &pool.workers[ i ] );
+        if ( err != 0 )
+        {
+            /* its share will be stolen by the others */
+            LogError( "unable to start worker thread %u (%d: %s)", i, err, strerror( err ) );
+            break;
+        }
+        ++started;
+    }
+    workerThread( &pool.workers[ 0 ] );
+    for ( unsigned i = 1; i < started; ++i )
+    {
+        pthread_join( pool.workers[ i ].thread, NULL );
+    }
+
+    for ( unsigned i = 0; i < threadCount; ++i )
+    {
+        if ( stats != NULL )
+        {
+            stats[ i ] = pool.workers[ i ].stats;
+        }
+        pthread_mutex_destroy( &pool.workers[ i ].lock );
+    }
+    free( pool.workers );
+
+    return pool.failed ? -1 : 0;
+}
+
+void reportWorkerStats( FILE * output, unsigned threadCount, const tWorkerStats * stats )
+{
+    uint64_t totalBytes = 0;
+    double   longest    = 0;
+
+    for ( unsigned i = 0; i < threadCount; ++i )
+    {
+        const tWorkerStats * s = &stats[ i ];
+        fprintf( output, "  thread %2u: %6" PRIu64 " tasks (%" PRIu64 " stolen), %8.2f MB in %6.3f s, %8.2f MB/s\n",
+                 i, s->tasks, s->stolen, s->bytes / 1048576.0, s->seconds,
+                 s->seconds > 0 ? s->bytes / 1048576.0 / s->seconds : 0.0 );
+        totalBytes += s->bytes;
+        if ( s->seconds > longest )
+        {
+            longest = s->seconds;
+        }
+    }
+    fprintf( output, "  total:     %8.2f MB in %6.3f s, %8.2f MB/s\n",
+             totalBytes / 1048576.0, longest, longest > 0 ? totalBytes / 1048576.0 / longest : 0.0 );
+}
@@ -0,0 +1,34 @@
+/*
+    A work-stealing thread pool, for running a fixed set of numbered tasks.
+
+    Each worker starts with its own contiguous share of the tasks, and works
+    through it in ascending order; when it runs out, it steals from the far
+    end of another worker's share. Neighbouring tasks usually touch
+    neighbouring data, so each worker mostly sees sequential i/o, and the
+    stealing only starts once the work is unevenly spread.
+*/
+
+#ifndef READLOGICALVOLUME_WORKPOOL_H
+#define READLOGICALVOLUME_WORKPOOL_H
+
+/* upper limit on the number of workers */
+#define kMaxWorkers     64
+
+/**
+   run a task. worker identifies the thread, from 0 to threadCount - 1, so per-thread
+   resources can be indexed by it. returns the number of bytes it moved, or -1 on failure,
+   which stops the pool from starting any more tasks.
+ */
+typedef ssize_t (*tWorkFunction)( int task, unsigned worker, void * context );
+
+typedef struct {
+    uint64_t    tasks;          /* tasks run */
+    uint64_t    stolen;         /* ...of which were taken from another worker */
+    uint64_t    bytes;
+    double      seconds;        /* from the start until this worker ran out of work */
+} tWorkerStats;
+
+int  runWorkPool( unsigned threadCount, int taskCount, tWorkFunction work, void * context, tWorkerStats * stats );
+void reportWorkerStats( FILE * output, unsigned threadCount, const tWorkerStats * stats );
+
+#endif //READLOGICALVOLUME_WORKPOOL_H
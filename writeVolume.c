@@ -0,0 +1,971 @@
+/*
+    Streaming a logical volume out to a file descriptor.
+
+    The volume is walked in logical order, one chunk at a time. Each chunk
+    is read into the next free buffer in a ring of drive->queueDepth
+    buffers, so that many reads are in flight at once, while the buffer at
+    the head of the ring is written out as soon as its read completes.
+    Reads can finish in any order, but the output is always written
+    strictly sequentially. Each drive the volume is on has a reader of its
+    own, so a volume spread across several drives keeps all of them busy.
+    Mirrored segments are read from alternate legs in turn, and a chunk
+    that can't be read from one leg is fetched again from another. A chunk
+    on a missing raid leg is rebuilt from parity as it's written out.
+
+    Where the volume is on one drive, isn't mirrored or raid, and that
+    drive is a plain file descriptor, none of that is needed:
+    each segment is handed to the kernel with copy_file_range(), which can
+    share blocks outright on a reflink-capable filesystem. If that isn't
+    supported between these two files, splice() through a pipe still keeps
+    the data out of user space. Either way, whatever is left when a path
+    gives up is picked up by the next one, ending with the buffer ring.
+
+    Volumes are often mostly unwritten. Holes in a sparse input image are
+    found with SEEK_DATA/SEEK_HOLE and never read at all, every buffered
+    chunk is checked for zeros, and runs of zeros are skipped over in the
+    output with lseek(), so a regular output file comes out sparse too.
+*/
+
+#define _GNU_SOURCE     /* for copy_file_range() and splice() */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "readlogicalvolume.h"
+#include "debug.h"
+#include "stringHash.h"
+#include "readaccess.h"
+#include "asyncRead.h"
+#include "parseMetadata.h"
+#include "extentIndex.h"
+#include "thinPool.h"
+#include "lvAccess.h"
+#include "writeVolume.h"
+
+typedef struct tStreamBuffer
+{
+    tAsyncReader * reader;  /* that the read was queued on, or NULL */
+    uint64_t logical;       /* where in the volume its contents are from */
+    byte  * ptr;
+    size_t  length;     /* bytes of the volume it holds this time round */
+    size_t  remaining;  /* bytes still to arrive */
+    int     failed;
+    int     zeros;      /* nothing was read: it's a hole, so all zeros */
+} tStreamBuffer;
+
+/* one reader per drive, at most */
+#define kMaxStreamReaders   64
+
+/* where we've got to, walking the volume in logical order */
+typedef struct tStreamPosition
+{
+    tLogicalVolume * lv;
+    int              segment;
+    uint64_t         logical;   /* byte offset into the volume */
+    int              readerCount;
+    tDrive         * readerDrives[ kMaxStreamReaders ];
+    tAsyncReader   * readers[ kMaxStreamReaders ];
+} tStreamPosition;
+
+typedef struct tTransfer
+{
+    tDrive        * drive;
+    int             output;
+    int             outputIsPipe;
+    int             pipe[2];        /* for splicing to an output that isn't a pipe itself */
+    size_t          pipeSize;
+    tTransferPath   path;
+    int             sparse;         /* leave holes in the output, rather than writing zeros */
+    off64_t         outputSize;     /* of the output when we started; holes below this must be punched */
+    uint64_t        pendingHole;    /* zeros skipped, but not yet seeked over */
+    size_t          alignment;      /* the strictest of any drive's, so the buffer ring suits them all */
+    size_t          chunkSize;      /* ...and the largest */
+    int             probeCount;
+    tDrive        * probeDrives[ kMaxStreamReaders ];
+    int             probeIds[ kMaxStreamReaders ];     /* their own descriptors, for SEEK_DATA and SEEK_HOLE */
+    tWriteStats     stats;
+} tTransfer;
+
+static const char * const kTransferPathNames[] = {
+    [transferCopyRange] = "copy_file_range",
+    [transferSplice]    = "splice",
+    [transferBuffered]  = "buffered"
+};
+
+const char * getTransferPathName( tTransferPath path )
+{
+    return kTransferPathNames[ path ];
+}
+
+/**
+ * Write all of a buffer, coping with short writes and interrupted system calls.
+ *
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int writeFully( int fd, const void * ptr, size_t length )
+{
+    const byte * p = ptr;
+
+    while ( length > 0 )
+    {
+        ssize_t wrLen = write( fd, p, length );
+        if ( wrLen < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            return -1;
+        }
+        p      += wrLen;
+        length -= wrLen;
+    }
+    return 0;
+}
+
+/* zeros, to write where the output can't have holes in it */
+static const byte gZeros[ 64 * 1024 ];
+
+/* the widest vector the compiler can handle, for isAllZero(); it'll use several registers if need be */
+typedef uint64_t tZeroVector __attribute__(( vector_size( 32 ) ));
+
+/**
+ * @return non-zero if every byte in the block is zero
+ */
+int isAllZero( const void * ptr, size_t length )
+{
+    const byte * p = ptr;
+
+    /* most non-zero blocks give themselves away in the first few bytes */
+    if ( length >= 16 )
+    {
+        uint64_t head[2];
+        memcpy( head, p, sizeof( head ) );
+        if ( (head[0] | head[1]) != 0 )
+        {
+            return 0;
+        }
+    }
+
+    /* OR four vectors together, then test once */
+    while ( length >= 4 * sizeof( tZeroVector ) )
+    {
+        tZeroVector v[4];
+        memcpy( v, p, sizeof( v ) );
+        tZeroVector acc = (v[0] | v[1]) | (v[2] | v[3]);
+        if ( (acc[0] | acc[1] | acc[2] | acc[3]) != 0 )
+        {
+            return 0;
+        }
+        p      += sizeof( v );
+        length -= sizeof( v );
+    }
+
+    byte acc = 0;
+    while ( length-- > 0 )
+    {
+        acc |= *p++;
+    }
+    return acc == 0;
+}
+
+/**
+ * Seek over any zeros we've skipped, so the next write lands in the right place.
+ * If the output already had data there, punch it out, so it reads back as zeros.
+ */
+static int flushHole( tTransfer * transfer )
+{
+    if ( transfer->pendingHole > 0 )
+    {
+        off64_t start = lseek64( transfer->output, 0, SEEK_CUR );
+        if ( start < 0 || lseek64( transfer->output, transfer->pendingHole, SEEK_CUR ) < 0 )
+        {
+            return -1;
+        }
+        if ( start < transfer->outputSize )
+        {
+            off64_t end = start + transfer->pendingHole;
+            if ( end > transfer->outputSize )
+            {
+                end = transfer->outputSize;
+            }
+            if ( fallocate64( transfer->output, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start ) < 0 )
+            {
+                return -1;
+            }
+        }
+        transfer->pendingHole = 0;
+    }
+    return 0;
+}
+
+/**
+ * Output a run of zeros: skip over it if the output can have holes, write it if not.
+ */
+static int outputZeros( tTransfer * transfer, uint64_t length )
+{
+    if ( transfer->sparse )
+    {
+        transfer->pendingHole   += length;
+        transfer->stats.skipped += length;
+        return 0;
+    }
+
+    transfer->stats.written += length;
+    while ( length > 0 )
+    {
+        size_t count = length < sizeof( gZeros ) ? length : sizeof( gZeros );
+        if ( writeFully( transfer->output, gZeros, count ) < 0 )
+        {
+            return -1;
+        }
+        length -= count;
+    }
+    return 0;
+}
+
+static int outputData( tTransfer * transfer, const void * ptr, size_t length )
+{
+    if ( flushHole( transfer ) < 0 || writeFully( transfer->output, ptr, length ) < 0 )
+    {
+        return -1;
+    }
+    transfer->stats.written += length;
+    return 0;
+}
+
+/**
+ * Sort out the tail of the output: a trailing hole has to be made part of the
+ * file, by extending it.
+ */
+static int finishOutput( tTransfer * transfer )
+{
+    if ( transfer->pendingHole > 0 )
+    {
+        if ( flushHole( transfer ) < 0 )
+        {
+            return -1;
+        }
+        off64_t end = lseek64( transfer->output, 0, SEEK_CUR );
+        if ( end < 0 || (end > transfer->outputSize && ftruncate64( transfer->output, end ) < 0) )
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * SEEK_DATA and SEEK_HOLE move the file offset, and the drive's descriptor is
+ * shared with the readers, so the holes in a drive are looked for through a
+ * descriptor of the transfer's own, opened the first time it's needed.
+ *
+ * @return the descriptor, or -1 if the drive isn't a file we can open again
+ */
+static int getProbeId( tTransfer * transfer, tDrive * drive )
+{
+    for ( int i = 0; i < transfer->probeCount; ++i )
+    {
+        if ( transfer->probeDrives[ i ] == drive )
+        {
+            return transfer->probeIds[ i ];
+        }
+    }
+    if ( drive->id < 0 || drive->path == NULL || transfer->probeCount == kMaxStreamReaders )
+    {
+        return -1;
+    }
+    transfer->probeDrives[ transfer->probeCount ] = drive;
+    transfer->probeIds[ transfer->probeCount ] = open( drive->path, O_RDONLY );
+    return transfer->probeIds[ transfer->probeCount++ ];
+}
+
+static void closeProbes( tTransfer * transfer )
+{
+    for ( int i = 0; i < transfer->probeCount; ++i )
+    {
+        if ( transfer->probeIds[ i ] >= 0 )
+        {
+            close( transfer->probeIds[ i ] );
+        }
+    }
+    transfer->probeCount = 0;
+}
+
+/**
+ * Find out how a range of a sparse input image starts: with how much hole,
+ * followed by how much data. Where the input can't tell us, it's all data.
+ *
+ * @param position  absolute position on the drive
+ */
+static void findInputData( tTransfer * transfer, tDrive * drive, off64_t position, uint64_t length,
+                           uint64_t * holeLength, uint64_t * dataLength )
+{
+    int probe = getProbeId( transfer, drive );
+
+    *holeLength = 0;
+    *dataLength = length;
+
+    if ( probe < 0 )
+    {
+        return;
+    }
+
+    off64_t data = lseek64( probe, position, SEEK_DATA );
+    if ( data < 0 )
+    {
+        /* past the end of a truncated image is an error, not a hole */
+        if ( errno == ENXIO && lseek64( probe, 0, SEEK_END ) > position )
+        {
+            /* nothing but hole from here to the end of the file */
+            *holeLength = length;
+            *dataLength = 0;
+        }
+        return;
+    }
+
+    *holeLength = (uint64_t)(data - position) < length ? (uint64_t)(data - position) : length;
+    *dataLength = length - *holeLength;
+    if ( *dataLength > 0 )
+    {
+        off64_t hole = lseek64( probe, data, SEEK_HOLE );
+        if ( hole > data && (uint64_t)(hole - data) < *dataLength )
+        {
+            *dataLength = hole - data;
+        }
+    }
+}
+
+/* tReadCallback: a chunk of a stream buffer has arrived */
+static void chunkArrived( void * dest, size_t length, ssize_t result, void * cbData )
+{
+    tStreamBuffer * buffer = cbData;
+    (void) dest;
+
+    if ( result != (ssize_t) length )
+    {
+        buffer->failed = 1;
+    }
+    buffer->remaining -= length;
+}
+
+/**
+ * @return the reader for a drive, opening it the first time the volume needs
+ *         that drive, or NULL to read it synchronously
+ */
+static tAsyncReader * getDriveReader( tStreamPosition * pos, tDrive * drive )
+{
+    for ( int i = 0; i < pos->readerCount; ++i )
+    {
+        if ( pos->readerDrives[ i ] == drive )
+        {
+            return pos->readers[ i ];
+        }
+    }
+    if ( pos->readerCount == kMaxStreamReaders )
+    {
+        return NULL;
+    }
+    pos->readerDrives[ pos->readerCount ] = drive;
+    pos->readers[ pos->readerCount ] = openAsyncReader( drive );
+    return pos->readers[ pos->readerCount++ ];
+}
+
+/**
+ * Start filling a buffer with the next piece of the volume. A piece never
+ * crosses a segment boundary, or the end of a stripe chunk. Anything not
+ * covered by a segment reads as zeros.
+ *
+ * @return 0 if the buffer was started, -1 on error
+ */
+static int fillBuffer( tTransfer * transfer, tStreamPosition * pos, tStreamBuffer * buffer, size_t chunkSize )
+{
+    tLogicalVolume        * lv      = pos->lv;
+    tLogicalVolumeSegment * segment = &lv->segments[ pos->segment ];
+    uint64_t                start   = segment->startExtent * lv->extentSize;
+    uint64_t                end     = start + segment->extentCount * lv->extentSize;
+
+    buffer->reader  = NULL;
+    buffer->logical = pos->logical;
+    buffer->failed  = 0;
+    buffer->zeros   = 0;
+
+    if ( pos->logical < start )
+    {
+        /* a gap between segments */
+        buffer->length = start - pos->logical < chunkSize ? start - pos->logical : chunkSize;
+        buffer->remaining = 0;
+        buffer->zeros  = 1;
+        pos->logical += buffer->length;
+        return 0;
+    }
+
+    tExtentRun run;
+    mapSegmentOffset( lv, segment, pos->logical - start, &run );
+
+    buffer->length    = run.length < chunkSize ? run.length : chunkSize;
+    buffer->remaining = 0;
+
+    tDrive * drive = (run.physicalVolume != NULL && !run.rebuild) ? run.physicalVolume->drive : NULL;
+    uint64_t holeLength = 0;
+    if ( drive != NULL )
+    {
+        /* a buffer is either all hole, which isn't read, or data up to the next hole. Direct
+           i/o has to stay aligned, so a hole that doesn't start and end on a sector is read */
+        uint64_t dataLength;
+        uint64_t mask = ~(uint64_t)(drive->alignment - 1);
+        findInputData( transfer, drive, drive->partition.start + run.offset, buffer->length, &holeLength, &dataLength );
+        if ( (holeLength & mask) > 0 )
+        {
+            holeLength     = holeLength & mask;
+            buffer->length = holeLength;
+        }
+        else
+        {
+            dataLength = (holeLength + dataLength + drive->alignment - 1) & mask;
+            holeLength = 0;
+            if ( dataLength > 0 && dataLength < buffer->length )
+            {
+                buffer->length = dataLength;
+            }
+        }
+    }
+
+    pos->logical += buffer->length;
+    if ( pos->logical >= end )
+    {
+        ++pos->segment;
+    }
+
+    if ( run.rebuild )
+    {
+        /* on a missing raid leg: it's rebuilt from parity when its turn comes to be written */
+        buffer->failed    = 1;
+        return 0;
+    }
+    if ( drive == NULL || holeLength > 0 )
+    {
+        /* e.g. a gap in a mirror leg, or a hole in a sparse image */
+        buffer->zeros     = 1;
+        return 0;
+    }
+
+    tAsyncReader * reader = getDriveReader( pos, drive );
+    off64_t        offset = run.offset;
+
+    buffer->remaining = buffer->length;
+    transfer->stats.read += buffer->length;
+
+    if ( reader != NULL )
+    {
+        buffer->reader = reader;
+        return queueAsyncRead( reader, offset, buffer->ptr, buffer->length, chunkArrived, buffer );
+    }
+
+    chunkArrived( buffer->ptr, buffer->length,
+                  readDriveExtent( drive, offset, buffer->ptr, buffer->length ), buffer );
+    return 0;
+}
+
+
+/**
+ * Copy the rest of a logical volume to a file descriptor through the buffer
+ * ring, using a fixed amount of memory.
+ *
+ * @param transfer  the drive and output
+ * @param lv        the logical volume
+ * @param start     byte offset into the volume to start from
+ * @return 0 on success, -1 on error
+ */
+static int streamBuffered( tTransfer * transfer, tLogicalVolume * lv, uint64_t start )
+{
+    tDrive        * drive  = transfer->drive;
+    int             result = 0;
+    size_t          chunkSize;
+    unsigned        bufferCount;
+    tStreamBuffer * ring;
+    tStreamPosition pos;
+
+    memset( &pos, 0, sizeof( pos ) );
+    pos.lv      = lv;
+    pos.logical = start;
+
+    while ( pos.segment < lv->segmentCount
+         && (lv->segments[ pos.segment ].startExtent + lv->segments[ pos.segment ].extentCount)
+             * lv->extentSize <= start )
+    {
+        ++pos.segment;
+    }
+
+    chunkSize = (transfer->chunkSize + transfer->alignment - 1) & ~(transfer->alignment - 1);
+
+    bufferCount = drive->queueDepth > 0 ? drive->queueDepth : 1;
+    if ( bufferCount > kMaxStreamBuffers )
+    {
+        bufferCount = kMaxStreamBuffers;
+    }
+
+    ring = calloc( bufferCount, sizeof( tStreamBuffer ) );
+    if ( !isHeapPtr( ring ) )
+    {
+        return -1;
+    }
+    for ( unsigned i = 0; i < bufferCount; ++i )
+    {
+        ring[i].ptr = allocAlignedBuffer( transfer->alignment, chunkSize );
+        if ( !isValidPtr( ring[i].ptr ) )
+        {
+            result = -1;
+        }
+    }
+
+    LogInfo( "streaming \"%s\" (%lu bytes) through %u x %lu KB buffers",
+             lv->name, lv->length, bufferCount, chunkSize / 1024 );
+
+
+    unsigned head   = 0;    /* the next buffer to be written out */
+    unsigned filled = 0;    /* buffers between head and tail that hold, or are receiving, data */
+    uint64_t written = start;
+
+    while ( result == 0 && (filled > 0 || pos.segment < lv->segmentCount) )
+    {
+        /* keep the ring full of reads */
+        while ( filled < bufferCount && pos.segment < lv->segmentCount )
+        {
+            if ( fillBuffer( transfer, &pos, &ring[ (head + filled) % bufferCount ], chunkSize ) < 0 )
+            {
+                result = -1;
+                break;
+            }
+            ++filled;
+        }
+
+        tStreamBuffer * buffer = &ring[ head ];
+        while ( result == 0 && buffer->remaining > 0 )
+        {
+            if ( pollAsyncReads( buffer->reader, 1 ) < 0 )
+            {
+                result = -1;
+            }
+        }
+        if ( result != 0 )
+        {
+            break;
+        }
+
+        if ( buffer->failed && recoverVolumeRange( lv, buffer->logical, buffer->ptr, buffer->length ) < 0 )
+        {
+            LogError( "failed to read \"%s\" at offset %lu", lv->name, written );
+            result = -1;
+        }
+        else if ( buffer->zeros || (transfer->sparse && isAllZero( buffer->ptr, buffer->length ))
+                  ? outputZeros( transfer, buffer->length ) < 0
+                  : outputData( transfer, buffer->ptr, buffer->length ) < 0 )
+        {
+            LogError( "unable to write \"%s\" (%d: %s)", lv->name, errno, strerror( errno ) );
+            result = -1;
+        }
+        else
+        {
+            written += buffer->length;
+            head = (head + 1) % bufferCount;
+            --filled;
+        }
+    }
+
+    /* don't free buffers that reads may still be landing in */
+    for ( int i = 0; i < pos.readerCount; ++i )
+    {
+        closeAsyncReader( pos.readers[ i ] );
+    }
+
+    for ( unsigned i = 0; i < bufferCount; ++i )
+    {
+        free( ring[i].ptr );
+    }
+    free( ring );
+
+    return result;
+}
+
+/**
+ * Move a range from the drive to the output with copy_file_range().
+ * @return the number of bytes moved; short if the kernel wouldn't do any more
+ */
+static size_t copyRange( tTransfer * transfer, loff_t position, size_t length )
+{
+    size_t done = 0;
+
+    while ( done < length )
+    {
+        ssize_t count = copy_file_range( transfer->drive->id, &position, transfer->output, NULL, length - done, 0 );
+        if ( count < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if ( count <= 0 )
+        {
+            if ( count < 0 )
+            {
+                LogInfo( "copy_file_range: %d: %s", errno, strerror( errno ) );
+            }
+            break;
+        }
+        done += count;
+    }
+    return done;
+}
+
+/**
+ * Write out whatever is sitting in our pipe, when the output won't take it by
+ * splice(): it's already been taken from the drive, so it can't be abandoned.
+ */
+static int drainPipe( tTransfer * transfer, size_t length )
+{
+    byte buffer[ 16 * 1024 ];
+
+    while ( length > 0 )
+    {
+        ssize_t count = read( transfer->pipe[0], buffer, length < sizeof( buffer ) ? length : sizeof( buffer ) );
+        if ( count < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if ( count <= 0 || writeFully( transfer->output, buffer, count ) < 0 )
+        {
+            return -1;
+        }
+        length -= count;
+    }
+    return 0;
+}
+
+/**
+ * Move a range from the drive to the output with splice(), directly if the
+ * output is a pipe, or through one of our own if it isn't.
+ * @return the number of bytes moved; short if the kernel wouldn't do any more, or -1 on error
+ */
+static ssize_t spliceRange( tTransfer * transfer, loff_t position, size_t length )
+{
+    size_t done = 0;
+
+    while ( done < length )
+    {
+        size_t  want  = length - done < transfer->pipeSize ? length - done : transfer->pipeSize;
+        int     into  = transfer->outputIsPipe ? transfer->output : transfer->pipe[1];
+        ssize_t count = splice( transfer->drive->id, &position, into, NULL, want, SPLICE_F_MOVE );
+
+        if ( count < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if ( count <= 0 )
+        {
+            if ( count < 0 )
+            {
+                LogInfo( "splice: %d: %s", errno, strerror( errno ) );
+            }
+            break;
+        }
+
+        if ( !transfer->outputIsPipe )
+        {
+            size_t inPipe = count;
+            while ( inPipe > 0 )
+            {
+                ssize_t outCount = splice( transfer->pipe[0], NULL, transfer->output, NULL, inPipe, SPLICE_F_MOVE );
+                if ( outCount < 0 && errno == EINTR )
+                {
+                    continue;
+                }
+                if ( outCount <= 0 )
+                {
+                    if ( drainPipe( transfer, inPipe ) < 0 )
+                    {
+                        return -1;
+                    }
+                    /* the output can't be spliced to, so there's no point going on */
+                    return done + count;
+                }
+                inPipe -= outCount;
+            }
+        }
+        done += count;
+    }
+    return done;
+}
+
+/**
+ * Move a range of the drive to the output on the current path, stepping down
+ * to the next path whenever one gives up part way.
+ * @return the number of bytes moved (short once we're down to the buffered path), or -1 on error
+ */
+static ssize_t transferRange( tTransfer * transfer, off64_t offset, size_t length )
+{
+    loff_t position = transfer->drive->partition.start + offset;
+    size_t done     = 0;
+
+    if ( transfer->path == transferCopyRange )
+    {
+        done = copyRange( transfer, position, length );
+        if ( done < length )
+        {
+            transfer->path = transferSplice;
+        }
+    }
+
+    if ( transfer->path == transferSplice && done < length )
+    {
+        if ( !transfer->outputIsPipe && transfer->pipe[0] < 0 )
+        {
+            if ( pipe( transfer->pipe ) < 0 )
+            {
+                transfer->path = transferBuffered;
+                return done;
+            }
+            fcntl( transfer->pipe[1], F_SETPIPE_SZ, (int) transfer->pipeSize );
+        }
+        int pipeSize = fcntl( transfer->outputIsPipe ? transfer->output : transfer->pipe[1], F_GETPIPE_SZ );
+        if ( pipeSize > 0 )
+        {
+            transfer->pipeSize = pipeSize;
+        }
+
+        ssize_t count = spliceRange( transfer, position + done, length - done );
+        if ( count < 0 )
+        {
+            return -1;
+        }
+        done += count;
+        if ( done < length )
+        {
+            transfer->path = transferBuffered;
+        }
+    }
+    return done;
+}
+
+/**
+ * Pick the drive whose settings the transfer goes by: the one the volume is on,
+ * or if it's spread across several, the one with the strictest alignment. The
+ * buffer ring goes by every drive's, in writeLogicalVolume().
+ *
+ * @param lv      the logical volume
+ * @param drive   what to fall back on if the volume has no segments
+ * @param single  set to non-zero if the whole volume is on the one drive
+ */
+static tDrive * getVolumeDrive( tLogicalVolume * lv, tDrive * drive, int * single )
+{
+    tDrive * result = NULL;
+
+    *single = 1;
+    for ( int i = 0; i < lv->segmentCount; ++i )
+    {
+        tLogicalVolumeSegment * segment = &lv->segments[ i ];
+        int                     count   = segment->stripeCount;
+
+        if ( segment->type != segmentStriped )
+        {
+            /* mirror reads alternate between the legs and fail over between them, raid
+               data may have to be rebuilt, thin blocks can be anywhere in the pool, and
+               snapshot chunks in the origin or the COW store, so none of them can be
+               left to the kernel */
+            *single = 0;
+            count   = (segment->type == segmentThin) ? 1
+                    : (segment->type == segmentSnapshot) ? 2 : segment->legCount;
+        }
+        for ( int j = 0; j < count; ++j )
+        {
+            tDrive * stripeDrive;
+            int      legSingle;
+
+            if ( segment->type == segmentThin )
+            {
+                stripeDrive = getVolumeDrive( getThinDataVolume( segment ), NULL, &legSingle );
+            }
+            else if ( segment->type == segmentSnapshot )
+            {
+                stripeDrive = getVolumeDrive( (j == 0) ? segment->origin.lv : segment->cowStore.lv, NULL, &legSingle );
+            }
+            else if ( segment->type != segmentStriped )
+            {
+                stripeDrive = (segment->legs[ j ].lv != NULL)
+                            ? getVolumeDrive( segment->legs[ j ].lv, NULL, &legSingle ) : NULL;
+            }
+            else
+            {
+                stripeDrive = segment->stripes[ j ].physicalVolume->drive;
+            }
+            if ( stripeDrive == NULL )
+            {
+                continue;
+            }
+            if ( result == NULL )
+            {
+                result = stripeDrive;
+            }
+            else if ( stripeDrive != result )
+            {
+                *single = 0;
+                if ( stripeDrive->alignment > result->alignment )
+                {
+                    result = stripeDrive;
+                }
+            }
+        }
+    }
+    return (result != NULL) ? result : drive;
+}
+
+/**
+ * Copy a logical volume to a file descriptor, in logical order. Where the drive
+ * is a file descriptor, the data goes from one to the other inside the kernel;
+ * otherwise, or if the kernel won't do that for this pair of files, it goes
+ * through a fixed-size ring of buffers. So does a volume spread across several
+ * drives, so that they're all read at once.
+ *
+ * @param drive  the drives, as passed to findLogicalVolume()
+ * @param lv     the logical volume, from findLogicalVolume()
+ * @param fd     where to write it; need not be seekable
+ * @param flags  kWriteSparse to leave holes in the output where the volume is zeros
+ * @param stats  filled in with how it went; may be NULL
+ * @return 0 on success, -1 on error
+ */
+int writeLogicalVolume( tDrive * drive, tLogicalVolume * lv, int fd, unsigned flags, tWriteStats * stats )
+{
+    int         result  = 0;
+    uint64_t    logical = 0;
+    struct stat outputStat;
+    tTransfer   transfer;
+    int         singleDrive;
+
+    memset( &transfer, 0, sizeof( transfer ) );
+
+    /* the volume may be read from any of the drives, including through a mirror leg or a
+       pool, so the buffers have to suit every one of them */
+    transfer.alignment = 1;
+    for ( tDrive * d = drive; d != NULL; d = d->next )
+    {
+        size_t chunkSize = d->chunkSize > 0 ? d->chunkSize : kDefaultChunkSize;
+        if ( d->alignment > transfer.alignment )
+        {
+            transfer.alignment = d->alignment;
+        }
+        if ( chunkSize > transfer.chunkSize )
+        {
+            transfer.chunkSize = chunkSize;
+        }
+    }
+
+    drive = getVolumeDrive( lv, drive, &singleDrive );
+    transfer.drive    = drive;
+    transfer.output   = fd;
+    transfer.pipe[0]  = -1;
+    transfer.pipe[1]  = -1;
+    transfer.pipeSize = drive->chunkSize > 0 ? drive->chunkSize : kDefaultChunkSize;
+
+    /* mapped and in-memory drives have no file descriptor to hand to the kernel */
+    transfer.path = (singleDrive && drive->id >= 0) ? transferCopyRange : transferBuffered;
+
+    if ( fstat( fd, &outputStat ) == 0 )
+    {
+        transfer.outputIsPipe = S_ISFIFO( outputStat.st_mode );
+        /* only a regular file can have holes in it */
+        transfer.sparse       = (flags & kWriteSparse) && S_ISREG( outputStat.st_mode )
+                                && lseek64( fd, 0, SEEK_CUR ) >= 0;
+        transfer.outputSize   = S_ISREG( outputStat.st_mode ) ? outputStat.st_size : 0;
+    }
+
+    for ( int i = 0; i < lv->segmentCount && transfer.path != transferBuffered && result == 0; ++i )
+    {
+        tLogicalVolumeSegment * segment = &lv->segments[ i ];
+        uint64_t start = segment->startExtent * lv->extentSize;
+        uint64_t end   = start + segment->extentCount * lv->extentSize;
+
+        if ( logical < start )
+        {
+            if ( outputZeros( &transfer, start - logical ) < 0 )
+            {
+                result = -1;
+                break;
+            }
+            logical = start;
+        }
+
+        /* a linear segment is one run; a striped one is a run per chunk */
+        while ( logical < end && transfer.path != transferBuffered )
+        {
+            tExtentRun run;
+            uint64_t   holeLength, dataLength;
+
+            mapSegmentOffset( lv, segment, logical - start, &run );
+            findInputData( &transfer, drive, drive->partition.start + run.offset, run.length, &holeLength, &dataLength );
+
+            if ( holeLength > 0 )
+            {
+                if ( outputZeros( &transfer, holeLength ) < 0 )
+                {
+                    result = -1;
+                    break;
+                }
+                logical += holeLength;
+                continue;
+            }
+
+            if ( flushHole( &transfer ) < 0 )
+            {
+                result = -1;
+                break;
+            }
+            ssize_t count = transferRange( &transfer, run.offset, dataLength );
+            if ( count < 0 )
+            {
+                result = -1;
+                break;
+            }
+            transfer.stats.read    += count;
+            transfer.stats.written += count;
+            logical += count;
+        }
+    }
+
+    if ( result < 0 )
+    {
+        LogError( "unable to write \"%s\" (%d: %s)", lv->name, errno, strerror( errno ) );
+    }
+    else if ( logical < lv->length )
+    {
+        if ( logical > 0 )
+        {
+            LogInfo( "falling back to buffered copying at offset %lu", logical );
+        }
+        transfer.path = transferBuffered;
+        result = streamBuffered( &transfer, lv, logical );
+    }
+
+    if ( result == 0 && finishOutput( &transfer ) < 0 )
+    {
+        LogError( "unable to finish \"%s\" (%d: %s)", lv->name, errno, strerror( errno ) );
+        result = -1;
+    }
+
+    if ( transfer.pipe[0] >= 0 )
+    {
+        close( transfer.pipe[0] );
+        close( transfer.pipe[1] );
+    }
+    closeProbes( &transfer );
+
+    transfer.stats.path = transfer.path;
+    if ( stats != NULL )
+    {
+        *stats = transfer.stats;
+    }
+    return result;
+}
@@ -0,0 +1,39 @@
+/*
+    Streaming a logical volume out to a file descriptor.
+
+    Rather than reading the whole volume into memory and then writing it,
+    the volume is passed through a small ring of chunk-sized buffers, so
+    memory use stays fixed however big the volume is, and the output can
+    be a pipe. When the drive is a plain file or device, the data needn't
+    come into user space at all. Runs of zeros, and holes in a sparse
+    input, become holes in the output.
+*/
+
+#ifndef READLOGICALVOLUME_WRITEVOLUME_H
+#define READLOGICALVOLUME_WRITEVOLUME_H
+
+typedef enum {
+    transferCopyRange = 0,  /* copy_file_range(): in-kernel, may just share blocks */
+    transferSplice,         /* splice() through a pipe */
+    transferBuffered        /* read into the buffer ring, then write() */
+} tTransferPath;
+
+typedef struct {
+    tTransferPath   path;       /* the path that wrote the last of the volume */
+    uint64_t        read;       /* bytes taken from the drive */
+    uint64_t        written;    /* bytes written to the output */
+    uint64_t        skipped;    /* bytes of zeros left as holes in the output */
+} tWriteStats;
+
+/* flags for writeLogicalVolume() */
+#define kWriteSparse        0x1     /* skip over zeros in the output, rather than writing them */
+
+/* upper limit on the number of buffers in the ring, whatever the queue depth */
+#define kMaxStreamBuffers   64
+
+int          writeFully( int fd, const void * ptr, size_t length );
+int          writeLogicalVolume( tDrive * drive, tLogicalVolume * lv, int fd, unsigned flags, tWriteStats * stats );
+int          isAllZero( const void * ptr, size_t length );
+const char * getTransferPathName( tTransferPath path );
+
+#endif //READLOGICALVOLUME_WRITEVOLUME_H